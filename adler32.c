@@ -59,6 +59,216 @@ local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 #  define MOD63(a) a %= BASE
 #endif
 
+/* SIMD_ADLER32: sum runs of 32 bytes at a time with SSSE3 or AVX2, whichever
+ * the CPU has, checked on the first call.  NEON_ADLER32: the same with NEON,
+ * when pngcrush is built with PNGCRUSH_USE_ARM_NEON for a CPU that has it.
+ * All give the same result as the loop below.  Define NO_SIMD_ADLER32 to use
+ * the loop only, and TEST_ADLER32 to check them (at the end of this file).
+ *
+ * adler32_simd is read and set with atomic builtins, since the threads of a
+ * multi-threaded deflate may make that first call at the same time; they all
+ * set it to the same value.  __builtin_cpu_init() does nothing once the CPU
+ * has been identified, which libgcc does before main().
+ */
+#if !defined(NO_SIMD_ADLER32) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define SIMD_ADLER32
+#  include <immintrin.h>
+local uLong adler32_ssse3 OF((uLong adler, const Bytef *buf, z_size_t len))
+    __attribute__((target("ssse3")));
+local uLong adler32_avx2 OF((uLong adler, const Bytef *buf, z_size_t len))
+    __attribute__((target("avx2")));
+local int adler32_simd = -1;    /* 0: none, 1: SSSE3, 2: AVX2 */
+
+/* Each step of 32 bytes adds, with s1 and s2 the sums at the start of it,
+ * 32 * s1 + 32 * buf[0] + 31 * buf[1] + ... + 1 * buf[31] to s2, and the
+ * bytes to s1.  The s1 terms are collected in ps and multiplied at the end.
+ * At most NMAX / 32 steps go between the modulos, so that nothing
+ * overflows.  len is a multiple of 32.
+ */
+local uLong adler32_ssse3(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 32;
+
+    while (blocks) {
+        unsigned n = NMAX / 32;
+        __m128i v_ps, v_s1, v_s2, bytes1, bytes2;
+
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+
+        v_ps = _mm_setr_epi32((int)(s1 * n), 0, 0, 0);
+        v_s1 = _mm_setzero_si128();
+        v_s2 = _mm_setr_epi32((int)s2, 0, 0, 0);
+        do {
+            bytes1 = _mm_loadu_si128((const __m128i *)buf);
+            bytes2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                       _mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                       _mm_maddubs_epi16(bytes2, tap2), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* add up the four lanes of each */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0xb1));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0x4e));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0xb1));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0x4e));
+        s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+        s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+        MOD(s1);
+        MOD(s2);
+    }
+    return s1 | (s2 << 16);
+}
+
+local uLong adler32_avx2(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                         24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9,
+                                         8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 32;
+
+    while (blocks) {
+        unsigned n = NMAX / 32;
+        __m256i v_ps, v_s1, v_s2, bytes;
+        __m128i h_s1, h_s2;
+
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+
+        v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+        v_s1 = _mm256_setzero_si256();
+        v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+        do {
+            bytes = _mm256_loadu_si256((const __m256i *)buf);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(
+                       _mm256_maddubs_epi16(bytes, tap), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+        /* add up the eight lanes of each */
+        h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1),
+                             _mm256_extracti128_si256(v_s1, 1));
+        h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2),
+                             _mm256_extracti128_si256(v_s2, 1));
+        h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, 0xb1));
+        h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, 0x4e));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, 0xb1));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, 0x4e));
+        s1 += (unsigned)_mm_cvtsi128_si32(h_s1);
+        s2 = (unsigned)_mm_cvtsi128_si32(h_s2);
+        MOD(s1);
+        MOD(s2);
+    }
+    return s1 | (s2 << 16);
+}
+#endif /* SIMD_ADLER32 */
+
+#if !defined(NO_SIMD_ADLER32) && !defined(SIMD_ADLER32) && \
+    defined(PNGCRUSH_USE_ARM_NEON) && \
+    (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#  define NEON_ADLER32
+#  include <arm_neon.h>
+local uLong adler32_neon OF((uLong adler, const Bytef *buf, z_size_t len));
+
+/* As adler32_ssse3(), except that the bytes in each of the 32 columns are
+ * added up (in 16 bits, which holds NMAX / 32 of them) and only multiplied
+ * by their weights at the end.
+ */
+local uLong adler32_neon(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    static const uint16_t tap[32] = {
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+    };
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 32;
+
+    while (blocks) {
+        unsigned n = NMAX / 32;
+        uint32x4_t v_ps, v_s1, v_s2;
+        uint16x8_t col1, col2, col3, col4;
+        uint8x16_t bytes1, bytes2;
+        uint32x2_t h_s1, h_s2;
+
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+
+        v_ps = vsetq_lane_u32((uint32_t)(s1 * n), vdupq_n_u32(0), 0);
+        v_s1 = vdupq_n_u32(0);
+        v_s2 = vsetq_lane_u32((uint32_t)s2, vdupq_n_u32(0), 0);
+        col1 = col2 = col3 = col4 = vdupq_n_u16(0);
+        do {
+            bytes1 = vld1q_u8(buf);
+            bytes2 = vld1q_u8(buf + 16);
+            v_ps = vaddq_u32(v_ps, v_s1);
+            v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+            col1 = vaddw_u8(col1, vget_low_u8(bytes1));
+            col2 = vaddw_u8(col2, vget_high_u8(bytes1));
+            col3 = vaddw_u8(col3, vget_low_u8(bytes2));
+            col4 = vaddw_u8(col4, vget_high_u8(bytes2));
+            buf += 32;
+        } while (--n);
+        v_s2 = vaddq_u32(v_s2, vshlq_n_u32(v_ps, 5));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col1), vld1_u16(tap));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col1), vld1_u16(tap + 4));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col2), vld1_u16(tap + 8));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col2), vld1_u16(tap + 12));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col3), vld1_u16(tap + 16));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col3), vld1_u16(tap + 20));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(col4), vld1_u16(tap + 24));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(col4), vld1_u16(tap + 28));
+
+        /* add up the four lanes of each */
+        h_s1 = vadd_u32(vget_low_u32(v_s1), vget_high_u32(v_s1));
+        h_s2 = vadd_u32(vget_low_u32(v_s2), vget_high_u32(v_s2));
+        h_s1 = vpadd_u32(h_s1, h_s1);
+        h_s2 = vpadd_u32(h_s2, h_s2);
+        s1 += vget_lane_u32(h_s1, 0);
+        s2 = vget_lane_u32(h_s2, 0);
+        MOD(s1);
+        MOD(s2);
+    }
+    return s1 | (s2 << 16);
+}
+#endif /* NEON_ADLER32 */
+
 /* ========================================================================= */
 uLong ZEXPORT adler32_z(adler, buf, len)
     uLong adler;
@@ -99,6 +309,44 @@ uLong ZEXPORT adler32_z(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef SIMD_ADLER32
+    if (len >= 64) {
+        int simd = __atomic_load_n(&adler32_simd, __ATOMIC_RELAXED);
+
+        if (simd < 0) {
+            __builtin_cpu_init();
+            simd = __builtin_cpu_supports("avx2") ? 2 :
+                   __builtin_cpu_supports("ssse3") ? 1 : 0;
+            __atomic_store_n(&adler32_simd, simd, __ATOMIC_RELAXED);
+        }
+        if (simd != 0) {
+            z_size_t n = len & ~(z_size_t)31;
+
+            adler = simd == 2 ? adler32_avx2(adler | (sum2 << 16), buf, n)
+                              : adler32_ssse3(adler | (sum2 << 16), buf, n);
+            buf += n;
+            len -= n;
+            if (len == 0)
+                return adler;
+            sum2 = (adler >> 16) & 0xffff;
+            adler &= 0xffff;
+        }
+    }
+#endif
+#ifdef NEON_ADLER32
+    if (len >= 64) {
+        z_size_t n = len & ~(z_size_t)31;
+
+        adler = adler32_neon(adler | (sum2 << 16), buf, n);
+        buf += n;
+        len -= n;
+        if (len == 0)
+            return adler;
+        sum2 = (adler >> 16) & 0xffff;
+        adler &= 0xffff;
+    }
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
@@ -184,3 +432,117 @@ uLong ZEXPORT adler32_combine64(adler1, adler2, len2)
 {
     return adler32_combine_(adler1, adler2, len2);
 }
+
+#ifdef TEST_ADLER32
+/* ========================================================================= */
+/* Define TEST_ADLER32 to build a program that checks the SIMD versions above,
+ * and adler32_z(), against a byte at a time on random buffers, lengths,
+ * alignments and starting values, and times them, for example with
+ *     cc -O2 -DTEST_ADLER32 -DNO_GZ -o testadler adler32.c zutil.c
+ * (add -DPNGCRUSH_USE_ARM_NEON for NEON).  It returns 1 on a mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_SIZE   (1L << 20)
+#define TEST_TRIALS 20000
+
+typedef uLong (*test_func) OF((uLong adler, const Bytef *buf, z_size_t len));
+
+local unsigned long test_seed = 1;
+
+local unsigned long test_rand()
+{
+    test_seed = test_seed * 1103515245UL + 12345UL;
+    return (test_seed >> 16) & 0x7fff;
+}
+
+local uLong test_ref(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+
+    while (len--) {
+        s1 = (s1 + *buf++) % BASE;
+        s2 = (s2 + s1) % BASE;
+    }
+    return s1 | (s2 << 16);
+}
+
+/* Check func, which takes lengths that are a multiple of step, then time
+ * it on the whole buffer.  One in eight trials is all 0xff, the most the
+ * sums can grow by.
+ */
+local int test_one(name, func, step, buf)
+    const char *name;
+    test_func func;
+    z_size_t step;
+    Bytef *buf;
+{
+    z_size_t off, len, i;
+    uLong adler, want;
+    clock_t start;
+    int trial, bad = 0;
+
+    for (trial = 0; trial < TEST_TRIALS; trial++) {
+        off = test_rand() % 64;
+        len = trial % 16 == 1 ? (test_rand() << 15 | test_rand()) % TEST_SIZE :
+              trial & 1 ? test_rand() % 20000 : test_rand() % 600;
+        len -= len % step;
+        adler = test_rand() % BASE | (test_rand() % BASE) << 16;
+        if (trial % 8 == 0)
+            for (i = off; i < off + len; i++)
+                buf[i] = 0xff;
+        want = test_ref(adler, buf + off, len);
+        if (func(adler, buf + off, len) != want && bad++ < 5)
+            printf("%s: mismatch, length %lu at offset %lu\n", name,
+                   (unsigned long)len, (unsigned long)off);
+        if (trial % 8 == 0)
+            for (i = off; i < off + len; i++)
+                buf[i] = (Bytef)test_rand();
+    }
+
+    start = clock();
+    for (trial = 0, adler = 1; trial < 2000; trial++)
+        adler = func(adler, buf, TEST_SIZE);
+    printf("%-10s %s, %5.0f MB/s\n", name, bad ? "FAILED" : "ok",
+           2000.0 * TEST_SIZE / 1e6 * CLOCKS_PER_SEC /
+           (double)(clock() - start + 1));
+    return bad != 0;
+}
+
+int main()
+{
+    Bytef *buf = (Bytef *)malloc(TEST_SIZE + 64);
+    z_size_t i;
+    int bad = 0;
+
+    if (buf == NULL)
+        return 1;
+    for (i = 0; i < TEST_SIZE + 64; i++)
+        buf[i] = (Bytef)test_rand();
+
+#ifdef SIMD_ADLER32
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        bad |= test_one("ssse3", adler32_ssse3, 32, buf);
+    if (__builtin_cpu_supports("avx2"))
+        bad |= test_one("avx2", adler32_avx2, 32, buf);
+    bad |= test_one("adler32_z", adler32_z, 1, buf);
+    adler32_simd = 0;
+    bad |= test_one("loop", adler32_z, 1, buf);
+#else
+#  ifdef NEON_ADLER32
+    bad |= test_one("neon", adler32_neon, 32, buf);
+#  endif
+    bad |= test_one("adler32_z", adler32_z, 1, buf);
+#endif
+
+    free(buf);
+    return bad;
+}
+#endif /* TEST_ADLER32 */
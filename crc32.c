@@ -18,7 +18,9 @@
   first call get_crc_table() to initialize the tables before allowing more than
   one thread to use crc32().
 
-  DYNAMIC_CRC_TABLE and MAKECRCH can be #defined to write out crc32.h.
+  DYNAMIC_CRC_TABLE and MAKECRCH can be #defined to write out crc32.h, and
+  TEST_CRC32 to build a program that checks and times the ways of computing
+  the crc below (at the end of this file).
  */
 
 #ifdef MAKECRCH
@@ -44,6 +46,33 @@
 #  define TBLS 1
 #endif /* BYFOUR */
 
+/* Definitions for doing the crc sixteen data bytes at a time, with a table
+   for each byte position.  The first four bytes are put together a byte at a
+   time, so this works on either byte order and needs no 32-bit type.  When
+   it is used, crc32_little() and crc32_big() are not. */
+#ifndef NOBYSIXTEEN
+#  define BYSIXTEEN
+   local unsigned long crc32_sixteen OF((unsigned long,
+                        const unsigned char FAR *, z_size_t));
+#endif
+
+/* PCLMUL_CRC32: fold runs of 16 bytes with carry-less multiplies (PCLMULQDQ)
+   when the CPU has them, checked on the first call of 64 bytes or more, as in
+   Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+   Instruction".  The result is the same as that of the tables.  Define
+   NO_PCLMUL_CRC32 to use the tables only.  crc32_use_pclmul is read and set
+   with atomic builtins, since the threads of a multi-threaded deflate may
+   make that first call at the same time; they all set it to the same value. */
+#if !defined(NO_PCLMUL_CRC32) && defined(__GNUC__) && __GNUC__ >= 6 && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define PCLMUL_CRC32
+#  include <immintrin.h>
+   local unsigned crc32_pclmul OF((unsigned, const unsigned char FAR *,
+                                   z_size_t))
+       __attribute__((target("sse2,pclmul")));
+   local int crc32_use_pclmul = -1;     /* -1 until checked */
+#endif
+
 /* Local functions for crc concatenation */
 local unsigned long gf2_matrix_times OF((unsigned long *mat,
                                          unsigned long vec));
@@ -55,6 +84,9 @@ local uLong crc32_combine_ OF((uLong crc1, uLong crc2, z_off64_t len2));
 
 local volatile int crc_table_empty = 1;
 local z_crc_t FAR crc_table[TBLS][256];
+#ifdef BYSIXTEEN
+local z_crc_t FAR crc_table16[16][256];
+#endif
 local void make_crc_table OF((void));
 #ifdef MAKECRCH
    local void write_table OF((FILE *, const z_crc_t FAR *));
@@ -83,7 +115,8 @@ local void make_crc_table OF((void));
   all the information needed to generate CRCs on data a byte at a time for all
   combinations of CRC register values and incoming bytes.  The remaining tables
   allow for word-at-a-time CRC calculation for both big-endian and little-
-  endian machines, where a word is four bytes.
+  endian machines, where a word is four bytes.  The crc_table16[k] are the
+  CRCs of each byte followed by k zeros, for sixteen bytes at a time.
 */
 local void make_crc_table()
 {
@@ -127,6 +160,17 @@ local void make_crc_table()
         }
 #endif /* BYFOUR */
 
+#ifdef BYSIXTEEN
+        for (n = 0; n < 256; n++) {
+            c = crc_table[0][n];
+            crc_table16[0][n] = c;
+            for (k = 1; k < 16; k++) {
+                c = crc_table[0][c & 0xff] ^ (c >> 8);
+                crc_table16[k][n] = c;
+            }
+        }
+#endif /* BYSIXTEEN */
+
         crc_table_empty = 0;
     }
     else {      /* not first */
@@ -156,6 +200,17 @@ local void make_crc_table()
         fprintf(out, "#endif\n");
 #  endif /* BYFOUR */
         fprintf(out, "  }\n};\n");
+#  ifdef BYSIXTEEN
+        fprintf(out, "\n#ifdef BYSIXTEEN\n");
+        fprintf(out, "local const z_crc_t FAR ");
+        fprintf(out, "crc_table16[16][256] =\n{\n  {\n");
+        write_table(out, crc_table16[0]);
+        for (k = 1; k < 16; k++) {
+            fprintf(out, "  },\n  {\n");
+            write_table(out, crc_table16[k]);
+        }
+        fprintf(out, "  }\n};\n#endif\n");
+#  endif /* BYSIXTEEN */
         fclose(out);
     }
 #endif /* MAKECRCH */
@@ -211,6 +266,32 @@ unsigned long ZEXPORT crc32_z(crc, buf, len)
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
+#ifdef PCLMUL_CRC32
+    if (len >= 64) {
+        int use = __atomic_load_n(&crc32_use_pclmul, __ATOMIC_RELAXED);
+
+        if (use < 0) {
+            __builtin_cpu_init();
+            use = __builtin_cpu_supports("pclmul") ? 1 : 0;
+            __atomic_store_n(&crc32_use_pclmul, use, __ATOMIC_RELAXED);
+        }
+        if (use) {
+            z_size_t n = len & ~(z_size_t)15;
+
+            crc = crc32_pclmul((unsigned)crc ^ 0xffffffffU, buf, n) ^
+                  0xffffffffUL;
+            buf += n;
+            len -= n;
+            if (len == 0)
+                return crc;
+        }
+    }
+#endif /* PCLMUL_CRC32 */
+
+#ifdef BYSIXTEEN
+    return crc32_sixteen(crc, buf, len);
+#endif /* BYSIXTEEN */
+
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         z_crc_t endian;
@@ -338,6 +419,136 @@ local unsigned long crc32_big(crc, buf, len)
 
 #endif /* BYFOUR */
 
+#ifdef BYSIXTEEN
+
+/* ========================================================================= */
+#define DOSIXTEEN \
+        c ^= (z_crc_t)buf[0] | ((z_crc_t)buf[1] << 8) | \
+             ((z_crc_t)buf[2] << 16) | ((z_crc_t)buf[3] << 24); \
+        c = crc_table16[15][c & 0xff] ^ crc_table16[14][(c >> 8) & 0xff] ^ \
+            crc_table16[13][(c >> 16) & 0xff] ^ crc_table16[12][c >> 24] ^ \
+            crc_table16[11][buf[4]] ^ crc_table16[10][buf[5]] ^ \
+            crc_table16[9][buf[6]] ^ crc_table16[8][buf[7]] ^ \
+            crc_table16[7][buf[8]] ^ crc_table16[6][buf[9]] ^ \
+            crc_table16[5][buf[10]] ^ crc_table16[4][buf[11]] ^ \
+            crc_table16[3][buf[12]] ^ crc_table16[2][buf[13]] ^ \
+            crc_table16[1][buf[14]] ^ crc_table16[0][buf[15]]; \
+        buf += 16
+
+/* ========================================================================= */
+local unsigned long crc32_sixteen(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    register z_crc_t c;
+
+    c = (z_crc_t)crc;
+    c = ~c & 0xffffffffUL;
+    while (len >= 16) {
+        DOSIXTEEN;
+        len -= 16;
+    }
+    if (len) do {
+        c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    } while (--len);
+    c = ~c & 0xffffffffUL;
+    return (unsigned long)c;
+}
+
+#endif /* BYSIXTEEN */
+
+#ifdef PCLMUL_CRC32
+
+/* =========================================================================
+ * Return the CRC register (not inverted) after the len bytes at buf, from
+ * crc.  len is a multiple of 16 and at least 64.  Four 128-bit lanes are
+ * folded forward 64 bytes at a time by multiplying them by x^(512+64) and
+ * x^512 mod P, then folded into one lane, then 16 bytes at a time, and that
+ * is reduced to 64 and then to 32 bits with a Barrett reduction.  The
+ * constants are bit-reflected, for the bit order of the tables.
+ */
+local unsigned crc32_pclmul(crc, buf, len)
+    unsigned crc;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)buf);
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    /* fold 64 bytes at a time */
+    x0 = k1k2;
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)buf));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *)(buf + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *)(buf + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *)(buf + 48)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold the rest 16 bytes at a time */
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+#endif /* PCLMUL_CRC32 */
+
 #define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
 
 /* ========================================================================= */
@@ -440,3 +651,158 @@ uLong ZEXPORT crc32_combine64(crc1, crc2, len2)
 {
     return crc32_combine_(crc1, crc2, len2);
 }
+
+#ifdef TEST_CRC32
+/* ========================================================================= */
+/* The program built with TEST_CRC32, for example with
+       cc -O2 -DTEST_CRC32 -DNO_GZ -o testcrc crc32.c
+   checks each way of computing the crc that this build has, and crc32_z(),
+   against one bit at a time, on random buffers, lengths, alignments and
+   starting values, and prints their throughput for calls of 64K, 8K and 256
+   bytes.  It returns 1 on a mismatch. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_SIZE   (1L << 20)
+#define TEST_TRIALS 20000
+#define TEST_BYTES  (256L << 20)        /* timed per call size */
+
+typedef unsigned long (*test_func) OF((unsigned long crc,
+                                       const unsigned char FAR *buf,
+                                       z_size_t len));
+
+local unsigned long test_seed = 1;
+
+local unsigned long test_rand()
+{
+    test_seed = test_seed * 1103515245UL + 12345UL;
+    return (test_seed >> 16) & 0x7fff;
+}
+
+local unsigned long test_ref(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    int k;
+
+    crc = ~crc & 0xffffffffUL;
+    while (len--) {
+        crc ^= *buf++;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320UL : crc >> 1;
+    }
+    return ~crc & 0xffffffffUL;
+}
+
+local unsigned long test_bytes(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    crc = crc ^ 0xffffffffUL;
+    while (len >= 8) {
+        DO8;
+        len -= 8;
+    }
+    if (len) do {
+        DO1;
+    } while (--len);
+    return crc ^ 0xffffffffUL;
+}
+
+#ifdef PCLMUL_CRC32
+/* crc32_pclmul() needs a multiple of 16 bytes, and at least 64 */
+local unsigned long test_pclmul(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    return crc32_pclmul((unsigned)crc ^ 0xffffffffU, buf, len) ^
+           0xffffffffUL;
+}
+#endif
+
+/* Check func on lengths that are a multiple of step and no less than least,
+   then time it. */
+local int test_one(name, func, step, least, buf)
+    const char *name;
+    test_func func;
+    z_size_t step;
+    z_size_t least;
+    unsigned char FAR *buf;
+{
+    static const z_size_t sizes[3] = {65536, 8192, 256};
+    z_size_t off, len, reps, r;
+    unsigned long crc;
+    clock_t start;
+    int trial, k, bad = 0;
+
+    for (trial = 0; trial < TEST_TRIALS; trial++) {
+        off = test_rand() % 64;
+        len = trial % 64 == 1 ? (test_rand() << 15 | test_rand()) % TEST_SIZE :
+              trial & 1 ? test_rand() % 4096 : test_rand() % 300;
+        len -= len % step;
+        if (len < least)
+            len = least;
+        crc = (test_rand() << 17 ^ test_rand() << 2 ^ test_rand()) &
+              0xffffffffUL;
+        if (func(crc, buf + off, len) != test_ref(crc, buf + off, len) &&
+            bad++ < 5)
+            printf("%s: mismatch, length %lu at offset %lu\n", name,
+                   (unsigned long)len, (unsigned long)off);
+    }
+
+    printf("%-8s %s", name, bad ? "FAILED" : "ok    ");
+    for (k = 0; k < 3; k++) {
+        reps = TEST_BYTES / sizes[k];
+        crc = 0;
+        start = clock();
+        for (r = 0; r < reps; r++)
+            crc = func(crc, buf + (r & 7) * step, sizes[k]);
+        printf(" %6lu: %5.0f MB/s", (unsigned long)sizes[k],
+               (double)TEST_BYTES / 1e6 * CLOCKS_PER_SEC /
+               (double)(clock() - start + 1));
+    }
+    printf("\n");
+    return bad != 0;
+}
+
+int main()
+{
+    unsigned char *buf = (unsigned char *)malloc(TEST_SIZE + 128);
+    z_size_t i;
+    int bad = 0;
+
+    if (buf == NULL)
+        return 1;
+    for (i = 0; i < TEST_SIZE + 128; i++)
+        buf[i] = (unsigned char)test_rand();
+    get_crc_table();
+
+#ifdef PCLMUL_CRC32
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul"))
+        bad |= test_one("pclmul", test_pclmul, 16, 64, buf);
+#endif
+#ifdef BYSIXTEEN
+    bad |= test_one("sixteen", crc32_sixteen, 1, 0, buf);
+#endif
+#ifdef BYFOUR
+    {
+        z_crc_t endian = 1;
+
+        if (*((unsigned char *)(&endian)))
+            bad |= test_one("little", crc32_little, 1, 0, buf);
+        else
+            bad |= test_one("big", crc32_big, 1, 0, buf);
+    }
+#endif
+    bad |= test_one("bytes", test_bytes, 1, 0, buf);
+    bad |= test_one("crc32_z", crc32_z, 1, 0, buf);
+
+    free(buf);
+    return bad;
+}
+#endif /* TEST_CRC32 */
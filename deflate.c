@@ -80,6 +80,9 @@ local block_state deflate_stored OF((deflate_state *s, int flush));
 local block_state deflate_fast   OF((deflate_state *s, int flush));
 #ifndef FASTEST
 local block_state deflate_slow   OF((deflate_state *s, int flush));
+local block_state deflate_optimal OF((deflate_state *s, int flush));
+local block_state deflate_quick  OF((deflate_state *s, int flush));
+local block_state deflate_medium OF((deflate_state *s, int flush));
 #endif
 local block_state deflate_rle    OF((deflate_state *s, int flush));
 local block_state deflate_huff   OF((deflate_state *s, int flush));
@@ -94,12 +97,80 @@ local unsigned read_buf   OF((z_streamp strm, Bytef *buf, unsigned size));
 #else
 local uInt longest_match  OF((deflate_state *s, IPos cur_match));
 #endif
+#ifndef FASTEST
+local unsigned tree_matches OF((deflate_state *s, uInt pos, uInt max_len,
+                                ushf *lens, ushf *dists, unsigned max_pairs));
+local void mcache_restore OF((deflate_state *s));
+#endif
 
 #ifdef ZLIB_DEBUG
 local  void check_match OF((deflate_state *s, IPos start, IPos match,
                             int length));
 #endif
 
+/* SIMD_MATCH: compare the strings in longest_match() sixteen bytes at a time
+ * with SSE2, or thirty-two with AVX2 if the CPU has it.  The match lengths
+ * are the same as those of the byte loop, so the output does not change.
+ * Define NO_SIMD_MATCH to use the byte loop.
+ */
+#if !defined(NO_SIMD_MATCH) && !defined(FASTEST) && !defined(ASMV) && \
+    !defined(UNALIGNED_OK) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define SIMD_MATCH
+#  include <emmintrin.h>
+local uInt match_len_sse2 OF((const Bytef *a, const Bytef *b));
+#  if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#    define SIMD_MATCH_AVX2
+#    include <immintrin.h>
+local uInt match_len_avx2 OF((const Bytef *a, const Bytef *b))
+    __attribute__((target("avx2")));
+#    define MATCH_LEN(s, a, b) \
+       ((s)->use_avx2 ? match_len_avx2(a, b) : match_len_sse2(a, b))
+#  else
+#    define MATCH_LEN(s, a, b) match_len_sse2(a, b)
+#  endif
+#endif
+
+/* SIMD_SLIDE: slide the hash table in slide_hash() eight entries at a time
+ * with SSE2, or sixteen with AVX2 if the CPU has it, using an unsigned
+ * saturating subtract: an entry less than w_size becomes NIL (zero), as in
+ * the plain loop.  Define NO_SIMD_SLIDE to use the plain loop.
+ */
+#if !defined(NO_SIMD_SLIDE) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define SIMD_SLIDE
+#  include <emmintrin.h>
+local void slide_sse2 OF((Posf *p, unsigned n, uInt wsize));
+#  if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#    define SIMD_SLIDE_AVX2
+#    include <immintrin.h>
+local void slide_avx2 OF((Posf *p, unsigned n, uInt wsize))
+    __attribute__((target("avx2")));
+#  endif
+#endif
+
+/* SIMD_RLE: measure the runs in deflate_rle() sixteen bytes at a time with
+ * SSE2, or thirty-two with AVX2 if the CPU has it, comparing the window with
+ * the repeated byte.  The run lengths are those of the byte loop, so the
+ * output does not change.  Define NO_SIMD_RLE to use the byte loop.
+ */
+#if !defined(NO_SIMD_RLE) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define SIMD_RLE
+#  include <emmintrin.h>
+local uInt run_len_sse2 OF((const Bytef *scan, uInt c));
+#  if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#    define SIMD_RLE_AVX2
+#    include <immintrin.h>
+local uInt run_len_avx2 OF((const Bytef *scan, uInt c))
+    __attribute__((target("avx2")));
+#    define RUN_LEN(s, scan, c) \
+       ((s)->use_avx2 ? run_len_avx2(scan, c) : run_len_sse2(scan, c))
+#  else
+#    define RUN_LEN(s, scan, c) run_len_sse2(scan, c)
+#  endif
+#endif
+
 /* ===========================================================================
  * Local data
  */
@@ -112,6 +183,55 @@ local  void check_match OF((deflate_state *s, IPos start, IPos match,
 #endif
 /* Matches of length 3 are discarded if their distance exceeds TOO_FAR */
 
+#define OPT_ITERATIONS 10
+/* Default number of passes of the Z_OPTIMAL parse, see deflateIterations() */
+
+#define OPT_BLOCK 8192
+/* Number of bytes parsed at a time by deflate_optimal() */
+
+#define OPT_PAIRS 8
+/* Number of matches kept for each position by deflate_optimal() */
+
+#define OPT_LAZY (1 << (MAX_MEM_LEVEL + 6))
+/* Most symbols in a block (lit_bufsize), for the lazy parse that
+ * deflate_optimal() keeps alongside its own
+ */
+
+#define MCACHE_OFF    0     /* no match cache, or no longer using it */
+#define MCACHE_START  1     /* not known yet whether to record or replay */
+#define MCACHE_RECORD 2
+#define MCACHE_REPLAY 3
+/* Values of mcache_mode, see deflateMatchCache() */
+
+#define MCACHE_HEAD 32
+/* Bytes at the start of the match cache that describe its contents */
+
+struct opt_state_s {
+    ulg  cost[OPT_BLOCK+1];      /* cheapest known cost to get to each byte */
+    ush  from_len[OPT_BLOCK+1];  /* last symbol on the path with that cost */
+    ush  from_dist[OPT_BLOCK+1];
+    ush  same[OPT_BLOCK];        /* number of equal bytes starting here */
+    uch  num_pairs[OPT_BLOCK];
+    ush  pair_len[OPT_BLOCK*OPT_PAIRS];  /* increasing lengths, each with */
+    ush  pair_dist[OPT_BLOCK*OPT_PAIRS]; /* the nearest match that long */
+    ush  sym_len[3][OPT_BLOCK];  /* the best parse so far, the next, and */
+    ush  sym_dist[3][OPT_BLOCK]; /* the lazy one (in buffer 2) */
+    uInt sym_count[3];
+    int  sym_buf;                /* the best, which is what gets tallied */
+    uInt sym_next;
+    ush  lazy_dist[OPT_LAZY];    /* the lazy parse of the current block, */
+    uch  lazy_lc[OPT_LAZY];      /* as _tr_tally() would have kept it */
+    uInt lazy_count;
+    ulg  lazy_bytes;             /* the input bytes it stands for, */
+    uInt lazy_skip;              /* and how far its last match goes past */
+    int  have_freq;              /* set once a parse has been counted */
+    ulg  lit_freq[L_CODES];      /* symbol counts of the last parse */
+    ulg  dist_freq[D_CODES];
+    ulg  lit_cost[L_CODES];      /* symbol costs, in 1/256 bit */
+    ulg  dist_cost[D_CODES];     /* including the extra bits */
+    ulg  len_cost[MAX_MATCH+1];  /* including the extra bits */
+};
+
 /* Values for max_lazy_match, good_match and max_chain_length, depending on
  * the desired pack level (0..9). The values given below have been tuned to
  * exclude worst case performance for pathological files. Better values may be
@@ -162,6 +282,36 @@ local const config configuration_table[10] = {
  */
 #define UPDATE_HASH(s,h,c) (h = (((h)<<s->hash_shift) ^ (c)) & s->hash_mask)
 
+/* ===========================================================================
+ * Hash key of the four bytes at str, for deflateHash(strm, 4).  This is not a
+ * running key: the bytes are multiplied by a constant (the golden ratio
+ * times 2^32), and the top hash_bits bits of the low 32 bits are used.
+ */
+#define HASH4(s, str) \
+   ((uInt)((((ulg)s->window[(str)] | (ulg)s->window[(str)+1] << 8 | \
+             (ulg)s->window[(str)+2] << 16 | (ulg)s->window[(str)+3] << 24) * \
+            2654435761UL & 0xffffffffUL) >> (32 - s->hash_bits)))
+
+/* ===========================================================================
+ * Set ins_h to the hash key of the string at str, with the hash selected by
+ * deflateHash().
+ * IN  assertion: as for UPDATE_HASH, for the MIN_MATCH-byte hash.
+ */
+#define HASH_STRING(s, str) \
+   (s->hash4 ? (s->ins_h = HASH4(s, str)) : \
+    UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]))
+
+/* ===========================================================================
+ * After deflateTree(), the strings are kept in binary trees instead of hash
+ * chains (see tree_matches()) by Z_OPTIMAL.  The other strategies keep the
+ * chains: the lazy evaluation stops at good_match and nice_match, and only
+ * inserts the strings inside a match, which the trees cannot do cheaply.
+ * Everything that inserts strings must check this, since the two cannot be
+ * mixed.
+ */
+#define USE_TREE(s) \
+   ((s)->right != Z_NULL && (s)->strategy == Z_OPTIMAL)
+
 
 /* ===========================================================================
  * Insert string str in the dictionary and set match_head to the previous head
@@ -175,12 +325,12 @@ local const config configuration_table[10] = {
  */
 #ifdef FASTEST
 #define INSERT_STRING(s, str, match_head) \
-   (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
+   (HASH_STRING(s, str), \
     match_head = s->head[s->ins_h], \
     s->head[s->ins_h] = (Pos)(str))
 #else
 #define INSERT_STRING(s, str, match_head) \
-   (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
+   (HASH_STRING(s, str), \
     match_head = s->prev[(str) & s->w_mask] = s->head[s->ins_h], \
     s->head[s->ins_h] = (Pos)(str))
 #endif
@@ -198,6 +348,42 @@ local const config configuration_table[10] = {
  * bit values at the expense of memory usage). We slide even when level == 0 to
  * keep the hash table consistent if we switch back to level > 0 later.
  */
+#ifdef SIMD_SLIDE
+/* ===========================================================================
+ * Slide the n entries at p down by wsize, as slide_hash() does.  n is a
+ * power of two no less than 256 (hash_size or w_size), so a multiple of the
+ * sixteen entries that are done at a time.  Pos must be 16 bits.
+ */
+local void slide_sse2(p, n, wsize)
+    Posf *p;
+    unsigned n;
+    uInt wsize;
+{
+    const __m128i w = _mm_set1_epi16((short)wsize);
+
+    for (; n != 0; n -= 16, p += 16) {
+        _mm_storeu_si128((__m128i *)p, _mm_subs_epu16(
+            _mm_loadu_si128((const __m128i *)p), w));
+        _mm_storeu_si128((__m128i *)(p + 8), _mm_subs_epu16(
+            _mm_loadu_si128((const __m128i *)(p + 8)), w));
+    }
+}
+
+#ifdef SIMD_SLIDE_AVX2
+local void slide_avx2(p, n, wsize)
+    Posf *p;
+    unsigned n;
+    uInt wsize;
+{
+    const __m256i w = _mm256_set1_epi16((short)wsize);
+
+    for (; n != 0; n -= 16, p += 16)
+        _mm256_storeu_si256((__m256i *)p, _mm256_subs_epu16(
+            _mm256_loadu_si256((const __m256i *)p), w));
+}
+#endif /* SIMD_SLIDE_AVX2 */
+#endif /* SIMD_SLIDE */
+
 local void slide_hash(s)
     deflate_state *s;
 {
@@ -205,6 +391,28 @@ local void slide_hash(s)
     Posf *p;
     uInt wsize = s->w_size;
 
+#ifdef SIMD_SLIDE
+    if (sizeof(Pos) == 2 && (s->hash_size & 15) == 0 && (wsize & 15) == 0) {
+#ifdef SIMD_SLIDE_AVX2
+        if (s->use_avx2) {
+            slide_avx2(s->head, s->hash_size, wsize);
+#ifndef FASTEST
+            slide_avx2(s->prev, wsize, wsize);
+            if (s->right != Z_NULL)
+                slide_avx2(s->right, wsize, wsize);
+#endif
+            return;
+        }
+#endif
+        slide_sse2(s->head, s->hash_size, wsize);
+#ifndef FASTEST
+        slide_sse2(s->prev, wsize, wsize);
+        if (s->right != Z_NULL)
+            slide_sse2(s->right, wsize, wsize);
+#endif
+        return;
+    }
+#endif
     n = s->hash_size;
     p = &s->head[n];
     do {
@@ -221,6 +429,14 @@ local void slide_hash(s)
          * its value will never be used.
          */
     } while (--n);
+    if (s->right != Z_NULL) {
+        n = wsize;
+        p = &s->right[n];
+        do {
+            m = *--p;
+            *p = (Pos)(m >= wsize ? m - wsize : NIL);
+        } while (--n);
+    }
 #endif
 }
 
@@ -297,7 +513,8 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
 #endif
     if (memLevel < 1 || memLevel > MAX_MEM_LEVEL || method != Z_DEFLATED ||
         windowBits < 8 || windowBits > 15 || level < 0 || level > 9 ||
-        strategy < 0 || strategy > Z_FIXED || (windowBits == 8 && wrap != 1)) {
+        strategy < 0 || strategy > Z_MEDIUM ||
+        (windowBits == 8 && wrap != 1)) {
         return Z_STREAM_ERROR;
     }
     if (windowBits == 8) windowBits = 9;  /* until 256-byte window bug fixed */
@@ -306,6 +523,24 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     strm->state = (struct internal_state FAR *)s;
     s->strm = strm;
     s->status = INIT_STATE;     /* to pass state test in deflateReset() */
+    s->opt = Z_NULL;
+    s->opt_iterations = OPT_ITERATIONS;
+    s->hash4 = 0;
+    s->right = Z_NULL;
+    s->split = Z_NULL;
+    s->block_split = 0;
+    s->pm = Z_NULL;
+    s->huff_optimal = 0;
+    s->count_only = 0;
+    s->mcache = Z_NULL;
+    s->mcache_size = 0;
+#if defined(SIMD_MATCH_AVX2) || defined(SIMD_SLIDE_AVX2) || \
+    defined(SIMD_RLE_AVX2)
+    __builtin_cpu_init();
+    s->use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#else
+    s->use_avx2 = 0;
+#endif
 
     s->wrap = wrap;
     s->gzhead = Z_NULL;
@@ -318,7 +553,7 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     s->hash_mask = s->hash_size - 1;
     s->hash_shift =  ((s->hash_bits+MIN_MATCH-1)/MIN_MATCH);
 
-    s->window = (Bytef *) ZALLOC(strm, s->w_size, 2*sizeof(Byte));
+    s->window = (Bytef *) ZALLOC(strm, s->w_size + WIN_PAD, 2*sizeof(Byte));
     s->prev   = (Posf *)  ZALLOC(strm, s->w_size, sizeof(Pos));
     s->head   = (Posf *)  ZALLOC(strm, s->hash_size, sizeof(Pos));
 
@@ -339,6 +574,7 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     }
     s->d_buf = overlay + s->lit_bufsize/sizeof(ush);
     s->l_buf = s->pending_buf + (1+sizeof(ush))*s->lit_bufsize;
+    zmemzero(s->window + 2*s->w_size, 2*WIN_PAD);
 
     s->level = level;
     s->strategy = strategy;
@@ -418,11 +654,19 @@ int ZEXPORT deflateSetDictionary (strm, dictionary, dictLength)
         str = s->strstart;
         n = s->lookahead - (MIN_MATCH-1);
         do {
-            UPDATE_HASH(s, s->ins_h, s->window[str + MIN_MATCH-1]);
 #ifndef FASTEST
-            s->prev[str & s->w_mask] = s->head[s->ins_h];
+            if (USE_TREE(s))
+                tree_matches(s, str, s->strstart + s->lookahead - str,
+                             Z_NULL, Z_NULL, 0);
+            else
 #endif
-            s->head[s->ins_h] = (Pos)str;
+            {
+                HASH_STRING(s, str);
+#ifndef FASTEST
+                s->prev[str & s->w_mask] = s->head[s->ins_h];
+#endif
+                s->head[s->ins_h] = (Pos)str;
+            }
             str++;
         } while (--n);
         s->strstart = str;
@@ -572,6 +816,7 @@ int ZEXPORT deflateParams(strm, level, strategy)
 {
     deflate_state *s;
     compress_func func;
+    int tree, changed;
 
     if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
     s = strm->state;
@@ -581,10 +826,12 @@ int ZEXPORT deflateParams(strm, level, strategy)
 #else
     if (level == Z_DEFAULT_COMPRESSION) level = 6;
 #endif
-    if (level < 0 || level > 9 || strategy < 0 || strategy > Z_FIXED) {
+    if (level < 0 || level > 9 || strategy < 0 || strategy > Z_MEDIUM) {
         return Z_STREAM_ERROR;
     }
     func = configuration_table[s->level].func;
+    tree = USE_TREE(s);
+    changed = level != s->level || strategy != s->strategy;
 
     if ((strategy != s->strategy || func != configuration_table[level].func) &&
         s->high_water) {
@@ -610,6 +857,15 @@ int ZEXPORT deflateParams(strm, level, strategy)
         s->max_chain_length = configuration_table[level].max_chain;
     }
     s->strategy = strategy;
+    if (USE_TREE(s) != tree) {
+        CLEAR_HASH(s);          /* the hash chains and trees do not mix */
+    }
+#ifndef FASTEST
+    if (changed && s->mcache_mode == MCACHE_REPLAY)
+        mcache_restore(s);      /* the new settings need the hash table */
+    else if (changed && s->mcache_mode == MCACHE_RECORD)
+        s->mcache_mode = MCACHE_OFF;
+#endif
     return Z_OK;
 }
 
@@ -632,6 +888,114 @@ int ZEXPORT deflateTune(strm, good_length, max_lazy, nice_length, max_chain)
     return Z_OK;
 }
 
+/* ========================================================================= */
+int ZEXPORT deflateIterations(strm, iterations)
+    z_streamp strm;
+    int iterations;
+{
+    if (deflateStateCheck(strm) || iterations < 1) return Z_STREAM_ERROR;
+    strm->state->opt_iterations = iterations;
+    return Z_OK;
+}
+
+/* ========================================================================= */
+int ZEXPORT deflateHash(strm, bytes)
+    z_streamp strm;
+    int bytes;
+{
+    deflate_state *s;
+
+    if (deflateStateCheck(strm) || (bytes != MIN_MATCH && bytes != 4))
+        return Z_STREAM_ERROR;
+    s = strm->state;
+    if (s->strstart != 0 || s->lookahead != 0 || s->insert != 0)
+        return Z_STREAM_ERROR;  /* the hash table is already in use */
+    s->hash4 = bytes == 4;
+    return Z_OK;
+}
+
+/* ========================================================================= */
+int ZEXPORT deflateTree(strm, tree)
+    z_streamp strm;
+    int tree;
+{
+    deflate_state *s;
+
+    if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
+    s = strm->state;
+    if (s->strstart != 0 || s->lookahead != 0 || s->insert != 0)
+        return Z_STREAM_ERROR;  /* the hash table is already in use */
+#ifndef FASTEST
+    if (tree && s->right == Z_NULL) {
+        s->right = (Posf *) ZALLOC(strm, s->w_size, sizeof(Pos));
+        if (s->right == Z_NULL) return Z_MEM_ERROR;
+        zmemzero((Bytef *)s->right, (unsigned)s->w_size * sizeof(Pos));
+    }
+#endif
+    if (!tree && s->right != Z_NULL) {
+        ZFREE(strm, s->right);
+        s->right = Z_NULL;
+    }
+    return Z_OK;
+}
+
+/* ========================================================================= */
+int ZEXPORT deflateSplit(strm, split)
+    z_streamp strm;
+    int split;
+{
+    if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
+    strm->state->block_split = split != 0;
+    return Z_OK;
+}
+
+/* ========================================================================= */
+int ZEXPORT deflateHuffman(strm, optimal)
+    z_streamp strm;
+    int optimal;
+{
+    if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
+    strm->state->huff_optimal = optimal != 0;
+    return Z_OK;
+}
+
+/* ========================================================================= */
+int ZEXPORT deflateCount(strm, count)
+    z_streamp strm;
+    int count;
+{
+    deflate_state *s;
+
+    if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
+    s = strm->state;
+    if (s->strstart != 0 || s->lookahead != 0 || s->insert != 0 ||
+        s->pending != 0 || s->bi_valid != 0)
+        return Z_STREAM_ERROR;  /* output already started */
+    s->count_only = count != 0;
+    return Z_OK;
+}
+
+/* ========================================================================= */
+int ZEXPORT deflateMatchCache(strm, cache, size)
+    z_streamp strm;
+    Bytef *cache;
+    uLong size;
+{
+    deflate_state *s;
+
+    if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
+    s = strm->state;
+    if (s->strstart != 0 || s->lookahead != 0 || s->insert != 0)
+        return Z_STREAM_ERROR;  /* the stream has started */
+    if (cache != Z_NULL && size < MCACHE_HEAD)
+        return Z_STREAM_ERROR;
+    s->mcache = cache;
+    s->mcache_size = cache != Z_NULL ? size : 0;
+    s->mcache_mode = cache != Z_NULL ? MCACHE_START : MCACHE_OFF;
+    s->mcache_next = 0;
+    return Z_OK;
+}
+
 /* =========================================================================
  * For the default windowBits of 15 and memLevel of 8, this function returns
  * a close to exact, as well as small, upper bound on the compressed size.
@@ -738,7 +1102,8 @@ local void flush_pending(strm)
     if (len > strm->avail_out) len = strm->avail_out;
     if (len == 0) return;
 
-    zmemcpy(strm->next_out, s->pending_out, len);
+    if (!s->count_only)         /* else the bytes are not defined anyway */
+        zmemcpy(strm->next_out, s->pending_out, len);
     strm->next_out  += len;
     s->pending_out  += len;
     strm->total_out += len;
@@ -816,7 +1181,8 @@ int ZEXPORT deflate (strm, flush)
         uInt header = (Z_DEFLATED + ((s->w_bits-8)<<4)) << 8;
         uInt level_flags;
 
-        if (s->strategy >= Z_HUFFMAN_ONLY || s->level < 2)
+        if ((s->strategy >= Z_HUFFMAN_ONLY && s->strategy <= Z_FIXED) ||
+            s->strategy == Z_QUICK || s->level < 2)
             level_flags = 0;
         else if (s->level < 6)
             level_flags = 1;
@@ -859,7 +1225,9 @@ int ZEXPORT deflate (strm, flush)
             put_byte(s, 0);
             put_byte(s, 0);
             put_byte(s, s->level == 9 ? 2 :
-                     (s->strategy >= Z_HUFFMAN_ONLY || s->level < 2 ?
+                     ((s->strategy >= Z_HUFFMAN_ONLY &&
+                       s->strategy <= Z_FIXED) || s->strategy == Z_QUICK ||
+                      s->level < 2 ?
                       4 : 0));
             put_byte(s, OS_CODE);
             s->status = BUSY_STATE;
@@ -883,7 +1251,9 @@ int ZEXPORT deflate (strm, flush)
             put_byte(s, (Byte)((s->gzhead->time >> 16) & 0xff));
             put_byte(s, (Byte)((s->gzhead->time >> 24) & 0xff));
             put_byte(s, s->level == 9 ? 2 :
-                     (s->strategy >= Z_HUFFMAN_ONLY || s->level < 2 ?
+                     ((s->strategy >= Z_HUFFMAN_ONLY &&
+                       s->strategy <= Z_FIXED) || s->strategy == Z_QUICK ||
+                      s->level < 2 ?
                       4 : 0));
             put_byte(s, s->gzhead->os & 0xff);
             if (s->gzhead->extra != Z_NULL) {
@@ -1000,6 +1370,11 @@ int ZEXPORT deflate (strm, flush)
         bstate = s->level == 0 ? deflate_stored(s, flush) :
                  s->strategy == Z_HUFFMAN_ONLY ? deflate_huff(s, flush) :
                  s->strategy == Z_RLE ? deflate_rle(s, flush) :
+#ifndef FASTEST
+                 s->strategy == Z_OPTIMAL ? deflate_optimal(s, flush) :
+                 s->strategy == Z_QUICK ? deflate_quick(s, flush) :
+                 s->strategy == Z_MEDIUM ? deflate_medium(s, flush) :
+#endif
                  (*(configuration_table[s->level].func))(s, flush);
 
         if (bstate == finish_started || bstate == finish_done) {
@@ -1083,6 +1458,10 @@ int ZEXPORT deflateEnd (strm)
     status = strm->state->status;
 
     /* Deallocate in reverse order of allocations: */
+    TRY_FREE(strm, strm->state->opt);
+    TRY_FREE(strm, strm->state->split);
+    TRY_FREE(strm, strm->state->pm);
+    TRY_FREE(strm, strm->state->right);
     TRY_FREE(strm, strm->state->pending_buf);
     TRY_FREE(strm, strm->state->head);
     TRY_FREE(strm, strm->state->prev);
@@ -1124,20 +1503,39 @@ int ZEXPORT deflateCopy (dest, source)
     dest->state = (struct internal_state FAR *) ds;
     zmemcpy((voidpf)ds, (voidpf)ss, sizeof(deflate_state));
     ds->strm = dest;
-
-    ds->window = (Bytef *) ZALLOC(dest, ds->w_size, 2*sizeof(Byte));
+    ds->opt = Z_NULL;
+    ds->right = Z_NULL;
+    ds->split = Z_NULL;     /* only holds data while a block is flushed */
+    ds->pm = Z_NULL;        /* likewise */
+    if (ds->mcache_mode != MCACHE_REPLAY)
+        ds->mcache_mode = MCACHE_OFF;   /* only one of them can write it */
+
+    ds->window = (Bytef *) ZALLOC(dest, ds->w_size + WIN_PAD, 2*sizeof(Byte));
     ds->prev   = (Posf *)  ZALLOC(dest, ds->w_size, sizeof(Pos));
     ds->head   = (Posf *)  ZALLOC(dest, ds->hash_size, sizeof(Pos));
     overlay = (ushf *) ZALLOC(dest, ds->lit_bufsize, sizeof(ush)+2);
     ds->pending_buf = (uchf *) overlay;
 
+    if (ss->opt != Z_NULL)
+        ds->opt = (struct opt_state_s FAR *)
+                  ZALLOC(dest, 1, sizeof(struct opt_state_s));
+    if (ss->right != Z_NULL)
+        ds->right = (Posf *) ZALLOC(dest, ds->w_size, sizeof(Pos));
+
     if (ds->window == Z_NULL || ds->prev == Z_NULL || ds->head == Z_NULL ||
-        ds->pending_buf == Z_NULL) {
+        ds->pending_buf == Z_NULL ||
+        (ss->opt != Z_NULL && ds->opt == Z_NULL) ||
+        (ss->right != Z_NULL && ds->right == Z_NULL)) {
         deflateEnd (dest);
         return Z_MEM_ERROR;
     }
+    if (ss->opt != Z_NULL)
+        zmemcpy((voidpf)ds->opt, (voidpf)ss->opt, sizeof(struct opt_state_s));
+    if (ss->right != Z_NULL)
+        zmemcpy((voidpf)ds->right, (voidpf)ss->right,
+                ds->w_size * sizeof(Pos));
     /* following zmemcpy do not work for 16-bit MSDOS */
-    zmemcpy(ds->window, ss->window, ds->w_size * 2 * sizeof(Byte));
+    zmemcpy(ds->window, ss->window, (ds->w_size + WIN_PAD) * 2 * sizeof(Byte));
     zmemcpy((voidpf)ds->prev, (voidpf)ss->prev, ds->w_size * sizeof(Pos));
     zmemcpy((voidpf)ds->head, (voidpf)ss->head, ds->hash_size * sizeof(Pos));
     zmemcpy(ds->pending_buf, ss->pending_buf, (uInt)ds->pending_buf_size);
@@ -1174,7 +1572,10 @@ local unsigned read_buf(strm, buf, size)
     strm->avail_in  -= len;
 
     zmemcpy(buf, strm->next_in, len);
-    if (strm->state->wrap == 1) {
+    if (strm->state->count_only) {
+        /* the check value is not needed, see deflateCount() */
+    }
+    else if (strm->state->wrap == 1) {
         strm->adler = adler32(strm->adler, buf, len);
     }
 #ifdef GZIP
@@ -1197,6 +1598,8 @@ local void lm_init (s)
     s->window_size = (ulg)2L*s->w_size;
 
     CLEAR_HASH(s);
+    if (s->right != Z_NULL)
+        zmemzero((Bytef *)s->right, (unsigned)s->w_size * sizeof(Pos));
 
     /* Set the default configuration parameters:
      */
@@ -1212,7 +1615,18 @@ local void lm_init (s)
     s->match_length = s->prev_length = MIN_MATCH-1;
     s->match_available = 0;
     s->ins_h = 0;
+    s->mcache_mode = s->mcache != Z_NULL ? MCACHE_START : MCACHE_OFF;
+    s->mcache_next = 0;
 #ifndef FASTEST
+    if (s->opt != Z_NULL) {
+        s->opt->sym_count[0] = s->opt->sym_count[1] = 0;
+        s->opt->sym_buf = 0;
+        s->opt->sym_next = 0;
+        s->opt->have_freq = 0;
+        s->opt->lazy_count = 0;
+        s->opt->lazy_bytes = 0;
+        s->opt->lazy_skip = 0;
+    }
 #ifdef ASMV
     match_init(); /* initialize the asm code */
 #endif
@@ -1229,6 +1643,52 @@ local void lm_init (s)
  *   string (strstart) and its distance is <= MAX_DIST, and prev_length >= 1
  * OUT assertion: the match length is not greater than s->lookahead.
  */
+#ifdef SIMD_MATCH
+/* ===========================================================================
+ * Return the number of equal bytes at the start of a and b, up to MAX_MATCH.
+ * Both must have MAX_MATCH readable bytes.
+ */
+local uInt match_len_sse2(a, b)
+    const Bytef *a;
+    const Bytef *b;
+{
+    uInt len;
+    unsigned mask;
+
+    for (len = 0; len < MAX_MATCH - 2; len += 16) {
+        mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128((const __m128i *)(a + len)),
+                   _mm_loadu_si128((const __m128i *)(b + len)))) ^ 0xffff;
+        if (mask != 0)
+            return len + (uInt)__builtin_ctz(mask);
+    }
+    /* MAX_MATCH-2 is a multiple of 32; two bytes are left */
+    if (a[len] != b[len]) return len;
+    return a[len + 1] != b[len + 1] ? len + 1 : len + 2;
+}
+
+#ifdef SIMD_MATCH_AVX2
+local uInt match_len_avx2(a, b)
+    const Bytef *a;
+    const Bytef *b;
+{
+    uInt len;
+    unsigned mask;
+
+    for (len = 0; len < MAX_MATCH - 2; len += 32) {
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                   _mm256_loadu_si256((const __m256i *)(a + len)),
+                   _mm256_loadu_si256((const __m256i *)(b + len)))) ^
+               0xffffffffU;
+        if (mask != 0)
+            return len + (uInt)__builtin_ctz(mask);
+    }
+    if (a[len] != b[len]) return len;
+    return a[len + 1] != b[len + 1] ? len + 1 : len + 2;
+}
+#endif /* SIMD_MATCH_AVX2 */
+#endif /* SIMD_MATCH */
+
 #ifndef ASMV
 /* For 80x86 and 680x0, an optimized version will be provided in match.asm or
  * match.S. The code will be functionally equivalent.
@@ -1259,7 +1719,9 @@ local uInt longest_match(s, cur_match)
     register ush scan_start = *(ushf*)scan;
     register ush scan_end   = *(ushf*)(scan+best_len-1);
 #else
+#ifndef SIMD_MATCH
     register Bytef *strend = s->window + s->strstart + MAX_MATCH;
+#endif
     register Byte scan_end1  = scan[best_len-1];
     register Byte scan_end   = scan[best_len];
 #endif
@@ -1292,12 +1754,22 @@ local uInt longest_match(s, cur_match)
          * However the length of the match is limited to the lookahead, so
          * the output of deflate is not affected by the uninitialized values.
          */
-#if (defined(UNALIGNED_OK) && MAX_MATCH == 258)
+#ifdef SIMD_MATCH
+        if (match[best_len]   != scan_end  ||
+            match[best_len-1] != scan_end1 ||
+            *match            != *scan     ||
+            match[1]          != scan[1])      continue;
+
+        /* Here scan[2] is compared too, so the hash does not matter */
+        len = (int)MATCH_LEN(s, scan, match);
+
+#elif (defined(UNALIGNED_OK) && MAX_MATCH == 258)
         /* This code assumes sizeof(unsigned short) == 2. Do not use
          * UNALIGNED_OK if your compiler uses a different size.
          */
         if (*(ushf*)(match+best_len-1) != scan_end ||
-            *(ushf*)match != scan_start) continue;
+            *(ushf*)match != scan_start ||
+            (s->hash4 && match[2] != scan[2])) continue;
 
         /* It is not necessary to compare scan[2] and match[2] since they are
          * always equal when the other bytes match, given that the hash keys
@@ -1330,13 +1802,15 @@ local uInt longest_match(s, cur_match)
         if (match[best_len]   != scan_end  ||
             match[best_len-1] != scan_end1 ||
             *match            != *scan     ||
-            *++match          != scan[1])      continue;
+            *++match          != scan[1]   ||
+            (s->hash4 && match[1] != scan[2])) continue;
 
         /* The check at best_len-1 can be removed because it will be made
          * again later. (This heuristic is not always a win.)
          * It is not necessary to compare scan[2] and match[2] since they
          * are always equal when the other bytes match, given that
-         * the hash keys are equal and that HASH_BITS >= 8.
+         * the hash keys are equal and that HASH_BITS >= 8.  That is not
+         * so for the four-byte hash, which is why it is compared above.
          */
         scan += 2, match++;
         Assert(*scan == *match, "match[2]?");
@@ -1356,7 +1830,7 @@ local uInt longest_match(s, cur_match)
         len = MAX_MATCH - (int)(strend - scan);
         scan = strend - MAX_MATCH;
 
-#endif /* UNALIGNED_OK */
+#endif /* SIMD_MATCH, UNALIGNED_OK */
 
         if (len > best_len) {
             s->match_start = cur_match;
@@ -1377,6 +1851,103 @@ local uInt longest_match(s, cur_match)
 }
 #endif /* ASMV */
 
+/* ===========================================================================
+ * Binary-tree match finder, for deflateTree().  The strings with the same
+ * hash key are kept in a binary search tree, ordered by their bytes, with
+ * the newest string at the root and each string older than its parent.  The
+ * string at pos is inserted by walking down from the root: every string on
+ * the way shares at least as many bytes with it as the nearer of the
+ * smaller and greater strings already passed, so the comparisons start
+ * there, and the path splits into the new smaller and greater subtrees of
+ * pos.  A string that matches pos for all MAX_MATCH bytes is replaced by
+ * pos.  If max_len is shorter (near the end of the input) the strings past
+ * a full match are dropped instead, since they cannot be ordered against
+ * pos, and a wrong order would break the shortcut above.
+ *
+ * On the way, each match longer than the ones before it is recorded in
+ * lens[] and dists[], up to max_pairs of them (the longest are kept), as
+ * opt_matches() does; the strings are visited newest first, so each is the
+ * nearest of its length.  With lens == Z_NULL the string is only inserted.
+ * The walk stops after max_chain_length strings or at the first one too far
+ * back, which cuts off the rest of the tree since they are all older.
+ *
+ * pos must be the next string to be inserted, and max_len (at most the
+ * lookahead from pos) at least MIN_MATCH.  Returns the number of matches
+ * recorded.
+ */
+local unsigned tree_matches(s, pos, max_len, lens, dists, max_pairs)
+    deflate_state *s;
+    uInt pos;
+    uInt max_len;
+    ushf *lens;
+    ushf *dists;
+    unsigned max_pairs;
+{
+    Posf *smaller = s->prev;
+    Posf *greater = s->right;
+    uInt wmask = s->w_mask;
+    Bytef *scan = s->window + pos;
+    Posf *lt = &smaller[pos & wmask];   /* where the next smaller goes */
+    Posf *gt = &greater[pos & wmask];   /* where the next greater goes */
+    uInt lt_len = 0, gt_len = 0;        /* bytes shared with each */
+    uInt best_len = MIN_MATCH-1;
+    unsigned chain_length = s->max_chain_length;
+    IPos limit = pos > (IPos)MAX_DIST(s) ? pos - (IPos)MAX_DIST(s) : NIL;
+    IPos cur_match;
+    unsigned n = 0;
+
+    if (max_len > MAX_MATCH) max_len = MAX_MATCH;
+    HASH_STRING(s, pos);
+    cur_match = s->head[s->ins_h];
+    s->head[s->ins_h] = (Pos)pos;
+
+    while (cur_match > limit && chain_length-- != 0) {
+        Bytef *match = s->window + cur_match;
+        uInt len = lt_len < gt_len ? lt_len : gt_len;
+
+        Assert(cur_match < pos, "no future");
+        if (match[len] == scan[len]) {
+            while (++len < max_len && match[len] == scan[len])
+                ;
+            if (len > best_len && lens != Z_NULL) {
+                if (n == max_pairs) {       /* drop the shortest */
+                    for (n = 1; n < max_pairs; n++) {
+                        lens[n - 1] = lens[n];
+                        dists[n - 1] = dists[n];
+                    }
+                    n--;
+                }
+                lens[n] = (ush)len;
+                dists[n] = (ush)(pos - cur_match);
+                n++;
+                best_len = len;
+            }
+            if (len >= max_len) {
+                if (max_len == MAX_MATCH) {
+                    *lt = smaller[cur_match & wmask];
+                    *gt = greater[cur_match & wmask];
+                }
+                else
+                    *lt = *gt = NIL;
+                return n;
+            }
+        }
+        if (match[len] < scan[len]) {
+            *lt = (Pos)cur_match;
+            lt = &greater[cur_match & wmask];
+            cur_match = *lt;
+            lt_len = len;
+        } else {
+            *gt = (Pos)cur_match;
+            gt = &smaller[cur_match & wmask];
+            cur_match = *gt;
+            gt_len = len;
+        }
+    }
+    *lt = *gt = NIL;
+    return n;
+}
+
 #else /* FASTEST */
 
 /* ---------------------------------------------------------------------------
@@ -1404,7 +1975,8 @@ local uInt longest_match(s, cur_match)
 
     /* Return failure if the match length is less than 2:
      */
-    if (match[0] != scan[0] || match[1] != scan[1]) return MIN_MATCH-1;
+    if (match[0] != scan[0] || match[1] != scan[1] ||
+        (s->hash4 && match[2] != scan[2])) return MIN_MATCH-1;
 
     /* The check at best_len-1 can be removed because it will be made
      * again later. (This heuristic is not always a win.)
@@ -1486,7 +2058,8 @@ local void fill_window(s)
     unsigned more;    /* Amount of free space at the end of the window. */
     uInt wsize = s->w_size;
 
-    Assert(s->lookahead < MIN_LOOKAHEAD, "already enough lookahead");
+    Assert(s->lookahead < MIN_LOOKAHEAD || s->strategy == Z_OPTIMAL,
+           "already enough lookahead");
 
     do {
         more = (unsigned)(s->window_size -(ulg)s->lookahead -(ulg)s->strstart);
@@ -1543,11 +2116,19 @@ local void fill_window(s)
             Call UPDATE_HASH() MIN_MATCH-3 more times
 #endif
             while (s->insert) {
-                UPDATE_HASH(s, s->ins_h, s->window[str + MIN_MATCH-1]);
 #ifndef FASTEST
-                s->prev[str & s->w_mask] = s->head[s->ins_h];
+                if (USE_TREE(s))
+                    tree_matches(s, str, s->lookahead + s->insert,
+                                 Z_NULL, Z_NULL, 0);
+                else
 #endif
-                s->head[s->ins_h] = (Pos)str;
+                {
+                    HASH_STRING(s, str);
+#ifndef FASTEST
+                    s->prev[str & s->w_mask] = s->head[s->ins_h];
+#endif
+                    s->head[s->ins_h] = (Pos)str;
+                }
                 str++;
                 s->insert--;
                 if (s->lookahead + s->insert < MIN_MATCH)
@@ -2047,63 +2628,71 @@ local block_state deflate_slow(s, flush)
         FLUSH_BLOCK(s, 0);
     return block_done;
 }
-#endif /* FASTEST */
 
 /* ===========================================================================
- * For Z_RLE, simply look for runs of bytes, generate matches only of distance
- * one.  Do not maintain a hash table.  (It will be regenerated if this run of
- * deflate switches away from Z_RLE.)
+ * For Z_QUICK: look only at the head of the hash chain, and do not insert
+ * the strings inside a match in the hash table.  This is a good deal faster
+ * than deflate_fast() at level 1, which still follows the chain, at some
+ * cost in compression.  The blocks are ended as for the other strategies,
+ * so the fixed codes are used only when they are the smaller.
  */
-local block_state deflate_rle(s, flush)
+local block_state deflate_quick(s, flush)
     deflate_state *s;
     int flush;
 {
-    int bflush;             /* set if current block must be flushed */
-    uInt prev;              /* byte at distance one to match */
-    Bytef *scan, *strend;   /* scan goes up to strend for length of run */
+    IPos hash_head;       /* head of the hash chain */
+    uInt mlen;            /* length of the match at hash_head */
+    int bflush;           /* set if current block must be flushed */
 
     for (;;) {
         /* Make sure that we always have enough lookahead, except
          * at the end of the input file. We need MAX_MATCH bytes
-         * for the longest run, plus one for the unrolled loop.
+         * for the next match, plus MIN_MATCH bytes to insert the
+         * string following the next match.
          */
-        if (s->lookahead <= MAX_MATCH) {
+        if (s->lookahead < MIN_LOOKAHEAD) {
             fill_window(s);
-            if (s->lookahead <= MAX_MATCH && flush == Z_NO_FLUSH) {
+            if (s->lookahead < MIN_LOOKAHEAD && flush == Z_NO_FLUSH) {
                 return need_more;
             }
             if (s->lookahead == 0) break; /* flush the current block */
         }
 
-        /* See how many times the previous byte repeats */
-        s->match_length = 0;
-        if (s->lookahead >= MIN_MATCH && s->strstart > 0) {
-            scan = s->window + s->strstart - 1;
-            prev = *scan;
-            if (prev == *++scan && prev == *++scan && prev == *++scan) {
-                strend = s->window + s->strstart + MAX_MATCH;
-                do {
-                } while (prev == *++scan && prev == *++scan &&
-                         prev == *++scan && prev == *++scan &&
-                         prev == *++scan && prev == *++scan &&
-                         prev == *++scan && prev == *++scan &&
-                         scan < strend);
-                s->match_length = MAX_MATCH - (uInt)(strend - scan);
-                if (s->match_length > s->lookahead)
-                    s->match_length = s->lookahead;
+        /* Insert the string at strstart and compare it with the previous
+         * string with the same hash key, if that is near enough.  strstart
+         * is at most window_size-MIN_LOOKAHEAD, so MAX_MATCH bytes can be
+         * read from it; the length is cut back to the lookahead afterwards.
+         */
+        mlen = 0;
+        if (s->lookahead >= MIN_MATCH) {
+            INSERT_STRING(s, s->strstart, hash_head);
+            if (hash_head != NIL && s->strstart - hash_head <= MAX_DIST(s)) {
+                Bytef *scan = s->window + s->strstart;
+                Bytef *match = s->window + hash_head;
+
+#ifdef SIMD_MATCH
+                mlen = MATCH_LEN(s, scan, match);
+#else
+                while (mlen < MAX_MATCH && scan[mlen] == match[mlen])
+                    mlen++;
+#endif
+                if (mlen > s->lookahead) mlen = s->lookahead;
             }
-            Assert(scan <= s->window+(uInt)(s->window_size-1), "wild scan");
         }
 
-        /* Emit match if have run of MIN_MATCH or longer, else emit literal */
-        if (s->match_length >= MIN_MATCH) {
-            check_match(s, s->strstart, s->strstart - 1, s->match_length);
+        if (mlen >= MIN_MATCH) {
+            check_match(s, s->strstart, hash_head, (int)mlen);
 
-            _tr_tally_dist(s, 1, s->match_length - MIN_MATCH, bflush);
+            _tr_tally_dist(s, s->strstart - hash_head, mlen - MIN_MATCH,
+                           bflush);
 
-            s->lookahead -= s->match_length;
-            s->strstart += s->match_length;
-            s->match_length = 0;
+            s->lookahead -= mlen;
+            s->strstart += mlen;
+            s->ins_h = s->window[s->strstart];
+            UPDATE_HASH(s, s->ins_h, s->window[s->strstart+1]);
+#if MIN_MATCH != 3
+            Call UPDATE_HASH() MIN_MATCH-3 more times
+#endif
         } else {
             /* No match, output a literal byte */
             Tracevv((stderr,"%c", s->window[s->strstart]));
@@ -2113,7 +2702,7 @@ local block_state deflate_rle(s, flush)
         }
         if (bflush) FLUSH_BLOCK(s, 0);
     }
-    s->insert = 0;
+    s->insert = s->strstart < MIN_MATCH-1 ? s->strstart : MIN_MATCH-1;
     if (flush == Z_FINISH) {
         FLUSH_BLOCK(s, 1);
         return finish_done;
@@ -2124,40 +2713,1088 @@ local block_state deflate_rle(s, flush)
 }
 
 /* ===========================================================================
- * For Z_HUFFMAN_ONLY, do not look for matches.  Do not maintain a hash table.
- * (It will be regenerated if this run of deflate switches away from Huffman.)
+ * For Z_MEDIUM: the lazy evaluation of deflate_slow(), but the strings inside
+ * a match longer than max_insert_length (the max_lazy of the level) are not
+ * inserted in the hash table, as in deflate_fast().  Long matches are common
+ * in image data, and entering every string in them is most of the work of
+ * deflate_slow() there.
  */
-local block_state deflate_huff(s, flush)
+local block_state deflate_medium(s, flush)
     deflate_state *s;
     int flush;
 {
-    int bflush;             /* set if current block must be flushed */
+    IPos hash_head;          /* head of hash chain */
+    int bflush;              /* set if current block must be flushed */
 
     for (;;) {
-        /* Make sure that we have a literal to write. */
-        if (s->lookahead == 0) {
+        if (s->lookahead < MIN_LOOKAHEAD) {
             fill_window(s);
-            if (s->lookahead == 0) {
-                if (flush == Z_NO_FLUSH)
-                    return need_more;
-                break;      /* flush the current block */
+            if (s->lookahead < MIN_LOOKAHEAD && flush == Z_NO_FLUSH) {
+                return need_more;
             }
+            if (s->lookahead == 0) break; /* flush the current block */
         }
 
-        /* Output a literal byte */
-        s->match_length = 0;
-        Tracevv((stderr,"%c", s->window[s->strstart]));
-        _tr_tally_lit (s, s->window[s->strstart], bflush);
-        s->lookahead--;
-        s->strstart++;
-        if (bflush) FLUSH_BLOCK(s, 0);
-    }
-    s->insert = 0;
-    if (flush == Z_FINISH) {
-        FLUSH_BLOCK(s, 1);
+        hash_head = NIL;
+        if (s->lookahead >= MIN_MATCH) {
+            INSERT_STRING(s, s->strstart, hash_head);
+        }
+
+        s->prev_length = s->match_length, s->prev_match = s->match_start;
+        s->match_length = MIN_MATCH-1;
+
+        if (hash_head != NIL && s->prev_length < s->max_lazy_match &&
+            s->strstart - hash_head <= MAX_DIST(s)) {
+            s->match_length = longest_match (s, hash_head);
+
+            if (s->match_length <= 5 && (s->strategy == Z_FILTERED
+#if TOO_FAR <= 32767
+                || (s->match_length == MIN_MATCH &&
+                    s->strstart - s->match_start > TOO_FAR)
+#endif
+                )) {
+                s->match_length = MIN_MATCH-1;
+            }
+        }
+        if (s->prev_length >= MIN_MATCH && s->match_length <= s->prev_length) {
+            uInt max_insert = s->strstart + s->lookahead - MIN_MATCH;
+            /* Do not insert strings in hash table beyond this. */
+
+            check_match(s, s->strstart-1, s->prev_match, s->prev_length);
+
+            _tr_tally_dist(s, s->strstart -1 - s->prev_match,
+                           s->prev_length - MIN_MATCH, bflush);
+
+            /* strstart-1 and strstart are already inserted.  The rest of
+             * a short match is inserted as in deflate_slow(); a long one is
+             * skipped, and the hash key is set up again after it.
+             */
+            s->lookahead -= s->prev_length-1;
+            if (s->prev_length <= s->max_insert_length) {
+                s->prev_length -= 2;
+                do {
+                    if (++s->strstart <= max_insert) {
+                        INSERT_STRING(s, s->strstart, hash_head);
+                    }
+                } while (--s->prev_length != 0);
+                s->strstart++;
+            } else {
+                s->strstart += s->prev_length-1;
+                s->ins_h = s->window[s->strstart];
+                UPDATE_HASH(s, s->ins_h, s->window[s->strstart+1]);
+#if MIN_MATCH != 3
+                Call UPDATE_HASH() MIN_MATCH-3 more times
+#endif
+            }
+            s->match_available = 0;
+            s->match_length = MIN_MATCH-1;
+
+            if (bflush) FLUSH_BLOCK(s, 0);
+
+        } else if (s->match_available) {
+            Tracevv((stderr,"%c", s->window[s->strstart-1]));
+            _tr_tally_lit(s, s->window[s->strstart-1], bflush);
+            if (bflush) {
+                FLUSH_BLOCK_ONLY(s, 0);
+            }
+            s->strstart++;
+            s->lookahead--;
+            if (s->strm->avail_out == 0) return need_more;
+        } else {
+            s->match_available = 1;
+            s->strstart++;
+            s->lookahead--;
+        }
+    }
+    Assert (flush != Z_NO_FLUSH, "no flush?");
+    if (s->match_available) {
+        Tracevv((stderr,"%c", s->window[s->strstart-1]));
+        _tr_tally_lit(s, s->window[s->strstart-1], bflush);
+        s->match_available = 0;
+    }
+    s->insert = s->strstart < MIN_MATCH-1 ? s->strstart : MIN_MATCH-1;
+    if (flush == Z_FINISH) {
+        FLUSH_BLOCK(s, 1);
+        return finish_done;
+    }
+    if (s->last_lit)
+        FLUSH_BLOCK(s, 0);
+    return block_done;
+}
+#endif /* FASTEST */
+
+#ifdef SIMD_RLE
+/* ===========================================================================
+ * Return the number of bytes at the start of scan that are equal to c, up to
+ * MAX_MATCH.  scan must have MAX_MATCH readable bytes.
+ */
+local uInt run_len_sse2(scan, c)
+    const Bytef *scan;
+    uInt c;
+{
+    const __m128i v = _mm_set1_epi8((char)c);
+    uInt len;
+    unsigned mask;
+
+    for (len = 0; len < MAX_MATCH - 2; len += 16) {
+        mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128((const __m128i *)(scan + len)), v)) ^
+               0xffff;
+        if (mask != 0)
+            return len + (uInt)__builtin_ctz(mask);
+    }
+    if (scan[len] != c) return len;
+    return scan[len + 1] != c ? len + 1 : len + 2;
+}
+
+#ifdef SIMD_RLE_AVX2
+local uInt run_len_avx2(scan, c)
+    const Bytef *scan;
+    uInt c;
+{
+    const __m256i v = _mm256_set1_epi8((char)c);
+    uInt len;
+    unsigned mask;
+
+    for (len = 0; len < MAX_MATCH - 2; len += 32) {
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                   _mm256_loadu_si256((const __m256i *)(scan + len)), v)) ^
+               0xffffffffU;
+        if (mask != 0)
+            return len + (uInt)__builtin_ctz(mask);
+    }
+    if (scan[len] != c) return len;
+    return scan[len + 1] != c ? len + 1 : len + 2;
+}
+#endif /* SIMD_RLE_AVX2 */
+#endif /* SIMD_RLE */
+
+/* ===========================================================================
+ * For Z_RLE, simply look for runs of bytes, generate matches only of distance
+ * one.  Do not maintain a hash table.  (It will be regenerated if this run of
+ * deflate switches away from Z_RLE.)
+ */
+local block_state deflate_rle(s, flush)
+    deflate_state *s;
+    int flush;
+{
+    int bflush;             /* set if current block must be flushed */
+    uInt prev;              /* byte at distance one to match */
+    Bytef *scan;            /* scan goes up to strend for length of run */
+#ifndef SIMD_RLE
+    Bytef *strend;
+#endif
+
+    for (;;) {
+        /* Make sure that we always have enough lookahead, except
+         * at the end of the input file. We need MAX_MATCH bytes
+         * for the longest run, plus one for the unrolled loop.
+         */
+        if (s->lookahead <= MAX_MATCH) {
+            fill_window(s);
+            if (s->lookahead <= MAX_MATCH && flush == Z_NO_FLUSH) {
+                return need_more;
+            }
+            if (s->lookahead == 0) break; /* flush the current block */
+        }
+
+        /* See how many times the previous byte repeats */
+        s->match_length = 0;
+        if (s->lookahead >= MIN_MATCH && s->strstart > 0) {
+            scan = s->window + s->strstart - 1;
+            prev = *scan;
+            if (prev == *++scan && prev == *++scan && prev == *++scan) {
+#ifdef SIMD_RLE
+                s->match_length = RUN_LEN(s, s->window + s->strstart, prev);
+#else
+                strend = s->window + s->strstart + MAX_MATCH;
+                do {
+                } while (prev == *++scan && prev == *++scan &&
+                         prev == *++scan && prev == *++scan &&
+                         prev == *++scan && prev == *++scan &&
+                         prev == *++scan && prev == *++scan &&
+                         scan < strend);
+                s->match_length = MAX_MATCH - (uInt)(strend - scan);
+#endif
+                if (s->match_length > s->lookahead)
+                    s->match_length = s->lookahead;
+            }
+            Assert(scan <= s->window+(uInt)(s->window_size-1), "wild scan");
+        }
+
+        /* Emit match if have run of MIN_MATCH or longer, else emit literal */
+        if (s->match_length >= MIN_MATCH) {
+            check_match(s, s->strstart, s->strstart - 1, s->match_length);
+
+            _tr_tally_dist(s, 1, s->match_length - MIN_MATCH, bflush);
+
+            s->lookahead -= s->match_length;
+            s->strstart += s->match_length;
+            s->match_length = 0;
+        } else {
+            /* No match, output a literal byte */
+            Tracevv((stderr,"%c", s->window[s->strstart]));
+            _tr_tally_lit (s, s->window[s->strstart], bflush);
+            s->lookahead--;
+            s->strstart++;
+        }
+        if (bflush) FLUSH_BLOCK(s, 0);
+    }
+    s->insert = 0;
+    if (flush == Z_FINISH) {
+        FLUSH_BLOCK(s, 1);
         return finish_done;
     }
     if (s->last_lit)
         FLUSH_BLOCK(s, 0);
     return block_done;
 }
+
+/* ===========================================================================
+ * For Z_HUFFMAN_ONLY, do not look for matches.  Do not maintain a hash table.
+ * (It will be regenerated if this run of deflate switches away from Huffman.)
+ */
+local block_state deflate_huff(s, flush)
+    deflate_state *s;
+    int flush;
+{
+    int bflush;             /* set if current block must be flushed */
+
+    for (;;) {
+        /* Make sure that we have a literal to write. */
+        if (s->lookahead == 0) {
+            fill_window(s);
+            if (s->lookahead == 0) {
+                if (flush == Z_NO_FLUSH)
+                    return need_more;
+                break;      /* flush the current block */
+            }
+        }
+
+        /* Output a literal byte */
+        s->match_length = 0;
+        Tracevv((stderr,"%c", s->window[s->strstart]));
+        _tr_tally_lit (s, s->window[s->strstart], bflush);
+        s->lookahead--;
+        s->strstart++;
+        if (bflush) FLUSH_BLOCK(s, 0);
+    }
+    s->insert = 0;
+    if (flush == Z_FINISH) {
+        FLUSH_BLOCK(s, 1);
+        return finish_done;
+    }
+    if (s->last_lit)
+        FLUSH_BLOCK(s, 0);
+    return block_done;
+}
+
+#ifndef FASTEST
+/* ===========================================================================
+ * Z_OPTIMAL: instead of taking the longest match at each step, as the other
+ * strategies do, deflate_optimal() takes OPT_BLOCK bytes at a time and finds
+ * the cheapest sequence of literals and matches that covers them.  The cost
+ * of each literal and match is estimated from the symbol counts of the
+ * current block: those already tallied, plus those of the last parse of the
+ * segment (or of the previous segment, or the fixed Huffman code lengths for
+ * the very first one).  The parse is then repeated, up to opt_iterations
+ * times, until the estimated size of the result stops going down.
+ *
+ * All the matches at each position, not just the longest, are found once
+ * per segment by opt_find_matches().  For each length only the nearest match
+ * is kept, since it has the cheapest distance code.  The cheapest path is
+ * then found by opt_shortest_path(), in integer arithmetic so that the output
+ * does not depend on the machine.
+ *
+ * The lazy parse of deflate_slow() is made from the same matches by
+ * opt_lazy_path() and kept for the whole block, and each block is sent with
+ * whichever of the two is smaller with its Huffman codes (see
+ * opt_lazy_block()).
+ */
+
+/* The symbols of the current block are coded together, so the costs are
+ * those of the symbols already tallied for it plus those of the parse.
+ */
+#define OPT_LIT_FREQ(s, n) \
+    ((ulg)(s)->dyn_ltree[n].Freq + (s)->opt->lit_freq[n])
+#define OPT_DIST_FREQ(s, n) \
+    ((ulg)(s)->dyn_dtree[n].Freq + (s)->opt->dist_freq[n])
+
+/* Within a long run of one byte value, MAX_MATCH-long matches at distance
+ * one are the best there is, and searching the hash chain at every position
+ * is slow, so opt_find_matches() and opt_shortest_path() take them without
+ * looking any further.
+ */
+#define OPT_IN_RUN(o, i, n) \
+    ((o)->same[i] > 2*MAX_MATCH && (i) > MAX_MATCH && \
+     (i) + 2*MAX_MATCH + 1 < (n) && (o)->same[(i) - MAX_MATCH] > MAX_MATCH)
+
+/* ===========================================================================
+ * Like longest_match(), but record every match that is longer than the ones
+ * before it on the hash chain, up to OPT_PAIRS of them (the longest are kept).
+ * Returns the number recorded.
+ */
+local unsigned opt_matches(s, pos, cur_match, max_len, lens, dists)
+    deflate_state *s;
+    uInt pos;
+    IPos cur_match;
+    uInt max_len;
+    ushf *lens;
+    ushf *dists;
+{
+    unsigned chain_length = s->max_chain_length;
+    register Bytef *scan = s->window + pos;
+#ifndef SIMD_MATCH
+    register Bytef *strend = s->window + pos + MAX_MATCH;
+    register Bytef *sp;
+#endif
+    register Bytef *match;
+    int len;
+    int best_len = MIN_MATCH-1;
+    int nice_match = s->nice_match;
+    IPos limit = pos > (IPos)MAX_DIST(s) ? pos - (IPos)MAX_DIST(s) : NIL;
+    Posf *prev = s->prev;
+    uInt wmask = s->w_mask;
+    unsigned n = 0;
+
+    if (max_len > MAX_MATCH) max_len = MAX_MATCH;
+    if ((uInt)nice_match > max_len) nice_match = (int)max_len;
+
+    do {
+        Assert(cur_match < pos, "no future");
+        match = s->window + cur_match;
+
+        if (match[best_len]   != scan[best_len]   ||
+            match[best_len-1] != scan[best_len-1] ||
+            *match            != *scan            ||
+            match[1]          != scan[1])         continue;
+
+#ifdef SIMD_MATCH
+        len = (int)MATCH_LEN(s, scan, match);
+#else
+        /* scan[2] and match[2] are equal, as in longest_match() */
+        if (s->hash4 && match[2] != scan[2]) continue;
+        sp = scan + 2, match += 2;
+        do {
+        } while (*++sp == *++match && *++sp == *++match &&
+                 *++sp == *++match && *++sp == *++match &&
+                 *++sp == *++match && *++sp == *++match &&
+                 *++sp == *++match && *++sp == *++match &&
+                 sp < strend);
+
+        len = MAX_MATCH - (int)(strend - sp);
+#endif
+        if (len > (int)max_len) len = (int)max_len;
+
+        if (len > best_len) {
+            if (n == OPT_PAIRS) {       /* drop the shortest */
+                for (n = 1; n < OPT_PAIRS; n++) {
+                    lens[n - 1] = lens[n];
+                    dists[n - 1] = dists[n];
+                }
+                n--;
+            }
+            lens[n] = (ush)len;
+            dists[n] = (ush)(pos - cur_match);
+            n++;
+            best_len = len;
+            if (len >= nice_match) break;
+        }
+    } while ((cur_match = prev[cur_match & wmask]) > limit
+             && --chain_length != 0);
+
+    return n;
+}
+
+/* ===========================================================================
+ * The match cache (see deflateMatchCache()) starts with MCACHE_HEAD bytes:
+ * whether it is complete, the number of bytes used, and the settings that
+ * the matches depend on, each four bytes, least significant first.  Then
+ * for each segment of deflate_optimal() come its length n and the number of
+ * bytes m from strstart on that the matches can depend on, two bytes each,
+ * and a copy of those m bytes, then for each position the number of matches
+ * and their lengths and distances, two bytes each.  The bytes are compared
+ * with the window in full before a segment is replayed: a checksum could
+ * match for different input, and the replayed matches would then be wrong.
+ *
+ * When replaying, the strings are not inserted in the hash table, so it has
+ * to be rebuilt with mcache_restore() if the input turns out to differ from
+ * what was recorded; from there on the matches are searched for again.
+ */
+local ulg mcache_get(p, bytes)
+    const Bytef *p;
+    int bytes;
+{
+    ulg v = 0;
+
+    while (bytes--)
+        v = (v << 8) | p[bytes];
+    return v;
+}
+
+local void mcache_put(p, v, bytes)
+    Bytef *p;
+    ulg v;
+    int bytes;
+{
+    while (bytes--) {
+        *p++ = (Bytef)v;
+        v >>= 8;
+    }
+}
+
+/* The settings that decide which matches are found: they go in words 2 to 7
+ * of the header.
+ */
+local void mcache_key(s, key)
+    deflate_state *s;
+    ulg *key;
+{
+    key[0] = (ulg)s->w_bits;
+    key[1] = (ulg)s->hash_bits | ((ulg)s->hash4 << 8) |
+             ((ulg)USE_TREE(s) << 9);
+    key[2] = (ulg)s->max_chain_length;
+    key[3] = (ulg)s->nice_match;
+    key[4] = OPT_PAIRS;
+    key[5] = MCACHE_HEAD;
+}
+
+local int mcache_key_ok(s)
+    deflate_state *s;
+{
+    ulg key[6];
+    int i;
+
+    mcache_key(s, key);
+    for (i = 0; i < 6; i++)
+        if (mcache_get(s->mcache + 8 + 4*i, 4) != key[i])
+            return 0;
+    return 1;
+}
+
+/* Number of bytes from strstart that the matches of an n-byte segment can
+ * depend on, including the runs counted for OPT_IN_RUN().
+ */
+#define MCACHE_SPAN(s, n) \
+    ((s)->lookahead < (n) + 2*MAX_MATCH+1 ? \
+     (s)->lookahead : (n) + 2*MAX_MATCH+1)
+
+/* ===========================================================================
+ * Put the strings before strstart back in the hash table (or trees), after
+ * replaying matches from the cache, and stop using it.
+ */
+local void mcache_restore(s)
+    deflate_state *s;
+{
+    uInt str = s->strstart > s->w_size ? s->strstart - s->w_size : 0;
+    uInt end = s->strstart + s->lookahead;
+
+    s->mcache_mode = MCACHE_OFF;
+    CLEAR_HASH(s);
+    if (s->right != Z_NULL)
+        zmemzero((Bytef *)s->right, (unsigned)s->w_size * sizeof(Pos));
+    if (str >= s->strstart || end - str < MIN_MATCH)
+        return;
+
+    s->ins_h = s->window[str];
+    UPDATE_HASH(s, s->ins_h, s->window[str + 1]);
+#if MIN_MATCH != 3
+    Call UPDATE_HASH() MIN_MATCH-3 more times
+#endif
+    for (; str < s->strstart && end - str >= MIN_MATCH; str++) {
+        if (USE_TREE(s))
+            tree_matches(s, str, end - str, Z_NULL, Z_NULL, 0);
+        else {
+            HASH_STRING(s, str);
+            s->prev[str & s->w_mask] = s->head[s->ins_h];
+            s->head[s->ins_h] = (Pos)str;
+        }
+    }
+}
+
+/* ===========================================================================
+ * Take the matches of the n-byte segment at strstart from the cache, if it
+ * is being replayed and it has them.  Returns true if it did.
+ */
+local int mcache_replay(s, n)
+    deflate_state *s;
+    uInt n;
+{
+    struct opt_state_s FAR *o = s->opt;
+    Bytef *p, *end;
+    uInt i, k, span = MCACHE_SPAN(s, n);
+    int ok;
+
+    if (s->mcache_mode == MCACHE_START) {
+        if (s->strstart != 0) {
+            s->mcache_mode = MCACHE_OFF;    /* a dictionary was set */
+            return 0;
+        }
+        s->mcache_mode = MCACHE_REPLAY;     /* if it is complete, see below */
+        s->mcache_next = MCACHE_HEAD;
+    }
+    if (s->mcache_mode != MCACHE_REPLAY)
+        return 0;
+
+    p = s->mcache + s->mcache_next;
+    end = s->mcache + MCACHE_HEAD;
+    if (mcache_get(s->mcache, 4) == 1 &&
+        mcache_get(s->mcache + 4, 4) <= s->mcache_size)
+        end = s->mcache + mcache_get(s->mcache + 4, 4);
+    ok = end - p >= 4 && mcache_get(p, 2) == n &&
+         mcache_get(p + 2, 2) == span && mcache_key_ok(s) &&
+         (ulg)(end - p) - 4 >= span &&
+         zmemcmp(p + 4, s->window + s->strstart, span) == 0;
+    if (!ok && s->mcache_next == MCACHE_HEAD) {
+        /* It is for some other input or settings: record this one instead,
+         * nothing having been replayed yet
+         */
+        ulg key[6];
+
+        mcache_key(s, key);
+        zmemzero(s->mcache, MCACHE_HEAD);
+        for (i = 0; i < 6; i++)
+            mcache_put(s->mcache + 8 + 4*i, key[i], 4);
+        s->mcache_mode = MCACHE_RECORD;
+        return 0;
+    }
+    if (!ok) {
+        mcache_restore(s);
+        return 0;
+    }
+    p += 4 + span;
+    for (i = 0; i < n; i++) {
+        ushf *lens = o->pair_len + i * OPT_PAIRS;
+        ushf *dists = o->pair_dist + i * OPT_PAIRS;
+
+        if (p == end || *p > OPT_PAIRS || end - p < 1 + 4 * *p) {
+            mcache_restore(s);
+            return 0;
+        }
+        o->num_pairs[i] = *p++;
+        for (k = 0; k < o->num_pairs[i]; k++, p += 4) {
+            lens[k] = (ush)mcache_get(p, 2);
+            dists[k] = (ush)mcache_get(p + 2, 2);
+        }
+    }
+    s->mcache_next = (ulg)(p - s->mcache);
+    return 1;
+}
+
+/* ===========================================================================
+ * Add the matches just found for the n-byte segment at strstart to the
+ * cache.  If they do not fit, recording stops, and the cache is left marked
+ * incomplete.
+ */
+local void mcache_record(s, n)
+    deflate_state *s;
+    uInt n;
+{
+    struct opt_state_s FAR *o = s->opt;
+    ulg need = 4 + n;
+    Bytef *p;
+    uInt i, k, span = MCACHE_SPAN(s, n);
+
+    need += span;
+    for (i = 0; i < n; i++)
+        need += 4 * o->num_pairs[i];
+    if (need > s->mcache_size - s->mcache_next) {
+        s->mcache_mode = MCACHE_OFF;
+        return;
+    }
+    p = s->mcache + s->mcache_next;
+    mcache_put(p, n, 2);
+    mcache_put(p + 2, span, 2);
+    zmemcpy(p + 4, s->window + s->strstart, span);
+    p += 4 + span;
+    for (i = 0; i < n; i++) {
+        ushf *lens = o->pair_len + i * OPT_PAIRS;
+        ushf *dists = o->pair_dist + i * OPT_PAIRS;
+
+        *p++ = o->num_pairs[i];
+        for (k = 0; k < o->num_pairs[i]; k++, p += 4) {
+            mcache_put(p, lens[k], 2);
+            mcache_put(p + 2, dists[k], 2);
+        }
+    }
+    s->mcache_next += need;
+}
+
+/* ===========================================================================
+ * Insert the n strings starting at strstart into the hash table, finding the
+ * matches for each one as it goes.
+ */
+local void opt_find_matches(s, n)
+    deflate_state *s;
+    uInt n;
+{
+    struct opt_state_s FAR *o = s->opt;
+    Bytef *win = s->window + s->strstart;
+    IPos hash_head;
+    uInt i, k, lim;
+    int tree = USE_TREE(s);
+
+    /* Runs of equal bytes, counted back from the end of the segment */
+    i = n - 1;
+    lim = s->lookahead - i < 2*MAX_MATCH+2 ? s->lookahead - i : 2*MAX_MATCH+2;
+    for (k = 1; k < lim && win[i + k] == win[i]; k++)
+        ;
+    o->same[i] = (ush)k;
+    while (i-- > 0)
+        o->same[i] = win[i] != win[i + 1] ? 1 :
+                     o->same[i + 1] == 65535 ? 65535 : o->same[i + 1] + 1;
+
+    if (s->mcache_mode != MCACHE_OFF && mcache_replay(s, n))
+        return;
+
+    for (i = 0; i < n; i++) {
+        uInt pos = s->strstart + i;
+        uInt avail = s->lookahead - i;
+        ushf *lens = o->pair_len + i * OPT_PAIRS;
+        ushf *dists = o->pair_dist + i * OPT_PAIRS;
+
+        o->num_pairs[i] = 0;
+        if (tree) {
+            if (avail >= MIN_MATCH)
+                o->num_pairs[i] = (uch)tree_matches(s, pos, avail,
+                                                    lens, dists, OPT_PAIRS);
+            continue;
+        }
+        hash_head = NIL;
+        if (avail >= MIN_MATCH) {
+            INSERT_STRING(s, pos, hash_head);
+        }
+
+        if (OPT_IN_RUN(o, i, n)) {
+            lens[0] = MAX_MATCH;
+            dists[0] = 1;
+            o->num_pairs[i] = 1;
+        }
+        else if (hash_head != NIL && pos - hash_head <= MAX_DIST(s)) {
+            o->num_pairs[i] = (uch)opt_matches(s, pos, hash_head, avail,
+                                               lens, dists);
+        }
+    }
+    if (s->mcache_mode == MCACHE_RECORD)
+        mcache_record(s, n);
+}
+
+/* ===========================================================================
+ * Set the symbol costs from the counts of the last parse, or from the fixed
+ * Huffman code if there has not been one.  A symbol that was not used costs
+ * the same as one that was used once.
+ */
+local void opt_set_costs(s)
+    deflate_state *s;
+{
+    struct opt_state_s FAR *o = s->opt;
+    ulg total, log_total;
+    unsigned n, code;
+
+    if (!o->have_freq) {
+        for (n = 0; n < L_CODES; n++)
+            o->lit_cost[n] = (ulg)(n < 144 ? 8 : n < 256 ? 9 : n < 280 ? 7 : 8)
+                             << 8;
+        for (n = 0; n < D_CODES; n++)
+            o->dist_cost[n] = 5 << 8;
+    }
+    else {
+        for (total = 0, n = 0; n < L_CODES; n++)
+            total += OPT_LIT_FREQ(s, n);
+        log_total = _tr_log2(total);
+        for (n = 0; n < L_CODES; n++)
+            o->lit_cost[n] = log_total - (OPT_LIT_FREQ(s, n) ?
+                                          _tr_log2(OPT_LIT_FREQ(s, n)) : 0);
+
+        for (total = 0, n = 0; n < D_CODES; n++)
+            total += OPT_DIST_FREQ(s, n);
+        log_total = total ? _tr_log2(total) : 5 << 8;
+        for (n = 0; n < D_CODES; n++)
+            o->dist_cost[n] = log_total - (OPT_DIST_FREQ(s, n) ?
+                                           _tr_log2(OPT_DIST_FREQ(s, n)) : 0);
+    }
+
+    /* Add the extra bits (see extra_lbits and extra_dbits in trees.c) */
+    for (n = 0; n < D_CODES; n++)
+        o->dist_cost[n] += (ulg)(n < 4 ? 0 : (n - 2) >> 1) << 8;
+    for (n = MIN_MATCH; n <= MAX_MATCH; n++) {
+        code = _length_code[n - MIN_MATCH];
+        o->len_cost[n] = o->lit_cost[code + LITERALS + 1] +
+                         ((ulg)(code < 8 || code == 28 ? 0 : (code - 4) >> 2)
+                          << 8);
+    }
+}
+
+/* ===========================================================================
+ * Find the cheapest path through the n bytes at strstart with the current
+ * costs, and leave it in parse buffer b.
+ */
+local void opt_shortest_path(s, n, b)
+    deflate_state *s;
+    uInt n;
+    int b;
+{
+    struct opt_state_s FAR *o = s->opt;
+    Bytef *win = s->window + s->strstart;
+    uInt i, k, len, max_len;
+    ulg c, t, dc;
+
+    o->cost[0] = 0;
+    for (i = 1; i <= n; i++)
+        o->cost[i] = ~(ulg)0;
+
+    for (i = 0; i < n; i++) {
+        ushf *lens = o->pair_len + i * OPT_PAIRS;
+        ushf *dists = o->pair_dist + i * OPT_PAIRS;
+
+        if (OPT_IN_RUN(o, i, n)) {
+            /* MAX_MATCH bytes at a time through the run, see above */
+            t = o->len_cost[MAX_MATCH] + o->dist_cost[0];
+            for (k = 0; k < MAX_MATCH; k++, i++) {
+                if (o->cost[i] == ~(ulg)0)
+                    continue;   /* not reached, the run began mid-match */
+                c = o->cost[i] + t;
+                if (c < o->cost[i + MAX_MATCH]) {
+                    o->cost[i + MAX_MATCH] = c;
+                    o->from_len[i + MAX_MATCH] = MAX_MATCH;
+                    o->from_dist[i + MAX_MATCH] = 1;
+                }
+            }
+            i--;
+            continue;
+        }
+
+        c = o->cost[i];
+        t = c + o->lit_cost[win[i]];
+        if (t < o->cost[i + 1]) {
+            o->cost[i + 1] = t;
+            o->from_len[i + 1] = 1;
+            o->from_dist[i + 1] = 0;
+        }
+
+        /* Each length up to that of a match can use that match's distance */
+        len = MIN_MATCH;
+        for (k = 0; k < o->num_pairs[i]; k++) {
+            max_len = lens[k] < n - i ? lens[k] : n - i;
+            dc = c + o->dist_cost[d_code(dists[k] - 1)];
+            for (; len <= max_len; len++) {
+                t = dc + o->len_cost[len];
+                if (t < o->cost[i + len]) {
+                    o->cost[i + len] = t;
+                    o->from_len[i + len] = (ush)len;
+                    o->from_dist[i + len] = dists[k];
+                }
+            }
+        }
+    }
+
+    /* Trace the path back from the end */
+    for (k = 0, i = n; i > 0; i -= o->from_len[i])
+        k++;
+    o->sym_count[b] = k;
+    for (i = n; i > 0; i -= o->from_len[i]) {
+        k--;
+        o->sym_len[b][k] = o->from_len[i];
+        o->sym_dist[b][k] = o->from_dist[i];
+    }
+}
+
+/* ===========================================================================
+ * Parse the n bytes at strstart into buffer 2 as deflate_slow() would, from
+ * the longest match found at each position: a match is taken only if the
+ * one at the next position is no longer.  The parse starts lazy_skip bytes
+ * in, where the last match of the segment before ended, and its own last
+ * match may likewise run past the segment.
+ */
+local void opt_lazy_path(s, n)
+    deflate_state *s;
+    uInt n;
+{
+    struct opt_state_s FAR *o = s->opt;
+    uInt i, k, len, next;
+
+#define OPT_LONGEST(i) (o->num_pairs[i] == 0 ? 0 : \
+    o->pair_len[(i) * OPT_PAIRS + o->num_pairs[i] - 1])
+
+    for (i = o->lazy_skip, k = 0; i < n; k++) {
+        len = OPT_LONGEST(i);
+#if TOO_FAR <= 32767
+        if (len == MIN_MATCH &&
+            o->pair_dist[i * OPT_PAIRS + o->num_pairs[i] - 1] > TOO_FAR)
+            len = 0;
+#endif
+        if (len >= MIN_MATCH && len < s->max_lazy_match && i + 1 < n) {
+            next = OPT_LONGEST(i + 1);
+            if (next > len)
+                len = 0;
+        }
+        if (len < MIN_MATCH) {
+            o->sym_len[2][k] = 1;
+            o->sym_dist[2][k] = 0;
+            i++;
+        }
+        else {
+            o->sym_len[2][k] = (ush)len;
+            o->sym_dist[2][k] = o->pair_dist[i * OPT_PAIRS +
+                                             o->num_pairs[i] - 1];
+            i += len;
+        }
+    }
+    o->sym_count[2] = k;
+#undef OPT_LONGEST
+}
+
+/* ===========================================================================
+ * Add the lazy parse of the n bytes at strstart, in buffer 2, to that of the
+ * current block.
+ */
+local void opt_lazy_keep(s, n)
+    deflate_state *s;
+    uInt n;
+{
+    struct opt_state_s FAR *o = s->opt;
+    Bytef *win = s->window + s->strstart;
+    uInt i, k;
+
+    for (i = o->lazy_skip, k = 0; k < o->sym_count[2]; k++) {
+        if (o->sym_dist[2][k] == 0) {
+            o->lazy_dist[o->lazy_count] = 0;
+            o->lazy_lc[o->lazy_count] = win[i];
+        }
+        else {
+            o->lazy_dist[o->lazy_count] = o->sym_dist[2][k];
+            o->lazy_lc[o->lazy_count] = (uch)(o->sym_len[2][k] - MIN_MATCH);
+        }
+        o->lazy_count++;
+        i += o->sym_len[2][k];
+    }
+    o->lazy_bytes += n;
+    o->lazy_skip = i - n;
+}
+
+/* ===========================================================================
+ * Before the current block is sent, replace its symbols with those of the
+ * lazy parse if they make a smaller block, so that Z_OPTIMAL never does
+ * worse than that.  The estimated costs that the parse goes by are not
+ * those of the Huffman codes in the end, so it can lose to the lazy parse
+ * on some blocks.  The last match of the lazy parse is cut at the end of
+ * the block, and the parse of the next block starts there.
+ */
+local void opt_lazy_block(s)
+    deflate_state *s;
+{
+    struct opt_state_s FAR *o = s->opt;
+    uInt k, len;
+
+    if (o->lazy_count != 0 &&
+        o->lazy_bytes == (ulg)((long)s->strstart - s->block_start)) {
+        if (o->lazy_skip != 0) {
+            k = o->lazy_count - 1;
+            len = o->lazy_lc[k] + MIN_MATCH - o->lazy_skip;
+            if (len >= MIN_MATCH)
+                o->lazy_lc[k] = (uch)(len - MIN_MATCH);
+            else
+                for (o->lazy_count = k; len != 0; len--) {
+                    o->lazy_dist[o->lazy_count] = 0;
+                    o->lazy_lc[o->lazy_count++] =
+                        s->window[s->strstart - len];
+                }
+        }
+        (void)_tr_smaller_block(s, o->lazy_dist, o->lazy_lc, o->lazy_count);
+    }
+    o->lazy_count = 0;
+    o->lazy_bytes = 0;
+    o->lazy_skip = 0;
+}
+
+/* ===========================================================================
+ * Count the symbols of the parse in buffer b, and return an estimate of its
+ * compressed size in 1/256 bit: the entropy of the symbols plus the extra
+ * bits.  This is what the iterations of the parse try to reduce.
+ */
+local ulg opt_count(s, b)
+    deflate_state *s;
+    int b;
+{
+    struct opt_state_s FAR *o = s->opt;
+    Bytef *win = s->window + s->strstart;
+    uInt i, k, code;
+    ulg total, bits;
+
+    zmemzero((Bytef *)o->lit_freq, sizeof(o->lit_freq));
+    zmemzero((Bytef *)o->dist_freq, sizeof(o->dist_freq));
+    bits = 0;
+    for (i = 0, k = 0; k < o->sym_count[b]; k++) {
+        if (o->sym_dist[b][k] == 0)
+            o->lit_freq[win[i]]++;
+        else {
+            code = _length_code[o->sym_len[b][k] - MIN_MATCH];
+            o->lit_freq[code + LITERALS + 1]++;
+            bits += code < 8 || code == 28 ? 0 : (code - 4) >> 2;
+            code = d_code(o->sym_dist[b][k] - 1);
+            o->dist_freq[code]++;
+            bits += code < 4 ? 0 : (code - 2) >> 1;
+        }
+        i += o->sym_len[b][k];
+    }
+    o->lit_freq[LITERALS]++;    /* end of block */
+    o->have_freq = 1;
+
+    bits <<= 8;
+    for (total = 0, k = 0; k < L_CODES; k++)
+        total += OPT_LIT_FREQ(s, k);
+    for (k = 0; k < L_CODES; k++)
+        if (OPT_LIT_FREQ(s, k))
+            bits += OPT_LIT_FREQ(s, k) *
+                    (_tr_log2(total) - _tr_log2(OPT_LIT_FREQ(s, k)));
+    for (total = 0, k = 0; k < D_CODES; k++)
+        total += OPT_DIST_FREQ(s, k);
+    for (k = 0; k < D_CODES; k++)
+        if (OPT_DIST_FREQ(s, k))
+            bits += OPT_DIST_FREQ(s, k) *
+                    (_tr_log2(total) - _tr_log2(OPT_DIST_FREQ(s, k)));
+    return bits;
+}
+
+/* ===========================================================================
+ * Compression function for Z_OPTIMAL.  A segment is parsed only when there
+ * are OPT_BLOCK bytes of lookahead beyond MIN_LOOKAHEAD, or no more input
+ * can be taken, or when flushing, so that the segments are not cut short
+ * by the way the input happens to be supplied.  The parse is then tallied
+ * a symbol at a time, and can be resumed if the output buffer fills.
+ */
+local block_state deflate_optimal(s, flush)
+    deflate_state *s;
+    int flush;
+{
+    struct opt_state_s FAR *o;
+    int bflush;             /* set if current block must be flushed */
+    uInt n, match_len, match_dist;   /* not len and dist, see _tr_tally */
+    ulg bits, best;
+    int i, b;
+
+    if (s->opt == Z_NULL) {
+        s->opt = (struct opt_state_s FAR *)
+                 ZALLOC(s->strm, 1, sizeof(struct opt_state_s));
+        if (s->opt == Z_NULL)
+            return deflate_slow(s, flush);  /* do the best we can */
+        s->opt->sym_count[0] = s->opt->sym_count[1] = 0;
+        s->opt->sym_buf = 0;
+        s->opt->sym_next = 0;
+        s->opt->have_freq = 0;
+        s->opt->lazy_count = 0;
+        s->opt->lazy_bytes = 0;
+        s->opt->lazy_skip = 0;
+    }
+    o = s->opt;
+
+    for (;;) {
+        /* Tally what is left of the last parse */
+        while (o->sym_next < o->sym_count[o->sym_buf]) {
+            match_len = o->sym_len[o->sym_buf][o->sym_next];
+            match_dist = o->sym_dist[o->sym_buf][o->sym_next];
+            o->sym_next++;
+            if (match_dist == 0) {
+                Tracevv((stderr,"%c", s->window[s->strstart]));
+                _tr_tally_lit(s, s->window[s->strstart], bflush);
+            }
+            else {
+                check_match(s, s->strstart, s->strstart - match_dist,
+                            match_len);
+                _tr_tally_dist(s, match_dist, match_len - MIN_MATCH, bflush);
+            }
+            s->strstart += match_len;
+            s->lookahead -= match_len;
+            if (bflush) {
+                opt_lazy_block(s);
+                FLUSH_BLOCK(s, 0);
+            }
+        }
+
+        /* fill_window() only makes room by sliding once strstart has gone
+         * far enough, which the other strategies ensure by waiting until
+         * lookahead is below MIN_LOOKAHEAD.  Until then the segment may have
+         * to be shorter.
+         */
+        if (s->lookahead < OPT_BLOCK + MIN_LOOKAHEAD &&
+            (s->window_size - s->lookahead - s->strstart >= 2 ||
+             s->strstart >= s->w_size + MAX_DIST(s))) {
+            fill_window(s);
+            if (s->lookahead < OPT_BLOCK + MIN_LOOKAHEAD &&
+                s->strm->avail_in == 0 && flush == Z_NO_FLUSH) {
+                return need_more;
+            }
+            if (s->lookahead == 0) break; /* flush the current block */
+        }
+
+        if (flush != Z_NO_FLUSH && s->strm->avail_in == 0)
+            n = s->lookahead;
+        else
+            n = s->lookahead - MIN_LOOKAHEAD + 1;
+        if (n > OPT_BLOCK)
+            n = OPT_BLOCK;
+        if (n > s->lit_bufsize - 1)
+            n = s->lit_bufsize - 1;     /* so that its symbols fit a block */
+        /* The matches are compared MAX_MATCH bytes at a time, as in
+         * longest_match(), so every position searched must have at least
+         * MIN_LOOKAHEAD bytes of window after it.  The rest of the lookahead
+         * is parsed after fill_window() has slid the window.
+         */
+        if ((ulg)s->strstart + n > s->window_size - MIN_LOOKAHEAD + 1)
+            n = (uInt)(s->window_size - MIN_LOOKAHEAD + 1 - s->strstart);
+
+        /* Parse with the costs of the best parse so far, until that stops
+         * getting any better
+         */
+        opt_find_matches(s, n);
+        opt_lazy_path(s, n);
+        best = ~(ulg)0;
+        b = 1 - o->sym_buf;
+        for (i = 0; i < s->opt_iterations; i++) {
+            opt_set_costs(s);
+            opt_shortest_path(s, n, b);
+            bits = opt_count(s, b);
+            if (bits >= best) {
+                opt_count(s, o->sym_buf);   /* put the counts back */
+                break;
+            }
+            best = bits;
+            o->sym_buf = b;
+            b = 1 - b;
+        }
+        o->sym_next = 0;
+
+        /* Blocks end between segments, so that opt_lazy_block() can
+         * compare the two parses.  Cutting the last lazy match may add a
+         * literal.
+         */
+        bflush = s->last_lit + o->sym_count[o->sym_buf] > s->lit_bufsize - 1 ||
+                 o->lazy_count + o->sym_count[2] > s->lit_bufsize - 2;
+        if (bflush) {
+            opt_lazy_block(s);
+            FLUSH_BLOCK_ONLY(s, 0);
+            opt_lazy_path(s, n);        /* from the start of the segment */
+        }
+        opt_lazy_keep(s, n);
+        if (bflush && s->strm->avail_out == 0)
+            return need_more;
+    }
+    s->insert = s->strstart < MIN_MATCH-1 ? s->strstart : MIN_MATCH-1;
+    if (flush == Z_FINISH) {
+        if (s->mcache_mode == MCACHE_RECORD) {
+            /* every segment is in, so later streams can use it */
+            mcache_put(s->mcache + 4, s->mcache_next, 4);
+            mcache_put(s->mcache, 1, 4);
+            s->mcache_mode = MCACHE_OFF;
+        }
+        opt_lazy_block(s);
+        FLUSH_BLOCK(s, 1);
+        return finish_done;
+    }
+    if (s->last_lit) {
+        opt_lazy_block(s);
+        FLUSH_BLOCK(s, 0);
+    }
+    return block_done;
+}
+#endif /* !FASTEST */
@@ -273,6 +273,38 @@ typedef struct internal_state {
      * updated to the new high water mark.
      */
 
+    int hash4;
+    /* Hash on four bytes instead of MIN_MATCH, see deflateHash(). */
+
+    Posf *right;
+    /* Set by deflateTree(): the strings with each hash key are then kept in
+     * a binary tree, with the smaller subtree of each string in prev[] and
+     * the greater one in right[], indexed like prev[].
+     */
+
+    int use_avx2;        /* CPU has AVX2, see SIMD_MATCH, _SLIDE and _RLE */
+
+    int opt_iterations;  /* passes of the Z_OPTIMAL parse over each segment */
+    struct opt_state_s FAR *opt;
+    /* Work space for Z_OPTIMAL, allocated the first time it is used. */
+
+    int block_split;     /* choose the block boundaries, see deflateSplit() */
+    struct split_state_s FAR *split;
+    /* Work space for block splitting in trees.c, allocated when first used. */
+
+    int huff_optimal;    /* limit code lengths optimally, see
+                          * deflateHuffman() */
+    struct pm_state_s FAR *pm;
+    /* Work space for package-merge in trees.c, allocated when first used. */
+
+    int count_only;      /* measure the output only, see deflateCount() */
+
+    Bytef *mcache;       /* matches kept across streams, see
+                          * deflateMatchCache() */
+    ulg mcache_size;
+    ulg mcache_next;     /* the next byte of it to be read or written */
+    int mcache_mode;     /* MCACHE_OFF etc., see deflate.c */
+
 } FAR deflate_state;
 
 /* Output a byte on the stream.
@@ -295,6 +327,11 @@ typedef struct internal_state {
 /* Number of bytes after end of data in window to initialize in order to avoid
    memory checker errors from longest match routines */
 
+#define WIN_PAD 8
+/* The window is allocated with 2*WIN_PAD bytes more than window_size, which
+ * are kept at zero.  The four-byte hash may read one byte past the end.
+ */
+
         /* in trees.c */
 void ZLIB_INTERNAL _tr_init OF((deflate_state *s));
 int ZLIB_INTERNAL _tr_tally OF((deflate_state *s, unsigned dist, unsigned lc));
@@ -304,6 +341,9 @@ void ZLIB_INTERNAL _tr_flush_bits OF((deflate_state *s));
 void ZLIB_INTERNAL _tr_align OF((deflate_state *s));
 void ZLIB_INTERNAL _tr_stored_block OF((deflate_state *s, charf *buf,
                         ulg stored_len, int last));
+ulg ZLIB_INTERNAL _tr_log2 OF((ulg x));
+int ZLIB_INTERNAL _tr_smaller_block OF((deflate_state *s, const ushf *dbuf,
+                        const uchf *lbuf, unsigned nsym));
 
 #define d_code(dist) \
    ((dist) < 256 ? _dist_code[dist] : _dist_code[256+((dist)>>7)])
@@ -312,9 +352,6 @@ void ZLIB_INTERNAL _tr_stored_block OF((deflate_state *s, charf *buf,
  * used.
  */
 
-#ifndef ZLIB_DEBUG
-/* Inline versions of _tr_tally for speed: */
-
 #if defined(GEN_TREES_H) || !defined(STDC)
   extern uch ZLIB_INTERNAL _length_code[];
   extern uch ZLIB_INTERNAL _dist_code[];
@@ -323,6 +360,9 @@ void ZLIB_INTERNAL _tr_stored_block OF((deflate_state *s, charf *buf,
   extern const uch ZLIB_INTERNAL _dist_code[];
 #endif
 
+#ifndef ZLIB_DEBUG
+/* Inline versions of _tr_tally for speed: */
+
 # define _tr_tally_lit(s, c, flush) \
   { uch cc = (c); \
     s->d_buf[s->last_lit] = 0; \
@@ -0,0 +1,212 @@
+
+/* filter_avx2_intrinsics.c - AVX2 optimized filter functions
+ *
+ * Copyright (c) 2026 The pngcrush contributors
+ * Derived from filter_sse2_intrinsics.c, which was
+ * Copyright (c) 2016 Google, Inc.
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ */
+
+#include "pngpriv.h"
+
+#ifdef PNG_READ_SUPPORTED
+
+#if PNG_INTEL_AVX2_OPT > 0
+
+#include <immintrin.h>
+
+/* These functions are compiled for AVX2 with a function attribute, so the
+ * rest of libpng does not need to be built with -mavx2.  They are only
+ * installed by png_init_filter_functions_sse2() after a run-time check has
+ * shown that the CPU supports AVX2.
+ *
+ * Only the Up and Sub filters are here.  Avg and Paeth need the fully
+ * reconstructed pixel to the left before they can predict the next one,
+ * so there is nothing to gain over the SSE2 versions by using wider
+ * registers.  Sub has the same dependency, but it is a plain running sum,
+ * so eight pixels at a time can be done as a prefix sum.
+ */
+#define PNG_AVX2_TARGET __attribute__((target("avx2")))
+
+PNG_AVX2_TARGET
+static __m128i avx2_load4(const void* p) {
+   return _mm_cvtsi32_si128(*(const int*)p);
+}
+
+PNG_AVX2_TARGET
+static void avx2_store4(void* p, __m128i v) {
+   *(int*)p = _mm_cvtsi128_si32(v);
+}
+
+PNG_AVX2_TARGET
+static __m128i avx2_load3(const void* p) {
+   const png_uint_16* p01 = p;
+   const png_byte*    p2  = (const png_byte*)(p01+1);
+
+   png_uint_32 v012 = (png_uint_32)(*p01)
+                    | (png_uint_32)(*p2) << 16;
+   return avx2_load4(&v012);
+}
+
+PNG_AVX2_TARGET
+static void avx2_store3(void* p, __m128i v) {
+   png_uint_32 v012;
+   avx2_store4(&v012, v);
+
+   png_uint_16* p01 = p;
+   png_byte*    p2  = (png_byte*)(p01+1);
+   *p01 = v012;
+   *p2  = v012 >> 16;
+}
+
+/* Running sum of the eight 4-byte pixels in d, plus the pixel in carry
+ * (which must already be broadcast to every pixel position).
+ */
+PNG_AVX2_TARGET
+static __m256i avx2_prefix_sum4(__m256i d, __m256i carry) {
+   __m256i t;
+
+   /* Within each 128-bit lane, add pixel n-1 and then n-2 to pixel n. */
+   d = _mm256_add_epi8(d, _mm256_slli_si256(d, 4));
+   d = _mm256_add_epi8(d, _mm256_slli_si256(d, 8));
+
+   /* Add the last pixel of the low lane to every pixel of the high lane. */
+   t = _mm256_permute2x128_si256(d, d, 0x08);
+   t = _mm256_shuffle_epi32(t, 0xff);
+   d = _mm256_add_epi8(d, t);
+
+   return _mm256_add_epi8(d, carry);
+}
+
+PNG_AVX2_TARGET
+void png_read_filter_row_up_avx2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_size_t rb = row_info->rowbytes;
+   png_debug(1, "in png_read_filter_row_up_avx2");
+
+   while (rb >= 32) {
+      __m256i b = _mm256_loadu_si256((const __m256i*)prev);
+      __m256i d = _mm256_loadu_si256((const __m256i*)row);
+      _mm256_storeu_si256((__m256i*)row, _mm256_add_epi8(d, b));
+
+      prev += 32;
+      row  += 32;
+      rb   -= 32;
+   }
+   if (rb >= 16) {
+      __m128i b = _mm_loadu_si128((const __m128i*)prev);
+      __m128i d = _mm_loadu_si128((const __m128i*)row);
+      _mm_storeu_si128((__m128i*)row, _mm_add_epi8(d, b));
+
+      prev += 16;
+      row  += 16;
+      rb   -= 16;
+   }
+   while (rb > 0) {
+      *row = (png_byte)(*row + *prev);
+
+      prev++;
+      row++;
+      rb--;
+   }
+}
+
+PNG_AVX2_TARGET
+void png_read_filter_row_sub3_avx2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   /* Eight 3-byte pixels (24 bytes) per step.  They are spread out to one
+    * pixel per 32-bit lane, summed like the 4-byte case, and packed back.
+    * A step loads 32 bytes, so it is only taken while that many remain.
+    */
+   const __m256i spread_idx = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+   const __m256i pack_idx   = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+   const __m256i spread = _mm256_setr_epi8(
+       0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+       0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+   const __m256i pack = _mm256_setr_epi8(
+       0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+       0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+   const __m256i last = _mm256_set1_epi32(7);
+   __m256i carry = _mm256_setzero_si256();
+   __m128i a, d;
+
+   png_size_t rb = row_info->rowbytes;
+   png_debug(1, "in png_read_filter_row_sub3_avx2");
+   PNG_UNUSED(prev)
+
+   while (rb >= 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)row);
+      v = _mm256_permutevar8x32_epi32(v, spread_idx);
+      v = _mm256_shuffle_epi8(v, spread);
+
+      v = avx2_prefix_sum4(v, carry);
+      carry = _mm256_permutevar8x32_epi32(v, last);
+
+      v = _mm256_shuffle_epi8(v, pack);
+      v = _mm256_permutevar8x32_epi32(v, pack_idx);
+      _mm_storeu_si128((__m128i*)row, _mm256_castsi256_si128(v));
+      _mm_storel_epi64((__m128i*)(row + 16), _mm256_extracti128_si256(v, 1));
+
+      row += 24;
+      rb  -= 24;
+   }
+
+   /* Finish the row one pixel at a time, as in the SSE2 version. */
+   d = _mm256_castsi256_si128(carry);
+   while (rb >= 4) {
+      a = d; d = avx2_load4(row);
+      d = _mm_add_epi8(d, a);
+      avx2_store3(row, d);
+
+      row += 3;
+      rb  -= 3;
+   }
+   if (rb > 0) {
+      a = d; d = avx2_load3(row);
+      d = _mm_add_epi8(d, a);
+      avx2_store3(row, d);
+   }
+}
+
+PNG_AVX2_TARGET
+void png_read_filter_row_sub4_avx2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   /* Eight 4-byte pixels (32 bytes) per step. */
+   const __m256i last = _mm256_set1_epi32(7);
+   __m256i carry = _mm256_setzero_si256();
+   __m128i a, d;
+
+   png_size_t rb = row_info->rowbytes;
+   png_debug(1, "in png_read_filter_row_sub4_avx2");
+   PNG_UNUSED(prev)
+
+   while (rb >= 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)row);
+
+      v = avx2_prefix_sum4(v, carry);
+      carry = _mm256_permutevar8x32_epi32(v, last);
+      _mm256_storeu_si256((__m256i*)row, v);
+
+      row += 32;
+      rb  -= 32;
+   }
+
+   d = _mm256_castsi256_si128(carry);
+   while (rb > 0) {
+      a = d; d = avx2_load4(row);
+      d = _mm_add_epi8(d, a);
+      avx2_store4(row, d);
+
+      row += 4;
+      rb  -= 4;
+   }
+}
+
+#endif /* PNG_INTEL_AVX2_OPT > 0 */
+#endif /* READ */
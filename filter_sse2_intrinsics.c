@@ -15,8 +15,6 @@
 
 #include "pngpriv.h"
 
-#ifdef PNG_READ_SUPPORTED
-
 #if PNG_INTEL_SSE_IMPLEMENTATION > 0
 
 #include <immintrin.h>
@@ -29,6 +27,36 @@
  * whichever of a, b, or c is closest to p=a+b-c.
  */
 
+/* Returns |x| for 16-bit lanes. */
+static __m128i abs_i16(__m128i x) {
+#if PNG_INTEL_SSE_IMPLEMENTATION >= 2
+   return _mm_abs_epi16(x);
+#else
+   /* Read this all as, return x<0 ? -x : x.
+   * To negate two's complement, you flip all the bits then add 1.
+    */
+   __m128i is_negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+
+   /* Flip negative lanes. */
+   x = _mm_xor_si128(x, is_negative);
+
+   /* +1 to negative lanes, else +0. */
+   x = _mm_sub_epi16(x, is_negative);
+   return x;
+#endif
+}
+
+/* Bytewise c ? t : e. */
+static __m128i if_then_else(__m128i c, __m128i t, __m128i e) {
+#if PNG_INTEL_SSE_IMPLEMENTATION >= 3
+   return _mm_blendv_epi8(e,t,c);
+#else
+   return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+#endif
+}
+
+#ifdef PNG_READ_SUPPORTED
+
 static __m128i load4(const void* p) {
    return _mm_cvtsi32_si128(*(const int*)p);
 }
@@ -62,6 +90,51 @@ static void store3(void* p, __m128i v) {
    *p2  = v012 >> 16;
 }
 
+static __m128i load2(const void* p) {
+   return _mm_cvtsi32_si128(*(const png_uint_16*)p);
+}
+
+static void store2(void* p, __m128i v) {
+   *(png_uint_16*)p = (png_uint_16)_mm_cvtsi128_si32(v);
+}
+
+static __m128i load6(const void* p) {
+   /* Bytes 0-3 come from the first load, 4-5 from the second. */
+   return _mm_unpacklo_epi32(load4(p), load2((const png_byte*)p + 4));
+}
+
+static void store6(void* p, __m128i v) {
+   store4(p, v);
+   store2((png_byte*)p + 4, _mm_srli_si128(v, 4));
+}
+
+static __m128i load8(const void* p) {
+   return _mm_loadl_epi64((const __m128i*)p);
+}
+
+static void store8(void* p, __m128i v) {
+   _mm_storel_epi64((__m128i*)p, v);
+}
+
+/* Loads and stores of one 2-, 6- or 8-byte pixel.  bpp is always a
+ * constant where these are called, so the switch goes away.
+ */
+static __m128i load_pixel(const void* p, unsigned int bpp) {
+   switch (bpp) {
+      case 2:  return load2(p);
+      case 6:  return load6(p);
+      default: return load8(p);
+   }
+}
+
+static void store_pixel(void* p, __m128i v, unsigned int bpp) {
+   switch (bpp) {
+      case 2:  store2(p, v); break;
+      case 6:  store6(p, v); break;
+      default: store8(p, v); break;
+   }
+}
+
 void png_read_filter_row_sub3_sse2(png_row_infop row_info, png_bytep row,
    png_const_bytep prev)
 {
@@ -194,34 +267,6 @@ void png_read_filter_row_avg4_sse2(png_row_infop row_info, png_bytep row,
    }
 }
 
-/* Returns |x| for 16-bit lanes. */
-static __m128i abs_i16(__m128i x) {
-#if PNG_INTEL_SSE_IMPLEMENTATION >= 2
-   return _mm_abs_epi16(x);
-#else
-   /* Read this all as, return x<0 ? -x : x.
-   * To negate two's complement, you flip all the bits then add 1.
-    */
-   __m128i is_negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
-
-   /* Flip negative lanes. */
-   x = _mm_xor_si128(x, is_negative);
-
-   /* +1 to negative lanes, else +0. */
-   x = _mm_sub_epi16(x, is_negative);
-   return x;
-#endif
-}
-
-/* Bytewise c ? t : e. */
-static __m128i if_then_else(__m128i c, __m128i t, __m128i e) {
-#if PNG_INTEL_SSE_IMPLEMENTATION >= 3
-   return _mm_blendv_epi8(e,t,c);
-#else
-   return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
-#endif
-}
-
 void png_read_filter_row_paeth3_sse2(png_row_infop row_info, png_bytep row,
    png_const_bytep prev)
 {
@@ -375,5 +420,448 @@ void png_read_filter_row_paeth4_sse2(png_row_infop row_info, png_bytep row,
    }
 }
 
-#endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
+/* For pixels of one, two and eight bytes, sixteen bytes of the Sub filter
+ * can be undone at once.  The running sum within the register is built up
+ * by adding in copies of the register shifted left by one pixel, then two,
+ * then four, and so on; the last pixel of the previous block is then added
+ * to every pixel.
+ */
+void png_read_filter_row_sub1_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_sub1_sse2");
+   __m128i carry = _mm_setzero_si128();
+   png_byte a = 0;
+
+   png_size_t rb = row_info->rowbytes;
+   PNG_UNUSED(prev)
+
+   while (rb >= 16) {
+      __m128i d = _mm_loadu_si128((const __m128i*)row);
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 1));
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 2));
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+      d = _mm_add_epi8(d, carry);
+      _mm_storeu_si128((__m128i*)row, d);
+
+      a = row[15];
+      carry = _mm_set1_epi8((char)a);
+
+      row += 16;
+      rb  -= 16;
+   }
+   while (rb > 0) {
+      a = *row = (png_byte)(*row + a);
+
+      row++;
+      rb--;
+   }
+}
+
+void png_read_filter_row_sub2_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_sub2_sse2");
+   __m128i a, d = _mm_setzero_si128();
+
+   png_size_t rb = row_info->rowbytes;
+   PNG_UNUSED(prev)
+
+   while (rb >= 16) {
+      a = _mm_shufflelo_epi16(_mm_srli_si128(d, 14), 0);
+      a = _mm_unpacklo_epi64(a, a);
+      d = _mm_loadu_si128((const __m128i*)row);
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 2));
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+      d = _mm_add_epi8(d, a);
+      _mm_storeu_si128((__m128i*)row, d);
+
+      row += 16;
+      rb  -= 16;
+   }
+   d = _mm_srli_si128(d, 14);
+   while (rb > 0) {
+      a = d; d = load2(row);
+      d = _mm_add_epi8(d, a);
+      store2(row, d);
+
+      row += 2;
+      rb  -= 2;
+   }
+}
+
+void png_read_filter_row_sub6_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   /* Sixteen is not a multiple of six, so this one goes a pixel at a time
+    * like the 3- and 4-byte versions.
+    */
+   png_debug(1, "in png_read_filter_row_sub6_sse2");
+   __m128i a, d = _mm_setzero_si128();
+
+   png_size_t rb = row_info->rowbytes;
+   PNG_UNUSED(prev)
+
+   while (rb > 0) {
+      a = d; d = load6(row);
+      d = _mm_add_epi8(d, a);
+      store6(row, d);
+
+      row += 6;
+      rb  -= 6;
+   }
+}
+
+void png_read_filter_row_sub8_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_sub8_sse2");
+   __m128i a, d = _mm_setzero_si128();
+
+   png_size_t rb = row_info->rowbytes;
+   PNG_UNUSED(prev)
+
+   while (rb >= 16) {
+      a = _mm_unpackhi_epi64(d, d);
+      d = _mm_loadu_si128((const __m128i*)row);
+      d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+      d = _mm_add_epi8(d, a);
+      _mm_storeu_si128((__m128i*)row, d);
+
+      row += 16;
+      rb  -= 16;
+   }
+   if (rb > 0) {
+      a = _mm_unpackhi_epi64(d, d);
+      d = _mm_add_epi8(load8(row), a);
+      store8(row, d);
+   }
+}
+
+/* Avg and Paeth for 2-, 6- and 8-byte pixels work exactly like the 4-byte
+ * versions above, one pixel per step.  The row is always a whole number of
+ * pixels, so no care is needed at the end.
+ */
+static void avg_n_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev, unsigned int bpp)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i    b;
+   __m128i a, d = zero;
+
+   png_size_t rb = row_info->rowbytes;
+   while (rb > 0) {
+             b = load_pixel(prev, bpp);
+      a = d; d = load_pixel(row,  bpp);
+
+      /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
+      __m128i avg = _mm_avg_epu8(a,b);
+      /* ...but we can fix it up by subtracting off 1 if it rounded up. */
+      avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a,b),
+                                            _mm_set1_epi8(1)));
+
+      d = _mm_add_epi8(d, avg);
+      store_pixel(row, d, bpp);
+
+      prev += bpp;
+      row  += bpp;
+      rb   -= bpp;
+   }
+}
+
+static void paeth_n_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev, unsigned int bpp)
+{
+   /* As in the 3- and 4-byte versions, the math is done with 16-bit
+    * intermediates; an 8-byte pixel exactly fills the register.
+    */
+   const __m128i zero = _mm_setzero_si128();
+   __m128i c, b = zero,
+           a, d = zero;
+
+   png_size_t rb = row_info->rowbytes;
+   while (rb > 0) {
+      c = b; b = _mm_unpacklo_epi8(load_pixel(prev, bpp), zero);
+      a = d; d = _mm_unpacklo_epi8(load_pixel(row,  bpp), zero);
+
+      /* (p-a) == (a+b-c - a) == (b-c) */
+      __m128i pa = _mm_sub_epi16(b,c);
+
+      /* (p-b) == (a+b-c - b) == (a-c) */
+      __m128i pb = _mm_sub_epi16(a,c);
+
+      /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
+      __m128i pc = _mm_add_epi16(pa,pb);
+
+      pa = abs_i16(pa);  /* |p-a| */
+      pb = abs_i16(pb);  /* |p-b| */
+      pc = abs_i16(pc);  /* |p-c| */
+
+      __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+      /* Paeth breaks ties favoring a over b over c. */
+      __m128i nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                         if_then_else(_mm_cmpeq_epi16(smallest, pb), b,
+                                                                     c));
+
+      /* Note `_epi8`: we need addition to wrap modulo 255. */
+      d = _mm_add_epi8(d, nearest);
+      store_pixel(row, _mm_packus_epi16(d,d), bpp);
+
+      prev += bpp;
+      row  += bpp;
+      rb   -= bpp;
+   }
+}
+
+void png_read_filter_row_avg2_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg2_sse2");
+   avg_n_sse2(row_info, row, prev, 2);
+}
+
+void png_read_filter_row_avg6_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg6_sse2");
+   avg_n_sse2(row_info, row, prev, 6);
+}
+
+void png_read_filter_row_avg8_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg8_sse2");
+   avg_n_sse2(row_info, row, prev, 8);
+}
+
+void png_read_filter_row_paeth2_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth2_sse2");
+   paeth_n_sse2(row_info, row, prev, 2);
+}
+
+void png_read_filter_row_paeth6_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth6_sse2");
+   paeth_n_sse2(row_info, row, prev, 6);
+}
+
+void png_read_filter_row_paeth8_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth8_sse2");
+   paeth_n_sse2(row_info, row, prev, 8);
+}
+
 #endif /* READ */
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+/* Write side: these apply a filter to a row, sixteen bytes at a time, and
+ * return the sum of the filtered bytes taken as signed magnitudes, which is
+ * what png_write_find_filter() uses to choose the filter.  Here rp is the
+ * row being written and pp the previous row (both without the filter byte)
+ * and the result goes to dp.
+ *
+ * Unlike the read side, nothing depends on bytes already computed in the
+ * same row, so the pixel size makes no difference: a, b and c are simply
+ * loaded from bpp bytes back.  The first bpp bytes, which have no pixel to
+ * the left, and the last few bytes of the row are done in C.
+ *
+ * Like the C versions, they stop early and return a partial sum once the
+ * sum is greater than lmins.  The sum is only checked every sixteen bytes,
+ * so the partial sum may differ, but it is still greater than lmins and the
+ * filter chosen is the same.
+ */
+static png_size_t msad_byte(unsigned int v) {
+   return (v < 128) ? v : 256 - v;
+}
+
+static png_size_t msad_sse2(__m128i v) {
+   /* min(v, -v) taken as unsigned bytes is v<128 ? v : 256-v, and
+    * _mm_sad_epu8 adds each half up against zero.
+    */
+   const __m128i zero = _mm_setzero_si128();
+   __m128i s = _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero);
+
+   s = _mm_add_epi32(s, _mm_srli_si128(s, 8));
+   return (png_size_t)_mm_cvtsi128_si32(s);
+}
+
+/* Returns the Paeth predictor for sixteen bytes at once. */
+static __m128i paeth_predict_sse2(__m128i a, __m128i b, __m128i c) {
+   const __m128i zero = _mm_setzero_si128();
+   __m128i half[2];
+   int h;
+
+   for (h = 0; h < 2; h++) {
+      __m128i a16 = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+      __m128i b16 = h ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+      __m128i c16 = h ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+
+      __m128i pa = _mm_sub_epi16(b16, c16);
+      __m128i pb = _mm_sub_epi16(a16, c16);
+      __m128i pc = _mm_add_epi16(pa, pb);
+
+      pa = abs_i16(pa);
+      pb = abs_i16(pb);
+      pc = abs_i16(pc);
+
+      __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+      half[h] = if_then_else(_mm_cmpeq_epi16(smallest, pa), a16,
+                if_then_else(_mm_cmpeq_epi16(smallest, pb), b16,
+                                                            c16));
+   }
+
+   return _mm_packus_epi16(half[0], half[1]);
+}
+
+png_size_t png_write_filter_row_sub_sse2(png_bytep dp, png_const_bytep rp,
+   png_const_bytep pp, png_size_t row_bytes, unsigned int bpp,
+   png_size_t lmins)
+{
+   png_size_t i, sum = 0;
+   PNG_UNUSED(pp)
+
+   for (i = 0; i < bpp; i++)
+      sum += msad_byte(dp[i] = rp[i]);
+
+   for (; i + 16 <= row_bytes; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(rp + i));
+      __m128i a = _mm_loadu_si128((const __m128i*)(rp + i - bpp));
+      __m128i d = _mm_sub_epi8(x, a);
+
+      _mm_storeu_si128((__m128i*)(dp + i), d);
+      sum += msad_sse2(d);
+
+      if (sum > lmins)
+         return sum;
+   }
+
+   for (; i < row_bytes; i++) {
+      sum += msad_byte(dp[i] = (png_byte)(rp[i] - rp[i-bpp]));
+
+      if (sum > lmins)
+         break;
+   }
+
+   return sum;
+}
+
+png_size_t png_write_filter_row_up_sse2(png_bytep dp, png_const_bytep rp,
+   png_const_bytep pp, png_size_t row_bytes, unsigned int bpp,
+   png_size_t lmins)
+{
+   png_size_t i, sum = 0;
+   PNG_UNUSED(bpp)
+
+   for (i = 0; i + 16 <= row_bytes; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(rp + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(pp + i));
+      __m128i d = _mm_sub_epi8(x, b);
+
+      _mm_storeu_si128((__m128i*)(dp + i), d);
+      sum += msad_sse2(d);
+
+      if (sum > lmins)
+         return sum;
+   }
+
+   for (; i < row_bytes; i++) {
+      sum += msad_byte(dp[i] = (png_byte)(rp[i] - pp[i]));
+
+      if (sum > lmins)
+         break;
+   }
+
+   return sum;
+}
+
+png_size_t png_write_filter_row_avg_sse2(png_bytep dp, png_const_bytep rp,
+   png_const_bytep pp, png_size_t row_bytes, unsigned int bpp,
+   png_size_t lmins)
+{
+   png_size_t i, sum = 0;
+
+   for (i = 0; i < bpp; i++)
+      sum += msad_byte(dp[i] = (png_byte)(rp[i] - (pp[i] >> 1)));
+
+   for (; i + 16 <= row_bytes; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(rp + i));
+      __m128i a = _mm_loadu_si128((const __m128i*)(rp + i - bpp));
+      __m128i b = _mm_loadu_si128((const __m128i*)(pp + i));
+
+      /* Truncating average, as on the read side. */
+      __m128i avg = _mm_avg_epu8(a,b);
+      avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a,b),
+                                            _mm_set1_epi8(1)));
+
+      __m128i d = _mm_sub_epi8(x, avg);
+
+      _mm_storeu_si128((__m128i*)(dp + i), d);
+      sum += msad_sse2(d);
+
+      if (sum > lmins)
+         return sum;
+   }
+
+   for (; i < row_bytes; i++) {
+      sum += msad_byte(dp[i] =
+          (png_byte)(rp[i] - ((rp[i-bpp] + pp[i]) >> 1)));
+
+      if (sum > lmins)
+         break;
+   }
+
+   return sum;
+}
+
+png_size_t png_write_filter_row_paeth_sse2(png_bytep dp, png_const_bytep rp,
+   png_const_bytep pp, png_size_t row_bytes, unsigned int bpp,
+   png_size_t lmins)
+{
+   png_size_t i, sum = 0;
+
+   for (i = 0; i < bpp; i++)
+      sum += msad_byte(dp[i] = (png_byte)(rp[i] - pp[i]));
+
+   for (; i + 16 <= row_bytes; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(rp + i));
+      __m128i a = _mm_loadu_si128((const __m128i*)(rp + i - bpp));
+      __m128i b = _mm_loadu_si128((const __m128i*)(pp + i));
+      __m128i c = _mm_loadu_si128((const __m128i*)(pp + i - bpp));
+      __m128i d = _mm_sub_epi8(x, paeth_predict_sse2(a, b, c));
+
+      _mm_storeu_si128((__m128i*)(dp + i), d);
+      sum += msad_sse2(d);
+
+      if (sum > lmins)
+         return sum;
+   }
+
+   for (; i < row_bytes; i++) {
+      int a = rp[i-bpp], b = pp[i], c = pp[i-bpp];
+      int pa = b - c, pb = a - c, pc;
+
+      pc = pa + pb;
+      pa = pa < 0 ? -pa : pa;
+      pb = pb < 0 ? -pb : pb;
+      pc = pc < 0 ? -pc : pc;
+
+      sum += msad_byte(dp[i] = (png_byte)(rp[i] -
+          ((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c)));
+
+      if (sum > lmins)
+         break;
+   }
+
+   return sum;
+}
+#endif /* WRITE_FILTER */
+
+#endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
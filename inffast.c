@@ -320,4 +320,267 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
    - Moving len -= 3 statement into middle of loop
  */
 
+#ifdef INFLATE_CHUNK
+/*
+   Copy len bytes from from to out, where out - from is dist if from is in the
+   output, or INFLATE_CHUNK_SIZE if it is in the window.  The copy is done in
+   sixteen or eight byte pieces, so it may read and write up to fifteen bytes
+   past the end of the match.  For distances under eight, the first eight
+   bytes are copied one at a time, after which the pattern can be copied eight
+   bytes at a time from a whole number of periods back.  Returns out + len.
+   GCC turns the fixed-size __builtin_memcpy() calls into single unaligned
+   loads and stores (zmemcpy() may be the byte loop in zutil.c).
+ */
+local unsigned char FAR *chunk_copy(out, from, len, dist)
+unsigned char FAR *out;
+const unsigned char FAR *from;
+unsigned len;
+unsigned dist;
+{
+    unsigned char FAR *stop = out + len;
+
+    if (dist >= 16) {
+        do {
+            __builtin_memcpy(out, from, 16);
+            out += 16;
+            from += 16;
+        } while (out < stop);
+        return stop;
+    }
+    if (dist < 8) {
+        unsigned n = len < 8 ? len : 8;
+
+        len -= n;
+        do {
+            *out++ = *from++;
+        } while (--n);
+        if (len == 0)
+            return stop;
+        dist *= (dist + 8) / dist;      /* 9 to 15 */
+        from = out - dist;
+    }
+    do {
+        __builtin_memcpy(out, from, 8);
+        out += 8;
+        from += 8;
+    } while (out < stop);
+    return stop;
+}
+
+/*
+   inflate_fast() with the match copies done by chunk_copy(), and the bit
+   buffer refilled with one eight byte load at the top of each loop, which
+   leaves at least 56 bits, more than the 48 that a length/distance pair can
+   use.  The load may pick up part of a byte beyond those counted in bits; the
+   next load puts the same bits in the same place, so hold is or'ed instead of
+   added to.  inflate() calls this with INFLATE_FAST_MIN_INPUT bytes of input
+   and INFLATE_FAST_MIN_OUTPUT bytes of output space, and with the window
+   padded by INFLATE_CHUNK_SIZE bytes.
+ */
+void ZLIB_INTERNAL inflate_fast_chunk(strm, start)
+z_streamp strm;
+unsigned start;         /* inflate()'s starting value for strm->avail_out */
+{
+    struct inflate_state FAR *state;
+    z_const unsigned char FAR *in;      /* local strm->next_in */
+    z_const unsigned char FAR *last;    /* have enough input while in < last */
+    unsigned char FAR *out;     /* local strm->next_out */
+    unsigned char FAR *beg;     /* inflate()'s initial strm->next_out */
+    unsigned char FAR *end;     /* while out < end, enough space available */
+#ifdef INFLATE_STRICT
+    unsigned dmax;              /* maximum distance from zlib header */
+#endif
+    unsigned wsize;             /* window size or zero if not using window */
+    unsigned whave;             /* valid bytes in the window */
+    unsigned wnext;             /* window write index */
+    unsigned char FAR *window;  /* allocated sliding window, if wsize != 0 */
+    unsigned long hold;         /* local strm->hold */
+    unsigned bits;              /* local strm->bits */
+    unsigned long word;         /* eight bytes of input */
+    code const FAR *lcode;      /* local strm->lencode */
+    code const FAR *dcode;      /* local strm->distcode */
+    unsigned lmask;             /* mask for first level of length codes */
+    unsigned dmask;             /* mask for first level of distance codes */
+    code here;                  /* retrieved table entry */
+    unsigned op;                /* code bits, operation, extra bits, or */
+                                /*  window position, window bytes to copy */
+    unsigned len;               /* match length, unused bytes */
+    unsigned dist;              /* match distance */
+    unsigned op2;               /* distance for the rest of a window match */
+    unsigned char FAR *from;    /* where to copy match from */
+
+    /* copy state to local variables */
+    state = (struct inflate_state FAR *)strm->state;
+    in = strm->next_in;
+    last = in + (strm->avail_in - (INFLATE_FAST_MIN_INPUT - 1));
+    out = strm->next_out;
+    beg = out - (start - strm->avail_out);
+    end = out + (strm->avail_out - (INFLATE_FAST_MIN_OUTPUT - 1));
+#ifdef INFLATE_STRICT
+    dmax = state->dmax;
+#endif
+    wsize = state->wsize;
+    whave = state->whave;
+    wnext = state->wnext;
+    window = state->window;
+    hold = state->hold;
+    bits = state->bits;
+    lcode = state->lencode;
+    dcode = state->distcode;
+    lmask = (1U << state->lenbits) - 1;
+    dmask = (1U << state->distbits) - 1;
+
+    /* decode literals and length/distances until end-of-block or not enough
+       input data or output space */
+    do {
+        if (bits < 48) {
+            __builtin_memcpy(&word, in, 8);
+            hold |= word << bits;
+            in += (63 - bits) >> 3;
+            bits |= 56;
+        }
+        here = lcode[hold & lmask];
+      dolen:
+        op = (unsigned)(here.bits);
+        hold >>= op;
+        bits -= op;
+        op = (unsigned)(here.op);
+        if (op == 0) {                          /* literal */
+            Tracevv((stderr, here.val >= 0x20 && here.val < 0x7f ?
+                    "inflate:         literal '%c'\n" :
+                    "inflate:         literal 0x%02x\n", here.val));
+            *out++ = (unsigned char)(here.val);
+        }
+        else if (op & 16) {                     /* length base */
+            len = (unsigned)(here.val);
+            op &= 15;                           /* number of extra bits */
+            if (op) {
+                len += (unsigned)hold & ((1U << op) - 1);
+                hold >>= op;
+                bits -= op;
+            }
+            Tracevv((stderr, "inflate:         length %u\n", len));
+            here = dcode[hold & dmask];
+          dodist:
+            op = (unsigned)(here.bits);
+            hold >>= op;
+            bits -= op;
+            op = (unsigned)(here.op);
+            if (op & 16) {                      /* distance base */
+                dist = (unsigned)(here.val);
+                op &= 15;                       /* number of extra bits */
+                dist += (unsigned)hold & ((1U << op) - 1);
+#ifdef INFLATE_STRICT
+                if (dist > dmax) {
+                    strm->msg = (char *)"invalid distance too far back";
+                    state->mode = BAD;
+                    break;
+                }
+#endif
+                hold >>= op;
+                bits -= op;
+                Tracevv((stderr, "inflate:         distance %u\n", dist));
+                op = (unsigned)(out - beg);     /* max distance in output */
+                if (dist > op) {                /* see if copy from window */
+                    op = dist - op;             /* distance back in window */
+                    if (op > whave) {
+                        if (state->sane) {
+                            strm->msg =
+                                (char *)"invalid distance too far back";
+                            state->mode = BAD;
+                            break;
+                        }
+                    }
+                    from = window;
+                    op2 = INFLATE_CHUNK_SIZE;   /* distance of last copy */
+                    if (wnext == 0) {           /* very common case */
+                        from += wsize - op;
+                        if (op < len) {         /* some from window */
+                            len -= op;
+                            out = chunk_copy(out, from, op,
+                                             INFLATE_CHUNK_SIZE);
+                            from = out - dist;  /* rest from output */
+                            op2 = dist;
+                        }
+                    }
+                    else if (wnext < op) {      /* wrap around window */
+                        from += wsize + wnext - op;
+                        op -= wnext;
+                        if (op < len) {         /* some from end of window */
+                            len -= op;
+                            out = chunk_copy(out, from, op,
+                                             INFLATE_CHUNK_SIZE);
+                            from = window;
+                            if (wnext < len) {  /* some from start of window */
+                                op = wnext;
+                                len -= op;
+                                out = chunk_copy(out, from, op,
+                                                 INFLATE_CHUNK_SIZE);
+                                from = out - dist;      /* rest from output */
+                                op2 = dist;
+                            }
+                        }
+                    }
+                    else {                      /* contiguous in window */
+                        from += wnext - op;
+                        if (op < len) {         /* some from window */
+                            len -= op;
+                            out = chunk_copy(out, from, op,
+                                             INFLATE_CHUNK_SIZE);
+                            from = out - dist;  /* rest from output */
+                            op2 = dist;
+                        }
+                    }
+                    out = chunk_copy(out, from, len, op2);
+                }
+                else                            /* copy direct from output */
+                    out = chunk_copy(out, out - dist, len, dist);
+            }
+            else if ((op & 64) == 0) {          /* 2nd level distance code */
+                here = dcode[here.val + (hold & ((1U << op) - 1))];
+                goto dodist;
+            }
+            else {
+                strm->msg = (char *)"invalid distance code";
+                state->mode = BAD;
+                break;
+            }
+        }
+        else if ((op & 64) == 0) {              /* 2nd level length code */
+            here = lcode[here.val + (hold & ((1U << op) - 1))];
+            goto dolen;
+        }
+        else if (op & 32) {                     /* end-of-block */
+            Tracevv((stderr, "inflate:         end of block\n"));
+            state->mode = TYPE;
+            break;
+        }
+        else {
+            strm->msg = (char *)"invalid literal/length code";
+            state->mode = BAD;
+            break;
+        }
+    } while (in < last && out < end);
+
+    /* return unused bytes, and clear the bits above bits */
+    len = bits >> 3;
+    in -= len;
+    bits -= len << 3;
+    hold &= (1UL << bits) - 1;
+
+    /* update state and return */
+    strm->next_in = in;
+    strm->next_out = out;
+    strm->avail_in = (unsigned)(in < last ?
+                                (INFLATE_FAST_MIN_INPUT - 1) + (last - in) :
+                                (INFLATE_FAST_MIN_INPUT - 1) - (in - last));
+    strm->avail_out = (unsigned)(out < end ?
+                                 (INFLATE_FAST_MIN_OUTPUT - 1) + (end - out) :
+                                 (INFLATE_FAST_MIN_OUTPUT - 1) - (out - end));
+    state->hold = hold;
+    state->bits = bits;
+    return;
+}
+#endif /* INFLATE_CHUNK */
+
 #endif /* !ASMINF */
@@ -9,3 +9,27 @@
  */
 
 void ZLIB_INTERNAL inflate_fast OF((z_streamp strm, unsigned start));
+
+/* INFLATE_CHUNK: inflate() uses inflate_fast_chunk(), which copies matches
+   sixteen bytes at a time and refills the bit buffer eight bytes at a time.
+   Its copies may read up to INFLATE_CHUNK_SIZE - 1 bytes past the end of a
+   match in the window, so inflate() allocates the window with that many more
+   bytes, and may write that many past the end of a match, so it needs that
+   much more output space to be called.  inflateBack() keeps inflate_fast(),
+   since its window comes from the application.  Needs 64-bit little-endian
+   longs.  Define NO_INFLATE_CHUNK to use inflate_fast() everywhere.
+ */
+#if !defined(NO_INFLATE_CHUNK) && !defined(ASMINF) && \
+    !defined(INFLATE_ALLOW_INVALID_DISTANCE_TOOFAR_ARRR) && \
+    defined(__GNUC__) && defined(__LP64__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define INFLATE_CHUNK
+#  define INFLATE_CHUNK_SIZE 16
+#  define INFLATE_FAST_MIN_INPUT 8
+#  define INFLATE_FAST_MIN_OUTPUT (258 + INFLATE_CHUNK_SIZE)
+void ZLIB_INTERNAL inflate_fast_chunk OF((z_streamp strm, unsigned start));
+#else
+#  define INFLATE_CHUNK_SIZE 0
+#  define INFLATE_FAST_MIN_INPUT 6
+#  define INFLATE_FAST_MIN_OUTPUT 258
+#endif
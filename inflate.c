@@ -406,9 +406,13 @@ unsigned copy;
     /* if it hasn't been done already, allocate space for the window */
     if (state->window == Z_NULL) {
         state->window = (unsigned char FAR *)
-                        ZALLOC(strm, 1U << state->wbits,
+                        ZALLOC(strm, (1U << state->wbits) + INFLATE_CHUNK_SIZE,
                                sizeof(unsigned char));
         if (state->window == Z_NULL) return 1;
+#ifdef INFLATE_CHUNK
+        /* the padding is only read by the copies, clear it for checkers */
+        zmemzero(state->window + (1U << state->wbits), INFLATE_CHUNK_SIZE);
+#endif
     }
 
     /* if window not in use yet, initialize */
@@ -1042,9 +1046,14 @@ int flush;
         case LEN_:
             state->mode = LEN;
         case LEN:
-            if (have >= 6 && left >= 258) {
+            if (have >= INFLATE_FAST_MIN_INPUT &&
+                left >= INFLATE_FAST_MIN_OUTPUT) {
                 RESTORE();
+#ifdef INFLATE_CHUNK
+                inflate_fast_chunk(strm, out);
+#else
                 inflate_fast(strm, out);
+#endif
                 LOAD();
                 if (state->mode == TYPE)
                     state->back = -1;
@@ -1479,7 +1488,8 @@ z_streamp source;
     window = Z_NULL;
     if (state->window != Z_NULL) {
         window = (unsigned char FAR *)
-                 ZALLOC(source, 1U << state->wbits, sizeof(unsigned char));
+                 ZALLOC(source, (1U << state->wbits) + INFLATE_CHUNK_SIZE,
+                        sizeof(unsigned char));
         if (window == Z_NULL) {
             ZFREE(source, copy);
             return Z_MEM_ERROR;
@@ -1497,7 +1507,7 @@ z_streamp source;
     }
     copy->next = copy->codes + (state->next - state->codes);
     if (window != Z_NULL) {
-        wsize = 1U << state->wbits;
+        wsize = (1U << state->wbits) + INFLATE_CHUNK_SIZE;
         zmemcpy(window, state->window, wsize);
     }
     copy->window = window;
@@ -18,19 +18,51 @@
 #ifdef PNG_READ_SUPPORTED
 #if PNG_INTEL_SSE_IMPLEMENTATION > 0
 
+#if PNG_INTEL_AVX2_OPT > 0
+/* Run-time check for AVX2.  __builtin_cpu_supports() also checks that the
+ * operating system saves the YMM registers.  The answer cannot change while
+ * we are running, so it is only asked once.
+ */
+static int
+png_have_avx2(void)
+{
+   static int have_avx2 = -1; /* not checked */
+
+   if (have_avx2 < 0)
+   {
+      __builtin_cpu_init();
+      have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+   }
+
+   return have_avx2;
+}
+#endif /* PNG_INTEL_AVX2_OPT > 0 */
+
 void
 png_init_filter_functions_sse2(png_structp pp, unsigned int bpp)
 {
    /* The techniques used to implement each of these filters in SSE operate on
     * one pixel at a time.
     * So they generally speed up 3bpp images about 3x, 4bpp images about 4x.
-    * They can scale up to 6 and 8 bpp images and down to 2 bpp images,
-    * but they'd not likely have any benefit for 1bpp images.
+    * The same per-pixel code is used for 2, 6 and 8 bpp images.  Sub for 1,
+    * 2 and 8 bpp images does sixteen bytes at a time instead.  1bpp Avg and
+    * Paeth are left alone; there is nothing to gain from one byte per step.
     * Most of these can be implemented using only MMX and 64-bit registers,
     * but they end up a bit slower than using the equally-ubiquitous SSE2.
    */
    png_debug(1, "in png_init_filter_functions_sse2");
-   if (bpp == 3)
+   if (bpp == 1)
+   {
+      pp->read_filter[PNG_FILTER_VALUE_SUB-1] = png_read_filter_row_sub1_sse2;
+   }
+   else if (bpp == 2)
+   {
+      pp->read_filter[PNG_FILTER_VALUE_SUB-1] = png_read_filter_row_sub2_sse2;
+      pp->read_filter[PNG_FILTER_VALUE_AVG-1] = png_read_filter_row_avg2_sse2;
+      pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+         png_read_filter_row_paeth2_sse2;
+   }
+   else if (bpp == 3)
    {
       pp->read_filter[PNG_FILTER_VALUE_SUB-1] = png_read_filter_row_sub3_sse2;
       pp->read_filter[PNG_FILTER_VALUE_AVG-1] = png_read_filter_row_avg3_sse2;
@@ -44,10 +76,42 @@ png_init_filter_functions_sse2(png_structp pp, unsigned int bpp)
       pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
           png_read_filter_row_paeth4_sse2;
    }
+   else if (bpp == 6)
+   {
+      pp->read_filter[PNG_FILTER_VALUE_SUB-1] = png_read_filter_row_sub6_sse2;
+      pp->read_filter[PNG_FILTER_VALUE_AVG-1] = png_read_filter_row_avg6_sse2;
+      pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+          png_read_filter_row_paeth6_sse2;
+   }
+   else if (bpp == 8)
+   {
+      pp->read_filter[PNG_FILTER_VALUE_SUB-1] = png_read_filter_row_sub8_sse2;
+      pp->read_filter[PNG_FILTER_VALUE_AVG-1] = png_read_filter_row_avg8_sse2;
+      pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+          png_read_filter_row_paeth8_sse2;
+   }
 
-   /* No need optimize PNG_FILTER_VALUE_UP.  The compiler should
+   /* No need optimize PNG_FILTER_VALUE_UP with SSE2.  The compiler should
     * autovectorize.
     */
+
+#if PNG_INTEL_AVX2_OPT > 0
+   /* With AVX2, Up is done 32 bytes at a time and Sub eight pixels at a
+    * time.  Avg and Paeth keep the SSE2 versions installed above.
+    */
+   if (png_have_avx2() != 0)
+   {
+      pp->read_filter[PNG_FILTER_VALUE_UP-1] = png_read_filter_row_up_avx2;
+
+      if (bpp == 3)
+         pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+            png_read_filter_row_sub3_avx2;
+
+      else if (bpp == 4)
+         pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+            png_read_filter_row_sub4_avx2;
+   }
+#endif
 }
 
 #endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
@@ -1528,6 +1528,42 @@ PNG_FIXED_EXPORT(209, void, png_set_filter_heuristics_fixed,
 #define PNG_FILTER_HEURISTIC_WEIGHTED   2  /* Experimental feature */
 #define PNG_FILTER_HEURISTIC_LAST       3  /* Not a valid value */
 
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+/* How the filter for each row is chosen when png_set_filter() has allowed
+ * more than one.  The default is the "minimum sum of absolute differences"
+ * heuristic.  PNG_FILTER_SELECT_ZLIB test-compresses the row with each of
+ * the filters, using a deflate stream that has seen the rows chosen so far,
+ * and keeps the filter that adds the fewest bits; it is much slower.  The
+ * others are about as cheap as MSAD and look at the histogram of the
+ * filtered bytes: its Shannon entropy, the number of different byte values
+ * (ties broken by MSAD), or the cost of coding the row with the byte
+ * frequencies of the rows chosen so far.
+ *
+ * PNG_FILTER_SELECT_BEAM looks at the whole image instead of one row at a
+ * time.  The rows are held back until the last one has been written, then
+ * a beam search keeps the png_set_filter_beam_width() best sequences of
+ * filters found so far, each scored by a deflate stream as for
+ * PNG_FILTER_SELECT_ZLIB, and the best complete sequence is written.  The
+ * time taken grows with the beam width; a width of 1 gives the same
+ * filters as PNG_FILTER_SELECT_ZLIB.  The whole image is kept in memory.
+ */
+#define PNG_FILTER_SELECT_MSAD      0 /* Default */
+#define PNG_FILTER_SELECT_ZLIB      1 /* "zlib predictive" */
+#define PNG_FILTER_SELECT_ENTROPY   2
+#define PNG_FILTER_SELECT_DISTINCT  3
+#define PNG_FILTER_SELECT_HISTOGRAM 4 /* running histogram of earlier rows */
+#define PNG_FILTER_SELECT_BEAM      5 /* search over the whole image */
+#define PNG_FILTER_SELECT_LAST      6 /* Not a valid value */
+
+#define PNG_FILTER_BEAM_WIDTH_DEFAULT 4
+#define PNG_FILTER_BEAM_WIDTH_MAX     64
+
+PNG_EXPORT(250, void, png_set_filter_selection, (png_structrp png_ptr,
+    int selection));
+PNG_EXPORT(251, void, png_set_filter_beam_width, (png_structrp png_ptr,
+    int width));
+#endif /* WRITE_FILTER_SELECTION */
+
 /* Set the library compression level.  Currently, valid values range from
  * 0 - 9, corresponding directly to the zlib compression levels 0 - 9
  * (0 - no compression, 9 - "maximal" compression).  Note that tests have
@@ -1553,6 +1589,128 @@ PNG_EXPORT(72, void, png_set_compression_window_bits, (png_structrp png_ptr,
 
 PNG_EXPORT(73, void, png_set_compression_method, (png_structrp png_ptr,
     int method));
+
+#ifdef PNG_WRITE_OPTIMAL_DEFLATE_SUPPORTED
+/* Number of passes made by the Z_OPTIMAL strategy of the zlib bundled with
+ * pngcrush, which parses the data again with the symbol costs found by the
+ * last pass.  Values less than 1 leave zlib's default (10).  Ignored with
+ * the other strategies.
+ */
+PNG_EXPORT(252, void, png_set_compression_iterations, (png_structrp png_ptr,
+    int iterations));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+/* Number of bytes (3 or 4) hashed by the bundled zlib to find matches in the
+ * IDAT stream, see deflateHash() in zlib.h.  4 is faster but gives different,
+ * and sometimes larger, output.  0 (the default) leaves zlib's default (3).
+ */
+PNG_EXPORT(253, void, png_set_compression_hash, (png_structrp png_ptr,
+    int bytes));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+/* With split non-zero the bundled zlib chooses where each deflate block of
+ * the IDAT stream ends, see deflateSplit() in zlib.h.  This makes the output
+ * smaller at some cost in time.  The default is 0, one block each time the
+ * symbol buffer fills.
+ */
+PNG_EXPORT(255, void, png_set_compression_split, (png_structrp png_ptr,
+    int split));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED
+/* With optimal non-zero the bundled zlib limits the lengths of the Huffman
+ * codes of the IDAT stream with the package-merge algorithm, see
+ * deflateHuffman() in zlib.h, instead of its own heuristic.  This only makes
+ * a difference to blocks with very skewed statistics.  The default is 0.
+ */
+PNG_EXPORT(256, void, png_set_compression_huffman, (png_structrp png_ptr,
+    int optimal));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+/* With tree non-zero the bundled zlib finds the matches in the IDAT stream
+ * with binary trees instead of hash chains for the Z_OPTIMAL strategy, see
+ * deflateTree() in zlib.h.  This is faster on images with long hash chains,
+ * and the output may be different.  The default is 0.
+ */
+PNG_EXPORT(257, void, png_set_compression_tree, (png_structrp png_ptr,
+    int tree));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+/* Replaces the match search parameters that zlib takes from the compression
+ * level for the IDAT stream, see deflateTune() in zlib.h.  Level 9 is 32,
+ * 258, 258 and 4096; a longer max_chain searches harder.  All 0 (the
+ * default) keeps the parameters of the level.
+ */
+PNG_EXPORT(258, void, png_set_compression_tune, (png_structrp png_ptr,
+    int good_length, int max_lazy, int nice_length, int max_chain));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+/* Gives the bundled zlib size bytes at cache in which to keep the matches
+ * that the Z_OPTIMAL strategy finds in the IDAT data, see deflateMatchCache()
+ * in zlib.h.  Writing the same image data again with the same filters and
+ * match search settings then takes them from there instead of searching
+ * again; the output is the same either way.  The cache belongs to the
+ * application, which can give it to another png_struct later.  NULL (the
+ * default) for none.
+ */
+PNG_EXPORT(260, void, png_set_compression_match_cache, (png_structrp png_ptr,
+    png_bytep cache, png_alloc_size_t size));
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+/* Splits the IDAT data into num_bands horizontal bands: first_row[i] is the
+ * first row of band i, counted in the order the rows are compressed (across
+ * the passes of an interlaced image), and first_row[0] must be 0.  Each band
+ * ends a deflate block, so its compressed size can be had from
+ * png_get_compression_band_bits() once the image is written.  With levels
+ * and strategies, band i is compressed at levels[i] (0-9) with strategies[i],
+ * which are set with deflateParams() as it starts; the result is still one
+ * zlib stream.  NULL for both keeps the level and strategy of the stream.
+ * Bands are not used while png_set_compression_threads() is in effect.  0
+ * (the default) for none.
+ */
+#define PNG_COMPRESSION_BANDS_MAX 16
+PNG_EXPORT(261, void, png_set_compression_bands, (png_structrp png_ptr,
+    int num_bands, png_const_uint_32p first_row, png_const_bytep levels,
+    png_const_bytep strategies));
+
+/* The number of bits that a band took in the IDAT zlib stream, including the
+ * zlib header in the first band, or 0 if the band was not written.
+ */
+PNG_EXPORT(262, png_alloc_size_t, png_get_compression_band_bits,
+    (png_const_structrp png_ptr, int band));
+#endif
+
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+/* With size_only non-zero the file is only measured: the bundled zlib works
+ * out the length of the compressed IDAT data without producing it (see
+ * deflateCount() in zlib.h), and the chunk CRCs are not computed.  The write
+ * function gets the right number of bytes, but not their values.  For trial
+ * compressions; the default is 0.
+ */
+PNG_EXPORT(259, void, png_set_write_size_only, (png_structrp png_ptr,
+    int size_only));
+#endif
+
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+/* Number of threads used to compress large images.  The IDAT data is split
+ * into 1 MByte segments that are compressed separately and joined into one
+ * zlib stream, so the output differs slightly from that of one thread.  0 or
+ * 1 (the default) compresses on the calling thread only.
+ */
+#define PNG_COMPRESSION_THREADS_MAX 256
+/* The size of those segments; an image of less than two of them is
+ * compressed on the calling thread.
+ */
+#define PNG_COMPRESSION_THREADS_SEGMENT 1048576
+PNG_EXPORT(254, void, png_set_compression_threads, (png_structrp png_ptr,
+    int threads));
+#endif
 #endif /* WRITE_CUSTOMIZE_COMPRESSION */
 
 #ifdef PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED
@@ -3266,7 +3424,7 @@ PNG_EXPORT(244, int, png_set_option, (png_structrp png_ptr, int option,
  * one to use is one more than this.)
  */
 #ifdef PNG_EXPORT_LAST_ORDINAL
-  PNG_EXPORT_LAST_ORDINAL(249);
+  PNG_EXPORT_LAST_ORDINAL(262);
 #endif
 
 #ifdef __cplusplus
@@ -5,7 +5,7 @@
  * Portions Copyright (C) 2005 Greg Roelofs
  */
 
-#define PNGCRUSH_VERSION "1.8.14"
+#define PNGCRUSH_VERSION "1.8.15"
 
 #undef BLOCKY_DEINTERLACE
 
@@ -96,10 +96,10 @@
  * If libpng is bundled with this software, it is conveyed under the
  * libpng license (see COPYRIGHT NOTICE, DISCLAIMER, and LICENSE, in png.h).
  *
- * If intel_init.c and filter_sse2_intrinsics.c are bundled with this
- * software, they are conveyed under the libpng license (see the
- * copyright notices within those files and the COPYRIGHT NOTICE, DISCLAIMER,
- * and LICENSE in png.h).
+ * If intel_init.c, filter_sse2_intrinsics.c, and filter_avx2_intrinsics.c
+ * are bundled with this software, they are conveyed under the libpng
+ * license (see the copyright notices within those files and the COPYRIGHT
+ * NOTICE, DISCLAIMER, and LICENSE in png.h).
  *
  * ZLIB COPYRIGHT, DISCLAIMER, and LICENSE:
  *
@@ -349,6 +349,135 @@
 
 Change log:
 
+Version 1.8.15 (built with libpng-1.6.34 and zlib-1.2.11)
+  Added filter_avx2_intrinsics.c, with AVX2 versions of the Up filter and
+    of the Sub filter for 3- and 4-byte pixels, which are installed by
+    intel_init.c when a run-time check finds that the CPU supports AVX2.
+  Added SSE2 versions of the Sub, Avg and Paeth unfilters for 2-, 6- and
+    8-byte pixels and of Sub for 1-byte pixels to filter_sse2_intrinsics.c.
+  Added SSE2 write-side filters to filter_sse2_intrinsics.c, used by
+    pngwutil.c when choosing the filter for each row.  They produce the
+    same filtered rows and choose the same filters as the C code.
+  Added png_set_filter_selection() to libpng, with PNG_FILTER_SELECT_ZLIB,
+    the "zlib predictive" method that had been mentioned in a comment in
+    png_write_find_filter() but never implemented.  Each row is compressed
+    with each filter by a copy of a deflate stream that has seen the rows
+    chosen so far, and the filter that adds the fewest bits is kept.
+  Added filter type 7 ("-f 7") for this and methods 177 through 180, which
+    use it with each zlib strategy.  Copy_idat is now method 181.
+  Added PNG_FILTER_SELECT_ENTROPY, _DISTINCT and _HISTOGRAM, which score
+    each filtered row by the Shannon entropy of its bytes, the number of
+    different byte values, or the cost of coding it with the byte counts
+    of the rows chosen so far.  They cost about as much as the default
+    heuristic.  Added filter types 8-10 and methods 181 through 192 for
+    them.  Copy_idat is now method 193.
+  Added PNG_FILTER_SELECT_BEAM, which holds the rows back until the end of
+    the image and does a beam search over the whole sequence of filters,
+    scoring each sequence with a deflate stream that has the IDAT settings.
+    Added filter type 11 and methods 193 through 196 for it, and the
+    "-beam n" option to set the beam width (default 4); the time taken
+    grows with the width.  Copy_idat is now method 197.
+  Added Z_OPTIMAL (5 in zlib.h, "-z 4" in pngcrush) to the bundled zlib,
+    an optimal-parse deflate that finds the cheapest sequence of literals
+    and matches for each 8k segment, estimating the cost of each symbol
+    from the counts of the previous parse, and parses again until that
+    stops helping.  A block is sent with the symbols of the lazy parse of
+    level 9 instead when those make it smaller.  It takes 10 to 30 times
+    as long as level 9, for output from a few bytes to 12% smaller.
+    Added methods 197 through 202, which use it with filters 0-5, "-z 4",
+    and the "-iter n" option to set the number of passes (default 10).
+    Copy_idat is now method 203.
+  Added an optional four-byte hash to the bundled zlib (deflateHash()) and
+    the "-hash 4" option to use it for IDAT.  It is faster, and the output
+    is different.  When built with SSE2 (the default on x86-64),
+    longest_match() now compares 16 bytes at a time, or 32 with AVX2 when
+    the CPU has it; this does not change the output.  Define
+    NO_SIMD_MATCH to use the byte loop.
+  Added block splitting to the bundled zlib (deflateSplit()): when the
+    symbol buffer is flushed it is divided into the deflate blocks that
+    give the smallest output.  Added methods 203-208, which are methods
+    113-118 with block splitting (png_set_compression_split()).
+  Added package-merge to the bundled zlib (deflateHuffman()), to limit the
+    lengths of Huffman codes that would be too long optimally instead of
+    with the heuristic of zlib, which is still used when its trees are
+    no larger.  pngcrush always uses it (png_set_compression_huffman()).
+  Added Z_QUICK and Z_MEDIUM (6 and 7 in zlib.h, "-z 5" and "-z 6" in
+    pngcrush) to the bundled zlib.  Z_QUICK tries only the most recent
+    string with the same hash and does not hash the strings inside
+    matches; Z_MEDIUM is the lazy parse of deflate_slow() that skips
+    hashing the strings inside matches longer than max_lazy, as
+    deflate_fast() does.  They are only used when asked for with
+    "-m method -z 5" or "-z 6": they are up to 1.4 times as fast as
+    levels 1 and 6, but their output is up to 5% larger, so they are
+    not among the methods, the default trials or "-fast".
+  When built with SSE2, slide_hash() in the bundled zlib now slides the
+    hash table with saturating subtracts, eight or (with AVX2, when the
+    CPU has it) sixteen entries at a time; this does not change the
+    output.  Define NO_SIMD_SLIDE to use the plain loop.
+  Added a binary-tree match finder to the bundled zlib (deflateTree()),
+    used with strategy 4, which finds the longest matches with fewer
+    comparisons than the hash chains when they are long, and gives
+    strategy 4 every match length on the way.  It is off by default,
+    since the output may differ; the "-tree" option turns it on
+    (png_set_compression_tree()).
+  Added levels 10-12 ("-l 10" to "-l 12" after "-m"), which are level 9
+    with longer hash chains set with deflateTune()
+    (png_set_compression_tune()), and the "-tune" option to change their
+    parameters.  They are not among the methods or in "-brute": level 9
+    already stops at matches of 258 bytes, so the longer chains seldom
+    save more than a few bytes.
+  Trial compressions are now only measured (png_set_write_size_only()):
+    the bundled zlib counts the bits of each deflate block instead of
+    writing them (deflateCount()), and the chunk CRCs are not computed.
+  The trials before the last one no longer read the iCCP, iTXt, sPLT,
+    tEXt, zTXt and eXIf chunks, which are only copied in the last trial.
+  Added a match cache to the bundled zlib (deflateMatchCache()), which
+    keeps the matches that strategy 4 finds so that another stream with
+    the same input and match settings can replay them instead of searching
+    (png_set_compression_match_cache()).  pngcrush keeps them for the two
+    filters with the smallest strategy 4 results, so the last trial does
+    not search again when one of those wins.  The "-cache n" option sets
+    the most memory used for each, in MBytes (default 32, 0 for none).
+  Added "-bands n" option.  Each trial then ends a deflate block after
+    every 1/n of the rows and measures the bands, and one more trial
+    compresses each band with the level and strategy that did best on it,
+    switching with deflateParams() within the one zlib stream
+    (png_set_compression_bands()).
+  When built with SSE2, deflate_rle() in the bundled zlib now measures
+    each run 16 bytes at a time, or 32 with AVX2 when the CPU has it;
+    this does not change the output.  Define NO_SIMD_RLE to use the
+    byte loop.
+  IDAT chunks are now put together in the compression buffer, which has
+    room for the length and name in front of the data and the CRC after
+    it, and written with one call instead of three.
+  Added inflate_fast_chunk() to the bundled zlib, which inflate() uses on
+    64-bit little-endian GCC targets: it copies matches 8 or 16 bytes at
+    a time and refills its bit buffer 8 bytes at a time.  The window has
+    16 bytes of padding for it.  Define NO_INFLATE_CHUNK to use
+    inflate_fast().
+  adler32() in the bundled zlib now sums 32 bytes at a time with SSSE3 or
+    AVX2, whichever the CPU has, on x86 with GCC 4.9 or later, and with
+    NEON when built with PNGCRUSH_USE_ARM_NEON for a CPU that has it.
+    Define NO_SIMD_ADLER32 to use the plain loop.
+  crc32() in the bundled zlib, which computes the chunk CRCs, now folds
+    16 bytes at a time with carry-less multiplies (PCLMULQDQ) on x86 with
+    GCC 6 or later when the CPU has them, and otherwise uses sixteen
+    tables, one byte at a time from each.  Define NO_PCLMUL_CRC32 or
+    NOBYSIXTEEN to leave either out.
+  The read and write structures are now created with a pooling allocator
+    (pngcrush_pool_malloc()), which keeps up to 16 MBytes of freed large
+    blocks, such as the zlib windows and hash tables, for the next trial
+    or file instead of returning them to the system.
+  Added "-huge" option, which keeps the zlib buffers of the pooling
+    allocator in arenas marked with madvise(MADV_HUGEPAGE) so that Linux
+    can back them with transparent huge pages.  It is only built when
+    PNGCRUSH_USE_HUGE_PAGES is defined (see the Makefile).
+  Added "-threads n" option to compress the IDAT data of large images on
+    n threads, in 1-MByte segments that are each primed with the 32 KBytes
+    before them and joined with sync flushes into a single zlib stream
+    (png_set_compression_threads()).  The Makefile builds it with POSIX
+    threads (PNGCRUSH_USE_PTHREADS, -lpthread).
+
 Version 1.8.14 (built with libpng-1.6.34 and zlib-1.2.11)
   Recognize the "-bail" option properly (bug fix by Hadrien Lacour).
   Fix documentation about "-force/-noforce" to represent the default
@@ -1460,9 +1589,19 @@ static int copy_idat = 0; /* = 1 to simply copy the IDAT chunk data */
 */
 #undef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 199309L /* for clock_gettime */
+#ifdef PNGCRUSH_USE_HUGE_PAGES
+#  define _DEFAULT_SOURCE /* for MAP_ANONYMOUS and MADV_HUGEPAGE */
+#endif
 
 #include <time.h>
 
+#ifdef PNGCRUSH_USE_HUGE_PAGES
+#  include <sys/mman.h>
+#  if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+#    define PNGCRUSH_HUGE_PAGES_SUPPORTED
+#  endif
+#endif
+
 #ifdef CLOCKS_PER_SECOND
 #  if CLOCKS_PER_SECOND == '"1000"'
 #    undef CLOCKS_PER_SEC
@@ -1737,6 +1876,7 @@ static unsigned long pngcrush_timer_min_nsec[PNGCRUSH_TIMERS];
 #ifdef PNGCRUSH_USE_INTEL_SSE
 # include "intel_init.c"
 # include "filter_sse2_intrinsics.c"
+# include "filter_avx2_intrinsics.c"
 #endif
 #ifdef PNGCRUSH_USE_POWERPC_VSX
 # include "powerpc_init.c"
@@ -2102,8 +2242,10 @@ png_uint_32 pngcrush_crc;
 
 #define STR_BUF_SIZE      2048
 #define MAX_IDAT_SIZE     524288L
-#define MAX_METHODS       177
+#define MAX_METHODS       209
 #define MAX_METHODSP1     (MAX_METHODS+1)
+#define MAX_TRIALS        (MAX_METHODS+2) /* and the segmented trial */
+#define SEGMENTED_ROW     MAX_METHODSP1   /* fm[] etc. of the segmented trial */
 #define DEFAULT_METHODS   10
 #define FAKE_PAUSE_STRING "P"
 
@@ -2113,6 +2255,46 @@ png_uint_32 pngcrush_crc;
 #  define NUM_STRATEGIES  3
 #endif
 
+/* Strategies 4-6 (Z_OPTIMAL, Z_QUICK and Z_MEDIUM, bundled zlib only) are
+ * not in the loops over NUM_STRATEGIES; strategy 4 is used by methods
+ * 197-202, and 5 and 6 only with "-m method -z strategy".
+ */
+#if defined(Z_QUICK)
+#  define MAX_STRATEGIES  7
+#elif defined(Z_OPTIMAL)
+#  define MAX_STRATEGIES  5
+#else
+#  define MAX_STRATEGIES  NUM_STRATEGIES
+#endif
+
+/* Levels 10-12 (only with -l) are zlib level 9 with longer hash chains,
+ * set with png_set_compression_tune().
+ */
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+#  define NUM_LEVELS      13
+#else
+#  define NUM_LEVELS      10
+#endif
+
+/* Marks the methods with block splitting (203-208) in the reports */
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+#  define SPLIT_STRING(split) ((split) ? " split" : "")
+#else
+#  define SPLIT_STRING(split) ""
+#endif
+
+/* Filter types in the method table: 0-4 the single filters, 5 adaptive
+ * (all filters, chosen by the libpng heuristic), 6 "speedy" (none, sub and
+ * up), and, with our copy of libpng, 7-11 adaptive with the filter chosen
+ * by png_set_filter_selection() method 1-5 ("zlib predictive", entropy,
+ * distinct bytes, running histogram, beam search over the whole image).
+ */
+#ifdef PNG_FILTER_SELECT_ZLIB
+#  define NUM_FILTERS     12
+#else
+#  define NUM_FILTERS     6
+#endif
+
 #ifdef __TURBOC__
 #  include <mem.h>
 #endif
@@ -2248,6 +2430,9 @@ static int check_crc = 0;  /* if 0, skip CRC and ADLER32 checks */
                            /* otherwise check both */
 static int force = 1; /* if 1, force output even if IDAT is larger */
 static unsigned int benchmark_iterations = 0;
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+static int huge_pages = 0; /* if 1, pool zlib buffers in huge pages */
+#endif
 
 static int blacken = 0; /* if 0, or 2 after the first trial,
                            do not blacken color samples */
@@ -2279,17 +2464,82 @@ static int compression_window;
 static int default_compression_window = 15;
 static int force_compression_window = 0;
 static int compression_mem_level = 9;
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+static int compression_hash_bytes = 0; /* 0: zlib default (3) */
+#endif
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+static int compression_tree = 0;
+#endif
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+static int compression_threads = 1;
+#endif
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+/* Matches of the strategy 4 trials, for the trial with the same filter that
+ * writes the output (see png_set_compression_match_cache()).  Two are kept,
+ * for the filters with the smallest results so far.
+ */
+static int match_cache_mbytes = 32;  /* largest size of each, 0 for none */
+static png_bytep match_cache[2];
+static png_alloc_size_t match_cache_size[2];
+static int match_cache_filter[2];
+static png_uint_32 match_cache_length[2];   /* best IDAT length with it */
+static int match_cache_slot = -1;           /* the one the trial uses */
+#endif
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+/* With "-bands n" each trial ends a deflate block after every 1/n of the
+ * rows and measures the bands (see png_set_compression_bands()).  The
+ * segmented trial then compresses each band with the level and strategy
+ * that did best on it.
+ */
+static int compression_bands = 0;          /* 0 for none */
+static int num_bands = 0;                  /* bands of this image */
+static int segmented_trial = -1;
+static int band_method[PNG_COMPRESSION_BANDS_MAX];
+static png_byte band_level[PNG_COMPRESSION_BANDS_MAX];
+static png_byte band_strategy[PNG_COMPRESSION_BANDS_MAX];
+static png_alloc_size_t band_bits[MAX_TRIALS][PNG_COMPRESSION_BANDS_MAX];
+#endif
 static int final_method = 0;
 static int brute_force = 0;
 static int brute_force_level = 0;
 static int brute_force_filter = 0;
 static int brute_force_strategy = 0;
-static int brute_force_levels[10] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
-static int brute_force_filters[6] = { 1, 1, 1, 1, 1, 1 };
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+static int brute_force_levels[NUM_LEVELS] =
+   { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+/* good_length, max_lazy, nice_length and max_chain of levels 10-12, as in
+ * the configuration_table of deflate.c, where level 9 is 32, 258, 258, 4096.
+ * Changed with -tune.
+ */
+static int level_tune[NUM_LEVELS - 10][4] = {
+   {  64, 258, 258,  8192 },
+   { 128, 258, 258, 16384 },
+   { 258, 258, 258, 32768 }
+};
+#else
+static int brute_force_levels[NUM_LEVELS] =
+   { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+#endif
+#ifdef PNG_FILTER_SELECT_ZLIB
+static int brute_force_filters[NUM_FILTERS] =
+   { 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1 };
+static int filter_beam_width = PNG_FILTER_BEAM_WIDTH_DEFAULT;
+#else
+static int brute_force_filters[NUM_FILTERS] = { 1, 1, 1, 1, 1, 1 };
+#endif
+#ifdef Z_OPTIMAL
+#  ifdef Z_QUICK
+static int brute_force_strategies[MAX_STRATEGIES] = { 1, 1, 1, 1, 1, 1, 1 };
+#  else
+static int brute_force_strategies[MAX_STRATEGIES] = { 1, 1, 1, 1, 1 };
+#  endif
+static int compression_iterations = 0; /* 0: zlib default */
+#else
 #ifdef Z_RLE
-static int brute_force_strategies[NUM_STRATEGIES] = { 1, 1, 1, 1 };
+static int brute_force_strategies[MAX_STRATEGIES] = { 1, 1, 1, 1 };
 #else
-static int brute_force_strategies[NUM_STRATEGIES] = { 1, 1, 1 };
+static int brute_force_strategies[MAX_STRATEGIES] = { 1, 1, 1 };
+#endif
 #endif
 static int speed = 0;
 static int method = 10;
@@ -2305,6 +2555,9 @@ static png_bytep row_buf;
 static png_bytepp row_pointers;
 #endif
 static int z_strategy;
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+static int block_split = 0;
+#endif
 static int best_of_three;
 static int methods_specified = 0;
 static int specified_intent = -1;
@@ -2371,7 +2624,7 @@ static int output_format = 0;
 static int do_color_count;
 png_uint_32 pngcrush_measure_idat(png_structp png_ptr);
 
-static png_uint_32 idat_length[MAX_METHODSP1];
+static png_uint_32 idat_length[MAX_TRIALS];
 static int filter_type, zlib_level;
 static png_bytep png_row_filters = NULL;
 
@@ -2439,6 +2692,19 @@ void pngcrush_write_png(png_structp write_pointer, png_bytep data,
 #ifdef PNG_USER_MEM_SUPPORTED
 png_voidp pngcrush_debug_malloc(png_structp png_ptr, png_uint_32 size);
 void pngcrush_debug_free(png_structp png_ptr, png_voidp ptr);
+png_voidp pngcrush_pool_malloc(png_structp png_ptr, png_alloc_size_t size);
+void pngcrush_pool_free(png_structp png_ptr, png_voidp ptr);
+void pngcrush_pool_release(void);
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+static int pngcrush_match_cache(int filter, png_alloc_size_t data_bytes);
+static void pngcrush_match_cache_release(void);
+#endif
+static int pngcrush_z_strategy(int zs_method);
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+static int pngcrush_choose_bands(int segmented, int *fm, int *lv, int *zs,
+    int *bs);
 #endif
 
 void pngcrush_pause(void);
@@ -2837,10 +3103,396 @@ void pngcrush_debug_free(png_structp png_ptr, png_voidp ptr)
     free(ptr);
 }
 
+/*
+ * Every trial creates and destroys its read and write structures, and with
+ * them the zlib deflate and inflate states (the window, hash tables and
+ * pending buffer are several hundred KBytes at memLevel 9).  Instead of
+ * returning large blocks to the system, pngcrush_pool_free() keeps up to
+ * POOL_SLOTS of them, and pngcrush_pool_malloc() hands one back for a
+ * request that it can hold without wasting more than half of it.  The next
+ * trial, or the next file, then gets its zlib states without going to the
+ * system allocator or faulting in new pages; zlib initializes them the same
+ * way either way.  The size is kept in front of each block.  With -threads,
+ * libpng serializes the allocations of the workers.
+ */
+#define POOL_SLOTS    16
+#define POOL_MIN_SIZE 4096
+#define POOL_MAX_SIZE (16L*1024L*1024L)  /* total size kept */
+#define POOL_HEADER   16                 /* keeps the blocks aligned */
+
+static png_bytep pool_block[POOL_SLOTS];
+static int pool_blocks = 0;
+static png_alloc_size_t pool_total = 0;
+
+#define POOL_SIZE(block) (*(png_alloc_size_t *)(png_voidp)(block))
+
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+/*
+ * With "-huge", blocks of HUGE_MIN_SIZE or more (the zlib windows, hash
+ * tables and pending buffers) are instead carved out of arenas that are
+ * aligned to HUGE_PAGE_SIZE and marked with madvise(MADV_HUGEPAGE), so that
+ * the kernel can back them with transparent huge pages, which may make the
+ * hash chain walks miss the TLB less often.  These blocks are marked in
+ * their header.  They are never returned to the system one by one: a freed
+ * block is linked into a list through its first bytes, and is handed back,
+ * as from the pool, for a request that it can hold without wasting more
+ * than half of it.  The arenas are unmapped by pngcrush_pool_release().
+ * Since each trial asks for the same sizes as the one before, the arenas
+ * stop growing after the first trial.
+ */
+#define HUGE_PAGE_SIZE  (2L*1024L*1024L)
+#define HUGE_ARENA_SIZE (4*HUGE_PAGE_SIZE)
+#define HUGE_MIN_SIZE   (64L*1024L)
+#define HUGE_ALIGN      64
+#define HUGE_ARENAS     64
+
+#define POOL_HUGE(block) ((block)[sizeof(png_alloc_size_t)])
+#define HUGE_NEXT(block) (*(png_bytep *)(png_voidp)((block) + POOL_HEADER))
+
+static png_bytep huge_arena[HUGE_ARENAS];
+static png_alloc_size_t huge_arena_size[HUGE_ARENAS];
+static int huge_arenas = 0;
+static png_alloc_size_t huge_arena_used = 0; /* in the last arena */
+static png_bytep huge_free = NULL;           /* the freed blocks */
+
+/* Map an arena of at least size bytes, aligned to HUGE_PAGE_SIZE. */
+static int pngcrush_huge_arena(png_alloc_size_t size)
+{
+    png_bytep map, arena;
+    png_alloc_size_t lead;
+
+    if (huge_arenas == HUGE_ARENAS ||
+        size > (png_alloc_size_t)-1 - 2*HUGE_PAGE_SIZE)
+        return 0;
+
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(png_alloc_size_t)(HUGE_PAGE_SIZE-1);
+    if (size < HUGE_ARENA_SIZE)
+        size = HUGE_ARENA_SIZE;
+
+    /* Map one huge page more than needed and trim it to the alignment. */
+    map = (png_bytep) mmap(NULL, size + HUGE_PAGE_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == (png_bytep) MAP_FAILED)
+        return 0;
+
+    lead = (png_alloc_size_t)(-(size_t)map & (HUGE_PAGE_SIZE - 1));
+    arena = map + lead;
+    if (lead != 0)
+        munmap(map, lead);
+    munmap(arena + size, HUGE_PAGE_SIZE - lead);
+
+    /* Only a hint: without transparent huge pages this just fails. */
+    madvise(arena, size, MADV_HUGEPAGE);
+
+    huge_arena[huge_arenas] = arena;
+    huge_arena_size[huge_arenas++] = size;
+    huge_arena_used = 0;
+    return 1;
+}
+
+/* Get a block of size bytes, with its header, from the arenas. */
+static png_bytep pngcrush_huge_malloc(png_alloc_size_t size)
+{
+    png_bytep block;
+    png_bytep *link, *best = NULL;
+    png_alloc_size_t need;
+
+    for (link = &huge_free; *link != NULL; link = &HUGE_NEXT(*link))
+    {
+        png_alloc_size_t have = POOL_SIZE(*link);
+
+        if (have >= size && have - size <= have / 2 &&
+            (best == NULL || have < POOL_SIZE(*best)))
+            best = link;
+    }
+
+    if (best != NULL)
+    {
+        block = *best;
+        *best = HUGE_NEXT(block);
+        return block;
+    }
+
+    if (size > (png_alloc_size_t)-1 - POOL_HEADER - HUGE_ALIGN)
+        return NULL;
+
+    need = (size + POOL_HEADER + HUGE_ALIGN - 1) &
+        ~(png_alloc_size_t)(HUGE_ALIGN - 1);
+
+    if (huge_arenas == 0 ||
+        need > huge_arena_size[huge_arenas-1] - huge_arena_used)
+    {
+        if (!pngcrush_huge_arena(need))
+            return NULL;
+    }
+
+    block = huge_arena[huge_arenas-1] + huge_arena_used;
+    huge_arena_used += need;
+
+    POOL_SIZE(block) = need - POOL_HEADER;
+    POOL_HUGE(block) = 1;
+    return block;
+}
+#endif /* PNGCRUSH_HUGE_PAGES_SUPPORTED */
+
+png_voidp pngcrush_pool_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+    png_bytep block;
+
+    PNG_UNUSED(png_ptr)
+
+    if (size == 0 || size > (png_alloc_size_t)-1 - POOL_HEADER)
+        return (png_voidp) (NULL);
+
+    if (size >= POOL_MIN_SIZE)
+    {
+        int i, best = -1;
+
+        for (i = 0; i < pool_blocks; i++)
+        {
+            png_alloc_size_t have = POOL_SIZE(pool_block[i]);
+
+            if (have >= size && have - size <= have / 2 &&
+                (best < 0 || have < POOL_SIZE(pool_block[best])))
+                best = i;
+        }
+
+        if (best >= 0)
+        {
+            block = pool_block[best];
+            pool_block[best] = pool_block[--pool_blocks];
+            pool_total -= POOL_SIZE(block);
+            return (png_voidp) (block + POOL_HEADER);
+        }
+    }
+
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+    if (huge_pages != 0 && size >= HUGE_MIN_SIZE)
+    {
+        block = pngcrush_huge_malloc(size);
+        if (block != NULL)
+            return (png_voidp) (block + POOL_HEADER);
+    }
+#endif
+
+    block = (png_bytep) malloc(size + POOL_HEADER);
+    if (block == NULL)
+        return (png_voidp) (NULL);
+
+    POOL_SIZE(block) = size;
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+    POOL_HUGE(block) = 0;
+#endif
+    return (png_voidp) (block + POOL_HEADER);
+}
+
+void pngcrush_pool_free(png_structp png_ptr, png_voidp ptr)
+{
+    png_bytep block;
+    png_alloc_size_t size;
+
+    PNG_UNUSED(png_ptr)
+
+    if (ptr == NULL)
+        return;
+
+    block = (png_bytep) ptr - POOL_HEADER;
+    size = POOL_SIZE(block);
+
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+    if (POOL_HUGE(block) != 0)
+    {
+        HUGE_NEXT(block) = huge_free;
+        huge_free = block;
+        return;
+    }
+#endif
+
+    if (size >= POOL_MIN_SIZE && pool_blocks < POOL_SLOTS &&
+        size <= POOL_MAX_SIZE - pool_total)
+    {
+        pool_block[pool_blocks++] = block;
+        pool_total += size;
+    }
+
+    else
+        free(block);
+}
+
+/* Return the blocks in the pool to the system. */
+void pngcrush_pool_release(void)
+{
+    while (pool_blocks > 0)
+        free(pool_block[--pool_blocks]);
+
+    pool_total = 0;
+
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+    while (huge_arenas > 0)
+    {
+        huge_arenas--;
+        munmap(huge_arena[huge_arenas], huge_arena_size[huge_arenas]);
+    }
+
+    huge_free = NULL;
+    huge_arena_used = 0;
+#endif
+}
+
 #endif /* PNG_USER_MEM_SUPPORTED */
+
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+/* Choose the match cache for a strategy 4 trial with this filter: the one
+ * that already has its matches, or else the one whose trial came out larger.
+ * It is made big enough for data_bytes of image data (35 bytes each at most,
+ * with the copy of the data, plus 1K), up to the "-cache" limit.  Returns -1
+ * if there is none.
+ */
+static int pngcrush_match_cache(int filter, png_alloc_size_t data_bytes)
+{
+    png_alloc_size_t size = (png_alloc_size_t) match_cache_mbytes << 20;
+    int slot;
+
+    if (size == 0)
+        return -1;
+
+    if (data_bytes < (size - 1024) / 35)
+        size = 1024 + 35 * data_bytes;
+
+    if (match_cache_filter[0] == filter)
+        slot = 0;
+    else if (match_cache_filter[1] == filter)
+        slot = 1;
+    else
+    {
+        slot = match_cache_length[0] >= match_cache_length[1] ? 0 : 1;
+        match_cache_filter[slot] = filter;
+        match_cache_length[slot] = 0xffffffff;
+    }
+
+    if (match_cache_size[slot] < size)
+    {
+        /* The old contents, if any, are of no use to a longer image. */
+        free(match_cache[slot]);
+        match_cache[slot] = (png_bytep) malloc(size);
+        if (match_cache[slot] == NULL)
+        {
+            match_cache_size[slot] = 0;
+            match_cache_filter[slot] = -1;
+            return -1;
+        }
+        match_cache_size[slot] = size;
+
+        /* Not complete, see deflateMatchCache() */
+        memset(match_cache[slot], 0, 32);
+    }
+
+    return slot;
+}
+
+static void pngcrush_match_cache_release(void)
+{
+    int slot;
+
+    for (slot = 0; slot < 2; slot++)
+    {
+        free(match_cache[slot]);
+        match_cache[slot] = NULL;
+        match_cache_size[slot] = 0;
+    }
+}
+#endif /* PNG_WRITE_DEFLATE_CACHE_SUPPORTED */
 /* END of code to test memory allocation/deallocation */
 
 
+/* The zlib strategy of the "zs" value of a method */
+static int pngcrush_z_strategy(int zs_method)
+{
+    if (zs_method == 1)
+        return Z_FILTERED;
+    if (zs_method == 2)
+        return Z_HUFFMAN_ONLY;
+#ifdef Z_RLE
+    if (zs_method == 3)
+        return Z_RLE;
+#endif
+#ifdef Z_OPTIMAL
+    if (zs_method == 4)
+        return Z_OPTIMAL;
+#endif
+#ifdef Z_QUICK
+    if (zs_method == 5)
+        return Z_QUICK;
+    if (zs_method == 6)
+        return Z_MEDIUM;
+#endif
+    return Z_DEFAULT_STRATEGY;
+}
+
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+/* Choose the method of each band for the segmented trial, from the band
+ * sizes measured by the trials before it.  The bands all keep the filter of
+ * the smallest of those trials, so that they compress the same data as the
+ * trials they were measured in, and only take methods that deflateParams()
+ * can switch to: levels 0-9 without block splitting.  The settings of the
+ * first band go in fm[SEGMENTED_ROW] etc.  Returns 0 if there is nothing new to
+ * try: a band was not measured, or every band did best with the same level
+ * and strategy.
+ */
+static int pngcrush_choose_bands(int segmented, int *fm, int *lv, int *zs,
+    int *bs)
+{
+    int b, t, best_trial = -1, mixed = 0;
+
+    if (num_bands < 2)
+        return 0;
+
+    for (t = 1; t < segmented; t++)
+    {
+        if (idat_length[t] != 0xffffffff && band_bits[t][num_bands-1] != 0 &&
+            (best_trial < 0 || idat_length[t] < idat_length[best_trial]))
+            best_trial = t;
+    }
+
+    if (best_trial < 0)
+        return 0;
+
+    for (b = 0; b < num_bands; b++)
+    {
+        int choice = -1;
+
+        for (t = 1; t < segmented; t++)
+        {
+            if (idat_length[t] == 0xffffffff || band_bits[t][b] == 0 ||
+                fm[t] != fm[best_trial] || lv[t] > 9 || bs[t] != 0)
+                continue;
+
+            if (choice < 0 || band_bits[t][b] < band_bits[choice][b])
+                choice = t;
+        }
+
+        if (choice < 0)
+            return 0;
+
+        band_method[b] = choice;
+        band_level[b] = (png_byte) lv[choice];
+        band_strategy[b] = (png_byte) pngcrush_z_strategy(zs[choice]);
+        if (band_level[b] != band_level[0] ||
+            band_strategy[b] != band_strategy[0])
+            mixed = 1;
+    }
+
+    fm[SEGMENTED_ROW] = fm[best_trial];
+    lv[SEGMENTED_ROW] = lv[band_method[0]];
+    zs[SEGMENTED_ROW] = zs[band_method[0]];
+    bs[SEGMENTED_ROW] = 0;
+
+    return mixed;
+}
+#endif
+
+
 
 
 void pngcrush_pause(void)
@@ -3589,9 +4241,13 @@ int main(int argc, char *argv[])
     int methods_enabled = 0;
     int last_method = MAX_METHODS;
 
-    int fm[MAX_METHODSP1];
-    int lv[MAX_METHODSP1];
-    int zs[MAX_METHODSP1];
+    /* The methods, and in the last row the segmented trial, which gets its
+     * own so that it does not change a method that later files use.
+     */
+    int fm[MAX_METHODSP1 + 1];
+    int lv[MAX_METHODSP1 + 1];
+    int zs[MAX_METHODSP1 + 1];
+    int bs[MAX_METHODSP1 + 1];  /* 1: block splitting */
     int lev, strat, filt;
 
 #ifdef PNG_gAMA_SUPPORTED
@@ -3650,6 +4306,7 @@ int main(int argc, char *argv[])
     {
         try_method[i] = 1;  /* 1 means do not try this method */
         fm[i] = 6; lv[i] = 9; zs[i] = 1;  /* default:  method 136 */
+        bs[i] = 0;
     }
 
 
@@ -3746,10 +4403,57 @@ int main(int argc, char *argv[])
         }
     }
 
+#ifdef PNG_FILTER_SELECT_ZLIB
+    /*
+     * methods 177 through 196 (5*4 = 20), adaptive filtering with the
+     * filter selections 7-11, at level 9 or at the level that suits the
+     * strategy (as in methods 11-16 and 125-136)
+     */
+    for (filt = 7; filt < NUM_FILTERS; filt++)
+    {
+        for (strat = 0; strat < NUM_STRATEGIES; strat++)
+        {
+            fm[method] = filt;
+            lv[method] = strat == 2 ? 2 : strat == 3 ? 4 : 9;
+            zs[method] = strat;
+            method++;
+        }
+    }
+#endif
+
+#ifdef Z_OPTIMAL
+    /*
+     * methods 197 through 202 (6*1*1 = 6), optimal parse
+     *
+     * [strategy 4 (Z_OPTIMAL) uses the level only for the match search]
+     */
+    for (filt = 0; filt <= 5; filt++)
+    {
+        fm[method] = filt;
+        lv[method] = 9;
+        zs[method] = 4;
+        method++;
+    }
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+    /*
+     * methods 203 through 208 (6*1*1 = 6), as methods 113-118 but with
+     * the deflate blocks split where it makes the output smallest
+     */
+    for (filt = 0; filt <= 5; filt++)
+    {
+        fm[method] = filt;
+        lv[method] = 9;
+        zs[method] = 0;
+        bs[method] = 1;
+        method++;
+    }
+#endif
 
     num_methods = method;   /* GRR */
 
-    /* method 177 */
+    /* method 209 */
     fm[method] = 0; lv[method] = 0; zs[method] = 0;  /* copy_idat */
     method++;
 
@@ -3786,6 +4490,34 @@ int main(int argc, char *argv[])
         if (!strncmp(argv[i], "-bail", 5))
             bail=0;
 
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+        else if (!strncmp(argv[i], "-bands", 6))
+        {
+            names++;
+            BUMP_I;
+            compression_bands = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (compression_bands < 2)
+                compression_bands = 0;
+            if (compression_bands > PNG_COMPRESSION_BANDS_MAX)
+                compression_bands = PNG_COMPRESSION_BANDS_MAX;
+        }
+#endif
+
+#ifdef PNG_FILTER_SELECT_ZLIB
+        else if (!strncmp(argv[i], "-beam", 5))
+        {
+            names++;
+            BUMP_I;
+            filter_beam_width = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (filter_beam_width < 1)
+                filter_beam_width = 1;
+            if (filter_beam_width > PNG_FILTER_BEAM_WIDTH_MAX)
+                filter_beam_width = PNG_FILTER_BEAM_WIDTH_MAX;
+        }
+#endif
+
         else if (!strncmp(argv[i], "-bench", 6))
         {
             names++;
@@ -3822,16 +4554,30 @@ int main(int argc, char *argv[])
             for (method = 1; method < num_methods; method++)
                 try_method[method] = 0;
             if (brute_force_filter == 0)
-                for (filt = 0; filt < 6; filt++)
+                for (filt = 0; filt < NUM_FILTERS; filt++)
                     brute_force_filters[filt] = 0;
             if (brute_force_level == 0)
-                for (lev = 0; lev < 10; lev++)
+                for (lev = 0; lev < NUM_LEVELS; lev++)
                     brute_force_levels[lev] = 0;
             if (brute_force_strategy == 0)
-                for (strat = 0; strat < NUM_STRATEGIES; strat++)
+                for (strat = 0; strat < MAX_STRATEGIES; strat++)
                     brute_force_strategies[strat] = 0;
         }
 
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+        else if (!strncmp(argv[i], "-cache", 6))
+        {
+            names++;
+            BUMP_I;
+            match_cache_mbytes = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (match_cache_mbytes < 0)
+                match_cache_mbytes = 0;
+            if (match_cache_mbytes > 1024)
+                match_cache_mbytes = 1024;
+        }
+#endif
+
         else if (!strncmp(argv[i], "-check", 6))
         {
             check_crc = 1;
@@ -3894,7 +4640,8 @@ int main(int argc, char *argv[])
             BUMP_I;
             specified_filter = pngcrush_get_long;
             pngcrush_check_long;
-            if (specified_filter > 5 || specified_filter < 0)
+            if (specified_filter >= NUM_FILTERS || specified_filter == 6 ||
+                specified_filter < 0)
                 specified_filter = 5;
             names++;
             if (brute_force == 0)
@@ -3902,8 +4649,10 @@ int main(int argc, char *argv[])
             else
             {
                 if (brute_force_filter == 0)
-                  for (filt = 0; filt < 6; filt++)
+                  for (filt = 0; filt < NUM_FILTERS; filt++)
                     brute_force_filters[filt] = 1;
+                /* The speedy methods are not restricted by -f */
+                brute_force_filters[6] = 0;
                 brute_force_filters[specified_filter] = 0;
                 brute_force_filter++;
             }
@@ -3947,6 +4696,18 @@ int main(int argc, char *argv[])
         }
 #endif /* PNG_gAMA_SUPPORTED */
 
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+        else if (!strncmp(argv[i], "-hash", 5))
+        {
+            names++;
+            BUMP_I;
+            compression_hash_bytes = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (compression_hash_bytes != 4)
+                compression_hash_bytes = 3;
+        }
+#endif
+
         else if (!strncmp(argv[i], "-h", 3) || !strncmp(argv[i], "-hel", 4))
         {
             ++verbose;
@@ -3955,6 +4716,11 @@ int main(int argc, char *argv[])
             print_usage(0);   /* this exits */
         }
 
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+        else if (!strncmp(argv[i], "-huge", 5))
+            huge_pages = 1;
+#endif
+
         else if (!strncmp(argv[i], "-huffman", 8))
         {
             /* try all filters with huffman */
@@ -3965,6 +4731,18 @@ int main(int argc, char *argv[])
             }
         }
 
+#ifdef Z_OPTIMAL
+        else if (!strncmp(argv[i], "-iter", 5))
+        {
+            names++;
+            BUMP_I;
+            compression_iterations = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (compression_iterations < 1)
+                compression_iterations = 1;
+        }
+#endif
+
 #ifdef PNG_iCCP_SUPPORTED
         else if (!strncmp(argv[i], "-iccp", 5))
         {
@@ -4026,7 +4804,7 @@ int main(int argc, char *argv[])
             BUMP_I;
             specified_level = pngcrush_get_long;
             pngcrush_check_long;
-            if (specified_level > 9 || specified_level < 0)
+            if (specified_level >= NUM_LEVELS || specified_level < 0)
                 specified_level = 9;
             names++;
             if (brute_force == 0)
@@ -4034,7 +4812,7 @@ int main(int argc, char *argv[])
             else
             {
                 if (brute_force_level == 0)
-                    for (lev = 0; lev < 10; lev++)
+                    for (lev = 0; lev < NUM_LEVELS; lev++)
                         brute_force_levels[lev] = 1;
                 brute_force_levels[specified_level] = 0;
                 brute_force_level++;
@@ -4429,10 +5207,59 @@ int main(int argc, char *argv[])
             }
         }
 
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+        else if (!strncmp(argv[i], "-threads", 8))
+        {
+            names++;
+            BUMP_I;
+            compression_threads = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (compression_threads < 1)
+                compression_threads = 1;
+            if (compression_threads > PNG_COMPRESSION_THREADS_MAX)
+                compression_threads = PNG_COMPRESSION_THREADS_MAX;
+        }
+#endif
+
         else if (!strncmp(argv[i], "-time_stamp", 5) ||  /* legacy */
                  !strncmp(argv[i], "-newtimestamp", 5))
             new_time_stamp=1;
 
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+        else if (!strncmp(argv[i], "-tree", 5))
+            compression_tree = 1;
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+        else if (!strncmp(argv[i], "-tune", 5))
+        {
+            int specified_level, k;
+            names += 5;
+            BUMP_I;
+            specified_level = (int) pngcrush_get_long;
+            pngcrush_check_long;
+            if (specified_level < 10 || specified_level >= NUM_LEVELS)
+            {
+                fprintf(STDERR, "pngcrush: -tune level must be 10-%d\n",
+                    NUM_LEVELS - 1);
+                exit(1);
+            }
+            for (k = 0; k < 4; k++)
+            {
+                BUMP_I;
+                level_tune[specified_level - 10][k] = (int) pngcrush_get_long;
+                pngcrush_check_long;
+            }
+            if (level_tune[specified_level - 10][2] < 3)
+                level_tune[specified_level - 10][2] = 3;
+            for (k = 0; k < 3; k++)
+                if (level_tune[specified_level - 10][k] > 258)
+                    level_tune[specified_level - 10][k] = 258;
+            if (level_tune[specified_level - 10][3] < 1)
+                level_tune[specified_level - 10][3] = 1;
+        }
+#endif
+
 #ifdef PNG_tRNS_SUPPORTED
         else if (!strncmp(argv[i], "-trns_a", 7) ||
                  !strncmp(argv[i], "-tRNS_a", 7))
@@ -4528,7 +5355,7 @@ int main(int argc, char *argv[])
             BUMP_I;
             specified_strategy = pngcrush_get_long;
             pngcrush_check_long;
-            if (specified_strategy > 2 || specified_strategy < 0)
+            if (specified_strategy >= MAX_STRATEGIES || specified_strategy < 0)
                 specified_strategy = 0;
             names++;
             if (brute_force == 0)
@@ -4536,7 +5363,7 @@ int main(int argc, char *argv[])
             else
             {
                 if (brute_force_strategy == 0)
-                    for (strat = 0; strat < 2; strat++)
+                    for (strat = 0; strat < MAX_STRATEGIES; strat++)
                         brute_force_strategies[strat] = 1;
                 brute_force_strategies[specified_strategy] = 0;
                 brute_force_strategy++;
@@ -4937,6 +5764,10 @@ int main(int argc, char *argv[])
 
         best_of_three = 1;
         pngcrush_best_byte_count=0xffffffff;
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+        match_cache_filter[0] = match_cache_filter[1] = -1;
+        match_cache_length[0] = match_cache_length[1] = 0xffffffff;
+#endif
 
         if (blacken == 1 || make_gray == 1 || make_opaque == 1 ||
             reduce_palette == 1)
@@ -5040,21 +5871,21 @@ int main(int argc, char *argv[])
              try_method[method]=1;
              if (brute_force_level)
              {
-                for (option = 0; option < 10; option++)
+                for (option = 0; option < NUM_LEVELS; option++)
                    if (option == lv[method])
                       try_method[method]=brute_force_levels[option];
              }
 
              if ((try_method[method] == 0) && brute_force_filter)
              {
-                for (option = 0; option < 6; option++)
+                for (option = 0; option < NUM_FILTERS; option++)
                    if (option == fm[method])
                       try_method[method]=brute_force_filters[option];
              }
 
              if ((try_method[method] == 0) && brute_force_strategy)
              {
-                for (option = 0; option < NUM_STRATEGIES; option++)
+                for (option = 0; option < MAX_STRATEGIES; option++)
                    if (option == zs[method])
                       try_method[method]=brute_force_strategies[option];
              }
@@ -5069,7 +5900,8 @@ int main(int argc, char *argv[])
              for (method = 1; method < num_methods; method++)
              {
                if (try_method[method] == 0 && (fm[method] == 3 ||
-                   fm[method] == 4 || fm[method] == 5))
+                   fm[method] == 4 || fm[method] == 5 || fm[method] >= 7 ||
+                   zs[method] == 4 || bs[method] != 0))
                      try_method[method] = 1;
              }
            }
@@ -5111,6 +5943,17 @@ int main(int argc, char *argv[])
         if (methods_enabled > 1)
            last_method++;
 
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+        /* The segmented trial goes just before the last one. */
+        segmented_trial = -1;
+        if (compression_bands > 1 && methods_enabled > 1 && nosave == 0 &&
+            last_method + 1 < MAX_TRIALS)
+        {
+           segmented_trial = last_method;
+           last_method++;
+        }
+#endif
+
         P1("   pngcrush: methods     = %d\n",methods_enabled);
         P1("   pngcrush: last_method = %d\n",last_method);
         
@@ -5136,7 +5979,7 @@ int main(int argc, char *argv[])
         ////////////////                                   ////////////////////
         //////////////////////////////////////////////////////////////////// */
 
-        /* MAX_METHODS is 177 */
+        /* MAX_METHODS is 209 */
         P1("\n\nENTERING MAIN LOOP OVER %d METHODS\n", MAX_METHODS);
         for (trial = 0; trial <= last_method; trial++)
         {
@@ -5147,6 +5990,9 @@ int main(int argc, char *argv[])
             fprintf(STDERR, "pngcrush: trial = %d\n",trial);
 
             pngcrush_write_byte_count=0;
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+            match_cache_slot = -1;
+#endif
 #ifdef PNGCRUSH_H
 # if ZLIB_VERNUM > 0x1240
             if (last_trial == 0)
@@ -5246,20 +6092,44 @@ int main(int argc, char *argv[])
                     break;
                 }
 
-                filter_type = fm[best];
-                zlib_level = lv[best];
-                if (zs[best] == 1)
-                    z_strategy = Z_FILTERED;
-                else if (zs[best] == 2)
-                    z_strategy = Z_HUFFMAN_ONLY;
-#ifdef Z_RLE
-                else if (zs[best] == 3)
-                    z_strategy = Z_RLE;
+                {
+                    int row = best;
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+                    if (best == segmented_trial)
+                        row = SEGMENTED_ROW;
+#endif
+                    filter_type = fm[row];
+                    zlib_level = lv[row];
+                    z_strategy = pngcrush_z_strategy(zs[row]);
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+                    block_split = bs[row];
 #endif
-                else /* if (zs[best] == 0) */
-                    z_strategy = Z_DEFAULT_STRATEGY;
+                }
             }
 
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+            else if (trial == segmented_trial)
+            {
+                if (pngcrush_choose_bands(trial, fm, lv, zs, bs) == 0)
+                {
+                    P2("skipping the segmented trial\n");
+                    continue;
+                }
+
+                filter_type = fm[SEGMENTED_ROW];
+                zlib_level = lv[SEGMENTED_ROW];
+                z_strategy = pngcrush_z_strategy(zs[SEGMENTED_ROW]);
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+                block_split = 0;
+#endif
+                final_method = trial;
+                P2("\n\n------------------------------------------------\n"
+                   "Begin segmented trial %d, filter %d, %d bands\n",
+                   trial, filter_type, num_bands);
+            }
+#endif
+
             else /* Trial < last_method */
             {
                 if (trial > 2 && trial < 5 && idat_length[trial - 1]
@@ -5296,16 +6166,10 @@ int main(int argc, char *argv[])
                 }
                 filter_type = fm[trial];
                 zlib_level = lv[trial];
-                if (zs[trial] == 1)
-                    z_strategy = Z_FILTERED;
-                else if (zs[trial] == 2)
-                    z_strategy = Z_HUFFMAN_ONLY;
-#ifdef Z_RLE
-                else if (zs[trial] == 3)
-                    z_strategy = Z_RLE;
+                z_strategy = pngcrush_z_strategy(zs[trial]);
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+                block_split = bs[trial];
 #endif
-                else /* if (zs[trial] == 0) */
-                    z_strategy = Z_DEFAULT_STRATEGY;
                 final_method = trial;
                 if (!nosave)
                 {
@@ -5385,11 +6249,19 @@ int main(int argc, char *argv[])
                      (png_malloc_ptr) pngcrush_debug_malloc,
                      (png_free_ptr) pngcrush_debug_free);
                 else
-#endif /* PNG_USER_MEM_SUPPORTED */
+                   read_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+                     (png_voidp) NULL,
+                     (png_error_ptr) pngcrush_cexcept_error,
+                     (png_error_ptr) pngcrush_warning,
+                     (png_voidp) NULL,
+                     (png_malloc_ptr) pngcrush_pool_malloc,
+                     (png_free_ptr) pngcrush_pool_free);
+#else
                    read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
                      (png_voidp) NULL,
                      (png_error_ptr) pngcrush_cexcept_error,
                      (png_error_ptr) pngcrush_warning);
+#endif /* PNG_USER_MEM_SUPPORTED */
                 if (read_ptr == NULL)
                     Throw "pngcrush could not create read_ptr";
 
@@ -5467,12 +6339,21 @@ int main(int argc, char *argv[])
                          (png_malloc_ptr) pngcrush_debug_malloc,
                          (png_free_ptr) pngcrush_debug_free);
                     else
-#endif
+                       write_ptr = png_create_write_struct_2(
+                         PNG_LIBPNG_VER_STRING,
+                         (png_voidp) NULL,
+                         (png_error_ptr) pngcrush_cexcept_error,
+                         (png_error_ptr) NULL,
+                         (png_voidp) NULL,
+                         (png_malloc_ptr) pngcrush_pool_malloc,
+                         (png_free_ptr) pngcrush_pool_free);
+#else
                        write_ptr = png_create_write_struct(
                          PNG_LIBPNG_VER_STRING,
                          (png_voidp) NULL,
                          (png_error_ptr) pngcrush_cexcept_error,
                          (png_error_ptr) NULL);
+#endif
                     if (write_ptr == NULL)
                         Throw "pngcrush could not create write_ptr";
 
@@ -5545,6 +6426,16 @@ int main(int argc, char *argv[])
 # endif
 #endif
 
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+                if (last_trial == 0)
+                {
+                    /* Only the size of a trial is used, so zlib need not
+                     * produce the compressed data, nor libpng the CRCs.
+                     */
+                    png_set_write_size_only(write_ptr, 1);
+                }
+#endif
+
 #ifdef PNG_READ_CHECK_FOR_INVALID_INDEX_SUPPORTED
                 /* Only run this test (new in libpng-1.5.10) during the
                  * 0th and last trial
@@ -5565,6 +6456,19 @@ int main(int argc, char *argv[])
                 }
 #endif
 
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+            if (last_trial == 0 && trial > 0)
+            {
+                /* The ancillary chunks are only copied in the last trial,
+                 * and the other trials only count the critical chunks, so
+                 * do not read (and decompress) the large ones meanwhile.
+                 */
+                png_set_keep_unknown_chunks(read_ptr, PNG_HANDLE_CHUNK_NEVER,
+                    (png_const_bytep) "iCCP\0" "iTXt\0" "sPLT\0"
+                    "tEXt\0" "zTXt\0" "eXIf", 6);
+            }
+#endif
+
             if (last_trial == 1)
             {
 
@@ -7044,6 +7948,21 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
                     else if (filter_type == 6) /* speedy */
                             png_set_filter(write_ptr, 0, PNG_FILTER_NONE |
                                PNG_FILTER_SUB | PNG_FILTER_UP);
+#ifdef PNG_FILTER_SELECT_ZLIB
+                    else if (filter_type >= 7 && filter_type < NUM_FILTERS)
+                    {
+                            /* 7: zlib predictive, 8: entropy,
+                             * 9: distinct bytes, 10: running histogram,
+                             * 11: beam search
+                             */
+                            png_set_filter(write_ptr, 0, PNG_ALL_FILTERS);
+                            png_set_filter_selection(write_ptr,
+                               filter_type - 7 + PNG_FILTER_SELECT_ZLIB);
+                            if (filter_type == 11)
+                                png_set_filter_beam_width(write_ptr,
+                                   filter_beam_width);
+                    }
+#endif
                     else
                         png_set_filter(write_ptr, 0, PNG_FILTER_NONE);
 
@@ -7109,6 +8028,28 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
                         int channels = 0;
                         png_set_compression_strategy(write_ptr,
                                                      z_strategy);
+#ifdef Z_OPTIMAL
+                        png_set_compression_iterations(write_ptr,
+                                                       compression_iterations);
+#endif
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+                        png_set_compression_hash(write_ptr,
+                                                 compression_hash_bytes);
+#endif
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+                        png_set_compression_split(write_ptr, block_split);
+#endif
+#ifdef PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED
+                        png_set_compression_huffman(write_ptr, 1);
+#endif
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+                        png_set_compression_tree(write_ptr,
+                                                 compression_tree);
+#endif
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+                        png_set_compression_threads(write_ptr,
+                                                    compression_threads);
+#endif
                         png_set_compression_mem_level(write_ptr,
                                                       compression_mem_level);
 
@@ -7231,10 +8172,80 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
                                     "   Compression window for output= %d\n",
                                     1 << compression_window);
 
+#if defined(PNG_WRITE_DEFLATE_CACHE_SUPPORTED) && defined(Z_OPTIMAL)
+                        match_cache_slot = -1;
+                        if (z_strategy == Z_OPTIMAL
+# ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+                            && compression_threads <= 1
+# endif
+                            )
+                           match_cache_slot =
+                               pngcrush_match_cache(filter_type, max_bytes);
+                        if (match_cache_slot >= 0)
+                           png_set_compression_match_cache(write_ptr,
+                               match_cache[match_cache_slot],
+                               match_cache_size[match_cache_slot]);
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+                        num_bands = 0;
+# ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+                        /* libpng does not use bands when it compresses on
+                         * several threads, so there would be nothing to
+                         * measure, and no segmented trial.  max_bytes is
+                         * only exact for small images, so the size is
+                         * worked out here as png_image_size() does.
+                         */
+                        if (compression_bands > 1 && compression_threads > 1
+                            && (PNGCRUSH_ROWBYTES(channels * output_bit_depth,
+                            width) + 1) * (png_alloc_size_t) height / 2 >=
+                            PNG_COMPRESSION_THREADS_SEGMENT)
+                        {
+                           if (last_trial && verbose > 0)
+                              fprintf(STDERR, "   Not using \"-bands\" "
+                                  "because of \"-threads\"\n");
+                        }
+                        else
+# endif
+                        if (compression_bands > 1 && trial > 0 &&
+                            interlace_method == 0)
+                        {
+                           png_uint_32 band_row[PNG_COMPRESSION_BANDS_MAX];
+                           int b;
+
+                           num_bands = height < (png_uint_32)
+                               compression_bands ? (int) height :
+                               compression_bands;
+                           for (b = 0; b < num_bands; b++)
+                              band_row[b] = height / num_bands * b +
+                                  height % num_bands * b / num_bands;
+
+                           if (segmented_trial > 0 &&
+                               (trial == segmented_trial ||
+                               (last_trial && best == segmented_trial)))
+                              png_set_compression_bands(write_ptr, num_bands,
+                                  band_row, band_level, band_strategy);
+                           else
+                              png_set_compression_bands(write_ptr, num_bands,
+                                  band_row, NULL, NULL);
+                        }
+#endif
+
                         png_set_compression_window_bits(write_ptr,
                                                         compression_window);
                       }
 
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+                    if (zlib_level > 9)
+                    {
+                        int *tune = level_tune[zlib_level - 10];
+
+                        png_set_compression_level(write_ptr, 9);
+                        png_set_compression_tune(write_ptr, tune[0], tune[1],
+                                                 tune[2], tune[3]);
+                    }
+                    else
+#endif
                     png_set_compression_level(write_ptr, zlib_level);
                     } /* copy_idat */
 
@@ -7770,6 +8781,11 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
                         png_write_chunk(write_ptr, (png_bytep) png_MEND,
                                         NULL, (png_size_t) 0);
                     }
+#endif
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+                    for (i = 0; i < PNG_COMPRESSION_BANDS_MAX; i++)
+                        band_bits[trial][i] =
+                            png_get_compression_band_bits(write_ptr, i);
 #endif
                     png_destroy_info_struct(write_ptr,
                                             &write_end_info_ptr);
@@ -7827,25 +8843,54 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
 
             idat_length[trial] = pngcrush_write_byte_count;
 
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+            if (match_cache_slot >= 0 &&
+                idat_length[trial] < match_cache_length[match_cache_slot])
+                match_cache_length[match_cache_slot] = idat_length[trial];
+#endif
+
             if (pngcrush_write_byte_count < pngcrush_best_byte_count)
                pngcrush_best_byte_count = pngcrush_write_byte_count;
 
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+            if (verbose > 0 && trial == segmented_trial)
+            {
+                int b, bailed = bail == 0 &&
+                    pngcrush_write_byte_count > pngcrush_best_byte_count;
+
+                fprintf(STDERR,
+                  "   Critical chunk length, segmented"
+                  " (ws %d fm %d, %d bands) %c%10lu\n",
+                  compression_window, filter_type, num_bands,
+                  bailed ? '>' : '=', (unsigned long)(bailed ?
+                  pngcrush_best_byte_count : idat_length[trial]));
+                for (b = 0; b < num_bands; b++)
+                   fprintf(STDERR,
+                     "     band %d: method %3d (zl %d zs %d)\n",
+                     b, band_method[b], lv[band_method[b]],
+                     zs[band_method[b]]);
+                fflush(STDERR);
+            }
+            else
+#endif
             if (verbose > 0 && trial != last_method)
             {
                 if (bail == 0 &&
                     pngcrush_write_byte_count > pngcrush_best_byte_count)
                    fprintf(STDERR,
                      "   Critical chunk length, method %3d"
-                     " (ws %d fm %d zl %d zs %d) >%10lu\n",
+                     " (ws %d fm %d zl %d zs %d%s) >%10lu\n",
                      trial, compression_window,
                      filter_type, zlib_level, z_strategy,
+                     SPLIT_STRING(block_split),
                      (unsigned long)pngcrush_best_byte_count);
                 else
                    fprintf(STDERR,
                      "   Critical chunk length, method %3d"
-                     " (ws %d fm %d zl %d zs %d) =%10lu\n",
+                     " (ws %d fm %d zl %d zs %d%s) =%10lu\n",
                      trial, compression_window,
                      filter_type, zlib_level, z_strategy,
+                     SPLIT_STRING(block_split),
                      (unsigned long)idat_length[trial]);
                 fflush(STDERR);
             }
@@ -7926,11 +8971,21 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
                 else if (!image_is_immutable)
 #endif
                 {
-                fprintf(STDERR,
-                  "   Best pngcrush method        = %3d "
-                  "(ws %d fm %d zl %d zs %d) =%10lu\n",
-                  best, compression_window, fm[best], lv[best], zs[best],
-                  (unsigned long)idat_length[best]);
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+                if (best == segmented_trial)
+                    fprintf(STDERR,
+                      "   Best pngcrush method        = segmented "
+                      "(ws %d fm %d, %d bands) =%10lu\n",
+                      compression_window, fm[SEGMENTED_ROW], num_bands,
+                      (unsigned long)idat_length[best]);
+                else
+#endif
+                    fprintf(STDERR,
+                      "   Best pngcrush method        = %3d "
+                      "(ws %d fm %d zl %d zs %d%s) =%10lu\n",
+                      best, compression_window, fm[best], lv[best],
+                      zs[best], SPLIT_STRING(bs[best]),
+                      (unsigned long)idat_length[best]);
                 }
 
                 if (verbose > 0)
@@ -8098,6 +9153,13 @@ defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
 #endif
     }
 
+#ifdef PNG_USER_MEM_SUPPORTED
+    pngcrush_pool_release();
+#endif
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+    pngcrush_match_cache_release();
+#endif
+
     if (pngcrush_must_exit)
        exit(0);
     return 0;  /* just in case */
@@ -8116,10 +9178,19 @@ png_uint_32 measure_idats(FILE * fp_in)
     P1( "Allocating read structure\n");
 /* OK to ignore any warning about the address of exception__prev in "Try" */
     Try {
+#ifdef PNG_USER_MEM_SUPPORTED
+        read_ptr =
+            png_create_read_struct_2(PNG_LIBPNG_VER_STRING, (png_voidp) NULL,
+                                     (png_error_ptr) pngcrush_cexcept_error,
+                                     (png_error_ptr) NULL, (png_voidp) NULL,
+                                     (png_malloc_ptr) pngcrush_pool_malloc,
+                                     (png_free_ptr) pngcrush_pool_free);
+#else
         read_ptr =
             png_create_read_struct(PNG_LIBPNG_VER_STRING, (png_voidp) NULL,
                                    (png_error_ptr) pngcrush_cexcept_error,
                                    (png_error_ptr) NULL);
+#endif
         P1( "Allocating read_info,  end_info structures\n");
         read_info_ptr = png_create_info_struct(read_ptr);
         end_info_ptr = png_create_info_struct(read_ptr);
@@ -8790,6 +9861,10 @@ void print_version_info(void)
 #if PNG_INTEL_SSE_OPT > 0
     fprintf(STDERR," | using INTEL_SSE optimizations.\n");
 #endif
+#if defined(PNGCRUSH_USE_INTEL_SSE) && PNG_INTEL_AVX2_OPT > 0
+    if (png_have_avx2() != 0)
+       fprintf(STDERR," | using INTEL_AVX2 optimizations.\n");
+#endif
 
     fprintf(STDERR, "\n");
 }
@@ -8851,6 +9926,34 @@ struct options_help pngcrush_options[] = {
     {2, "               option to prevent that."},
     {2, ""},
 
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+    {0, "        -bands n [2-16] (try a level and strategy per band of rows)"},
+    {2, ""},
+    {2, "               Each trial ends a deflate block after every 1/n of"},
+    {2, "               the rows and measures the bands.  One more trial"},
+    {2, "               then compresses each band with the level and"},
+    {2, "               strategy that did best on it, in the same zlib"},
+    {2, "               stream, which helps images that are part flat and"},
+    {2, "               part photographic.  The bands keep the filter of"},
+    {2, "               the best trial.  Not used for interlaced output or"},
+    {2, "               for images that \"-threads\" compresses on several"},
+    {2, "               threads (2 MBytes of data or more).  The extra"},
+    {2, "               blocks make the output differ slightly from that"},
+    {2, "               without \"-bands\"."},
+    {2, "               A trial that bails out is only measured up to that"},
+    {2, "               point (see \"-bail\")."},
+    {2, ""},
+#endif
+
+#ifdef PNG_FILTER_SELECT_ZLIB
+    {0, "         -beam width [1-64] (for filter type 11, default 4)"},
+    {2, ""},
+    {2, "               Number of filter sequences kept by the beam search"},
+    {2, "               of methods 193-196 (\"-f 11\").  The time taken is"},
+    {2, "               roughly proportional to the width."},
+    {2, ""},
+#endif
+
     {0, "      -blacken (zero samples underlying fully-transparent pixels)"},
     {2, ""},
     {2, "               Changing the color samples to zero can improve the"},
@@ -8858,10 +9961,24 @@ struct options_help pngcrush_options[] = {
     {2, "               blackening is off by default."},
     {2, ""},
 
-#ifdef Z_RLE
-    {0, "        -brute (use brute-force: try 176 different methods)"},
+#ifdef PNG_FILTER_SELECT_ZLIB
+#  if defined(Z_OPTIMAL) && defined(PNG_WRITE_DEFLATE_SPLIT_SUPPORTED)
+    {0, "        -brute (use brute-force: try 208 different methods)"},
+#  elif defined(Z_OPTIMAL)
+    {0, "        -brute (use brute-force: try 202 different methods)"},
+#  else
+#  ifdef Z_RLE
+    {0, "        -brute (use brute-force: try 196 different methods)"},
+#  else
+    {0, "        -brute (use brute-force: try 181 different methods)"},
+#  endif
+#  endif
 #else
+#  ifdef Z_RLE
+    {0, "        -brute (use brute-force: try 176 different methods)"},
+#  else
     {0, "        -brute (use brute-force: try 166 different methods)"},
+#  endif
 #endif
     {2, ""},
     {2, "               Very time-consuming and generally not worthwhile."},
@@ -8884,6 +10001,19 @@ struct options_help pngcrush_options[] = {
     {2, "               Default is to use same color type as the input file."},
     {2, ""},
 
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+    {0, "        -cache n (MBytes kept of each strategy 4 search, default 32)"},
+    {2, ""},
+    {2, "               The matches found by strategy 4 (\"-z 4\") for the"},
+    {2, "               two best filters are kept, so that the last trial"},
+    {2, "               does not have to search again if it uses one of"},
+    {2, "               them.  They take up to 33 bytes per byte of image"},
+    {2, "               data, usually much less, and are not kept if they do"},
+    {2, "               not fit in n MBytes.  \"-cache 0\" turns this off."},
+    {2, "               The output is the same either way."},
+    {2, ""},
+#endif
+
     {0, "        -check (check CRC and ADLER32 checksums)"},
     {2, ""},
     {2, "               Use \"-nocheck\" (default) to skip checking them"},
@@ -8909,11 +10039,25 @@ struct options_help pngcrush_options[] = {
     {2, "               and -e _pc.png means *.png => *_pc.png"},
     {2, ""},
 
+#ifdef PNG_FILTER_SELECT_ZLIB
+    {0, "            -f user_filter [0-5, 7-11] for specified method"},
+#else
     {0, "            -f user_filter [0-5] for specified method"},
+#endif
     {2, ""},
     {2, "               filter to use with the method specified in the"},
     {2, "               preceding '-m method' or '-brute_force' argument."},
     {2, "               0: none; 1-4: use specified filter; 5: adaptive."},
+#ifdef PNG_FILTER_SELECT_ZLIB
+    {2, "               7: adaptive, choosing the filter for each row by"},
+    {2, "               test-compressing it with each filter (slow)."},
+    {2, "               8-10: adaptive, choosing the filter that gives the"},
+    {2, "               filtered row with the lowest entropy (8), the fewest"},
+    {2, "               different byte values (9), or the lowest cost"},
+    {2, "               using the byte counts of the previous rows (10)."},
+    {2, "               11: like 7, but searching for the best sequence of"},
+    {2, "               filters for the whole image (very slow, see -beam)."},
+#endif
     {2, ""},
 
     {0, FAKE_PAUSE_STRING},
@@ -8941,6 +10085,27 @@ struct options_help pngcrush_options[] = {
 
     {0, FAKE_PAUSE_STRING},
 
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+    {0, "         -hash bytes [3 or 4, default 3]"},
+    {2, ""},
+    {2, "               Number of bytes zlib hashes to find matches.  4 is"},
+    {2, "               faster, especially on images with long runs, but"},
+    {2, "               finds 3-byte matches only by chance, so the output"},
+    {2, "               differs and is sometimes larger."},
+    {2, ""},
+#endif
+
+#ifdef PNGCRUSH_HUGE_PAGES_SUPPORTED
+    {0, "         -huge (keep the zlib buffers in huge pages)"},
+    {2, ""},
+    {2, "               Allocates the zlib windows and hash tables from"},
+    {2, "               memory that the system is asked to back with 2-MByte"},
+    {2, "               transparent huge pages.  That may reduce TLB misses"},
+    {2, "               with large windows; no speedup has been measured."},
+    {2, "               The output is the same."},
+    {2, ""},
+#endif
+
     {0, "      -huffman (use only zlib strategy 2, Huffman-only)"},
     {2, ""},
     {2, "               Fast, but almost never very effective except for"},
@@ -8954,6 +10119,15 @@ struct options_help pngcrush_options[] = {
     {2, ""},
 #endif
 
+#ifdef Z_OPTIMAL
+    {0, "         -iter n (passes of zlib strategy 4, default 10)"},
+    {2, ""},
+    {2, "               Number of times the optimal parse of methods 197-202"},
+    {2, "               (\"-z 4\") is repeated with the symbol costs of the"},
+    {2, "               last one.  It stops early when that does not help."},
+    {2, ""},
+#endif
+
 #ifdef PNG_iTXt_SUPPORTED
     {0, "         -itxt b[efore_IDAT]|a[fter_IDAT] \"keyword\""},
     {2, "               \"language_code\" \"translated_keyword\" \"text\""},
@@ -8971,11 +10145,20 @@ struct options_help pngcrush_options[] = {
     {2, ""},
 
 
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+    {0, "            -l zlib_compression_level [0-12] for specified method"},
+#else
     {0, "            -l zlib_compression_level [0-9] for specified method"},
+#endif
     {2, ""},
     {2, "               zlib compression level to use with method specified"},
     {2, "               with the preceding '-m method' or '-brute_force'"},
     {2, "               argument."},
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+    {2, "               Levels 10-12 are level 9 with longer hash chains"},
+    {2, "               (see -tune).  They are slower, and seldom save more"},
+    {2, "               than a few bytes."},
+#endif
     {2, ""},
 
 #ifdef PNGCRUSH_LOCO
@@ -9001,6 +10184,17 @@ struct options_help pngcrush_options[] = {
     {2, "               intensive.  Methods 1, 4, and 7 use no filtering;"},
     {2, "               methods 11 and up use a specified filter,"},
     {2, "               compression level, and strategy."},
+#ifdef PNG_FILTER_SELECT_ZLIB
+    {2, "               Methods 177-196 use filters 7-11 (see -f)."},
+#endif
+#ifdef Z_OPTIMAL
+    {2, "               Methods 197-202 use zlib strategy 4 (see -z)."},
+#endif
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+    {2, "               Methods 203-208 are methods 113-118 with the"},
+    {2, "               deflate blocks split where that makes the output"},
+    {2, "               smaller."},
+#endif
     {2, ""},
     {2, FAKE_PAUSE_STRING},
 
@@ -9184,6 +10378,36 @@ struct options_help pngcrush_options[] = {
     {2, "               ten tEXt, iTXt, or zTXt chunks per pngcrush run."},
     {2, ""},
 
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+    {0, "      -threads n (number of threads to compress with, default 1)"},
+    {2, ""},
+    {2, "               Images with more than 2 MBytes of pixel data are"},
+    {2, "               compressed in 1-MByte pieces, in parallel.  The"},
+    {2, "               output differs slightly from that of one thread but"},
+    {2, "               is the same for any number of threads."},
+    {2, ""},
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+    {0, "         -tree (find matches with binary trees for zlib strategy 4)"},
+    {2, ""},
+    {2, "               Keeps the strings in binary trees instead of hash"},
+    {2, "               chains with strategy 4 (methods 197-202), which is"},
+    {2, "               faster on images with long runs or repeats.  The"},
+    {2, "               output may differ, and is about the same size."},
+    {2, ""},
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+    {0, "         -tune level good_length max_lazy nice_length max_chain"},
+    {2, ""},
+    {2, "               Match search parameters of level 10, 11 or 12 (see"},
+    {2, "               deflateTune() in zlib.h).  The defaults are"},
+    {2, "               64 258 258 8192, 128 258 258 16384 and"},
+    {2, "               258 258 258 32768; level 9 is 32 258 258 4096."},
+    {2, ""},
+#endif
+
 #ifdef PNG_tRNS_SUPPORTED
     {0, "   -trns_array n trns[0] trns[1] .. trns[n-1]"},
     {2, ""},
@@ -9224,14 +10448,29 @@ struct options_help pngcrush_options[] = {
     {2, "               the uncompressed file is smaller than 16k."},
     {2, ""},
 
+#if defined(Z_QUICK)
+    {0, "            -z zlib_strategy [0 through 6] for specified method"},
+#elif defined(Z_OPTIMAL)
+    {0, "            -z zlib_strategy [0 through 4] for specified method"},
+#else
 #ifdef Z_RLE
     {0, "            -z zlib_strategy [0, 1, 2, or 3] for specified method"},
 #else
     {0, "            -z zlib_strategy [0, 1, or 2] for specified method"},
+#endif
 #endif
     {2, ""},
     {2, "               zlib compression strategy to use with the preceding"},
     {2, "               '-m method' argument."},
+#ifdef Z_OPTIMAL
+    {2, "               Strategy 4 is the optimal parse (see -iter)."},
+#endif
+#ifdef Z_QUICK
+    {2, "               Strategy 5 (quick) compares each string only with"},
+    {2, "               the last one with the same hash, and strategy 6"},
+    {2, "               (medium) does not hash the strings inside long"},
+    {2, "               matches."},
+#endif
     {2, ""},
 
     {0, "         -zmem zlib_compression_mem_level [1-9, default 9]"},
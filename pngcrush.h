@@ -5,7 +5,7 @@
  * libpng license (see LICENSE, in pngcrush.c).
  */
 
-/* Special defines for pngcrush version 1.8.14 */
+/* Special defines for pngcrush version 1.8.15 */
 
 #ifndef PNGCRUSH_H
 #define PNGCRUSH_H
@@ -50,6 +50,67 @@
 #undef PNG_WRITE_SWAP_SUPPORTED
 #undef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
 
+/* Added to this copy of libpng for pngcrush: png_set_filter_selection() */
+#define PNG_WRITE_FILTER_SELECTION_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_iterations()
+ * for the Z_OPTIMAL strategy of the bundled zlib
+ */
+#define PNG_WRITE_OPTIMAL_DEFLATE_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_hash() for
+ * the four-byte hash of the bundled zlib
+ */
+#define PNG_WRITE_DEFLATE_HASH_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_split() for
+ * the block splitting of the bundled zlib
+ */
+#define PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_huffman()
+ * for the package-merge code lengths of the bundled zlib
+ */
+#define PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_tree() for
+ * the binary-tree match finder of the bundled zlib
+ */
+#define PNG_WRITE_DEFLATE_TREE_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_tune() to
+ * set the deflateTune() parameters of the IDAT stream
+ */
+#define PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_write_size_only() to
+ * measure trial output without producing it
+ */
+#define PNG_WRITE_SIZE_ONLY_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: IDAT chunks are put together in
+ * the compression buffer and written with a single call
+ */
+#define PNG_WRITE_IDAT_IN_PLACE_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_match_cache()
+ * to keep the Z_OPTIMAL matches for a later trial
+ */
+#define PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_bands() to
+ * give horizontal bands of the IDAT data their own level and strategy
+ */
+#define PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+
+/* Added to this copy of libpng for pngcrush: png_set_compression_threads()
+ * to compress large IDAT streams on several threads.  It needs POSIX
+ * threads, so it is only built when PNGCRUSH_USE_PTHREADS is defined.
+ */
+#ifdef PNGCRUSH_USE_PTHREADS
+#  define PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+#endif
+
 #undef PNG_SIMPLIFIED_READ_AFIRST_SUPPORTED
 #undef PNG_SIMPLIFIED_READ_BGR_SUPPORTED
 #undef PNG_SIMPLIFIED_READ_SUPPORTED
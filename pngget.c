@@ -1187,6 +1187,20 @@ png_get_compression_buffer_size(png_const_structrp png_ptr)
 #endif
 }
 
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+png_alloc_size_t PNGAPI
+png_get_compression_band_bits(png_const_structrp png_ptr, int band)
+{
+   if (png_ptr == NULL || band < 0 || band >= png_ptr->zlib_bands ||
+       png_ptr->zlib_band_end[band] == 0)
+      return 0;
+
+   /* The ends are where each band stopped in the stream */
+   return png_ptr->zlib_band_end[band] -
+       (band > 0 ? png_ptr->zlib_band_end[band-1] : 0);
+}
+#endif
+
 #ifdef PNG_SET_USER_LIMITS_SUPPORTED
 /* These functions were added to libpng 1.2.6 and were enabled
  * by default in libpng-1.4.0 */
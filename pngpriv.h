@@ -236,6 +236,24 @@
 #   endif
 #endif
 
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+#   ifndef PNG_INTEL_AVX2_OPT
+      /* The AVX2 filter functions are compiled with a per-function target
+       * attribute and are selected by a run-time CPU check, so they do not
+       * depend on the -m options used for the rest of libpng.
+       */
+#      if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || \
+       (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#         define PNG_INTEL_AVX2_OPT 1
+#      else
+#         define PNG_INTEL_AVX2_OPT 0
+#      endif
+#   endif
+#else
+#   undef PNG_INTEL_AVX2_OPT
+#   define PNG_INTEL_AVX2_OPT 0
+#endif
+
 #if PNG_MIPS_MSA_OPT > 0
 #  define PNG_FILTER_OPTIMIZATIONS png_init_filter_functions_msa
 #  ifndef PNG_MIPS_MSA_IMPLEMENTATION
@@ -974,6 +992,17 @@ PNG_INTERNAL_FUNCTION(void,png_free_buffer_list,(png_structrp png_ptr,
    /* Free the buffer list used by the compressed write code. */
 #endif
 
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_beam_destroy,(png_structrp png_ptr),PNG_EMPTY);
+   /* Free the working memory of the beam filter search, if any. */
+#endif
+
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_zparallel_destroy,(png_structrp png_ptr),
+   PNG_EMPTY);
+   /* Free the state of a multi-threaded IDAT compression, if any. */
+#endif
+
 #if defined(PNG_FLOATING_POINT_SUPPORTED) && \
    !defined(PNG_FIXED_POINT_MACRO_SUPPORTED) && \
    (defined(PNG_gAMA_SUPPORTED) || defined(PNG_cHRM_SUPPORTED) || \
@@ -1353,6 +1382,52 @@ PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth3_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth4_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub1_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub2_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub6_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub8_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg2_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg6_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg8_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth2_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth6_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth8_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+/* Write-side filters for png_write_find_filter(); these return the sum of
+ * the filtered bytes, stopping early once it exceeds lmins.
+ */
+PNG_INTERNAL_FUNCTION(png_size_t,png_write_filter_row_sub_sse2,(png_bytep dp,
+    png_const_bytep rp, png_const_bytep pp, png_size_t row_bytes,
+    unsigned int bpp, png_size_t lmins),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(png_size_t,png_write_filter_row_up_sse2,(png_bytep dp,
+    png_const_bytep rp, png_const_bytep pp, png_size_t row_bytes,
+    unsigned int bpp, png_size_t lmins),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(png_size_t,png_write_filter_row_avg_sse2,(png_bytep dp,
+    png_const_bytep rp, png_const_bytep pp, png_size_t row_bytes,
+    unsigned int bpp, png_size_t lmins),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(png_size_t,png_write_filter_row_paeth_sse2,(png_bytep dp,
+    png_const_bytep rp, png_const_bytep pp, png_size_t row_bytes,
+    unsigned int bpp, png_size_t lmins),PNG_EMPTY);
+#endif
+#endif
+
+#if PNG_INTEL_AVX2_OPT > 0
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_up_avx2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub3_avx2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub4_avx2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 #endif
 
 /* Choose the best filter to use and filter the row data */
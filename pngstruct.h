@@ -58,6 +58,21 @@
 
 #ifdef PNG_WRITE_SUPPORTED
 /* The type of a compression buffer list used by the write code. */
+#ifdef PNG_WRITE_IDAT_IN_PLACE_SUPPORTED
+/* The length and name of an IDAT chunk go in 'header', right in front of the
+ * data, and the CRC goes in the 4 bytes after it, so that the whole chunk can
+ * be written with one call; see png_write_IDAT_in_place().
+ */
+typedef struct png_compression_buffer
+{
+   struct png_compression_buffer *next;
+   png_byte                       header[8];
+   png_byte                       output[1]; /* actually zbuf_size + 4 */
+} png_compression_buffer, *png_compression_bufferp;
+
+#define PNG_COMPRESSION_BUFFER_SIZE(pp)\
+   (offsetof(png_compression_buffer, output) + (pp)->zbuffer_size + 4)
+#else
 typedef struct png_compression_buffer
 {
    struct png_compression_buffer *next;
@@ -67,6 +82,7 @@ typedef struct png_compression_buffer
 #define PNG_COMPRESSION_BUFFER_SIZE(pp)\
    (offsetof(png_compression_buffer, output) + (pp)->zbuffer_size)
 #endif
+#endif
 
 /* Colorspace support; structures used in png_struct, png_info and in internal
  * functions to hold and communicate information about the color space.
@@ -191,6 +207,48 @@ struct png_struct_def
    int zlib_window_bits;      /* holds zlib compression window bits */
    int zlib_mem_level;        /* holds zlib compression memory level */
    int zlib_strategy;         /* holds zlib compression strategy */
+#ifdef PNG_WRITE_OPTIMAL_DEFLATE_SUPPORTED
+   int zlib_iterations;       /* passes of Z_OPTIMAL, 0 for zlib's default */
+#endif
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+   int zlib_hash_bytes;       /* bytes hashed for IDAT, 0 for zlib's default */
+#endif
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+   int zlib_split;            /* split IDAT into the best blocks */
+#endif
+#ifdef PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED
+   int zlib_huffman;          /* package-merge code lengths for IDAT */
+#endif
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+   int zlib_tree;             /* binary-tree match finder for IDAT */
+#endif
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+   int zlib_good_length;      /* deflateTune() for IDAT, */
+   int zlib_max_lazy;         /* all 0 for the parameters */
+   int zlib_nice_length;      /* of the level */
+   int zlib_max_chain;
+#endif
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+   png_bytep zlib_match_cache;           /* deflateMatchCache() for IDAT */
+   png_alloc_size_t zlib_match_cache_size;
+#endif
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+   int zlib_bands;            /* png_set_compression_bands(), 0 for none */
+   int zlib_band_params;      /* the bands have their own level and strategy */
+   int zlib_band;             /* the band being compressed */
+   png_uint_32 zlib_band_rows;               /* rows compressed so far */
+   png_uint_32 zlib_band_row[PNG_COMPRESSION_BANDS_MAX]; /* first rows */
+   png_byte zlib_band_level[PNG_COMPRESSION_BANDS_MAX];
+   png_byte zlib_band_strategy[PNG_COMPRESSION_BANDS_MAX];
+   png_alloc_size_t zlib_band_end[PNG_COMPRESSION_BANDS_MAX]; /* in bits */
+#endif
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+   int size_only;             /* measure the output only, no data or CRCs */
+#endif
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+   int zlib_threads;          /* threads compressing IDAT, 0 or 1 for none */
+   struct png_zparallel_s *zparallel; /* their state while IDAT is written */
+#endif
 #endif
 /* Added at libpng 1.5.4 */
 #ifdef PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED
@@ -231,6 +289,23 @@ struct png_struct_def
 #ifdef PNG_WRITE_FILTER_SUPPORTED
    png_bytep try_row;    /* buffer to save trial row when filtering */
    png_bytep tst_row;    /* buffer to save best trial row when filtering */
+#endif
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+   int filter_selection;      /* PNG_FILTER_SELECT_ value, see png.h */
+   int zpredict_ready;        /* zpredict has been initialized */
+   z_stream zpredict;         /* trial compressor for PNG_FILTER_SELECT_ZLIB */
+   png_uint_32p filter_hist;  /* 256 byte counts and their total, for
+                               * PNG_FILTER_SELECT_HISTOGRAM */
+   int filter_beam_width;     /* 0 for PNG_FILTER_BEAM_WIDTH_DEFAULT */
+   png_bytep beam_data;       /* unfiltered rows held for
+                               * PNG_FILTER_SELECT_BEAM, each with its
+                               * pass number in front */
+   png_alloc_size_t beam_data_used;
+   png_alloc_size_t beam_data_size;
+   png_uint_32p beam_row_len; /* length of each held row */
+   png_uint_32 beam_num_rows;
+   png_uint_32 beam_max_rows;
+   struct png_beam_state *beam; /* working memory of the beam search */
 #endif
    png_size_t info_rowbytes;  /* Added in 1.5.4: cache of updated row bytes */
 
@@ -944,6 +944,10 @@ png_write_destroy(png_structrp png_ptr)
    if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0)
       deflateEnd(&png_ptr->zstream);
 
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+   png_zparallel_destroy(png_ptr);
+#endif
+
    /* Free our memory.  png_free checks NULL for us. */
    png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list);
    png_free(png_ptr, png_ptr->row_buf);
@@ -957,6 +961,19 @@ png_write_destroy(png_structrp png_ptr)
    png_ptr->tst_row = NULL;
 #endif
 
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+   if (png_ptr->zpredict_ready != 0)
+      deflateEnd(&png_ptr->zpredict);
+   png_ptr->zpredict_ready = 0;
+   png_free(png_ptr, png_ptr->filter_hist);
+   png_ptr->filter_hist = NULL;
+   png_free(png_ptr, png_ptr->beam_data);
+   png_ptr->beam_data = NULL;
+   png_free(png_ptr, png_ptr->beam_row_len);
+   png_ptr->beam_row_len = NULL;
+   png_beam_destroy(png_ptr);
+#endif
+
 #ifdef PNG_SET_UNKNOWN_CHUNKS_SUPPORTED
    png_free(png_ptr, png_ptr->chunk_list);
    png_ptr->chunk_list = NULL;
@@ -1122,6 +1139,39 @@ png_set_filter(png_structrp png_ptr, int method, int filters)
       png_error(png_ptr, "Unknown custom filter method");
 }
 
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+void PNGAPI
+png_set_filter_selection(png_structrp png_ptr, int selection)
+{
+   png_debug(1, "in png_set_filter_selection");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (selection >= PNG_FILTER_SELECT_MSAD &&
+       selection < PNG_FILTER_SELECT_LAST)
+      png_ptr->filter_selection = selection;
+
+   else
+      png_app_error(png_ptr, "png_set_filter_selection: invalid selection");
+}
+
+void PNGAPI
+png_set_filter_beam_width(png_structrp png_ptr, int width)
+{
+   png_debug(1, "in png_set_filter_beam_width");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (width >= 1 && width <= PNG_FILTER_BEAM_WIDTH_MAX)
+      png_ptr->filter_beam_width = width;
+
+   else
+      png_app_error(png_ptr, "png_set_filter_beam_width: invalid width");
+}
+#endif /* WRITE_FILTER_SELECTION */
+
 #ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED /* DEPRECATED */
 /* Provide floating and fixed point APIs */
 #ifdef PNG_FLOATING_POINT_SUPPORTED
@@ -1190,6 +1240,200 @@ png_set_compression_strategy(png_structrp png_ptr, int strategy)
    png_ptr->zlib_strategy = strategy;
 }
 
+#ifdef PNG_WRITE_OPTIMAL_DEFLATE_SUPPORTED
+void PNGAPI
+png_set_compression_iterations(png_structrp png_ptr, int iterations)
+{
+   png_debug(1, "in png_set_compression_iterations");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->zlib_iterations = iterations;
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_HASH_SUPPORTED
+void PNGAPI
+png_set_compression_hash(png_structrp png_ptr, int bytes)
+{
+   png_debug(1, "in png_set_compression_hash");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (bytes == 0 || bytes == 3 || bytes == 4)
+      png_ptr->zlib_hash_bytes = bytes;
+
+   else
+      png_app_error(png_ptr, "png_set_compression_hash: invalid bytes");
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_SPLIT_SUPPORTED
+void PNGAPI
+png_set_compression_split(png_structrp png_ptr, int split)
+{
+   png_debug(1, "in png_set_compression_split");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->zlib_split = split != 0;
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED
+void PNGAPI
+png_set_compression_huffman(png_structrp png_ptr, int optimal)
+{
+   png_debug(1, "in png_set_compression_huffman");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->zlib_huffman = optimal != 0;
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TREE_SUPPORTED
+void PNGAPI
+png_set_compression_tree(png_structrp png_ptr, int tree)
+{
+   png_debug(1, "in png_set_compression_tree");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->zlib_tree = tree != 0;
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+void PNGAPI
+png_set_compression_tune(png_structrp png_ptr, int good_length, int max_lazy,
+    int nice_length, int max_chain)
+{
+   png_debug(1, "in png_set_compression_tune");
+
+   if (png_ptr == NULL)
+      return;
+
+   if ((good_length == 0 && max_lazy == 0 && nice_length == 0 &&
+       max_chain == 0) ||
+       (good_length >= 0 && good_length <= 258 &&
+       max_lazy >= 0 && max_lazy <= 258 &&
+       nice_length >= 3 && nice_length <= 258 && max_chain > 0))
+   {
+      png_ptr->zlib_good_length = good_length;
+      png_ptr->zlib_max_lazy = max_lazy;
+      png_ptr->zlib_nice_length = nice_length;
+      png_ptr->zlib_max_chain = max_chain;
+   }
+
+   else
+      png_app_error(png_ptr, "png_set_compression_tune: invalid parameters");
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_CACHE_SUPPORTED
+void PNGAPI
+png_set_compression_match_cache(png_structrp png_ptr, png_bytep cache,
+    png_alloc_size_t size)
+{
+   png_debug(1, "in png_set_compression_match_cache");
+
+   if (png_ptr == NULL)
+      return;
+
+   /* zlib keeps the size in a uLong, and needs room for its header */
+   if (cache != NULL && (size < 32 || size != (uLong)size))
+   {
+      png_app_error(png_ptr, "png_set_compression_match_cache: invalid size");
+      return;
+   }
+
+   png_ptr->zlib_match_cache = cache;
+   png_ptr->zlib_match_cache_size = cache != NULL ? size : 0;
+}
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+void PNGAPI
+png_set_compression_bands(png_structrp png_ptr, int num_bands,
+    png_const_uint_32p first_row, png_const_bytep levels,
+    png_const_bytep strategies)
+{
+   int i;
+
+   png_debug(1, "in png_set_compression_bands");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (num_bands < 0 || num_bands > PNG_COMPRESSION_BANDS_MAX ||
+       (num_bands > 0 && first_row == NULL) ||
+       (levels == NULL) != (strategies == NULL))
+   {
+      png_app_error(png_ptr, "png_set_compression_bands: invalid bands");
+      return;
+   }
+
+   for (i = 0; i < num_bands; i++)
+   {
+      /* The first band starts at row 0 and no band is empty; the strategies
+       * are checked by deflateParams().
+       */
+      if ((i == 0 ? first_row[i] != 0 : first_row[i] <= first_row[i-1]) ||
+          (levels != NULL && levels[i] > 9))
+      {
+         png_app_error(png_ptr, "png_set_compression_bands: invalid band");
+         return;
+      }
+   }
+
+   png_ptr->zlib_bands = num_bands;
+   png_ptr->zlib_band_params = levels != NULL;
+
+   for (i = 0; i < num_bands; i++)
+   {
+      png_ptr->zlib_band_row[i] = first_row[i];
+      png_ptr->zlib_band_level[i] = levels != NULL ? levels[i] : 0;
+      png_ptr->zlib_band_strategy[i] = strategies != NULL ? strategies[i] : 0;
+   }
+}
+#endif
+
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+void PNGAPI
+png_set_write_size_only(png_structrp png_ptr, int size_only)
+{
+   png_debug(1, "in png_set_write_size_only");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->size_only = size_only != 0;
+}
+#endif
+
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+void PNGAPI
+png_set_compression_threads(png_structrp png_ptr, int threads)
+{
+   png_debug(1, "in png_set_compression_threads");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (threads >= 0 && threads <= PNG_COMPRESSION_THREADS_MAX)
+      png_ptr->zlib_threads = threads;
+
+   else
+      png_app_error(png_ptr, "png_set_compression_threads: invalid threads");
+}
+#endif
+
 /* If PNG_WRITE_OPTIMIZE_CMF_SUPPORTED is defined, libpng will use a
  * smaller value of window_bits if it can do so safely.
  */
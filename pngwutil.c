@@ -13,6 +13,10 @@
 
 #include "pngpriv.h"
 
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+#  include <pthread.h>
+#endif
+
 #ifdef PNG_WRITE_SUPPORTED
 
 #ifdef PNG_WRITE_INT_FUNCTIONS_SUPPORTED
@@ -99,9 +103,14 @@ png_write_chunk_header(png_structrp png_ptr, png_uint_32 chunk_name,
    png_ptr->chunk_name = chunk_name;
 
    /* Reset the crc and run it over the chunk name */
-   png_reset_crc(png_ptr);
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+   if (png_ptr->size_only == 0)
+#endif
+   {
+      png_reset_crc(png_ptr);
 
-   png_calculate_crc(png_ptr, buf + 4, 4);
+      png_calculate_crc(png_ptr, buf + 4, 4);
+   }
 
 #ifdef PNG_IO_STATE_SUPPORTED
    /* Inform the I/O callback that chunk data will (possibly) be written.
@@ -138,7 +147,10 @@ png_write_chunk_data(png_structrp png_ptr, png_const_bytep data,
       /* Update the CRC after writing the data,
        * in case the user I/O routine alters it.
        */
-      png_calculate_crc(png_ptr, data, length);
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+      if (png_ptr->size_only == 0)
+#endif
+         png_calculate_crc(png_ptr, data, length);
    }
 }
 
@@ -197,6 +209,45 @@ png_write_chunk(png_structrp png_ptr, png_const_bytep chunk_string,
        length);
 }
 
+/* Write an IDAT chunk of the first 'length' bytes of compressed data in
+ * 'buffer'.  With PNG_WRITE_IDAT_IN_PLACE_SUPPORTED the length and name are
+ * put in the header of the buffer and the CRC after the data, while the data
+ * is still in the cache, and the whole chunk goes to the write function in a
+ * single call, so no part of it is copied to be written (and a large fwrite()
+ * skips the stdio buffer).  The io_state is then PNG_IO_CHUNK_HDR throughout.
+ */
+static void
+png_write_IDAT_chunk(png_structrp png_ptr, png_compression_bufferp buffer,
+    png_alloc_size_t length)
+{
+#ifdef PNG_WRITE_IDAT_IN_PLACE_SUPPORTED
+   if (length > PNG_UINT_31_MAX)
+      png_error(png_ptr, "length exceeds PNG maximum");
+
+   png_save_uint_32(buffer->header, (png_uint_32)length);
+   png_save_uint_32(buffer->header + 4, png_IDAT);
+   png_ptr->chunk_name = png_IDAT;
+
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
+   if (png_ptr->size_only == 0)
+#endif
+   {
+      png_reset_crc(png_ptr);
+      png_calculate_crc(png_ptr, buffer->header + 4, length + 4);
+   }
+
+   png_save_uint_32(buffer->output + length, png_ptr->crc);
+
+#ifdef PNG_IO_STATE_SUPPORTED
+   png_ptr->io_state = PNG_IO_WRITING | PNG_IO_CHUNK_HDR;
+#endif
+
+   png_write_data(png_ptr, buffer->header, length + 12);
+#else
+   png_write_complete_chunk(png_ptr, png_IDAT, buffer->output, length);
+#endif
+}
+
 /* This is used below to find the size of an image to pass to png_deflate_claim,
  * so it only needs to be accurate if the size is less than 16384 bytes (the
  * point at which a lower LZ window size can be used.)
@@ -288,6 +339,35 @@ optimize_cmf(png_bytep data, png_alloc_size_t data_size)
 }
 #endif /* WRITE_OPTIMIZE_CMF */
 
+/* The zlib strategy used for IDAT. */
+static int
+png_IDAT_strategy(png_const_structrp png_ptr)
+{
+   if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
+      return png_ptr->zlib_strategy;
+
+   else if (png_ptr->do_filter != PNG_FILTER_NONE)
+      return PNG_Z_DEFAULT_STRATEGY;
+
+   else
+      return PNG_Z_DEFAULT_NOFILTER_STRATEGY;
+}
+
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+/* Apply png_set_compression_tune() to an IDAT stream.  deflateReset() puts
+ * back the parameters of the level, so this follows every reset.
+ */
+static int
+png_deflate_tune(png_const_structrp png_ptr, z_streamp zs)
+{
+   if (png_ptr->zlib_max_chain == 0)
+      return Z_OK;
+
+   return deflateTune(zs, png_ptr->zlib_good_length, png_ptr->zlib_max_lazy,
+       png_ptr->zlib_nice_length, png_ptr->zlib_max_chain);
+}
+#endif
+
 /* Initialize the compressor for the appropriate type of compression. */
 static int
 png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
@@ -333,16 +413,7 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
       int ret; /* zlib return code */
 
       if (owner == png_IDAT)
-      {
-         if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
-            strategy = png_ptr->zlib_strategy;
-
-         else if (png_ptr->do_filter != PNG_FILTER_NONE)
-            strategy = PNG_Z_DEFAULT_STRATEGY;
-
-         else
-            strategy = PNG_Z_DEFAULT_NOFILTER_STRATEGY;
-      }
+         strategy = png_IDAT_strategy(png_ptr);
 
       else
       {
@@ -422,6 +493,64 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
             png_ptr->flags |= PNG_FLAG_ZSTREAM_INITIALIZED;
       }
 
+#if defined(PNG_WRITE_OPTIMAL_DEFLATE_SUPPORTED) && defined(Z_OPTIMAL)
+      /* deflateReset() keeps the count, but it may have been changed since
+       * the stream was initialized.  It is set whatever the strategy, since
+       * png_set_compression_bands() can switch to Z_OPTIMAL later.
+       */
+      if (ret == Z_OK && owner == png_IDAT && png_ptr->zlib_iterations > 0)
+         ret = deflateIterations(&png_ptr->zstream, png_ptr->zlib_iterations);
+#endif
+
+#if defined(PNG_WRITE_DEFLATE_HASH_SUPPORTED) && defined(Z_OPTIMAL)
+      /* deflateReset() keeps this too, and the stream is shared with the
+       * other compressed chunks, which always get the default.
+       */
+      if (ret == Z_OK && png_ptr->zlib_hash_bytes != 0)
+         ret = deflateHash(&png_ptr->zstream,
+             owner == png_IDAT ? png_ptr->zlib_hash_bytes : 3);
+#endif
+
+#if defined(PNG_WRITE_DEFLATE_SPLIT_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateSplit(&png_ptr->zstream,
+             owner == png_IDAT ? png_ptr->zlib_split : 0);
+#endif
+
+#if defined(PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateHuffman(&png_ptr->zstream,
+             owner == png_IDAT ? png_ptr->zlib_huffman : 0);
+#endif
+
+#if defined(PNG_WRITE_DEFLATE_TREE_SUPPORTED) && defined(Z_OPTIMAL)
+      /* Like the hash, this must be set while the stream is empty. */
+      if (ret == Z_OK)
+         ret = deflateTree(&png_ptr->zstream,
+             owner == png_IDAT ? png_ptr->zlib_tree : 0);
+#endif
+
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+      if (ret == Z_OK && owner == png_IDAT)
+         ret = png_deflate_tune(png_ptr, &png_ptr->zstream);
+#endif
+
+#if defined(PNG_WRITE_DEFLATE_CACHE_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateMatchCache(&png_ptr->zstream,
+             owner == png_IDAT ? png_ptr->zlib_match_cache : NULL,
+             owner == png_IDAT ? (uLong)png_ptr->zlib_match_cache_size : 0);
+#endif
+
+#if defined(PNG_WRITE_SIZE_ONLY_SUPPORTED) && defined(Z_OPTIMAL)
+      /* The other chunks compress into a buffer that is then written, so
+       * they always get real data.
+       */
+      if (ret == Z_OK)
+         ret = deflateCount(&png_ptr->zstream,
+             owner == png_IDAT ? png_ptr->size_only : 0);
+#endif
+
       /* The return code is from either deflateReset or deflateInit2; they have
        * pretty much the same set of error codes.
        */
@@ -911,1642 +1040,2982 @@ png_write_PLTE(png_structrp png_ptr, png_const_colorp palette,
    png_ptr->mode |= PNG_HAVE_PLTE;
 }
 
-/* This is similar to png_text_compress, above, except that it does not require
- * all of the data at once and, instead of buffering the compressed result,
- * writes it as IDAT chunks.  Unlike png_text_compress it *can* png_error out
- * because it calls the write interface.  As a result it does its own error
- * reporting and does not return an error code.  In the event of error it will
- * just call png_error.  The input data length may exceed 32-bits.  The 'flush'
- * parameter is exactly the same as that to deflate, with the following
- * meanings:
- *
- * Z_NO_FLUSH: normal incremental output of compressed data
- * Z_SYNC_FLUSH: do a SYNC_FLUSH, used by png_write_flush
- * Z_FINISH: this is the end of the input, do a Z_FINISH and clean up
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+/* Multi-threaded IDAT compression.  The filtered data is collected into
+ * segments of PNG_ZPARALLEL_SEGMENT bytes and one segment is given to each
+ * thread, which compresses it as raw deflate data primed with the window of
+ * data before it (deflateSetDictionary), so matches can still reach back
+ * across the join.  Every segment but the last ends with a Z_SYNC_FLUSH, which
+ * leaves the output byte aligned, so the pieces can simply be concatenated.
+ * libpng writes the zlib header itself and the Adler-32 is built up from the
+ * segment checksums with adler32_combine().
  *
- * The routine manages the acquire and release of the png_ptr->zstream by
- * checking and (at the end) clearing png_ptr->zowner; it does some sanity
- * checks on the 'mode' flags while doing this.
+ * The segments start at fixed offsets in the data, so the output does not
+ * depend on the number of threads (other than one, which uses the ordinary
+ * code) or on the order the threads finish.  It is not the same as the
+ * single-threaded output, though: each join costs a flush marker and ends a
+ * deflate block, which may make it slightly larger or smaller.
+ */
+#ifndef PNG_ZPARALLEL_SEGMENT
+#  define PNG_ZPARALLEL_SEGMENT PNG_COMPRESSION_THREADS_SEGMENT
+#endif
+
+typedef struct
+{
+   z_stream         zs;
+   int              ret;         /* Z_OK or the zlib error code */
+   int              flush;       /* Z_SYNC_FLUSH, or Z_FINISH for the last */
+   int              started;     /* running in its own thread */
+   pthread_t        thread;
+   png_const_bytep  dict;        /* the data before the input */
+   uInt             dict_len;
+   png_const_bytep  input;
+   uInt             input_len;
+   uLong            adler;       /* Adler-32 of the input */
+   png_bytep        output;
+   uInt             output_size;
+} png_zworker;
+
+typedef struct png_zparallel_s
+{
+   png_structrp     png_ptr;
+   int              threads;
+   int              workers;     /* number with an initialized zs */
+   png_zworker     *worker;
+   pthread_mutex_t  lock;        /* held by the workers to allocate memory */
+   uLong            adler;       /* Adler-32 of all the input so far */
+   png_alloc_size_t window;      /* deflate window size */
+   png_bytep        buffer;      /* 'window' bytes of history, then input */
+   png_alloc_size_t history;     /* bytes of history before the input */
+   png_alloc_size_t used;        /* bytes of input */
+} png_zparallel;
+
+/* zlib allocates the Z_OPTIMAL state from deflate() itself, so the workers
+ * take turns with png_malloc.
  */
+static voidpf
+png_zparallel_alloc(voidpf opaque, uInt items, uInt size)
+{
+   png_zparallel *zp = png_voidcast(png_zparallel *, opaque);
+   voidpf ptr;
+
+   pthread_mutex_lock(&zp->lock);
+   ptr = png_zalloc(zp->png_ptr, items, size);
+   pthread_mutex_unlock(&zp->lock);
+
+   return ptr;
+}
+
+static void
+png_zparallel_free_fn(voidpf opaque, voidpf ptr)
+{
+   png_zparallel *zp = png_voidcast(png_zparallel *, opaque);
+
+   pthread_mutex_lock(&zp->lock);
+   png_zfree(zp->png_ptr, ptr);
+   pthread_mutex_unlock(&zp->lock);
+}
+
 void /* PRIVATE */
-png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
-    png_alloc_size_t input_len, int flush)
+png_zparallel_destroy(png_structrp png_ptr)
 {
-   if (png_ptr->zowner != png_IDAT)
+   png_zparallel *zp = png_ptr->zparallel;
+
+   if (zp != NULL)
    {
-      /* First time.   Ensure we have a temporary buffer for compression and
-       * trim the buffer list if it has more than one entry to free memory.
-       * If 'WRITE_COMPRESSED_TEXT' is not set the list will never have been
-       * created at this point, but the check here is quick and safe.
-       */
-      if (png_ptr->zbuffer_list == NULL)
+      int i;
+
+      png_ptr->zparallel = NULL;
+
+      for (i = 0; i < zp->workers; ++i)
+         deflateEnd(&zp->worker[i].zs);
+
+      if (zp->worker != NULL)
       {
-         png_ptr->zbuffer_list = png_voidcast(png_compression_bufferp,
-             png_malloc(png_ptr, PNG_COMPRESSION_BUFFER_SIZE(png_ptr)));
-         png_ptr->zbuffer_list->next = NULL;
+         for (i = 0; i < zp->threads; ++i)
+            png_free(png_ptr, zp->worker[i].output);
+
+         png_free(png_ptr, zp->worker);
       }
 
-      else
-         png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list->next);
+      png_free(png_ptr, zp->buffer);
+      pthread_mutex_destroy(&zp->lock);
+      png_free(png_ptr, zp);
+   }
+}
 
-      /* It is a terminal error if we can't claim the zstream. */
-      if (png_deflate_claim(png_ptr, png_IDAT, png_image_size(png_ptr)) != Z_OK)
-         png_error(png_ptr, png_ptr->zstream.msg);
+/* Set up the workers if the IDAT data should be compressed in parallel.
+ * Returns 0, leaving png_ptr->zparallel NULL, if it should not or if the
+ * memory is not available.
+ */
+static int
+png_zparallel_init(png_structrp png_ptr)
+{
+   png_zparallel *zp;
+   int threads = png_ptr->zlib_threads;
+   int strategy = png_IDAT_strategy(png_ptr);
+   png_alloc_size_t size = png_image_size(png_ptr);
+   int i;
 
-      /* The output state is maintained in png_ptr->zstream, so it must be
-       * initialized here after the claim.
-       */
-      png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
-      png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
-   }
+   if (threads < 2 || size / 2 < PNG_ZPARALLEL_SEGMENT)
+      return 0;
 
-   /* Now loop reading and writing until all the input is consumed or an error
-    * terminates the operation.  The _out values are maintained across calls to
-    * this function, but the input must be reset each time.
-    */
-   png_ptr->zstream.next_in = PNGZ_INPUT_CAST(input);
-   png_ptr->zstream.avail_in = 0; /* set below */
-   for (;;)
-   {
-      int ret;
+   /* There is no point in more threads than segments. */
+   if ((png_alloc_size_t)threads > size / PNG_ZPARALLEL_SEGMENT)
+      threads = (int)(size / PNG_ZPARALLEL_SEGMENT);
 
-      /* INPUT: from the row data */
-      uInt avail = ZLIB_IO_MAX;
+   zp = png_voidcast(png_zparallel *, png_malloc_warn(png_ptr, sizeof *zp));
 
-      if (avail > input_len)
-         avail = (uInt)input_len; /* safe because of the check */
+   if (zp == NULL)
+      return 0;
 
-      png_ptr->zstream.avail_in = avail;
-      input_len -= avail;
+   memset(zp, 0, sizeof *zp);
+   zp->png_ptr = png_ptr;
+   zp->threads = threads;
+   zp->adler = adler32(0L, Z_NULL, 0);
+   zp->window = (png_alloc_size_t)1 << png_ptr->zlib_window_bits;
 
-      ret = deflate(&png_ptr->zstream, input_len > 0 ? Z_NO_FLUSH : flush);
+   if (pthread_mutex_init(&zp->lock, NULL) != 0)
+   {
+      png_free(png_ptr, zp);
+      return 0;
+   }
 
-      /* Include as-yet unconsumed input */
-      input_len += png_ptr->zstream.avail_in;
-      png_ptr->zstream.avail_in = 0;
+   png_ptr->zparallel = zp;
 
-      /* OUTPUT: write complete IDAT chunks when avail_out drops to zero. Note
-       * that these two zstream fields are preserved across the calls, therefore
-       * there is no need to set these up on entry to the loop.
-       */
-      if (png_ptr->zstream.avail_out == 0)
-      {
-         png_bytep data = png_ptr->zbuffer_list->output;
-         uInt size = png_ptr->zbuffer_size;
+   zp->buffer = png_voidcast(png_bytep, png_malloc_warn(png_ptr,
+       zp->window + (png_alloc_size_t)threads * PNG_ZPARALLEL_SEGMENT));
+   zp->worker = png_voidcast(png_zworker *, png_malloc_warn(png_ptr,
+       threads * (sizeof *zp->worker)));
 
-         /* Write an IDAT containing the data then reset the buffer.  The
-          * first IDAT may need deflate header optimization.
-          */
-#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
-            if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
-                png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
-               optimize_cmf(data, png_image_size(png_ptr));
-#endif
+   if (zp->buffer == NULL || zp->worker == NULL)
+   {
+      png_zparallel_destroy(png_ptr);
+      return 0;
+   }
 
-         if (size > 0)
-            png_write_complete_chunk(png_ptr, png_IDAT, data, size);
-         png_ptr->mode |= PNG_HAVE_IDAT;
+   memset(zp->worker, 0, threads * (sizeof *zp->worker));
 
-         png_ptr->zstream.next_out = data;
-         png_ptr->zstream.avail_out = size;
+   for (i = 0; i < threads; ++i)
+   {
+      png_zworker *w = &zp->worker[i];
+      int ret;
 
-         /* For SYNC_FLUSH or FINISH it is essential to keep calling zlib with
-          * the same flush parameter until it has finished output, for NO_FLUSH
-          * it doesn't matter.
-          */
-         if (ret == Z_OK && flush != Z_NO_FLUSH)
-            continue;
-      }
+      w->zs.zalloc = png_zparallel_alloc;
+      w->zs.zfree = png_zparallel_free_fn;
+      w->zs.opaque = zp;
 
-      /* The order of these checks doesn't matter much; it just affects which
-       * possible error might be detected if multiple things go wrong at once.
-       */
-      if (ret == Z_OK) /* most likely return code! */
-      {
-         /* If all the input has been consumed then just return.  If Z_FINISH
-          * was used as the flush parameter something has gone wrong if we get
-          * here.
-          */
-         if (input_len == 0)
-         {
-            if (flush == Z_FINISH)
-               png_error(png_ptr, "Z_OK on Z_FINISH with output space");
+      /* Negative windowBits: raw deflate data without a header or trailer */
+      ret = deflateInit2(&w->zs, png_ptr->zlib_level, png_ptr->zlib_method,
+          -png_ptr->zlib_window_bits, png_ptr->zlib_mem_level, strategy);
 
-            return;
-         }
-      }
+      if (ret != Z_OK)
+         break;
 
-      else if (ret == Z_STREAM_END && flush == Z_FINISH)
-      {
-         /* This is the end of the IDAT data; any pending output must be
-          * flushed.  For small PNG files we may still be at the beginning.
-          */
-         png_bytep data = png_ptr->zbuffer_list->output;
-         uInt size = png_ptr->zbuffer_size - png_ptr->zstream.avail_out;
+      zp->workers = i+1;
 
-#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
-         if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
-             png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
-            optimize_cmf(data, png_image_size(png_ptr));
+#if defined(PNG_WRITE_OPTIMAL_DEFLATE_SUPPORTED) && defined(Z_OPTIMAL)
+      if (strategy == Z_OPTIMAL && png_ptr->zlib_iterations > 0)
+         ret = deflateIterations(&w->zs, png_ptr->zlib_iterations);
+#endif
+#if defined(PNG_WRITE_DEFLATE_HASH_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK && png_ptr->zlib_hash_bytes != 0)
+         ret = deflateHash(&w->zs, png_ptr->zlib_hash_bytes);
+#endif
+#if defined(PNG_WRITE_DEFLATE_SPLIT_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateSplit(&w->zs, png_ptr->zlib_split);
+#endif
+#if defined(PNG_WRITE_DEFLATE_HUFFMAN_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateHuffman(&w->zs, png_ptr->zlib_huffman);
+#endif
+#if defined(PNG_WRITE_DEFLATE_TREE_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateTree(&w->zs, png_ptr->zlib_tree);
+#endif
+#if defined(PNG_WRITE_SIZE_ONLY_SUPPORTED) && defined(Z_OPTIMAL)
+      if (ret == Z_OK)
+         ret = deflateCount(&w->zs, png_ptr->size_only);
 #endif
 
-         if (size > 0)
-            png_write_complete_chunk(png_ptr, png_IDAT, data, size);
-         png_ptr->zstream.avail_out = 0;
-         png_ptr->zstream.next_out = NULL;
-         png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
+      /* Room for the sync flush marker in addition to the worst case */
+      w->output_size = (uInt)deflateBound(&w->zs, PNG_ZPARALLEL_SEGMENT) + 16;
+      w->output = png_voidcast(png_bytep, png_malloc_warn(png_ptr,
+          w->output_size));
 
-         png_ptr->zowner = 0; /* Release the stream */
-         return;
-      }
+      if (ret != Z_OK || w->output == NULL)
+         break;
+   }
 
-      else
-      {
-         /* This is an error condition. */
-         png_zstream_error(png_ptr, ret);
-         png_error(png_ptr, png_ptr->zstream.msg);
-      }
+   if (i < threads)
+   {
+      png_zparallel_destroy(png_ptr);
+      return 0;
    }
+
+   return 1;
 }
 
-/* Write an IEND chunk */
-void /* PRIVATE */
-png_write_IEND(png_structrp png_ptr)
+/* Compress one segment; this runs in the worker thread. */
+static void *
+png_zworker_run(void *arg)
 {
-   png_debug(1, "in png_write_IEND");
+   png_zworker *w = png_voidcast(png_zworker *, arg);
+   int ret = deflateReset(&w->zs);
 
-   png_write_complete_chunk(png_ptr, png_IEND, NULL, (png_size_t)0);
-   png_ptr->mode |= PNG_HAVE_IEND;
-}
+#ifdef PNG_WRITE_DEFLATE_TUNE_SUPPORTED
+   if (ret == Z_OK)
+   {
+      png_zparallel *zp = png_voidcast(png_zparallel *, w->zs.opaque);
+      ret = png_deflate_tune(zp->png_ptr, &w->zs);
+   }
+#endif
 
-#ifdef PNG_WRITE_gAMA_SUPPORTED
-/* Write a gAMA chunk */
-void /* PRIVATE */
-png_write_gAMA_fixed(png_structrp png_ptr, png_fixed_point file_gamma)
-{
-   png_byte buf[4];
+   if (ret == Z_OK && w->dict_len > 0)
+      ret = deflateSetDictionary(&w->zs, w->dict, w->dict_len);
 
-   png_debug(1, "in png_write_gAMA");
+   if (ret == Z_OK)
+   {
+      w->zs.next_in = PNGZ_INPUT_CAST(w->input);
+      w->zs.avail_in = w->input_len;
+      w->zs.next_out = w->output;
+      w->zs.avail_out = w->output_size;
 
-   /* file_gamma is saved in 1/100,000ths */
-   png_save_uint_32(buf, (png_uint_32)file_gamma);
-   png_write_complete_chunk(png_ptr, png_gAMA, buf, (png_size_t)4);
-}
-#endif
+      ret = deflate(&w->zs, w->flush);
 
-#ifdef PNG_WRITE_sRGB_SUPPORTED
-/* Write a sRGB chunk */
-void /* PRIVATE */
-png_write_sRGB(png_structrp png_ptr, int srgb_intent)
-{
-   png_byte buf[1];
-
-   png_debug(1, "in png_write_sRGB");
-
-   if (srgb_intent >= PNG_sRGB_INTENT_LAST)
-      png_warning(png_ptr,
-          "Invalid sRGB rendering intent specified");
-
-   buf[0]=(png_byte)srgb_intent;
-   png_write_complete_chunk(png_ptr, png_sRGB, buf, (png_size_t)1);
-}
-#endif
-
-#ifdef PNG_WRITE_iCCP_SUPPORTED
-/* Write an iCCP chunk */
-void /* PRIVATE */
-png_write_iCCP(png_structrp png_ptr, png_const_charp name,
-    png_const_bytep profile)
-{
-   png_uint_32 name_len;
-   png_uint_32 profile_len;
-   png_byte new_name[81]; /* 1 byte for the compression byte */
-   compression_state comp;
-   png_uint_32 temp;
-
-   png_debug(1, "in png_write_iCCP");
-
-   /* These are all internal problems: the profile should have been checked
-    * before when it was stored.
-    */
-   if (profile == NULL)
-      png_error(png_ptr, "No profile for iCCP chunk"); /* internal error */
-
-   profile_len = png_get_uint_32(profile);
-
-   if (profile_len < 132)
-      png_error(png_ptr, "ICC profile too short");
+      /* The output buffer is big enough for all of it in one call. */
+      if (w->flush == Z_FINISH ? ret == Z_STREAM_END :
+          ret == Z_OK && w->zs.avail_out > 0)
+         ret = Z_OK;
 
-   temp = (png_uint_32) (*(profile+8));
-   if (temp > 3 && (profile_len & 0x03))
-      png_error(png_ptr, "ICC profile length invalid (not a multiple of 4)");
+      else if (ret == Z_OK || ret == Z_STREAM_END)
+         ret = Z_BUF_ERROR;
+   }
 
+#ifdef PNG_WRITE_SIZE_ONLY_SUPPORTED
    {
-      png_uint_32 embedded_profile_len = png_get_uint_32(profile);
-
-      if (profile_len != embedded_profile_len)
-         png_error(png_ptr, "Profile length does not match profile");
-   }
+      /* When only measuring, the check value is not needed either. */
+      png_zparallel *zp = png_voidcast(png_zparallel *, w->zs.opaque);
 
-   name_len = png_check_keyword(png_ptr, name, new_name);
+      if (zp->png_ptr->size_only != 0)
+         w->adler = 1;
 
-   if (name_len == 0)
-      png_error(png_ptr, "iCCP: invalid keyword");
+      else
+         w->adler = adler32(adler32(0L, Z_NULL, 0), w->input, w->input_len);
+   }
+#else
+   w->adler = adler32(adler32(0L, Z_NULL, 0), w->input, w->input_len);
+#endif
+   w->ret = ret;
 
-   new_name[++name_len] = PNG_COMPRESSION_TYPE_BASE;
+   return NULL;
+}
 
-   /* Make sure we include the NULL after the name and the compression type */
-   ++name_len;
+/* Add compressed data to the IDAT buffer, writing it out when full. */
+static void
+png_zparallel_output(png_structrp png_ptr, png_const_bytep data,
+    png_alloc_size_t size)
+{
+   while (size > 0)
+   {
+      uInt avail = png_ptr->zstream.avail_out;
 
-   png_text_compress_init(&comp, profile, profile_len);
+      if (avail > size)
+         avail = (uInt)size;
 
-   /* Allow for keyword terminator and compression byte */
-   if (png_text_compress(png_ptr, png_iCCP, &comp, name_len) != Z_OK)
-      png_error(png_ptr, png_ptr->zstream.msg);
+      memcpy(png_ptr->zstream.next_out, data, avail);
+      png_ptr->zstream.next_out += avail;
+      png_ptr->zstream.avail_out -= avail;
+      data += avail;
+      size -= avail;
 
-   png_write_chunk_header(png_ptr, png_iCCP, name_len + comp.output_len);
+      if (png_ptr->zstream.avail_out == 0)
+      {
+         png_bytep chunk = png_ptr->zbuffer_list->output;
 
-   png_write_chunk_data(png_ptr, new_name, name_len);
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+         if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
+             png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+            optimize_cmf(chunk, png_image_size(png_ptr));
+#endif
 
-   png_write_compressed_data_out(png_ptr, &comp);
+         png_write_IDAT_chunk(png_ptr, png_ptr->zbuffer_list,
+             png_ptr->zbuffer_size);
+         png_ptr->mode |= PNG_HAVE_IDAT;
 
-   png_write_chunk_end(png_ptr);
+         png_ptr->zstream.next_out = chunk;
+         png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+      }
+   }
 }
-#endif
 
-#ifdef PNG_WRITE_sPLT_SUPPORTED
-/* Write a sPLT chunk */
-void /* PRIVATE */
-png_write_sPLT(png_structrp png_ptr, png_const_sPLT_tp spalette)
+/* Compress the collected input, one segment per thread.  'flush' is
+ * Z_SYNC_FLUSH or Z_FINISH; with Z_FINISH this is the end of the data.
+ */
+static void
+png_zparallel_run(png_structrp png_ptr, int flush)
 {
-   png_uint_32 name_len;
-   png_byte new_name[80];
-   png_byte entrybuf[10];
-   png_size_t entry_size = (spalette->depth == 8 ? 6 : 10);
-   png_size_t palette_size = entry_size * (png_size_t)spalette->nentries;
-   png_sPLT_entryp ep;
-#ifndef PNG_POINTER_INDEXING_SUPPORTED
-   int i;
-#endif
+   png_zparallel *zp = png_ptr->zparallel;
+   png_bytep input = zp->buffer + zp->window;
+   png_alloc_size_t done = 0;
+   int i, n;
 
-   png_debug(1, "in png_write_sPLT");
+   /* There is always at least one segment so that a flush is written. */
+   for (n = 0; n == 0 || done < zp->used; ++n)
+   {
+      png_zworker *w = &zp->worker[n];
+      png_alloc_size_t len = zp->used - done;
+      png_alloc_size_t dict = zp->history + done;
+
+      if (len > PNG_ZPARALLEL_SEGMENT)
+         len = PNG_ZPARALLEL_SEGMENT;
+
+      if (dict > zp->window)
+         dict = zp->window;
+
+      w->input = input + done;
+      w->input_len = (uInt)len;
+      w->dict = w->input - dict;
+      w->dict_len = (uInt)dict;
+      done += len;
+      w->flush = flush == Z_FINISH && done == zp->used ? Z_FINISH :
+          Z_SYNC_FLUSH;
+   }
 
-   name_len = png_check_keyword(png_ptr, spalette->name, new_name);
+   /* The first segment is done by this thread.  If a thread can not be
+    * started its segment is done here too, afterwards.
+    */
+   for (i = 1; i < n; ++i)
+      zp->worker[i].started = pthread_create(&zp->worker[i].thread, NULL,
+          png_zworker_run, &zp->worker[i]) == 0;
 
-   if (name_len == 0)
-      png_error(png_ptr, "sPLT: invalid keyword");
+   (void)png_zworker_run(&zp->worker[0]);
 
-   /* Make sure we include the NULL after the name */
-   png_write_chunk_header(png_ptr, png_sPLT,
-       (png_uint_32)(name_len + 2 + palette_size));
+   for (i = 1; i < n; ++i)
+   {
+      if (zp->worker[i].started != 0)
+         pthread_join(zp->worker[i].thread, NULL);
 
-   png_write_chunk_data(png_ptr, (png_bytep)new_name,
-       (png_size_t)(name_len + 1));
+      else
+         (void)png_zworker_run(&zp->worker[i]);
 
-   png_write_chunk_data(png_ptr, &spalette->depth, (png_size_t)1);
+      zp->worker[i].started = 0;
+   }
 
-   /* Loop through each palette entry, writing appropriately */
-#ifdef PNG_POINTER_INDEXING_SUPPORTED
-   for (ep = spalette->entries; ep<spalette->entries + spalette->nentries; ep++)
+   for (i = 0; i < n; ++i)
    {
-      if (spalette->depth == 8)
-      {
-         entrybuf[0] = (png_byte)ep->red;
-         entrybuf[1] = (png_byte)ep->green;
-         entrybuf[2] = (png_byte)ep->blue;
-         entrybuf[3] = (png_byte)ep->alpha;
-         png_save_uint_16(entrybuf + 4, ep->frequency);
-      }
+      png_zworker *w = &zp->worker[i];
 
-      else
+      if (w->ret != Z_OK)
       {
-         png_save_uint_16(entrybuf + 0, ep->red);
-         png_save_uint_16(entrybuf + 2, ep->green);
-         png_save_uint_16(entrybuf + 4, ep->blue);
-         png_save_uint_16(entrybuf + 6, ep->alpha);
-         png_save_uint_16(entrybuf + 8, ep->frequency);
+         png_zstream_error(png_ptr, w->ret);
+         png_error(png_ptr, png_ptr->zstream.msg);
       }
 
-      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+      zp->adler = adler32_combine(zp->adler, w->adler, (z_off_t)w->input_len);
+      png_zparallel_output(png_ptr, w->output,
+          w->output_size - w->zs.avail_out);
    }
-#else
-   ep=spalette->entries;
-   for (i = 0; i>spalette->nentries; i++)
+
+   /* Keep the end of the data as the history for the next segment. */
    {
-      if (spalette->depth == 8)
-      {
-         entrybuf[0] = (png_byte)ep[i].red;
-         entrybuf[1] = (png_byte)ep[i].green;
-         entrybuf[2] = (png_byte)ep[i].blue;
-         entrybuf[3] = (png_byte)ep[i].alpha;
-         png_save_uint_16(entrybuf + 4, ep[i].frequency);
-      }
+      png_alloc_size_t keep = zp->history + zp->used;
 
-      else
-      {
-         png_save_uint_16(entrybuf + 0, ep[i].red);
-         png_save_uint_16(entrybuf + 2, ep[i].green);
-         png_save_uint_16(entrybuf + 4, ep[i].blue);
-         png_save_uint_16(entrybuf + 6, ep[i].alpha);
-         png_save_uint_16(entrybuf + 8, ep[i].frequency);
-      }
+      if (keep > zp->window)
+         keep = zp->window;
 
-      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+      memmove(input - keep, input + zp->used - keep, keep);
+      zp->history = keep;
+      zp->used = 0;
    }
-#endif
-
-   png_write_chunk_end(png_ptr);
 }
-#endif
 
-#ifdef PNG_WRITE_sBIT_SUPPORTED
-/* Write the sBIT chunk */
-void /* PRIVATE */
-png_write_sBIT(png_structrp png_ptr, png_const_color_8p sbit, int color_type)
+/* Start the zlib stream; the header is the one deflate() would write. */
+static void
+png_zparallel_start(png_structrp png_ptr)
 {
-   png_byte buf[4];
-   png_size_t size;
+   int level = png_ptr->zlib_level;
+   int strategy = png_IDAT_strategy(png_ptr);
+   unsigned int header = (Z_DEFLATED + ((png_ptr->zlib_window_bits-8)<<4)) << 8;
+   unsigned int level_flags;
+   png_byte data[2];
+
+   if (level == Z_DEFAULT_COMPRESSION)
+      level = 6;
+
+   if ((strategy >= Z_HUFFMAN_ONLY && strategy <= Z_FIXED)
+#ifdef Z_QUICK
+       || strategy == Z_QUICK
+#endif
+       || level < 2)
+      level_flags = 0;
 
-   png_debug(1, "in png_write_sBIT");
+   else if (level < 6)
+      level_flags = 1;
 
-   /* Make sure we don't depend upon the order of PNG_COLOR_8 */
-   if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
-   {
-      png_byte maxbits;
+   else if (level == 6)
+      level_flags = 2;
 
-      maxbits = (png_byte)(color_type==PNG_COLOR_TYPE_PALETTE ? 8 :
-          png_ptr->usr_bit_depth);
+   else
+      level_flags = 3;
 
-      if (sbit->red == 0 || sbit->red > maxbits ||
-          sbit->green == 0 || sbit->green > maxbits ||
-          sbit->blue == 0 || sbit->blue > maxbits)
-      {
-         png_warning(png_ptr, "Invalid sBIT depth specified");
-         return;
-      }
+   header |= (level_flags << 6);
+   header += 31 - (header % 31);
+   data[0] = (png_byte)(header >> 8);
+   data[1] = (png_byte)header;
 
-      buf[0] = sbit->red;
-      buf[1] = sbit->green;
-      buf[2] = sbit->blue;
-      size = 3;
-   }
+   png_ptr->zowner = png_IDAT;
+   png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
+   png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+   png_zparallel_output(png_ptr, data, 2);
+}
 
-   else
+/* png_compress_IDAT for the parallel case. */
+static void
+png_zparallel_compress(png_structrp png_ptr, png_const_bytep input,
+    png_alloc_size_t input_len, int flush)
+{
+   png_zparallel *zp = png_ptr->zparallel;
+   png_alloc_size_t room = (png_alloc_size_t)zp->threads *
+       PNG_ZPARALLEL_SEGMENT;
+
+   while (input_len > 0)
    {
-      if (sbit->gray == 0 || sbit->gray > png_ptr->usr_bit_depth)
-      {
-         png_warning(png_ptr, "Invalid sBIT depth specified");
-         return;
-      }
+      png_alloc_size_t avail;
 
-      buf[0] = sbit->gray;
-      size = 1;
-   }
+      /* A full buffer is only compressed once there is more input, so that
+       * the last segment of the image is never empty.
+       */
+      if (zp->used == room)
+         png_zparallel_run(png_ptr, Z_SYNC_FLUSH);
 
-   if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
-   {
-      if (sbit->alpha == 0 || sbit->alpha > png_ptr->usr_bit_depth)
-      {
-         png_warning(png_ptr, "Invalid sBIT depth specified");
-         return;
-      }
+      avail = room - zp->used;
 
-      buf[size++] = sbit->alpha;
-   }
+      if (avail > input_len)
+         avail = input_len;
 
-   png_write_complete_chunk(png_ptr, png_sBIT, buf, size);
-}
-#endif
+      memcpy(zp->buffer + zp->window + zp->used, input, avail);
+      zp->used += avail;
+      input += avail;
+      input_len -= avail;
+   }
 
-#ifdef PNG_WRITE_cHRM_SUPPORTED
-/* Write the cHRM chunk */
-void /* PRIVATE */
-png_write_cHRM_fixed(png_structrp png_ptr, const png_xy *xy)
-{
-   png_byte buf[32];
+   if (flush != Z_NO_FLUSH)
+      png_zparallel_run(png_ptr, flush);
 
-   png_debug(1, "in png_write_cHRM");
+   if (flush == Z_FINISH)
+   {
+      png_byte adler[4];
+      uInt size;
 
-   /* Each value is saved in 1/100,000ths */
-   png_save_int_32(buf,      xy->whitex);
-   png_save_int_32(buf +  4, xy->whitey);
+      png_save_uint_32(adler, (png_uint_32)zp->adler);
+      png_zparallel_output(png_ptr, adler, 4);
 
-   png_save_int_32(buf +  8, xy->redx);
-   png_save_int_32(buf + 12, xy->redy);
+      size = png_ptr->zbuffer_size - png_ptr->zstream.avail_out;
 
-   png_save_int_32(buf + 16, xy->greenx);
-   png_save_int_32(buf + 20, xy->greeny);
+      if (size > 0)
+         png_write_IDAT_chunk(png_ptr, png_ptr->zbuffer_list, size);
 
-   png_save_int_32(buf + 24, xy->bluex);
-   png_save_int_32(buf + 28, xy->bluey);
+      png_ptr->zstream.avail_out = 0;
+      png_ptr->zstream.next_out = NULL;
+      png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
 
-   png_write_complete_chunk(png_ptr, png_cHRM, buf, 32);
+      png_ptr->zowner = 0;
+      png_zparallel_destroy(png_ptr);
+   }
 }
-#endif
+#endif /* WRITE_PARALLEL_DEFLATE */
 
-#ifdef PNG_WRITE_tRNS_SUPPORTED
-/* Write the tRNS chunk */
-void /* PRIVATE */
-png_write_tRNS(png_structrp png_ptr, png_const_bytep trans_alpha,
-    png_const_color_16p tran, int num_trans, int color_type)
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+/* Record where the current band ends.  The stream has just been flushed with
+ * Z_BLOCK or Z_FINISH, so all of it is in total_out except for up to seven
+ * bits that zlib holds back for the next byte.
+ */
+static void
+png_deflate_band_end(png_structrp png_ptr)
 {
-   png_byte buf[6];
+   unsigned int pending = 0;
+   int bits = 0;
 
-   png_debug(1, "in png_write_tRNS");
+   (void)deflatePending(&png_ptr->zstream, &pending, &bits);
+   png_ptr->zlib_band_end[png_ptr->zlib_band] =
+       ((png_alloc_size_t)(png_ptr->zstream.total_out + pending) << 3) +
+       (unsigned int)bits;
+}
 
-   if (color_type == PNG_COLOR_TYPE_PALETTE)
+/* Set the level and strategy of the band that is starting. */
+static void
+png_deflate_band_params(png_structrp png_ptr)
+{
+   int band = png_ptr->zlib_band;
+   int ret = deflateParams(&png_ptr->zstream, png_ptr->zlib_band_level[band],
+       png_ptr->zlib_band_strategy[band]);
+
+   if (ret != Z_OK)
    {
-      if (num_trans <= 0 || num_trans > (int)png_ptr->num_palette)
-      {
-         png_app_warning(png_ptr,
-             "Invalid number of transparent colors specified");
-         return;
-      }
-
-      /* Write the chunk out as it is */
-      png_write_complete_chunk(png_ptr, png_tRNS, trans_alpha,
-          (png_size_t)num_trans);
+      png_zstream_error(png_ptr, ret);
+      png_error(png_ptr, png_ptr->zstream.msg);
    }
+}
+#endif
 
-   else if (color_type == PNG_COLOR_TYPE_GRAY)
+/* This is similar to png_text_compress, above, except that it does not require
+ * all of the data at once and, instead of buffering the compressed result,
+ * writes it as IDAT chunks.  Unlike png_text_compress it *can* png_error out
+ * because it calls the write interface.  As a result it does its own error
+ * reporting and does not return an error code.  In the event of error it will
+ * just call png_error.  The input data length may exceed 32-bits.  The 'flush'
+ * parameter is exactly the same as that to deflate, with the following
+ * meanings:
+ *
+ * Z_NO_FLUSH: normal incremental output of compressed data
+ * Z_SYNC_FLUSH: do a SYNC_FLUSH, used by png_write_flush
+ * Z_FINISH: this is the end of the input, do a Z_FINISH and clean up
+ *
+ * The routine manages the acquire and release of the png_ptr->zstream by
+ * checking and (at the end) clearing png_ptr->zowner; it does some sanity
+ * checks on the 'mode' flags while doing this.
+ */
+void /* PRIVATE */
+png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
+    png_alloc_size_t input_len, int flush)
+{
+   if (png_ptr->zowner != png_IDAT)
    {
-      /* One 16-bit value */
-      if (tran->gray >= (1 << png_ptr->bit_depth))
+      /* First time.   Ensure we have a temporary buffer for compression and
+       * trim the buffer list if it has more than one entry to free memory.
+       * If 'WRITE_COMPRESSED_TEXT' is not set the list will never have been
+       * created at this point, but the check here is quick and safe.
+       */
+      if (png_ptr->zbuffer_list == NULL)
       {
-         png_app_warning(png_ptr,
-             "Ignoring attempt to write tRNS chunk out-of-range for bit_depth");
-
-         return;
+         png_ptr->zbuffer_list = png_voidcast(png_compression_bufferp,
+             png_malloc(png_ptr, PNG_COMPRESSION_BUFFER_SIZE(png_ptr)));
+         png_ptr->zbuffer_list->next = NULL;
       }
 
-      png_save_uint_16(buf, tran->gray);
-      png_write_complete_chunk(png_ptr, png_tRNS, buf, (png_size_t)2);
-   }
+      else
+         png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list->next);
 
-   else if (color_type == PNG_COLOR_TYPE_RGB)
-   {
-      /* Three 16-bit values */
-      png_save_uint_16(buf, tran->red);
-      png_save_uint_16(buf + 2, tran->green);
-      png_save_uint_16(buf + 4, tran->blue);
-#ifdef PNG_WRITE_16BIT_SUPPORTED
-      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
-#else
-      if ((buf[0] | buf[2] | buf[4]) != 0)
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+      png_ptr->zlib_band = 0;
+      png_ptr->zlib_band_rows = 0;
+      memset(png_ptr->zlib_band_end, 0, (sizeof png_ptr->zlib_band_end));
+#endif
+
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+      if (png_zparallel_init(png_ptr) != 0)
+         png_zparallel_start(png_ptr);
+
+      else
 #endif
       {
-         png_app_warning(png_ptr,
-             "Ignoring attempt to write 16-bit tRNS chunk when bit_depth is 8");
-         return;
-      }
+         /* It is a terminal error if we can't claim the zstream. */
+         if (png_deflate_claim(png_ptr, png_IDAT, png_image_size(png_ptr)) !=
+             Z_OK)
+            png_error(png_ptr, png_ptr->zstream.msg);
 
-      png_write_complete_chunk(png_ptr, png_tRNS, buf, (png_size_t)6);
+         /* The output state is maintained in png_ptr->zstream, so it must be
+          * initialized here after the claim.
+          */
+         png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
+         png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+         if (png_ptr->zlib_bands > 0 && png_ptr->zlib_band_params != 0)
+            png_deflate_band_params(png_ptr);
+#endif
+      }
    }
 
-   else
+#ifdef PNG_WRITE_PARALLEL_DEFLATE_SUPPORTED
+   if (png_ptr->zparallel != NULL)
    {
-      png_app_warning(png_ptr, "Can't write tRNS with an alpha channel");
+      png_zparallel_compress(png_ptr, input, input_len, flush);
+      return;
    }
-}
 #endif
 
-#ifdef PNG_WRITE_bKGD_SUPPORTED
-/* Write the background chunk */
-void /* PRIVATE */
-png_write_bKGD(png_structrp png_ptr, png_const_color_16p back, int color_type)
-{
-   png_byte buf[6];
-
-   png_debug(1, "in png_write_bKGD");
-
-   if (color_type == PNG_COLOR_TYPE_PALETTE)
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+   /* Each row comes in one call.  The last row of a band ends the deflate
+    * block, so that the band can be measured and the next one can start
+    * with its own parameters.
+    */
+   if (flush == Z_NO_FLUSH && png_ptr->zlib_band + 1 < png_ptr->zlib_bands &&
+       ++png_ptr->zlib_band_rows ==
+       png_ptr->zlib_band_row[png_ptr->zlib_band + 1])
    {
-      if (
-#ifdef PNG_MNG_FEATURES_SUPPORTED
-          (png_ptr->num_palette != 0 ||
-          (png_ptr->mng_features_permitted & PNG_FLAG_MNG_EMPTY_PLTE) == 0) &&
-#endif
-         back->index >= png_ptr->num_palette)
-      {
-         png_warning(png_ptr, "Invalid background palette index");
-         return;
-      }
+      png_compress_IDAT(png_ptr, input, input_len, Z_BLOCK);
+      png_deflate_band_end(png_ptr);
+      png_ptr->zlib_band++;
 
-      buf[0] = back->index;
-      png_write_complete_chunk(png_ptr, png_bKGD, buf, (png_size_t)1);
+      if (png_ptr->zlib_band_params != 0)
+         png_deflate_band_params(png_ptr);
+
+      return;
    }
+#endif
 
-   else if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+   /* Now loop reading and writing until all the input is consumed or an error
+    * terminates the operation.  The _out values are maintained across calls to
+    * this function, but the input must be reset each time.
+    */
+   png_ptr->zstream.next_in = PNGZ_INPUT_CAST(input);
+   png_ptr->zstream.avail_in = 0; /* set below */
+   for (;;)
    {
-      png_save_uint_16(buf, back->red);
-      png_save_uint_16(buf + 2, back->green);
-      png_save_uint_16(buf + 4, back->blue);
-#ifdef PNG_WRITE_16BIT_SUPPORTED
-      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
-#else
-      if ((buf[0] | buf[2] | buf[4]) != 0)
-#endif
+      int ret;
+
+      /* INPUT: from the row data */
+      uInt avail = ZLIB_IO_MAX;
+
+      if (avail > input_len)
+         avail = (uInt)input_len; /* safe because of the check */
+
+      png_ptr->zstream.avail_in = avail;
+      input_len -= avail;
+
+      ret = deflate(&png_ptr->zstream, input_len > 0 ? Z_NO_FLUSH : flush);
+
+      /* Include as-yet unconsumed input */
+      input_len += png_ptr->zstream.avail_in;
+      png_ptr->zstream.avail_in = 0;
+
+      /* OUTPUT: write complete IDAT chunks when avail_out drops to zero. Note
+       * that these two zstream fields are preserved across the calls, therefore
+       * there is no need to set these up on entry to the loop.
+       */
+      if (png_ptr->zstream.avail_out == 0)
       {
-         png_warning(png_ptr,
-             "Ignoring attempt to write 16-bit bKGD chunk "
-             "when bit_depth is 8");
+         png_bytep data = png_ptr->zbuffer_list->output;
+         uInt size = png_ptr->zbuffer_size;
 
-         return;
+         /* Write an IDAT containing the data then reset the buffer.  The
+          * first IDAT may need deflate header optimization.
+          */
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+            if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
+                png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+               optimize_cmf(data, png_image_size(png_ptr));
+#endif
+
+         if (size > 0)
+            png_write_IDAT_chunk(png_ptr, png_ptr->zbuffer_list, size);
+         png_ptr->mode |= PNG_HAVE_IDAT;
+
+         png_ptr->zstream.next_out = data;
+         png_ptr->zstream.avail_out = size;
+
+         /* For SYNC_FLUSH or FINISH it is essential to keep calling zlib with
+          * the same flush parameter until it has finished output, for NO_FLUSH
+          * it doesn't matter.
+          */
+         if (ret == Z_OK && flush != Z_NO_FLUSH)
+            continue;
       }
 
-      png_write_complete_chunk(png_ptr, png_bKGD, buf, (png_size_t)6);
-   }
+      /* The order of these checks doesn't matter much; it just affects which
+       * possible error might be detected if multiple things go wrong at once.
+       */
+      if (ret == Z_OK) /* most likely return code! */
+      {
+         /* If all the input has been consumed then just return.  If Z_FINISH
+          * was used as the flush parameter something has gone wrong if we get
+          * here.
+          */
+         if (input_len == 0)
+         {
+            if (flush == Z_FINISH)
+               png_error(png_ptr, "Z_OK on Z_FINISH with output space");
 
-   else
-   {
-      if (back->gray >= (1 << png_ptr->bit_depth))
+            return;
+         }
+      }
+
+      else if (ret == Z_STREAM_END && flush == Z_FINISH)
       {
-         png_warning(png_ptr,
-             "Ignoring attempt to write bKGD chunk out-of-range for bit_depth");
+         /* This is the end of the IDAT data; any pending output must be
+          * flushed.  For small PNG files we may still be at the beginning.
+          */
+         png_bytep data = png_ptr->zbuffer_list->output;
+         uInt size = png_ptr->zbuffer_size - png_ptr->zstream.avail_out;
+
+#ifdef PNG_WRITE_DEFLATE_BANDS_SUPPORTED
+         if (png_ptr->zlib_bands > 0)
+            png_deflate_band_end(png_ptr);
+#endif
+
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+         if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
+             png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+            optimize_cmf(data, png_image_size(png_ptr));
+#endif
+
+         if (size > 0)
+            png_write_IDAT_chunk(png_ptr, png_ptr->zbuffer_list, size);
+         png_ptr->zstream.avail_out = 0;
+         png_ptr->zstream.next_out = NULL;
+         png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
 
+         png_ptr->zowner = 0; /* Release the stream */
          return;
       }
 
-      png_save_uint_16(buf, back->gray);
-      png_write_complete_chunk(png_ptr, png_bKGD, buf, (png_size_t)2);
+      else
+      {
+         /* This is an error condition. */
+         png_zstream_error(png_ptr, ret);
+         png_error(png_ptr, png_ptr->zstream.msg);
+      }
    }
 }
-#endif
 
-#ifdef PNG_WRITE_eXIf_SUPPORTED
-/* Write the Exif data */
+/* Write an IEND chunk */
 void /* PRIVATE */
-png_write_eXIf(png_structrp png_ptr, png_bytep exif, int num_exif)
+png_write_IEND(png_structrp png_ptr)
 {
-   int i;
-   png_byte buf[1];
+   png_debug(1, "in png_write_IEND");
 
-   png_debug(1, "in png_write_eXIf");
+   png_write_complete_chunk(png_ptr, png_IEND, NULL, (png_size_t)0);
+   png_ptr->mode |= PNG_HAVE_IEND;
+}
 
-   png_write_chunk_header(png_ptr, png_eXIf, (png_uint_32)(num_exif));
+#ifdef PNG_WRITE_gAMA_SUPPORTED
+/* Write a gAMA chunk */
+void /* PRIVATE */
+png_write_gAMA_fixed(png_structrp png_ptr, png_fixed_point file_gamma)
+{
+   png_byte buf[4];
 
-   for (i = 0; i < num_exif; i++)
-   {
-      buf[0] = exif[i];
-      png_write_chunk_data(png_ptr, buf, (png_size_t)1);
-   }
+   png_debug(1, "in png_write_gAMA");
 
-   png_write_chunk_end(png_ptr);
+   /* file_gamma is saved in 1/100,000ths */
+   png_save_uint_32(buf, (png_uint_32)file_gamma);
+   png_write_complete_chunk(png_ptr, png_gAMA, buf, (png_size_t)4);
 }
 #endif
 
-#ifdef PNG_WRITE_hIST_SUPPORTED
-/* Write the histogram */
+#ifdef PNG_WRITE_sRGB_SUPPORTED
+/* Write a sRGB chunk */
 void /* PRIVATE */
-png_write_hIST(png_structrp png_ptr, png_const_uint_16p hist, int num_hist)
+png_write_sRGB(png_structrp png_ptr, int srgb_intent)
 {
-   int i;
-   png_byte buf[3];
-
-   png_debug(1, "in png_write_hIST");
-
-   if (num_hist > (int)png_ptr->num_palette)
-   {
-      png_debug2(3, "num_hist = %d, num_palette = %d", num_hist,
-          png_ptr->num_palette);
-
-      png_warning(png_ptr, "Invalid number of histogram entries specified");
-      return;
-   }
+   png_byte buf[1];
 
-   png_write_chunk_header(png_ptr, png_hIST, (png_uint_32)(num_hist * 2));
+   png_debug(1, "in png_write_sRGB");
 
-   for (i = 0; i < num_hist; i++)
-   {
-      png_save_uint_16(buf, hist[i]);
-      png_write_chunk_data(png_ptr, buf, (png_size_t)2);
-   }
+   if (srgb_intent >= PNG_sRGB_INTENT_LAST)
+      png_warning(png_ptr,
+          "Invalid sRGB rendering intent specified");
 
-   png_write_chunk_end(png_ptr);
+   buf[0]=(png_byte)srgb_intent;
+   png_write_complete_chunk(png_ptr, png_sRGB, buf, (png_size_t)1);
 }
 #endif
 
-#ifdef PNG_WRITE_tEXt_SUPPORTED
-/* Write a tEXt chunk */
+#ifdef PNG_WRITE_iCCP_SUPPORTED
+/* Write an iCCP chunk */
 void /* PRIVATE */
-png_write_tEXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
-    png_size_t text_len)
+png_write_iCCP(png_structrp png_ptr, png_const_charp name,
+    png_const_bytep profile)
 {
-   png_uint_32 key_len;
-   png_byte new_key[80];
+   png_uint_32 name_len;
+   png_uint_32 profile_len;
+   png_byte new_name[81]; /* 1 byte for the compression byte */
+   compression_state comp;
+   png_uint_32 temp;
 
-   png_debug(1, "in png_write_tEXt");
+   png_debug(1, "in png_write_iCCP");
 
-   key_len = png_check_keyword(png_ptr, key, new_key);
+   /* These are all internal problems: the profile should have been checked
+    * before when it was stored.
+    */
+   if (profile == NULL)
+      png_error(png_ptr, "No profile for iCCP chunk"); /* internal error */
 
-   if (key_len == 0)
-      png_error(png_ptr, "tEXt: invalid keyword");
+   profile_len = png_get_uint_32(profile);
 
-   if (text == NULL || *text == '\0')
-      text_len = 0;
+   if (profile_len < 132)
+      png_error(png_ptr, "ICC profile too short");
 
-   else
-      text_len = strlen(text);
+   temp = (png_uint_32) (*(profile+8));
+   if (temp > 3 && (profile_len & 0x03))
+      png_error(png_ptr, "ICC profile length invalid (not a multiple of 4)");
 
-   if (text_len > PNG_UINT_31_MAX - (key_len+1))
-      png_error(png_ptr, "tEXt: text too long");
+   {
+      png_uint_32 embedded_profile_len = png_get_uint_32(profile);
 
-   /* Make sure we include the 0 after the key */
-   png_write_chunk_header(png_ptr, png_tEXt,
-       (png_uint_32)/*checked above*/(key_len + text_len + 1));
-   /*
-    * We leave it to the application to meet PNG-1.0 requirements on the
-    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
-    * any non-Latin-1 characters except for NEWLINE.  ISO PNG will forbid them.
-    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
-    */
-   png_write_chunk_data(png_ptr, new_key, key_len + 1);
+      if (profile_len != embedded_profile_len)
+         png_error(png_ptr, "Profile length does not match profile");
+   }
 
-   if (text_len != 0)
-      png_write_chunk_data(png_ptr, (png_const_bytep)text, text_len);
+   name_len = png_check_keyword(png_ptr, name, new_name);
+
+   if (name_len == 0)
+      png_error(png_ptr, "iCCP: invalid keyword");
+
+   new_name[++name_len] = PNG_COMPRESSION_TYPE_BASE;
+
+   /* Make sure we include the NULL after the name and the compression type */
+   ++name_len;
+
+   png_text_compress_init(&comp, profile, profile_len);
+
+   /* Allow for keyword terminator and compression byte */
+   if (png_text_compress(png_ptr, png_iCCP, &comp, name_len) != Z_OK)
+      png_error(png_ptr, png_ptr->zstream.msg);
+
+   png_write_chunk_header(png_ptr, png_iCCP, name_len + comp.output_len);
+
+   png_write_chunk_data(png_ptr, new_name, name_len);
+
+   png_write_compressed_data_out(png_ptr, &comp);
 
    png_write_chunk_end(png_ptr);
 }
 #endif
 
-#ifdef PNG_WRITE_zTXt_SUPPORTED
-/* Write a compressed text chunk */
+#ifdef PNG_WRITE_sPLT_SUPPORTED
+/* Write a sPLT chunk */
 void /* PRIVATE */
-png_write_zTXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
-    int compression)
+png_write_sPLT(png_structrp png_ptr, png_const_sPLT_tp spalette)
 {
-   png_uint_32 key_len;
-   png_byte new_key[81];
-   compression_state comp;
+   png_uint_32 name_len;
+   png_byte new_name[80];
+   png_byte entrybuf[10];
+   png_size_t entry_size = (spalette->depth == 8 ? 6 : 10);
+   png_size_t palette_size = entry_size * (png_size_t)spalette->nentries;
+   png_sPLT_entryp ep;
+#ifndef PNG_POINTER_INDEXING_SUPPORTED
+   int i;
+#endif
 
-   png_debug(1, "in png_write_zTXt");
+   png_debug(1, "in png_write_sPLT");
 
-   if (compression == PNG_TEXT_COMPRESSION_NONE)
-   {
-      png_write_tEXt(png_ptr, key, text, 0);
-      return;
-   }
+   name_len = png_check_keyword(png_ptr, spalette->name, new_name);
 
-   if (compression != PNG_TEXT_COMPRESSION_zTXt)
-      png_error(png_ptr, "zTXt: invalid compression type");
+   if (name_len == 0)
+      png_error(png_ptr, "sPLT: invalid keyword");
 
-   key_len = png_check_keyword(png_ptr, key, new_key);
+   /* Make sure we include the NULL after the name */
+   png_write_chunk_header(png_ptr, png_sPLT,
+       (png_uint_32)(name_len + 2 + palette_size));
 
-   if (key_len == 0)
-      png_error(png_ptr, "zTXt: invalid keyword");
+   png_write_chunk_data(png_ptr, (png_bytep)new_name,
+       (png_size_t)(name_len + 1));
 
-   /* Add the compression method and 1 for the keyword separator. */
-   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
-   ++key_len;
+   png_write_chunk_data(png_ptr, &spalette->depth, (png_size_t)1);
 
-   /* Compute the compressed data; do it now for the length */
-   png_text_compress_init(&comp, (png_const_bytep)text,
-       text == NULL ? 0 : strlen(text));
+   /* Loop through each palette entry, writing appropriately */
+#ifdef PNG_POINTER_INDEXING_SUPPORTED
+   for (ep = spalette->entries; ep<spalette->entries + spalette->nentries; ep++)
+   {
+      if (spalette->depth == 8)
+      {
+         entrybuf[0] = (png_byte)ep->red;
+         entrybuf[1] = (png_byte)ep->green;
+         entrybuf[2] = (png_byte)ep->blue;
+         entrybuf[3] = (png_byte)ep->alpha;
+         png_save_uint_16(entrybuf + 4, ep->frequency);
+      }
 
-   if (png_text_compress(png_ptr, png_zTXt, &comp, key_len) != Z_OK)
-      png_error(png_ptr, png_ptr->zstream.msg);
+      else
+      {
+         png_save_uint_16(entrybuf + 0, ep->red);
+         png_save_uint_16(entrybuf + 2, ep->green);
+         png_save_uint_16(entrybuf + 4, ep->blue);
+         png_save_uint_16(entrybuf + 6, ep->alpha);
+         png_save_uint_16(entrybuf + 8, ep->frequency);
+      }
 
-   /* Write start of chunk */
-   png_write_chunk_header(png_ptr, png_zTXt, key_len + comp.output_len);
+      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+   }
+#else
+   ep=spalette->entries;
+   for (i = 0; i>spalette->nentries; i++)
+   {
+      if (spalette->depth == 8)
+      {
+         entrybuf[0] = (png_byte)ep[i].red;
+         entrybuf[1] = (png_byte)ep[i].green;
+         entrybuf[2] = (png_byte)ep[i].blue;
+         entrybuf[3] = (png_byte)ep[i].alpha;
+         png_save_uint_16(entrybuf + 4, ep[i].frequency);
+      }
 
-   /* Write key */
-   png_write_chunk_data(png_ptr, new_key, key_len);
+      else
+      {
+         png_save_uint_16(entrybuf + 0, ep[i].red);
+         png_save_uint_16(entrybuf + 2, ep[i].green);
+         png_save_uint_16(entrybuf + 4, ep[i].blue);
+         png_save_uint_16(entrybuf + 6, ep[i].alpha);
+         png_save_uint_16(entrybuf + 8, ep[i].frequency);
+      }
 
-   /* Write the compressed data */
-   png_write_compressed_data_out(png_ptr, &comp);
+      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+   }
+#endif
 
-   /* Close the chunk */
    png_write_chunk_end(png_ptr);
 }
 #endif
 
-#ifdef PNG_WRITE_iTXt_SUPPORTED
-/* Write an iTXt chunk */
+#ifdef PNG_WRITE_sBIT_SUPPORTED
+/* Write the sBIT chunk */
 void /* PRIVATE */
-png_write_iTXt(png_structrp png_ptr, int compression, png_const_charp key,
-    png_const_charp lang, png_const_charp lang_key, png_const_charp text)
+png_write_sBIT(png_structrp png_ptr, png_const_color_8p sbit, int color_type)
 {
-   png_uint_32 key_len, prefix_len;
-   png_size_t lang_len, lang_key_len;
-   png_byte new_key[82];
-   compression_state comp;
-
-   png_debug(1, "in png_write_iTXt");
-
-   key_len = png_check_keyword(png_ptr, key, new_key);
+   png_byte buf[4];
+   png_size_t size;
 
-   if (key_len == 0)
-      png_error(png_ptr, "iTXt: invalid keyword");
+   png_debug(1, "in png_write_sBIT");
 
-   /* Set the compression flag */
-   switch (compression)
+   /* Make sure we don't depend upon the order of PNG_COLOR_8 */
+   if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
    {
-      case PNG_ITXT_COMPRESSION_NONE:
-      case PNG_TEXT_COMPRESSION_NONE:
-         compression = new_key[++key_len] = 0; /* no compression */
-         break;
+      png_byte maxbits;
 
-      case PNG_TEXT_COMPRESSION_zTXt:
-      case PNG_ITXT_COMPRESSION_zTXt:
-         compression = new_key[++key_len] = 1; /* compressed */
-         break;
+      maxbits = (png_byte)(color_type==PNG_COLOR_TYPE_PALETTE ? 8 :
+          png_ptr->usr_bit_depth);
 
-      default:
-         png_error(png_ptr, "iTXt: invalid compression");
+      if (sbit->red == 0 || sbit->red > maxbits ||
+          sbit->green == 0 || sbit->green > maxbits ||
+          sbit->blue == 0 || sbit->blue > maxbits)
+      {
+         png_warning(png_ptr, "Invalid sBIT depth specified");
+         return;
+      }
+
+      buf[0] = sbit->red;
+      buf[1] = sbit->green;
+      buf[2] = sbit->blue;
+      size = 3;
    }
 
-   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
-   ++key_len; /* for the keywod separator */
-
-   /* We leave it to the application to meet PNG-1.0 requirements on the
-    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
-    * any non-Latin-1 characters except for NEWLINE.  ISO PNG, however,
-    * specifies that the text is UTF-8 and this really doesn't require any
-    * checking.
-    *
-    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
-    *
-    * TODO: validate the language tag correctly (see the spec.)
-    */
-   if (lang == NULL) lang = ""; /* empty language is valid */
-   lang_len = strlen(lang)+1;
-   if (lang_key == NULL) lang_key = ""; /* may be empty */
-   lang_key_len = strlen(lang_key)+1;
-   if (text == NULL) text = ""; /* may be empty */
-
-   prefix_len = key_len;
-   if (lang_len > PNG_UINT_31_MAX-prefix_len)
-      prefix_len = PNG_UINT_31_MAX;
-   else
-      prefix_len = (png_uint_32)(prefix_len + lang_len);
-
-   if (lang_key_len > PNG_UINT_31_MAX-prefix_len)
-      prefix_len = PNG_UINT_31_MAX;
    else
-      prefix_len = (png_uint_32)(prefix_len + lang_key_len);
-
-   png_text_compress_init(&comp, (png_const_bytep)text, strlen(text));
-
-   if (compression != 0)
    {
-      if (png_text_compress(png_ptr, png_iTXt, &comp, prefix_len) != Z_OK)
-         png_error(png_ptr, png_ptr->zstream.msg);
+      if (sbit->gray == 0 || sbit->gray > png_ptr->usr_bit_depth)
+      {
+         png_warning(png_ptr, "Invalid sBIT depth specified");
+         return;
+      }
+
+      buf[0] = sbit->gray;
+      size = 1;
    }
 
-   else
+   if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
    {
-      if (comp.input_len > PNG_UINT_31_MAX-prefix_len)
-         png_error(png_ptr, "iTXt: uncompressed text too long");
+      if (sbit->alpha == 0 || sbit->alpha > png_ptr->usr_bit_depth)
+      {
+         png_warning(png_ptr, "Invalid sBIT depth specified");
+         return;
+      }
 
-      /* So the string will fit in a chunk: */
-      comp.output_len = (png_uint_32)/*SAFE*/comp.input_len;
+      buf[size++] = sbit->alpha;
    }
 
-   png_write_chunk_header(png_ptr, png_iTXt, comp.output_len + prefix_len);
-
-   png_write_chunk_data(png_ptr, new_key, key_len);
-
-   png_write_chunk_data(png_ptr, (png_const_bytep)lang, lang_len);
-
-   png_write_chunk_data(png_ptr, (png_const_bytep)lang_key, lang_key_len);
-
-   if (compression != 0)
-      png_write_compressed_data_out(png_ptr, &comp);
-
-   else
-      png_write_chunk_data(png_ptr, (png_const_bytep)text, comp.output_len);
-
-   png_write_chunk_end(png_ptr);
+   png_write_complete_chunk(png_ptr, png_sBIT, buf, size);
 }
 #endif
 
-#ifdef PNG_WRITE_oFFs_SUPPORTED
-/* Write the oFFs chunk */
+#ifdef PNG_WRITE_cHRM_SUPPORTED
+/* Write the cHRM chunk */
 void /* PRIVATE */
-png_write_oFFs(png_structrp png_ptr, png_int_32 x_offset, png_int_32 y_offset,
-    int unit_type)
+png_write_cHRM_fixed(png_structrp png_ptr, const png_xy *xy)
 {
-   png_byte buf[9];
+   png_byte buf[32];
 
-   png_debug(1, "in png_write_oFFs");
+   png_debug(1, "in png_write_cHRM");
 
-   if (unit_type >= PNG_OFFSET_LAST)
-      png_warning(png_ptr, "Unrecognized unit type for oFFs chunk");
+   /* Each value is saved in 1/100,000ths */
+   png_save_int_32(buf,      xy->whitex);
+   png_save_int_32(buf +  4, xy->whitey);
 
-   png_save_int_32(buf, x_offset);
-   png_save_int_32(buf + 4, y_offset);
-   buf[8] = (png_byte)unit_type;
+   png_save_int_32(buf +  8, xy->redx);
+   png_save_int_32(buf + 12, xy->redy);
 
-   png_write_complete_chunk(png_ptr, png_oFFs, buf, (png_size_t)9);
+   png_save_int_32(buf + 16, xy->greenx);
+   png_save_int_32(buf + 20, xy->greeny);
+
+   png_save_int_32(buf + 24, xy->bluex);
+   png_save_int_32(buf + 28, xy->bluey);
+
+   png_write_complete_chunk(png_ptr, png_cHRM, buf, 32);
 }
 #endif
-#ifdef PNG_WRITE_pCAL_SUPPORTED
-/* Write the pCAL chunk (described in the PNG extensions document) */
+
+#ifdef PNG_WRITE_tRNS_SUPPORTED
+/* Write the tRNS chunk */
 void /* PRIVATE */
-png_write_pCAL(png_structrp png_ptr, png_charp purpose, png_int_32 X0,
-    png_int_32 X1, int type, int nparams, png_const_charp units,
-    png_charpp params)
+png_write_tRNS(png_structrp png_ptr, png_const_bytep trans_alpha,
+    png_const_color_16p tran, int num_trans, int color_type)
 {
-   png_uint_32 purpose_len;
-   png_size_t units_len, total_len;
-   png_size_tp params_len;
-   png_byte buf[10];
-   png_byte new_purpose[80];
-   int i;
-
-   png_debug1(1, "in png_write_pCAL (%d parameters)", nparams);
+   png_byte buf[6];
 
-   if (type >= PNG_EQUATION_LAST)
-      png_error(png_ptr, "Unrecognized equation type for pCAL chunk");
+   png_debug(1, "in png_write_tRNS");
 
-   purpose_len = png_check_keyword(png_ptr, purpose, new_purpose);
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      if (num_trans <= 0 || num_trans > (int)png_ptr->num_palette)
+      {
+         png_app_warning(png_ptr,
+             "Invalid number of transparent colors specified");
+         return;
+      }
 
-   if (purpose_len == 0)
-      png_error(png_ptr, "pCAL: invalid keyword");
+      /* Write the chunk out as it is */
+      png_write_complete_chunk(png_ptr, png_tRNS, trans_alpha,
+          (png_size_t)num_trans);
+   }
 
-   ++purpose_len; /* terminator */
+   else if (color_type == PNG_COLOR_TYPE_GRAY)
+   {
+      /* One 16-bit value */
+      if (tran->gray >= (1 << png_ptr->bit_depth))
+      {
+         png_app_warning(png_ptr,
+             "Ignoring attempt to write tRNS chunk out-of-range for bit_depth");
 
-   png_debug1(3, "pCAL purpose length = %d", (int)purpose_len);
-   units_len = strlen(units) + (nparams == 0 ? 0 : 1);
-   png_debug1(3, "pCAL units length = %d", (int)units_len);
-   total_len = purpose_len + units_len + 10;
+         return;
+      }
 
-   params_len = (png_size_tp)png_malloc(png_ptr,
-       (png_alloc_size_t)((png_alloc_size_t)nparams * (sizeof (png_size_t))));
+      png_save_uint_16(buf, tran->gray);
+      png_write_complete_chunk(png_ptr, png_tRNS, buf, (png_size_t)2);
+   }
 
-   /* Find the length of each parameter, making sure we don't count the
-    * null terminator for the last parameter.
-    */
-   for (i = 0; i < nparams; i++)
+   else if (color_type == PNG_COLOR_TYPE_RGB)
    {
-      params_len[i] = strlen(params[i]) + (i == nparams - 1 ? 0 : 1);
-      png_debug2(3, "pCAL parameter %d length = %lu", i,
-          (unsigned long)params_len[i]);
-      total_len += params_len[i];
-   }
+      /* Three 16-bit values */
+      png_save_uint_16(buf, tran->red);
+      png_save_uint_16(buf + 2, tran->green);
+      png_save_uint_16(buf + 4, tran->blue);
+#ifdef PNG_WRITE_16BIT_SUPPORTED
+      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
+#else
+      if ((buf[0] | buf[2] | buf[4]) != 0)
+#endif
+      {
+         png_app_warning(png_ptr,
+             "Ignoring attempt to write 16-bit tRNS chunk when bit_depth is 8");
+         return;
+      }
 
-   png_debug1(3, "pCAL total length = %d", (int)total_len);
-   png_write_chunk_header(png_ptr, png_pCAL, (png_uint_32)total_len);
-   png_write_chunk_data(png_ptr, new_purpose, purpose_len);
-   png_save_int_32(buf, X0);
-   png_save_int_32(buf + 4, X1);
-   buf[8] = (png_byte)type;
-   buf[9] = (png_byte)nparams;
-   png_write_chunk_data(png_ptr, buf, (png_size_t)10);
-   png_write_chunk_data(png_ptr, (png_const_bytep)units, (png_size_t)units_len);
+      png_write_complete_chunk(png_ptr, png_tRNS, buf, (png_size_t)6);
+   }
 
-   for (i = 0; i < nparams; i++)
+   else
    {
-      png_write_chunk_data(png_ptr, (png_const_bytep)params[i], params_len[i]);
+      png_app_warning(png_ptr, "Can't write tRNS with an alpha channel");
    }
-
-   png_free(png_ptr, params_len);
-   png_write_chunk_end(png_ptr);
 }
 #endif
 
-#ifdef PNG_WRITE_sCAL_SUPPORTED
-/* Write the sCAL chunk */
+#ifdef PNG_WRITE_bKGD_SUPPORTED
+/* Write the background chunk */
 void /* PRIVATE */
-png_write_sCAL_s(png_structrp png_ptr, int unit, png_const_charp width,
-    png_const_charp height)
+png_write_bKGD(png_structrp png_ptr, png_const_color_16p back, int color_type)
 {
-   png_byte buf[64];
-   png_size_t wlen, hlen, total_len;
-
-   png_debug(1, "in png_write_sCAL_s");
+   png_byte buf[6];
 
-   wlen = strlen(width);
-   hlen = strlen(height);
-   total_len = wlen + hlen + 2;
+   png_debug(1, "in png_write_bKGD");
 
-   if (total_len > 64)
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
    {
-      png_warning(png_ptr, "Can't write sCAL (buffer too small)");
-      return;
-   }
+      if (
+#ifdef PNG_MNG_FEATURES_SUPPORTED
+          (png_ptr->num_palette != 0 ||
+          (png_ptr->mng_features_permitted & PNG_FLAG_MNG_EMPTY_PLTE) == 0) &&
+#endif
+         back->index >= png_ptr->num_palette)
+      {
+         png_warning(png_ptr, "Invalid background palette index");
+         return;
+      }
 
-   buf[0] = (png_byte)unit;
-   memcpy(buf + 1, width, wlen + 1);      /* Append the '\0' here */
-   memcpy(buf + wlen + 2, height, hlen);  /* Do NOT append the '\0' here */
+      buf[0] = back->index;
+      png_write_complete_chunk(png_ptr, png_bKGD, buf, (png_size_t)1);
+   }
 
-   png_debug1(3, "sCAL total length = %u", (unsigned int)total_len);
-   png_write_complete_chunk(png_ptr, png_sCAL, buf, total_len);
-}
+   else if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+   {
+      png_save_uint_16(buf, back->red);
+      png_save_uint_16(buf + 2, back->green);
+      png_save_uint_16(buf + 4, back->blue);
+#ifdef PNG_WRITE_16BIT_SUPPORTED
+      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
+#else
+      if ((buf[0] | buf[2] | buf[4]) != 0)
 #endif
+      {
+         png_warning(png_ptr,
+             "Ignoring attempt to write 16-bit bKGD chunk "
+             "when bit_depth is 8");
 
-#ifdef PNG_WRITE_pHYs_SUPPORTED
-/* Write the pHYs chunk */
-void /* PRIVATE */
-png_write_pHYs(png_structrp png_ptr, png_uint_32 x_pixels_per_unit,
-    png_uint_32 y_pixels_per_unit,
-    int unit_type)
-{
-   png_byte buf[9];
+         return;
+      }
 
-   png_debug(1, "in png_write_pHYs");
+      png_write_complete_chunk(png_ptr, png_bKGD, buf, (png_size_t)6);
+   }
 
-   if (unit_type >= PNG_RESOLUTION_LAST)
-      png_warning(png_ptr, "Unrecognized unit type for pHYs chunk");
+   else
+   {
+      if (back->gray >= (1 << png_ptr->bit_depth))
+      {
+         png_warning(png_ptr,
+             "Ignoring attempt to write bKGD chunk out-of-range for bit_depth");
 
-   png_save_uint_32(buf, x_pixels_per_unit);
-   png_save_uint_32(buf + 4, y_pixels_per_unit);
-   buf[8] = (png_byte)unit_type;
+         return;
+      }
 
-   png_write_complete_chunk(png_ptr, png_pHYs, buf, (png_size_t)9);
+      png_save_uint_16(buf, back->gray);
+      png_write_complete_chunk(png_ptr, png_bKGD, buf, (png_size_t)2);
+   }
 }
 #endif
 
-#ifdef PNG_WRITE_tIME_SUPPORTED
-/* Write the tIME chunk.  Use either png_convert_from_struct_tm()
- * or png_convert_from_time_t(), or fill in the structure yourself.
- */
+#ifdef PNG_WRITE_eXIf_SUPPORTED
+/* Write the Exif data */
 void /* PRIVATE */
-png_write_tIME(png_structrp png_ptr, png_const_timep mod_time)
+png_write_eXIf(png_structrp png_ptr, png_bytep exif, int num_exif)
 {
-   png_byte buf[7];
+   int i;
+   png_byte buf[1];
 
-   png_debug(1, "in png_write_tIME");
+   png_debug(1, "in png_write_eXIf");
 
-   if (mod_time->month  > 12 || mod_time->month  < 1 ||
-       mod_time->day    > 31 || mod_time->day    < 1 ||
-       mod_time->hour   > 23 || mod_time->second > 60)
+   png_write_chunk_header(png_ptr, png_eXIf, (png_uint_32)(num_exif));
+
+   for (i = 0; i < num_exif; i++)
    {
-      png_warning(png_ptr, "Invalid time specified for tIME chunk");
+      buf[0] = exif[i];
+      png_write_chunk_data(png_ptr, buf, (png_size_t)1);
+   }
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_hIST_SUPPORTED
+/* Write the histogram */
+void /* PRIVATE */
+png_write_hIST(png_structrp png_ptr, png_const_uint_16p hist, int num_hist)
+{
+   int i;
+   png_byte buf[3];
+
+   png_debug(1, "in png_write_hIST");
+
+   if (num_hist > (int)png_ptr->num_palette)
+   {
+      png_debug2(3, "num_hist = %d, num_palette = %d", num_hist,
+          png_ptr->num_palette);
+
+      png_warning(png_ptr, "Invalid number of histogram entries specified");
+      return;
+   }
+
+   png_write_chunk_header(png_ptr, png_hIST, (png_uint_32)(num_hist * 2));
+
+   for (i = 0; i < num_hist; i++)
+   {
+      png_save_uint_16(buf, hist[i]);
+      png_write_chunk_data(png_ptr, buf, (png_size_t)2);
+   }
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_tEXt_SUPPORTED
+/* Write a tEXt chunk */
+void /* PRIVATE */
+png_write_tEXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
+    png_size_t text_len)
+{
+   png_uint_32 key_len;
+   png_byte new_key[80];
+
+   png_debug(1, "in png_write_tEXt");
+
+   key_len = png_check_keyword(png_ptr, key, new_key);
+
+   if (key_len == 0)
+      png_error(png_ptr, "tEXt: invalid keyword");
+
+   if (text == NULL || *text == '\0')
+      text_len = 0;
+
+   else
+      text_len = strlen(text);
+
+   if (text_len > PNG_UINT_31_MAX - (key_len+1))
+      png_error(png_ptr, "tEXt: text too long");
+
+   /* Make sure we include the 0 after the key */
+   png_write_chunk_header(png_ptr, png_tEXt,
+       (png_uint_32)/*checked above*/(key_len + text_len + 1));
+   /*
+    * We leave it to the application to meet PNG-1.0 requirements on the
+    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
+    * any non-Latin-1 characters except for NEWLINE.  ISO PNG will forbid them.
+    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
+    */
+   png_write_chunk_data(png_ptr, new_key, key_len + 1);
+
+   if (text_len != 0)
+      png_write_chunk_data(png_ptr, (png_const_bytep)text, text_len);
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_zTXt_SUPPORTED
+/* Write a compressed text chunk */
+void /* PRIVATE */
+png_write_zTXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
+    int compression)
+{
+   png_uint_32 key_len;
+   png_byte new_key[81];
+   compression_state comp;
+
+   png_debug(1, "in png_write_zTXt");
+
+   if (compression == PNG_TEXT_COMPRESSION_NONE)
+   {
+      png_write_tEXt(png_ptr, key, text, 0);
       return;
    }
 
-   png_save_uint_16(buf, mod_time->year);
-   buf[2] = mod_time->month;
-   buf[3] = mod_time->day;
-   buf[4] = mod_time->hour;
-   buf[5] = mod_time->minute;
-   buf[6] = mod_time->second;
+   if (compression != PNG_TEXT_COMPRESSION_zTXt)
+      png_error(png_ptr, "zTXt: invalid compression type");
+
+   key_len = png_check_keyword(png_ptr, key, new_key);
+
+   if (key_len == 0)
+      png_error(png_ptr, "zTXt: invalid keyword");
+
+   /* Add the compression method and 1 for the keyword separator. */
+   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
+   ++key_len;
+
+   /* Compute the compressed data; do it now for the length */
+   png_text_compress_init(&comp, (png_const_bytep)text,
+       text == NULL ? 0 : strlen(text));
+
+   if (png_text_compress(png_ptr, png_zTXt, &comp, key_len) != Z_OK)
+      png_error(png_ptr, png_ptr->zstream.msg);
+
+   /* Write start of chunk */
+   png_write_chunk_header(png_ptr, png_zTXt, key_len + comp.output_len);
+
+   /* Write key */
+   png_write_chunk_data(png_ptr, new_key, key_len);
+
+   /* Write the compressed data */
+   png_write_compressed_data_out(png_ptr, &comp);
+
+   /* Close the chunk */
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_iTXt_SUPPORTED
+/* Write an iTXt chunk */
+void /* PRIVATE */
+png_write_iTXt(png_structrp png_ptr, int compression, png_const_charp key,
+    png_const_charp lang, png_const_charp lang_key, png_const_charp text)
+{
+   png_uint_32 key_len, prefix_len;
+   png_size_t lang_len, lang_key_len;
+   png_byte new_key[82];
+   compression_state comp;
+
+   png_debug(1, "in png_write_iTXt");
+
+   key_len = png_check_keyword(png_ptr, key, new_key);
+
+   if (key_len == 0)
+      png_error(png_ptr, "iTXt: invalid keyword");
+
+   /* Set the compression flag */
+   switch (compression)
+   {
+      case PNG_ITXT_COMPRESSION_NONE:
+      case PNG_TEXT_COMPRESSION_NONE:
+         compression = new_key[++key_len] = 0; /* no compression */
+         break;
+
+      case PNG_TEXT_COMPRESSION_zTXt:
+      case PNG_ITXT_COMPRESSION_zTXt:
+         compression = new_key[++key_len] = 1; /* compressed */
+         break;
+
+      default:
+         png_error(png_ptr, "iTXt: invalid compression");
+   }
+
+   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
+   ++key_len; /* for the keywod separator */
+
+   /* We leave it to the application to meet PNG-1.0 requirements on the
+    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
+    * any non-Latin-1 characters except for NEWLINE.  ISO PNG, however,
+    * specifies that the text is UTF-8 and this really doesn't require any
+    * checking.
+    *
+    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
+    *
+    * TODO: validate the language tag correctly (see the spec.)
+    */
+   if (lang == NULL) lang = ""; /* empty language is valid */
+   lang_len = strlen(lang)+1;
+   if (lang_key == NULL) lang_key = ""; /* may be empty */
+   lang_key_len = strlen(lang_key)+1;
+   if (text == NULL) text = ""; /* may be empty */
+
+   prefix_len = key_len;
+   if (lang_len > PNG_UINT_31_MAX-prefix_len)
+      prefix_len = PNG_UINT_31_MAX;
+   else
+      prefix_len = (png_uint_32)(prefix_len + lang_len);
+
+   if (lang_key_len > PNG_UINT_31_MAX-prefix_len)
+      prefix_len = PNG_UINT_31_MAX;
+   else
+      prefix_len = (png_uint_32)(prefix_len + lang_key_len);
+
+   png_text_compress_init(&comp, (png_const_bytep)text, strlen(text));
+
+   if (compression != 0)
+   {
+      if (png_text_compress(png_ptr, png_iTXt, &comp, prefix_len) != Z_OK)
+         png_error(png_ptr, png_ptr->zstream.msg);
+   }
+
+   else
+   {
+      if (comp.input_len > PNG_UINT_31_MAX-prefix_len)
+         png_error(png_ptr, "iTXt: uncompressed text too long");
+
+      /* So the string will fit in a chunk: */
+      comp.output_len = (png_uint_32)/*SAFE*/comp.input_len;
+   }
+
+   png_write_chunk_header(png_ptr, png_iTXt, comp.output_len + prefix_len);
+
+   png_write_chunk_data(png_ptr, new_key, key_len);
+
+   png_write_chunk_data(png_ptr, (png_const_bytep)lang, lang_len);
+
+   png_write_chunk_data(png_ptr, (png_const_bytep)lang_key, lang_key_len);
+
+   if (compression != 0)
+      png_write_compressed_data_out(png_ptr, &comp);
+
+   else
+      png_write_chunk_data(png_ptr, (png_const_bytep)text, comp.output_len);
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_oFFs_SUPPORTED
+/* Write the oFFs chunk */
+void /* PRIVATE */
+png_write_oFFs(png_structrp png_ptr, png_int_32 x_offset, png_int_32 y_offset,
+    int unit_type)
+{
+   png_byte buf[9];
+
+   png_debug(1, "in png_write_oFFs");
+
+   if (unit_type >= PNG_OFFSET_LAST)
+      png_warning(png_ptr, "Unrecognized unit type for oFFs chunk");
+
+   png_save_int_32(buf, x_offset);
+   png_save_int_32(buf + 4, y_offset);
+   buf[8] = (png_byte)unit_type;
+
+   png_write_complete_chunk(png_ptr, png_oFFs, buf, (png_size_t)9);
+}
+#endif
+#ifdef PNG_WRITE_pCAL_SUPPORTED
+/* Write the pCAL chunk (described in the PNG extensions document) */
+void /* PRIVATE */
+png_write_pCAL(png_structrp png_ptr, png_charp purpose, png_int_32 X0,
+    png_int_32 X1, int type, int nparams, png_const_charp units,
+    png_charpp params)
+{
+   png_uint_32 purpose_len;
+   png_size_t units_len, total_len;
+   png_size_tp params_len;
+   png_byte buf[10];
+   png_byte new_purpose[80];
+   int i;
+
+   png_debug1(1, "in png_write_pCAL (%d parameters)", nparams);
+
+   if (type >= PNG_EQUATION_LAST)
+      png_error(png_ptr, "Unrecognized equation type for pCAL chunk");
+
+   purpose_len = png_check_keyword(png_ptr, purpose, new_purpose);
+
+   if (purpose_len == 0)
+      png_error(png_ptr, "pCAL: invalid keyword");
+
+   ++purpose_len; /* terminator */
+
+   png_debug1(3, "pCAL purpose length = %d", (int)purpose_len);
+   units_len = strlen(units) + (nparams == 0 ? 0 : 1);
+   png_debug1(3, "pCAL units length = %d", (int)units_len);
+   total_len = purpose_len + units_len + 10;
+
+   params_len = (png_size_tp)png_malloc(png_ptr,
+       (png_alloc_size_t)((png_alloc_size_t)nparams * (sizeof (png_size_t))));
+
+   /* Find the length of each parameter, making sure we don't count the
+    * null terminator for the last parameter.
+    */
+   for (i = 0; i < nparams; i++)
+   {
+      params_len[i] = strlen(params[i]) + (i == nparams - 1 ? 0 : 1);
+      png_debug2(3, "pCAL parameter %d length = %lu", i,
+          (unsigned long)params_len[i]);
+      total_len += params_len[i];
+   }
+
+   png_debug1(3, "pCAL total length = %d", (int)total_len);
+   png_write_chunk_header(png_ptr, png_pCAL, (png_uint_32)total_len);
+   png_write_chunk_data(png_ptr, new_purpose, purpose_len);
+   png_save_int_32(buf, X0);
+   png_save_int_32(buf + 4, X1);
+   buf[8] = (png_byte)type;
+   buf[9] = (png_byte)nparams;
+   png_write_chunk_data(png_ptr, buf, (png_size_t)10);
+   png_write_chunk_data(png_ptr, (png_const_bytep)units, (png_size_t)units_len);
+
+   for (i = 0; i < nparams; i++)
+   {
+      png_write_chunk_data(png_ptr, (png_const_bytep)params[i], params_len[i]);
+   }
+
+   png_free(png_ptr, params_len);
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_sCAL_SUPPORTED
+/* Write the sCAL chunk */
+void /* PRIVATE */
+png_write_sCAL_s(png_structrp png_ptr, int unit, png_const_charp width,
+    png_const_charp height)
+{
+   png_byte buf[64];
+   png_size_t wlen, hlen, total_len;
+
+   png_debug(1, "in png_write_sCAL_s");
+
+   wlen = strlen(width);
+   hlen = strlen(height);
+   total_len = wlen + hlen + 2;
+
+   if (total_len > 64)
+   {
+      png_warning(png_ptr, "Can't write sCAL (buffer too small)");
+      return;
+   }
+
+   buf[0] = (png_byte)unit;
+   memcpy(buf + 1, width, wlen + 1);      /* Append the '\0' here */
+   memcpy(buf + wlen + 2, height, hlen);  /* Do NOT append the '\0' here */
+
+   png_debug1(3, "sCAL total length = %u", (unsigned int)total_len);
+   png_write_complete_chunk(png_ptr, png_sCAL, buf, total_len);
+}
+#endif
+
+#ifdef PNG_WRITE_pHYs_SUPPORTED
+/* Write the pHYs chunk */
+void /* PRIVATE */
+png_write_pHYs(png_structrp png_ptr, png_uint_32 x_pixels_per_unit,
+    png_uint_32 y_pixels_per_unit,
+    int unit_type)
+{
+   png_byte buf[9];
+
+   png_debug(1, "in png_write_pHYs");
+
+   if (unit_type >= PNG_RESOLUTION_LAST)
+      png_warning(png_ptr, "Unrecognized unit type for pHYs chunk");
+
+   png_save_uint_32(buf, x_pixels_per_unit);
+   png_save_uint_32(buf + 4, y_pixels_per_unit);
+   buf[8] = (png_byte)unit_type;
+
+   png_write_complete_chunk(png_ptr, png_pHYs, buf, (png_size_t)9);
+}
+#endif
+
+#ifdef PNG_WRITE_tIME_SUPPORTED
+/* Write the tIME chunk.  Use either png_convert_from_struct_tm()
+ * or png_convert_from_time_t(), or fill in the structure yourself.
+ */
+void /* PRIVATE */
+png_write_tIME(png_structrp png_ptr, png_const_timep mod_time)
+{
+   png_byte buf[7];
+
+   png_debug(1, "in png_write_tIME");
+
+   if (mod_time->month  > 12 || mod_time->month  < 1 ||
+       mod_time->day    > 31 || mod_time->day    < 1 ||
+       mod_time->hour   > 23 || mod_time->second > 60)
+   {
+      png_warning(png_ptr, "Invalid time specified for tIME chunk");
+      return;
+   }
+
+   png_save_uint_16(buf, mod_time->year);
+   buf[2] = mod_time->month;
+   buf[3] = mod_time->day;
+   buf[4] = mod_time->hour;
+   buf[5] = mod_time->minute;
+   buf[6] = mod_time->second;
+
+   png_write_complete_chunk(png_ptr, png_tIME, buf, (png_size_t)7);
+}
+#endif
+
+/* Initializes the row writing capability of libpng */
+void /* PRIVATE */
+png_write_start_row(png_structrp png_ptr)
+{
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static PNG_CONST png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static PNG_CONST png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   /* Start of interlace block in the y direction */
+   static PNG_CONST png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+
+   /* Offset to next interlace block in the y direction */
+   static PNG_CONST png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+#endif
+
+   png_alloc_size_t buf_size;
+   int usr_pixel_depth;
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+   png_byte filters;
+#endif
+
+   png_debug(1, "in png_write_start_row");
+
+   usr_pixel_depth = png_ptr->usr_channels * png_ptr->usr_bit_depth;
+   buf_size = PNG_ROWBYTES(usr_pixel_depth, png_ptr->width) + 1;
+
+   /* 1.5.6: added to allow checking in the row write code. */
+   png_ptr->transformed_pixel_depth = png_ptr->pixel_depth;
+   png_ptr->maximum_pixel_depth = (png_byte)usr_pixel_depth;
+
+   /* Set up row buffer */
+   png_ptr->row_buf = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+
+   png_ptr->row_buf[0] = PNG_FILTER_VALUE_NONE;
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+   filters = png_ptr->do_filter;
+
+   if (png_ptr->height == 1)
+      filters &= 0xff & ~(PNG_FILTER_UP|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+
+   if (png_ptr->width == 1)
+      filters &= 0xff & ~(PNG_FILTER_SUB|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+
+   if (filters == 0)
+      filters = PNG_FILTER_NONE;
+
+   png_ptr->do_filter = filters;
+
+   if (((filters & (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_AVG |
+       PNG_FILTER_PAETH)) != 0) && png_ptr->try_row == NULL)
+   {
+      int num_filters = 0;
+
+      png_ptr->try_row = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+
+      if (filters & PNG_FILTER_SUB)
+         num_filters++;
+
+      if (filters & PNG_FILTER_UP)
+         num_filters++;
+
+      if (filters & PNG_FILTER_AVG)
+         num_filters++;
+
+      if (filters & PNG_FILTER_PAETH)
+         num_filters++;
+
+      if (num_filters > 1)
+         png_ptr->tst_row = png_voidcast(png_bytep, png_malloc(png_ptr,
+             buf_size));
+   }
+
+   /* We only need to keep the previous row if we are using one of the following
+    * filters.
+    */
+   if ((filters & (PNG_FILTER_AVG | PNG_FILTER_UP | PNG_FILTER_PAETH)) != 0)
+      png_ptr->prev_row = png_voidcast(png_bytep,
+          png_calloc(png_ptr, buf_size));
+#endif /* WRITE_FILTER */
+
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* If interlaced, we need to set up width and height of pass */
+   if (png_ptr->interlaced != 0)
+   {
+      if ((png_ptr->transformations & PNG_INTERLACE) == 0)
+      {
+         png_ptr->num_rows = (png_ptr->height + png_pass_yinc[0] - 1 -
+             png_pass_ystart[0]) / png_pass_yinc[0];
+
+         png_ptr->usr_width = (png_ptr->width + png_pass_inc[0] - 1 -
+             png_pass_start[0]) / png_pass_inc[0];
+      }
+
+      else
+      {
+         png_ptr->num_rows = png_ptr->height;
+         png_ptr->usr_width = png_ptr->width;
+      }
+   }
+
+   else
+#endif
+   {
+      png_ptr->num_rows = png_ptr->height;
+      png_ptr->usr_width = png_ptr->width;
+   }
+}
+
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+static void /* PRIVATE */
+png_write_beam_rows(png_structrp png_ptr);
+#endif
+
+/* Internal use only.  Called when finished processing a row of data. */
+void /* PRIVATE */
+png_write_finish_row(png_structrp png_ptr)
+{
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static PNG_CONST png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static PNG_CONST png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   /* Start of interlace block in the y direction */
+   static PNG_CONST png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+
+   /* Offset to next interlace block in the y direction */
+   static PNG_CONST png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+#endif
+
+   png_debug(1, "in png_write_finish_row");
+
+   /* Next row */
+   png_ptr->row_number++;
+
+   /* See if we are done */
+   if (png_ptr->row_number < png_ptr->num_rows)
+      return;
+
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* If interlaced, go to next pass */
+   if (png_ptr->interlaced != 0)
+   {
+      png_ptr->row_number = 0;
+      if ((png_ptr->transformations & PNG_INTERLACE) != 0)
+      {
+         png_ptr->pass++;
+      }
+
+      else
+      {
+         /* Loop until we find a non-zero width or height pass */
+         do
+         {
+            png_ptr->pass++;
+
+            if (png_ptr->pass >= 7)
+               break;
+
+            png_ptr->usr_width = (png_ptr->width +
+                png_pass_inc[png_ptr->pass] - 1 -
+                png_pass_start[png_ptr->pass]) /
+                png_pass_inc[png_ptr->pass];
+
+            png_ptr->num_rows = (png_ptr->height +
+                png_pass_yinc[png_ptr->pass] - 1 -
+                png_pass_ystart[png_ptr->pass]) /
+                png_pass_yinc[png_ptr->pass];
+
+            if ((png_ptr->transformations & PNG_INTERLACE) != 0)
+               break;
+
+         } while (png_ptr->usr_width == 0 || png_ptr->num_rows == 0);
+
+      }
+
+      /* Reset the row above the image for the next pass */
+      if (png_ptr->pass < 7)
+      {
+         if (png_ptr->prev_row != NULL)
+            memset(png_ptr->prev_row, 0,
+                (png_size_t)(PNG_ROWBYTES(png_ptr->usr_channels*
+                png_ptr->usr_bit_depth, png_ptr->width)) + 1);
+
+         return;
+      }
+   }
+#endif
+
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+   /* Rows held back for PNG_FILTER_SELECT_BEAM are compressed now */
+   if (png_ptr->beam_data != NULL)
+      png_write_beam_rows(png_ptr);
+#endif
+
+   /* If we get here, we've just written the last row, so we need
+      to flush the compressor */
+   png_compress_IDAT(png_ptr, NULL, 0, Z_FINISH);
+}
+
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+/* Pick out the correct pixels for the interlace pass.
+ * The basic idea here is to go through the row with a source
+ * pointer and a destination pointer (sp and dp), and copy the
+ * correct pixels for the pass.  As the row gets compacted,
+ * sp will always be >= dp, so we should never overwrite anything.
+ * See the default: case for the easiest code to understand.
+ */
+void /* PRIVATE */
+png_do_write_interlace(png_row_infop row_info, png_bytep row, int pass)
+{
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static PNG_CONST png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static PNG_CONST png_byte  png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   png_debug(1, "in png_do_write_interlace");
+
+   /* We don't have to do anything on the last pass (6) */
+   if (pass < 6)
+   {
+      /* Each pixel depth is handled separately */
+      switch (row_info->pixel_depth)
+      {
+         case 1:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            unsigned int shift;
+            int d;
+            int value;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+
+            dp = row;
+            d = 0;
+            shift = 7;
+
+            for (i = png_pass_start[pass]; i < row_width;
+               i += png_pass_inc[pass])
+            {
+               sp = row + (png_size_t)(i >> 3);
+               value = (int)(*sp >> (7 - (int)(i & 0x07))) & 0x01;
+               d |= (value << shift);
+
+               if (shift == 0)
+               {
+                  shift = 7;
+                  *dp++ = (png_byte)d;
+                  d = 0;
+               }
+
+               else
+                  shift--;
+
+            }
+            if (shift != 7)
+               *dp = (png_byte)d;
+
+            break;
+         }
+
+         case 2:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            unsigned int shift;
+            int d;
+            int value;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+
+            dp = row;
+            shift = 6;
+            d = 0;
+
+            for (i = png_pass_start[pass]; i < row_width;
+               i += png_pass_inc[pass])
+            {
+               sp = row + (png_size_t)(i >> 2);
+               value = (*sp >> ((3 - (int)(i & 0x03)) << 1)) & 0x03;
+               d |= (value << shift);
+
+               if (shift == 0)
+               {
+                  shift = 6;
+                  *dp++ = (png_byte)d;
+                  d = 0;
+               }
+
+               else
+                  shift -= 2;
+            }
+            if (shift != 6)
+               *dp = (png_byte)d;
+
+            break;
+         }
+
+         case 4:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            unsigned int shift;
+            int d;
+            int value;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+
+            dp = row;
+            shift = 4;
+            d = 0;
+            for (i = png_pass_start[pass]; i < row_width;
+                i += png_pass_inc[pass])
+            {
+               sp = row + (png_size_t)(i >> 1);
+               value = (*sp >> ((1 - (int)(i & 0x01)) << 2)) & 0x0f;
+               d |= (value << shift);
+
+               if (shift == 0)
+               {
+                  shift = 4;
+                  *dp++ = (png_byte)d;
+                  d = 0;
+               }
+
+               else
+                  shift -= 4;
+            }
+            if (shift != 4)
+               *dp = (png_byte)d;
+
+            break;
+         }
+
+         default:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+            png_size_t pixel_bytes;
+
+            /* Start at the beginning */
+            dp = row;
+
+            /* Find out how many bytes each pixel takes up */
+            pixel_bytes = (row_info->pixel_depth >> 3);
+
+            /* Loop through the row, only looking at the pixels that matter */
+            for (i = png_pass_start[pass]; i < row_width;
+               i += png_pass_inc[pass])
+            {
+               /* Find out where the original pixel is */
+               sp = row + (png_size_t)i * pixel_bytes;
+
+               /* Move the pixel */
+               if (dp != sp)
+                  memcpy(dp, sp, pixel_bytes);
+
+               /* Next pixel */
+               dp += pixel_bytes;
+            }
+            break;
+         }
+      }
+      /* Set new row width */
+      row_info->width = (row_info->width +
+          png_pass_inc[pass] - 1 -
+          png_pass_start[pass]) /
+          png_pass_inc[pass];
+
+      row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth,
+          row_info->width);
+   }
+}
+#endif
+
+
+/* This filters the row, chooses which filter to use, if it has not already
+ * been specified by the application, and then writes the row out with the
+ * chosen filter.
+ */
+static void /* PRIVATE */
+png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
+    png_size_t row_bytes);
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+/* When the SSE2 filter code is built these hand the work over to the
+ * png_write_filter_row_*_sse2() functions in filter_sse2_intrinsics.c,
+ * which produce the same rows and choose the same filters.
+ */
+static png_size_t /* PRIVATE */
+png_setup_sub_row(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes, const png_size_t lmins)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+
+   return (png_write_filter_row_sub_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, NULL, row_bytes, bpp, lmins));
+#else
+   png_bytep rp, dp, lp;
+   png_size_t i;
+   png_size_t sum = 0;
+   unsigned int v;
+
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1; i < bpp;
+        i++, rp++, dp++)
+   {
+      v = *dp = *rp;
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
+
+   for (lp = png_ptr->row_buf + 1; i < row_bytes;
+      i++, rp++, lp++, dp++)
+   {
+      v = *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
+
+   return (sum);
+#endif
+}
+
+static void /* PRIVATE */
+png_setup_sub_row_only(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+
+   (void)png_write_filter_row_sub_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, NULL, row_bytes, bpp, PNG_SIZE_MAX);
+#else
+   png_bytep rp, dp, lp;
+   png_size_t i;
+
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1; i < bpp;
+        i++, rp++, dp++)
+   {
+      *dp = *rp;
+   }
+
+   for (lp = png_ptr->row_buf + 1; i < row_bytes;
+      i++, rp++, lp++, dp++)
+   {
+      *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
+   }
+#endif
+}
+
+static png_size_t /* PRIVATE */
+png_setup_up_row(png_structrp png_ptr, const png_size_t row_bytes,
+    const png_size_t lmins)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+
+   return (png_write_filter_row_up_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, png_ptr->prev_row + 1, row_bytes, 0, lmins));
+#else
+   png_bytep rp, dp, pp;
+   png_size_t i;
+   png_size_t sum = 0;
+   unsigned int v;
+
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
+       pp = png_ptr->prev_row + 1; i < row_bytes;
+       i++, rp++, pp++, dp++)
+   {
+      v = *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
+
+   return (sum);
+#endif
+}
+static void /* PRIVATE */
+png_setup_up_row_only(png_structrp png_ptr, const png_size_t row_bytes)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+
+   (void)png_write_filter_row_up_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, png_ptr->prev_row + 1, row_bytes, 0, PNG_SIZE_MAX);
+#else
+   png_bytep rp, dp, pp;
+   png_size_t i;
+
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
+       pp = png_ptr->prev_row + 1; i < row_bytes;
+       i++, rp++, pp++, dp++)
+   {
+      *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
+   }
+#endif
+}
+
+static png_size_t /* PRIVATE */
+png_setup_avg_row(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes, const png_size_t lmins)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
+
+   return (png_write_filter_row_avg_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, png_ptr->prev_row + 1, row_bytes, bpp, lmins));
+#else
+   png_bytep rp, dp, pp, lp;
+   png_uint_32 i;
+   png_size_t sum = 0;
+   unsigned int v;
+
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
+
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
+       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   {
+      v = *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
+
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
+
+   for (lp = png_ptr->row_buf + 1; i < row_bytes; i++)
+   {
+      v = *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
+          & 0xff);
 
-   png_write_complete_chunk(png_ptr, png_tIME, buf, (png_size_t)7);
-}
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
 #endif
 
-/* Initializes the row writing capability of libpng */
-void /* PRIVATE */
-png_write_start_row(png_structrp png_ptr)
-{
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
-
-   /* Start of interlace block */
-   static PNG_CONST png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
 
-   /* Offset to next interlace block */
-   static PNG_CONST png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+   return (sum);
+#endif
+}
+static void /* PRIVATE */
+png_setup_avg_row_only(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
 
-   /* Start of interlace block in the y direction */
-   static PNG_CONST png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+   (void)png_write_filter_row_avg_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, png_ptr->prev_row + 1, row_bytes, bpp,
+       PNG_SIZE_MAX);
+#else
+   png_bytep rp, dp, pp, lp;
+   png_uint_32 i;
 
-   /* Offset to next interlace block in the y direction */
-   static PNG_CONST png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
-#endif
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
 
-   png_alloc_size_t buf_size;
-   int usr_pixel_depth;
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
+       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   {
+      *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
+   }
 
-#ifdef PNG_WRITE_FILTER_SUPPORTED
-   png_byte filters;
+   for (lp = png_ptr->row_buf + 1; i < row_bytes; i++)
+   {
+      *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
+          & 0xff);
+   }
 #endif
+}
 
-   png_debug(1, "in png_write_start_row");
+static png_size_t /* PRIVATE */
+png_setup_paeth_row(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes, const png_size_t lmins)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
 
-   usr_pixel_depth = png_ptr->usr_channels * png_ptr->usr_bit_depth;
-   buf_size = PNG_ROWBYTES(usr_pixel_depth, png_ptr->width) + 1;
+   return (png_write_filter_row_paeth_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, png_ptr->prev_row + 1, row_bytes, bpp, lmins));
+#else
+   png_bytep rp, dp, pp, cp, lp;
+   png_size_t i;
+   png_size_t sum = 0;
+   unsigned int v;
 
-   /* 1.5.6: added to allow checking in the row write code. */
-   png_ptr->transformed_pixel_depth = png_ptr->pixel_depth;
-   png_ptr->maximum_pixel_depth = (png_byte)usr_pixel_depth;
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
 
-   /* Set up row buffer */
-   png_ptr->row_buf = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
+       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   {
+      v = *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
 
-   png_ptr->row_buf[0] = PNG_FILTER_VALUE_NONE;
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
 
-#ifdef PNG_WRITE_FILTER_SUPPORTED
-   filters = png_ptr->do_filter;
+   for (lp = png_ptr->row_buf + 1, cp = png_ptr->prev_row + 1; i < row_bytes;
+        i++)
+   {
+      int a, b, c, pa, pb, pc, p;
 
-   if (png_ptr->height == 1)
-      filters &= 0xff & ~(PNG_FILTER_UP|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+      b = *pp++;
+      c = *cp++;
+      a = *lp++;
 
-   if (png_ptr->width == 1)
-      filters &= 0xff & ~(PNG_FILTER_SUB|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+      p = b - c;
+      pc = a - c;
 
-   if (filters == 0)
-      filters = PNG_FILTER_NONE;
+#ifdef PNG_USE_ABS
+      pa = abs(p);
+      pb = abs(pc);
+      pc = abs(p + pc);
+#else
+      pa = p < 0 ? -p : p;
+      pb = pc < 0 ? -pc : pc;
+      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
+#endif
 
-   png_ptr->do_filter = filters;
+      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
 
-   if (((filters & (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_AVG |
-       PNG_FILTER_PAETH)) != 0) && png_ptr->try_row == NULL)
-   {
-      int num_filters = 0;
+      v = *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
 
-      png_ptr->try_row = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
 
-      if (filters & PNG_FILTER_SUB)
-         num_filters++;
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
 
-      if (filters & PNG_FILTER_UP)
-         num_filters++;
+   return (sum);
+#endif
+}
+static void /* PRIVATE */
+png_setup_paeth_row_only(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes)
+{
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
 
-      if (filters & PNG_FILTER_AVG)
-         num_filters++;
+   (void)png_write_filter_row_paeth_sse2(png_ptr->try_row + 1,
+       png_ptr->row_buf + 1, png_ptr->prev_row + 1, row_bytes, bpp,
+       PNG_SIZE_MAX);
+#else
+   png_bytep rp, dp, pp, cp, lp;
+   png_size_t i;
 
-      if (filters & PNG_FILTER_PAETH)
-         num_filters++;
+   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
 
-      if (num_filters > 1)
-         png_ptr->tst_row = png_voidcast(png_bytep, png_malloc(png_ptr,
-             buf_size));
+   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
+       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   {
+      *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
    }
 
-   /* We only need to keep the previous row if we are using one of the following
-    * filters.
-    */
-   if ((filters & (PNG_FILTER_AVG | PNG_FILTER_UP | PNG_FILTER_PAETH)) != 0)
-      png_ptr->prev_row = png_voidcast(png_bytep,
-          png_calloc(png_ptr, buf_size));
-#endif /* WRITE_FILTER */
-
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* If interlaced, we need to set up width and height of pass */
-   if (png_ptr->interlaced != 0)
+   for (lp = png_ptr->row_buf + 1, cp = png_ptr->prev_row + 1; i < row_bytes;
+        i++)
    {
-      if ((png_ptr->transformations & PNG_INTERLACE) == 0)
-      {
-         png_ptr->num_rows = (png_ptr->height + png_pass_yinc[0] - 1 -
-             png_pass_ystart[0]) / png_pass_yinc[0];
+      int a, b, c, pa, pb, pc, p;
 
-         png_ptr->usr_width = (png_ptr->width + png_pass_inc[0] - 1 -
-             png_pass_start[0]) / png_pass_inc[0];
-      }
+      b = *pp++;
+      c = *cp++;
+      a = *lp++;
 
-      else
-      {
-         png_ptr->num_rows = png_ptr->height;
-         png_ptr->usr_width = png_ptr->width;
-      }
-   }
+      p = b - c;
+      pc = a - c;
 
-   else
+#ifdef PNG_USE_ABS
+      pa = abs(p);
+      pb = abs(pc);
+      pc = abs(p + pc);
+#else
+      pa = p < 0 ? -p : p;
+      pb = pc < 0 ? -pc : pc;
+      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
 #endif
-   {
-      png_ptr->num_rows = png_ptr->height;
-      png_ptr->usr_width = png_ptr->width;
+
+      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+
+      *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
    }
+#endif
 }
 
-/* Internal use only.  Called when finished processing a row of data. */
-void /* PRIVATE */
-png_write_finish_row(png_structrp png_ptr)
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+/* Support for png_set_filter_selection().  Every allowed filter is applied
+ * to the row and scored by png_filter_row_cost(); the row with the lowest
+ * score is written, and png_filter_row_commit() is told which one it was.
+ * The scores are in whatever units suit the scorer; only their order
+ * matters.
+ *
+ * PNG_FILTER_SELECT_ZLIB: zpredict is a deflate stream, with the same
+ * settings as the IDAT stream, which has been given every row chosen so far.
+ * Each row is ended with Z_BLOCK, so a copy of the stream can compress a
+ * candidate row by itself, using matches in the earlier rows, and report
+ * how many bits it took.
+ */
+static void
+png_zpredict_init(png_structrp png_ptr)
 {
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
-
-   /* Start of interlace block */
-   static PNG_CONST png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+   int strategy;
 
-   /* Offset to next interlace block */
-   static PNG_CONST png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+   if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
+      strategy = png_ptr->zlib_strategy;
 
-   /* Start of interlace block in the y direction */
-   static PNG_CONST png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+   else
+      strategy = PNG_Z_DEFAULT_STRATEGY;
 
-   /* Offset to next interlace block in the y direction */
-   static PNG_CONST png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+#ifdef Z_OPTIMAL
+   /* The optimal parse would make the trials far too slow; the default
+    * strategy is good enough to rank the filters.
+    */
+   if (strategy == Z_OPTIMAL)
+      strategy = Z_DEFAULT_STRATEGY;
 #endif
 
-   png_debug(1, "in png_write_finish_row");
-
-   /* Next row */
-   png_ptr->row_number++;
+   png_ptr->zpredict.zalloc = png_zalloc;
+   png_ptr->zpredict.zfree = png_zfree;
+   png_ptr->zpredict.opaque = png_ptr;
 
-   /* See if we are done */
-   if (png_ptr->row_number < png_ptr->num_rows)
-      return;
+   if (deflateInit2(&png_ptr->zpredict, png_ptr->zlib_level,
+       png_ptr->zlib_method, png_ptr->zlib_window_bits,
+       png_ptr->zlib_mem_level, strategy) != Z_OK)
+      png_error(png_ptr, "zlib failed to initialize filter selection");
 
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* If interlaced, go to next pass */
-   if (png_ptr->interlaced != 0)
-   {
-      png_ptr->row_number = 0;
-      if ((png_ptr->transformations & PNG_INTERLACE) != 0)
-      {
-         png_ptr->pass++;
-      }
+#if defined(PNG_WRITE_DEFLATE_HASH_SUPPORTED) && defined(Z_OPTIMAL)
+   if (png_ptr->zlib_hash_bytes != 0)
+      (void)deflateHash(&png_ptr->zpredict, png_ptr->zlib_hash_bytes);
+#endif
 
-      else
-      {
-         /* Loop until we find a non-zero width or height pass */
-         do
-         {
-            png_ptr->pass++;
+   png_ptr->zpredict_ready = 1;
+}
 
-            if (png_ptr->pass >= 7)
-               break;
+/* Compresses a row, ending the block with Z_BLOCK, and returns the number
+ * of bits the stream has produced since the last row.  The caller must make
+ * sure that len is no more than ZLIB_IO_MAX.
+ */
+static png_size_t
+png_zpredict_deflate(z_streamp zs, png_const_bytep row, png_size_t len)
+{
+   png_byte out[1024];
+   png_size_t bytes = 0;
+   int bits = 0;
 
-            png_ptr->usr_width = (png_ptr->width +
-                png_pass_inc[png_ptr->pass] - 1 -
-                png_pass_start[png_ptr->pass]) /
-                png_pass_inc[png_ptr->pass];
+   zs->next_in = PNGZ_INPUT_CAST(row);
+   zs->avail_in = (uInt)len;
 
-            png_ptr->num_rows = (png_ptr->height +
-                png_pass_yinc[png_ptr->pass] - 1 -
-                png_pass_ystart[png_ptr->pass]) /
-                png_pass_yinc[png_ptr->pass];
+   do
+   {
+      zs->next_out = out;
+      zs->avail_out = (uInt)(sizeof out);
+      (void)deflate(zs, Z_BLOCK);
+      bytes += (sizeof out) - zs->avail_out;
+   } while (zs->avail_out == 0);
 
-            if ((png_ptr->transformations & PNG_INTERLACE) != 0)
-               break;
+   /* Up to seven bits of the block are held back for the next byte. */
+   (void)deflatePending(zs, NULL, &bits);
 
-         } while (png_ptr->usr_width == 0 || png_ptr->num_rows == 0);
+   return bytes * 8 + (png_size_t)bits;
+}
 
-      }
+/* The other scorers work from the histogram of the filtered bytes.  This
+ * counts into four tables, one for each byte of a group of four, so that
+ * runs of the same byte value (common in filtered rows) do not wait on
+ * each other's increments; the tables are then added together in a loop
+ * that the compiler can vectorize.
+ */
+static void
+png_filter_histogram(png_const_bytep row, png_size_t len, png_uint_32p hist)
+{
+   png_uint_32 h[4][256];
+   png_size_t i;
+   int v;
 
-      /* Reset the row above the image for the next pass */
-      if (png_ptr->pass < 7)
-      {
-         if (png_ptr->prev_row != NULL)
-            memset(png_ptr->prev_row, 0,
-                (png_size_t)(PNG_ROWBYTES(png_ptr->usr_channels*
-                png_ptr->usr_bit_depth, png_ptr->width)) + 1);
+   memset(h, 0, (sizeof h));
 
-         return;
-      }
+   for (i = 0; i + 4 <= len; i += 4)
+   {
+      h[0][row[i]]++;
+      h[1][row[i+1]]++;
+      h[2][row[i+2]]++;
+      h[3][row[i+3]]++;
    }
-#endif
 
-   /* If we get here, we've just written the last row, so we need
-      to flush the compressor */
-   png_compress_IDAT(png_ptr, NULL, 0, Z_FINISH);
+   for (; i < len; i++)
+      h[0][row[i]]++;
+
+   for (v = 0; v < 256; v++)
+      hist[v] = h[0][v] + h[1][v] + h[2][v] + h[3][v];
 }
 
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-/* Pick out the correct pixels for the interlace pass.
- * The basic idea here is to go through the row with a source
- * pointer and a destination pointer (sp and dp), and copy the
- * correct pixels for the pass.  As the row gets compacted,
- * sp will always be >= dp, so we should never overwrite anything.
- * See the default: case for the easiest code to understand.
+/* Returns log2(x), for x > 0, in units of 1/256 bit.  This is done in
+ * integers so that the filter choices do not depend on the floating point
+ * arithmetic of the machine.
  */
-void /* PRIVATE */
-png_do_write_interlace(png_row_infop row_info, png_bytep row, int pass)
+static png_uint_32
+png_filter_log2(png_uint_32 x)
 {
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
-
-   /* Start of interlace block */
-   static PNG_CONST png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+   png_uint_32 y, result;
+   int n, i;
 
-   /* Offset to next interlace block */
-   static PNG_CONST png_byte  png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+   /* The integer part, then x scaled to [1,2) with 15 fraction bits. */
+   for (n = 0; (x >> n) > 1; n++)
+      ;
 
-   png_debug(1, "in png_do_write_interlace");
+   y = n > 15 ? x >> (n - 15) : x << (15 - n);
+   result = (png_uint_32)n << 8;
 
-   /* We don't have to do anything on the last pass (6) */
-   if (pass < 6)
+   /* The fraction, one bit at a time: squaring y doubles its log. */
+   for (i = 7; i >= 0; i--)
    {
-      /* Each pixel depth is handled separately */
-      switch (row_info->pixel_depth)
+      y = (y * y) >> 15;
+
+      if (y >= 65536)
       {
-         case 1:
-         {
-            png_bytep sp;
-            png_bytep dp;
-            unsigned int shift;
-            int d;
-            int value;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
+         y >>= 1;
+         result |= 1U << i;
+      }
+   }
 
-            dp = row;
-            d = 0;
-            shift = 7;
+   return result;
+}
 
-            for (i = png_pass_start[pass]; i < row_width;
-               i += png_pass_inc[pass])
-            {
-               sp = row + (png_size_t)(i >> 3);
-               value = (int)(*sp >> (7 - (int)(i & 0x07))) & 0x01;
-               d |= (value << shift);
+/* The running histogram is halved when it holds more than this many bytes,
+ * so that it follows the data that deflate will have in its window.
+ */
+#define PNG_FILTER_HIST_WINDOW 32768
 
-               if (shift == 0)
-               {
-                  shift = 7;
-                  *dp++ = (png_byte)d;
-                  d = 0;
-               }
+static png_size_t
+png_filter_row_cost(png_structrp png_ptr, png_const_bytep row, png_size_t len)
+{
+   png_uint_32 hist[256];
+   png_size_t cost = 0;
+   int v;
 
-               else
-                  shift--;
+   switch (png_ptr->filter_selection)
+   {
+      case PNG_FILTER_SELECT_ZLIB:
+      {
+         z_stream zs;
 
-            }
-            if (shift != 7)
-               *dp = (png_byte)d;
+         if (deflateCopy(&zs, &png_ptr->zpredict) != Z_OK)
+            png_error(png_ptr, "zlib failed to copy filter selection stream");
 
-            break;
-         }
+         cost = png_zpredict_deflate(&zs, row, len);
+         deflateEnd(&zs);
 
-         case 2:
-         {
-            png_bytep sp;
-            png_bytep dp;
-            unsigned int shift;
-            int d;
-            int value;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
+         return cost;
+      }
 
-            dp = row;
-            shift = 6;
-            d = 0;
+      case PNG_FILTER_SELECT_ENTROPY:
+      {
+         /* n times the Shannon entropy: sum of c * log2(n/c) */
+         png_uint_32 log_n = png_filter_log2((png_uint_32)(len - 1));
 
-            for (i = png_pass_start[pass]; i < row_width;
-               i += png_pass_inc[pass])
-            {
-               sp = row + (png_size_t)(i >> 2);
-               value = (*sp >> ((3 - (int)(i & 0x03)) << 1)) & 0x03;
-               d |= (value << shift);
+         png_filter_histogram(row + 1, len - 1, hist);
 
-               if (shift == 0)
-               {
-                  shift = 6;
-                  *dp++ = (png_byte)d;
-                  d = 0;
-               }
+         for (v = 0; v < 256; v++)
+            if (hist[v] != 0)
+               cost += hist[v] * (png_size_t)(log_n - png_filter_log2(hist[v]));
 
-               else
-                  shift -= 2;
-            }
-            if (shift != 6)
-               *dp = (png_byte)d;
+         return cost;
+      }
 
-            break;
-         }
+      case PNG_FILTER_SELECT_DISTINCT:
+      {
+         /* The number of different byte values, then MSAD */
+         png_size_t distinct = 0;
 
-         case 4:
-         {
-            png_bytep sp;
-            png_bytep dp;
-            unsigned int shift;
-            int d;
-            int value;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
+         png_filter_histogram(row + 1, len - 1, hist);
 
-            dp = row;
-            shift = 4;
-            d = 0;
-            for (i = png_pass_start[pass]; i < row_width;
-                i += png_pass_inc[pass])
+         for (v = 0; v < 256; v++)
+         {
+            if (hist[v] != 0)
             {
-               sp = row + (png_size_t)(i >> 1);
-               value = (*sp >> ((1 - (int)(i & 0x01)) << 2)) & 0x0f;
-               d |= (value << shift);
+               distinct++;
+               cost += hist[v] * (png_size_t)(v < 128 ? v : 256 - v);
+            }
+         }
 
-               if (shift == 0)
-               {
-                  shift = 4;
-                  *dp++ = (png_byte)d;
-                  d = 0;
-               }
+         return distinct * (128 * len) + cost;
+      }
 
-               else
-                  shift -= 4;
-            }
-            if (shift != 4)
-               *dp = (png_byte)d;
+      case PNG_FILTER_SELECT_HISTOGRAM:
+      {
+         /* The bits needed to code the row with the byte frequencies of the
+          * earlier rows and this one, each count starting at one.
+          */
+         png_uint_32p h = png_ptr->filter_hist;
+         png_uint_32 log_total = png_filter_log2(
+             h[256] + (png_uint_32)(len - 1) + 256);
 
-            break;
-         }
+         png_filter_histogram(row + 1, len - 1, hist);
 
-         default:
-         {
-            png_bytep sp;
-            png_bytep dp;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
-            png_size_t pixel_bytes;
+         for (v = 0; v < 256; v++)
+            if (hist[v] != 0)
+               cost += hist[v] * (png_size_t)(log_total -
+                   png_filter_log2(h[v] + hist[v] + 1));
 
-            /* Start at the beginning */
-            dp = row;
+         return cost;
+      }
 
-            /* Find out how many bytes each pixel takes up */
-            pixel_bytes = (row_info->pixel_depth >> 3);
+      default:
+         return 0;
+   }
+}
 
-            /* Loop through the row, only looking at the pixels that matter */
-            for (i = png_pass_start[pass]; i < row_width;
-               i += png_pass_inc[pass])
-            {
-               /* Find out where the original pixel is */
-               sp = row + (png_size_t)i * pixel_bytes;
+static void
+png_filter_row_commit(png_structrp png_ptr, png_const_bytep row,
+    png_size_t len)
+{
+   switch (png_ptr->filter_selection)
+   {
+      case PNG_FILTER_SELECT_ZLIB:
+         (void)png_zpredict_deflate(&png_ptr->zpredict, row, len);
+         break;
 
-               /* Move the pixel */
-               if (dp != sp)
-                  memcpy(dp, sp, pixel_bytes);
+      case PNG_FILTER_SELECT_HISTOGRAM:
+      {
+         png_uint_32p h = png_ptr->filter_hist;
+         png_uint_32 hist[256];
+         int v;
 
-               /* Next pixel */
-               dp += pixel_bytes;
+         png_filter_histogram(row + 1, len - 1, hist);
+
+         for (v = 0; v < 256; v++)
+            h[v] += hist[v];
+         h[256] += (png_uint_32)(len - 1);
+
+         while (h[256] > PNG_FILTER_HIST_WINDOW)
+         {
+            h[256] = 0;
+            for (v = 0; v < 256; v++)
+            {
+               h[v] >>= 1;
+               h[256] += h[v];
             }
-            break;
          }
+         break;
       }
-      /* Set new row width */
-      row_info->width = (row_info->width +
-          png_pass_inc[pass] - 1 -
-          png_pass_start[pass]) /
-          png_pass_inc[pass];
 
-      row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth,
-          row_info->width);
+      default:
+         break;
    }
 }
-#endif
-
-
-/* This filters the row, chooses which filter to use, if it has not already
- * been specified by the application, and then writes the row out with the
- * chosen filter.
- */
-static void /* PRIVATE */
-png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
-    png_size_t row_bytes);
 
-#ifdef PNG_WRITE_FILTER_SUPPORTED
-static png_size_t /* PRIVATE */
-png_setup_sub_row(png_structrp png_ptr, const png_uint_32 bpp,
-    const png_size_t row_bytes, const png_size_t lmins)
+static png_bytep
+png_select_filter_row(png_structrp png_ptr, png_uint_32 bpp,
+    png_size_t row_bytes, unsigned int filter_to_do)
 {
-   png_bytep rp, dp, lp;
-   png_size_t i;
-   png_size_t sum = 0;
-   unsigned int v;
+   png_bytep best_row = png_ptr->row_buf;
+   png_size_t mins = PNG_SIZE_MAX;
+   int v;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+   if (png_ptr->filter_selection == PNG_FILTER_SELECT_ZLIB &&
+       png_ptr->zpredict_ready == 0)
+      png_zpredict_init(png_ptr);
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1; i < bpp;
-        i++, rp++, dp++)
-   {
-      v = *dp = *rp;
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
-   }
+   else if (png_ptr->filter_selection == PNG_FILTER_SELECT_HISTOGRAM &&
+       png_ptr->filter_hist == NULL)
+      png_ptr->filter_hist = png_voidcast(png_uint_32p, png_calloc(png_ptr,
+          257 * (sizeof (png_uint_32))));
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes;
-      i++, rp++, lp++, dp++)
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; v++)
    {
-      v = *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+      png_bytep row = png_ptr->try_row;
+      png_size_t cost;
+
+      if ((filter_to_do & (PNG_FILTER_NONE << v)) == 0)
+         continue;
+
+      switch (v)
+      {
+         case PNG_FILTER_VALUE_NONE:
+            row = png_ptr->row_buf;
+            break;
+
+         case PNG_FILTER_VALUE_SUB:
+            png_setup_sub_row_only(png_ptr, bpp, row_bytes);
+            break;
+
+         case PNG_FILTER_VALUE_UP:
+            png_setup_up_row_only(png_ptr, row_bytes);
+            break;
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
+         case PNG_FILTER_VALUE_AVG:
+            png_setup_avg_row_only(png_ptr, bpp, row_bytes);
+            break;
+
+         default:
+            png_setup_paeth_row_only(png_ptr, bpp, row_bytes);
+            break;
+      }
+
+      cost = png_filter_row_cost(png_ptr, row, row_bytes + 1);
+
+      /* Ties go to the lower filter type, as they do for MSAD. */
+      if (cost < mins)
+      {
+         mins = cost;
+         best_row = row;
+         if (row == png_ptr->try_row && png_ptr->tst_row != NULL)
+         {
+            png_ptr->try_row = png_ptr->tst_row;
+            png_ptr->tst_row = best_row;
+         }
+      }
    }
 
-   return (sum);
+   png_filter_row_commit(png_ptr, best_row, row_bytes + 1);
+
+   return best_row;
 }
 
-static void /* PRIVATE */
-png_setup_sub_row_only(png_structrp png_ptr, const png_uint_32 bpp,
-    const png_size_t row_bytes)
+/* PNG_FILTER_SELECT_BEAM: each row is copied to beam_data, after a byte
+ * holding its pass number, as it is written.  The space for the whole image
+ * is allocated with the first row.
+ */
+static void
+png_beam_hold_row(png_structrp png_ptr, png_size_t row_bytes)
 {
-   png_bytep rp, dp, lp;
-   png_size_t i;
+   png_bytep dp;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
-
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1; i < bpp;
-        i++, rp++, dp++)
+   if (png_ptr->beam_data == NULL)
    {
-      *dp = *rp;
-   }
+      png_alloc_size_t size = 0;
+      png_uint_32 rows = 0;
+      int pass;
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes;
-      i++, rp++, lp++, dp++)
-   {
-      *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
-   }
-}
+      for (pass = 0; pass < 7; pass++)
+      {
+         png_uint_32 width = png_ptr->width;
+         png_uint_32 height = png_ptr->height;
+         png_alloc_size_t rb;
 
-static png_size_t /* PRIVATE */
-png_setup_up_row(png_structrp png_ptr, const png_size_t row_bytes,
-    const png_size_t lmins)
-{
-   png_bytep rp, dp, pp;
-   png_size_t i;
-   png_size_t sum = 0;
-   unsigned int v;
+         if (png_ptr->interlaced != 0)
+         {
+            width = PNG_PASS_COLS(width, pass);
+            height = PNG_PASS_ROWS(height, pass);
+         }
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+         else if (pass > 0)
+            break;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < row_bytes;
-       i++, rp++, pp++, dp++)
-   {
-      v = *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+         if (width == 0 || height == 0)
+            continue;
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
-   }
+         rb = PNG_ROWBYTES(png_ptr->pixel_depth, width) + 1;
 
-   return (sum);
-}
-static void /* PRIVATE */
-png_setup_up_row_only(png_structrp png_ptr, const png_size_t row_bytes)
-{
-   png_bytep rp, dp, pp;
-   png_size_t i;
+         if (rb > (PNG_SIZE_MAX - size) / height)
+            png_error(png_ptr, "image too large for beam filter selection");
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+         size += rb * height;
+         rows += height;
+      }
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < row_bytes;
-       i++, rp++, pp++, dp++)
-   {
-      *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
+      png_ptr->beam_row_len = png_voidcast(png_uint_32p, png_malloc(png_ptr,
+          rows * (png_alloc_size_t)(sizeof (png_uint_32))));
+      png_ptr->beam_data = png_voidcast(png_bytep, png_malloc(png_ptr, size));
+      png_ptr->beam_data_size = size;
+      png_ptr->beam_data_used = 0;
+      png_ptr->beam_max_rows = rows;
+      png_ptr->beam_num_rows = 0;
    }
+
+   if (png_ptr->beam_num_rows >= png_ptr->beam_max_rows ||
+       row_bytes + 1 > png_ptr->beam_data_size - png_ptr->beam_data_used)
+      png_error(png_ptr, "too many rows for beam filter selection");
+
+   dp = png_ptr->beam_data + png_ptr->beam_data_used;
+   dp[0] = png_ptr->pass;
+   memcpy(dp + 1, png_ptr->row_buf + 1, row_bytes);
+
+   png_ptr->beam_data_used += row_bytes + 1;
+   png_ptr->beam_row_len[png_ptr->beam_num_rows++] = (png_uint_32)row_bytes;
 }
 
-static png_size_t /* PRIVATE */
-png_setup_avg_row(png_structrp png_ptr, const png_uint_32 bpp,
-    const png_size_t row_bytes, const png_size_t lmins)
+/* Applies one filter to a held row, using the row above it (or a row of
+ * zeros at the start of a pass), and returns the result in "out".  The
+ * png_setup_*_row_only() functions work on row_buf, prev_row and try_row,
+ * so those are pointed at the held rows while they run.
+ */
+static void
+png_beam_filter_row(png_structrp png_ptr, int filter, png_bytep row,
+    png_bytep prev, png_bytep out, png_uint_32 bpp, png_size_t row_bytes)
 {
-   png_bytep rp, dp, pp, lp;
-   png_uint_32 i;
-   png_size_t sum = 0;
-   unsigned int v;
+   png_bytep row_buf = png_ptr->row_buf;
+   png_bytep prev_row = png_ptr->prev_row;
+   png_bytep try_row = png_ptr->try_row;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
+   png_ptr->row_buf = row;
+   png_ptr->prev_row = prev;
+   png_ptr->try_row = out;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   switch (filter)
    {
-      v = *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
+      case PNG_FILTER_VALUE_NONE:
+         out[0] = PNG_FILTER_VALUE_NONE;
+         memcpy(out + 1, row + 1, row_bytes);
+         break;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
-   }
+      case PNG_FILTER_VALUE_SUB:
+         png_setup_sub_row_only(png_ptr, bpp, row_bytes);
+         break;
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes; i++)
-   {
-      v = *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
-          & 0xff);
+      case PNG_FILTER_VALUE_UP:
+         png_setup_up_row_only(png_ptr, row_bytes);
+         break;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+      case PNG_FILTER_VALUE_AVG:
+         png_setup_avg_row_only(png_ptr, bpp, row_bytes);
+         break;
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
+      default:
+         png_setup_paeth_row_only(png_ptr, bpp, row_bytes);
+         break;
    }
 
-   return (sum);
+   png_ptr->row_buf = row_buf;
+   png_ptr->prev_row = prev_row;
+   png_ptr->try_row = try_row;
 }
-static void /* PRIVATE */
-png_setup_avg_row_only(png_structrp png_ptr, const png_uint_32 bpp,
-    const png_size_t row_bytes)
+
+struct png_beam_candidate
 {
-   png_bytep rp, dp, pp, lp;
-   png_uint_32 i;
+   png_size_t bits;  /* bits used by the rows so far */
+   int slot;         /* index of its deflate stream */
+   int parent;       /* its rank in the beam for the previous row */
+   int filter;
+};
+
+/* The working memory of png_write_beam_rows(), kept in png_struct so that
+ * png_beam_destroy() can free it if png_error() is called in the middle of
+ * the search.  The streams are allocated cleared, so deflateEnd() can be
+ * called on every one of them, in use or not.
+ */
+struct png_beam_state
+{
+   png_bytep zero_row;
+   png_bytep out[PNG_FILTER_VALUE_LAST];
+   png_bytep choice;
+   png_bytep seq;
+   z_streamp zs;
+   int num_slots;
+   int *free_slot;
+   int *beam_slot;
+   png_size_t *beam_bits;
+   struct png_beam_candidate *cand;
+};
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
+void /* PRIVATE */
+png_beam_destroy(png_structrp png_ptr)
+{
+   struct png_beam_state *st = png_ptr->beam;
+   int i;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
-   {
-      *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
-   }
+   if (st == NULL)
+      return;
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes; i++)
-   {
-      *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
-          & 0xff);
-   }
+   png_ptr->beam = NULL;
+
+   if (st->zs != NULL)
+      for (i = 0; i < st->num_slots; i++)
+         deflateEnd(&st->zs[i]);
+
+   png_free(png_ptr, st->cand);
+   png_free(png_ptr, st->beam_bits);
+   png_free(png_ptr, st->beam_slot);
+   png_free(png_ptr, st->free_slot);
+   png_free(png_ptr, st->zs);
+   png_free(png_ptr, st->seq);
+   png_free(png_ptr, st->choice);
+   for (i = PNG_FILTER_VALUE_NONE; i < PNG_FILTER_VALUE_LAST; i++)
+      png_free(png_ptr, st->out[i]);
+   png_free(png_ptr, st->zero_row);
+   png_free(png_ptr, st);
 }
 
-static png_size_t /* PRIVATE */
-png_setup_paeth_row(png_structrp png_ptr, const png_uint_32 bpp,
-    const png_size_t row_bytes, const png_size_t lmins)
+/* The beam search.  For each row every filter is tried on a copy of the
+ * deflate stream of every sequence in the beam, exactly as
+ * png_select_filter_row() does for a single stream, and the
+ * filter_beam_width sequences that have used the fewest bits go on to the
+ * next row.  Ties go to the sequence that was better on the previous row,
+ * then to the lower filter type, so the result does not depend on anything
+ * but the image and the settings.  The parent and filter of each survivor
+ * are recorded, and the winning sequence is traced back from the last row.
+ * The rows are then filtered again and compressed into the IDAT stream.
+ */
+static void /* PRIVATE */
+png_write_beam_rows(png_structrp png_ptr)
 {
-   png_bytep rp, dp, pp, cp, lp;
-   png_size_t i;
-   png_size_t sum = 0;
-   unsigned int v;
-
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
+   unsigned int filter_to_do = png_ptr->do_filter;
+   png_uint_32 bpp = (png_ptr->pixel_depth + 7) >> 3;
+   png_uint_32 num_rows = png_ptr->beam_num_rows;
+   int width = png_ptr->filter_beam_width;
+   int num_filters = 0, num_beams = 1, num_slots, num_free, i, k, v;
+   png_size_t max_bytes = 0;
+   png_uint_32 r;
+   png_bytep row, prev, zero_row, out[PNG_FILTER_VALUE_LAST], choice, seq;
+   z_streamp zs;
+   int *free_slot, *beam_slot;
+   png_size_t *beam_bits;
+   struct png_beam_candidate *cand;
+   struct png_beam_state *st;
+
+   png_debug(1, "in png_write_beam_rows");
+
+   if (width <= 0)
+      width = PNG_FILTER_BEAM_WIDTH_DEFAULT;
+
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; v++)
+      if ((filter_to_do & (PNG_FILTER_NONE << v)) != 0)
+         num_filters++;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   for (r = 0; r < num_rows; r++)
+      if (png_ptr->beam_row_len[r] > max_bytes)
+         max_bytes = png_ptr->beam_row_len[r];
+
+   if (num_rows > PNG_SIZE_MAX / (2 * (png_size_t)width))
+      png_error(png_ptr, "image too large for beam filter selection");
+
+   num_slots = width * (num_filters + 1);
+
+   png_beam_destroy(png_ptr);
+   st = png_voidcast(struct png_beam_state *, png_calloc(png_ptr, sizeof *st));
+   png_ptr->beam = st;
+
+   zero_row = st->zero_row = png_voidcast(png_bytep, png_calloc(png_ptr,
+       max_bytes + 1));
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; v++)
+      out[v] = st->out[v] = png_voidcast(png_bytep, png_malloc(png_ptr,
+          max_bytes + 1));
+   choice = st->choice = png_voidcast(png_bytep, png_malloc(png_ptr,
+       num_rows * 2 * (png_alloc_size_t)width));
+   seq = st->seq = png_voidcast(png_bytep, png_malloc(png_ptr, num_rows));
+   zs = st->zs = png_voidcast(z_streamp, png_calloc(png_ptr,
+       num_slots * (png_alloc_size_t)(sizeof *zs)));
+   st->num_slots = num_slots;
+   free_slot = st->free_slot = png_voidcast(int *, png_malloc(png_ptr,
+       num_slots * (png_alloc_size_t)(sizeof (int))));
+   beam_slot = st->beam_slot = png_voidcast(int *, png_malloc(png_ptr,
+       width * (png_alloc_size_t)(sizeof (int))));
+   beam_bits = st->beam_bits = png_voidcast(png_size_t *, png_malloc(png_ptr,
+       width * (png_alloc_size_t)(sizeof (png_size_t))));
+   cand = st->cand = png_voidcast(struct png_beam_candidate *,
+       png_malloc(png_ptr,
+       width * num_filters * (png_alloc_size_t)(sizeof *cand)));
+
+   num_free = 0;
+   for (i = num_slots - 1; i > 0; i--)
+      free_slot[num_free++] = i;
+
+   /* The search starts from a fresh stream with the IDAT settings. */
+   if (png_ptr->zpredict_ready != 0)
+      deflateEnd(&png_ptr->zpredict);
+   png_ptr->zpredict_ready = 0;
+   png_zpredict_init(png_ptr);
+
+   if (deflateCopy(&zs[0], &png_ptr->zpredict) != Z_OK)
+      png_error(png_ptr, "zlib failed to copy filter selection stream");
+
+   deflateEnd(&png_ptr->zpredict);
+   png_ptr->zpredict_ready = 0;
+   beam_slot[0] = 0;
+   beam_bits[0] = 0;
+
+   for (r = 0, row = png_ptr->beam_data, prev = zero_row; r < num_rows; r++)
    {
-      v = *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
+      png_size_t row_bytes = png_ptr->beam_row_len[r];
+      int num_cand = 0, num_next;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
-   }
+      if (r == 0 || row[0] != prev[0])
+         prev = zero_row;
 
-   for (lp = png_ptr->row_buf + 1, cp = png_ptr->prev_row + 1; i < row_bytes;
-        i++)
-   {
-      int a, b, c, pa, pb, pc, p;
+      for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; v++)
+         if ((filter_to_do & (PNG_FILTER_NONE << v)) != 0)
+            png_beam_filter_row(png_ptr, v, row, prev, out[v], bpp, row_bytes);
 
-      b = *pp++;
-      c = *cp++;
-      a = *lp++;
+      for (k = 0; k < num_beams; k++)
+      {
+         for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; v++)
+         {
+            struct png_beam_candidate *c = &cand[num_cand];
 
-      p = b - c;
-      pc = a - c;
+            if ((filter_to_do & (PNG_FILTER_NONE << v)) == 0)
+               continue;
 
-#ifdef PNG_USE_ABS
-      pa = abs(p);
-      pb = abs(pc);
-      pc = abs(p + pc);
-#else
-      pa = p < 0 ? -p : p;
-      pb = pc < 0 ? -pc : pc;
-      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
-#endif
+            c->slot = free_slot[--num_free];
+            c->parent = k;
+            c->filter = v;
 
-      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+            if (deflateCopy(&zs[c->slot], &zs[beam_slot[k]]) != Z_OK)
+               png_error(png_ptr,
+                   "zlib failed to copy filter selection stream");
 
-      v = *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
+            c->bits = beam_bits[k] +
+                png_zpredict_deflate(&zs[c->slot], out[v], row_bytes + 1);
+            num_cand++;
+         }
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+         deflateEnd(&zs[beam_slot[k]]);
+         free_slot[num_free++] = beam_slot[k];
+      }
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
-   }
+      /* Move the best candidates to the front, in order.  The candidates
+       * are already in (parent, filter) order, so taking the first of equal
+       * ones breaks ties as described above.
+       */
+      num_next = num_cand < width ? num_cand : width;
 
-   return (sum);
-}
-static void /* PRIVATE */
-png_setup_paeth_row_only(png_structrp png_ptr, const png_uint_32 bpp,
-    const png_size_t row_bytes)
-{
-   png_bytep rp, dp, pp, cp, lp;
-   png_size_t i;
+      for (k = 0; k < num_next; k++)
+      {
+         int best = k;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
+         for (i = k + 1; i < num_cand; i++)
+            if (cand[i].bits < cand[best].bits)
+               best = i;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
+         if (best != k)
+         {
+            struct png_beam_candidate t = cand[best];
+
+            /* Shift rather than swap, to keep the rest in order. */
+            memmove(&cand[k + 1], &cand[k], (best - k) * (sizeof *cand));
+            cand[k] = t;
+         }
+
+         beam_slot[k] = cand[k].slot;
+         beam_bits[k] = cand[k].bits;
+         choice[2 * (r * (png_size_t)width + k)] = (png_byte)cand[k].parent;
+         choice[2 * (r * (png_size_t)width + k) + 1] = (png_byte)cand[k].filter;
+      }
+
+      for (i = num_next; i < num_cand; i++)
+      {
+         deflateEnd(&zs[cand[i].slot]);
+         free_slot[num_free++] = cand[i].slot;
+      }
+
+      num_beams = num_next;
+      prev = row;
+      row += row_bytes + 1;
+   }
+
+   for (k = 0; k < num_beams; k++)
+      deflateEnd(&zs[beam_slot[k]]);
+
+   /* The best sequence is first in the beam after the last row. */
+   for (r = num_rows, k = 0; r > 0; r--)
    {
-      *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
+      seq[r - 1] = choice[2 * ((r - 1) * (png_size_t)width + k) + 1];
+      k = choice[2 * ((r - 1) * (png_size_t)width + k)];
    }
 
-   for (lp = png_ptr->row_buf + 1, cp = png_ptr->prev_row + 1; i < row_bytes;
-        i++)
+   for (r = 0, row = png_ptr->beam_data, prev = zero_row; r < num_rows; r++)
    {
-      int a, b, c, pa, pb, pc, p;
+      png_size_t row_bytes = png_ptr->beam_row_len[r];
 
-      b = *pp++;
-      c = *cp++;
-      a = *lp++;
+      if (r == 0 || row[0] != prev[0])
+         prev = zero_row;
 
-      p = b - c;
-      pc = a - c;
+      png_beam_filter_row(png_ptr, seq[r], row, prev, out[0], bpp, row_bytes);
+      png_compress_IDAT(png_ptr, out[0], row_bytes + 1, Z_NO_FLUSH);
 
-#ifdef PNG_USE_ABS
-      pa = abs(p);
-      pb = abs(pc);
-      pc = abs(p + pc);
-#else
-      pa = p < 0 ? -p : p;
-      pb = pc < 0 ? -pc : pc;
-      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
-#endif
+      prev = row;
+      row += row_bytes + 1;
+   }
 
-      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+   png_beam_destroy(png_ptr);
 
-      *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
-   }
+   png_free(png_ptr, png_ptr->beam_data);
+   png_ptr->beam_data = NULL;
+   png_free(png_ptr, png_ptr->beam_row_len);
+   png_ptr->beam_row_len = NULL;
+   png_ptr->beam_num_rows = 0;
 }
+#endif /* WRITE_FILTER_SELECTION */
 #endif /* WRITE_FILTER */
 
 void /* PRIVATE */
@@ -2571,16 +4040,44 @@ png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
    mins = PNG_SIZE_MAX - 256/* so we can detect potential overflow of the
                                running sum */;
 
+#ifdef PNG_WRITE_FILTER_SELECTION_SUPPORTED
+   /* The beam search needs the whole image, so the rows are kept until the
+    * last one arrives.  Once one row has been held they all must be.
+    */
+   if (png_ptr->beam_data != NULL ||
+       (png_ptr->filter_selection == PNG_FILTER_SELECT_BEAM &&
+       (filter_to_do & (filter_to_do - 1)) != 0 &&
+       PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->width) < ZLIB_IO_MAX))
+   {
+      png_beam_hold_row(png_ptr, row_bytes);
+      png_write_filtered_row(png_ptr, NULL, row_bytes + 1);
+      return;
+   }
+
+   /* A scorer other than MSAD, and more than one filter to choose from.
+    * The limit on row_bytes keeps the scores from overflowing.
+    */
+   if (png_ptr->filter_selection != PNG_FILTER_SELECT_MSAD &&
+       (filter_to_do & (filter_to_do - 1)) != 0 && row_bytes < ZLIB_IO_MAX &&
+       row_bytes < (PNG_SIZE_MAX >> 16))
+   {
+      png_write_filtered_row(png_ptr,
+          png_select_filter_row(png_ptr, bpp, row_bytes, filter_to_do),
+          row_bytes + 1);
+      return;
+   }
+#endif
+
    /* The prediction method we use is to find which method provides the
     * smallest value when summing the absolute values of the distances
     * from zero, using anything >= 128 as negative numbers.  This is known
     * as the "minimum sum of absolute differences" heuristic.  Other
     * heuristics are the "weighted minimum sum of absolute differences"
     * (experimental and can in theory improve compression), and the "zlib
-    * predictive" method (not implemented yet), which does test compressions
-    * of lines using different filter methods, and then chooses the
-    * (series of) filter(s) that give minimum compressed data size (VERY
-    * computationally expensive).
+    * predictive" method (PNG_FILTER_SELECT_ZLIB, see png_select_filter_row()
+    * above), which does test compressions of lines using different filter
+    * methods, and then chooses the filter that gives minimum compressed data
+    * size (VERY computationally expensive).
     *
     * GRR 980525:  consider also
     *
@@ -2752,9 +4249,15 @@ png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
 {
    png_debug(1, "in png_write_filtered_row");
 
-   png_debug1(2, "filter = %d", filtered_row[0]);
+   /* NULL means the row has been held back by png_beam_hold_row(); only the
+    * row counters are updated.
+    */
+   if (filtered_row != NULL)
+   {
+      png_debug1(2, "filter = %d", filtered_row[0]);
 
-   png_compress_IDAT(png_ptr, filtered_row, full_row_length, Z_NO_FLUSH);
+      png_compress_IDAT(png_ptr, filtered_row, full_row_length, Z_NO_FLUSH);
+   }
 
 #ifdef PNG_WRITE_FILTER_SUPPORTED
    /* Swap the current and previous rows */
@@ -139,18 +139,39 @@ local void tr_static_init OF((void));
 local void init_block     OF((deflate_state *s));
 local void pqdownheap     OF((deflate_state *s, ct_data *tree, int k));
 local void gen_bitlen     OF((deflate_state *s, tree_desc *desc));
+local int  pm_lengths     OF((deflate_state *s, tree_desc *desc));
+local void pm_bitlen      OF((deflate_state *s, tree_desc *desc));
+local void pm_keep        OF((deflate_state *s, tree_desc *desc));
+local void pm_apply       OF((deflate_state *s, tree_desc *desc,
+                              const uch *len));
 local void gen_codes      OF((ct_data *tree, int max_code, ushf *bl_count));
 local void build_tree     OF((deflate_state *s, tree_desc *desc));
 local void scan_tree      OF((deflate_state *s, ct_data *tree, int max_code));
 local void send_tree      OF((deflate_state *s, ct_data *tree, int max_code));
 local int  build_bl_tree  OF((deflate_state *s));
+local int  build_trees    OF((deflate_state *s));
 local void send_all_trees OF((deflate_state *s, int lcodes, int dcodes,
                               int blcodes));
 local void compress_block OF((deflate_state *s, const ct_data *ltree,
-                              const ct_data *dtree));
+                              const ct_data *dtree, const ushf *dbuf,
+                              const uchf *lbuf, unsigned nsym));
+local void flush_range    OF((deflate_state *s, charf *buf, ulg stored_len,
+                              int last, const ushf *dbuf, const uchf *lbuf,
+                              unsigned nsym));
+local ulg  split_cost     OF((const ush *log2, const ulg *all,
+                              const ulg *part, int n, int right));
+local unsigned split_point OF((deflate_state *s, unsigned from, unsigned to));
+local ulg  split_count    OF((deflate_state *s, const ushf *dbuf,
+                              const uchf *lbuf, unsigned from, unsigned to));
+local ulg  split_bits     OF((deflate_state *s, unsigned from, unsigned to));
+local void split_range    OF((deflate_state *s, unsigned from, unsigned to,
+                              int depth));
+local int  split_block    OF((deflate_state *s, charf *buf, ulg stored_len,
+                              int last));
 local int  detect_data_type OF((deflate_state *s));
 local unsigned bi_reverse OF((unsigned value, int length));
 local void bi_windup      OF((deflate_state *s));
+local void skip_bits      OF((deflate_state *s, ulg length));
 local void bi_flush       OF((deflate_state *s));
 
 #ifdef GEN_TREES_H
@@ -473,6 +494,201 @@ local void pqdownheap(s, tree, k)
     s->heap[k] = v;
 }
 
+/* ===========================================================================
+ * Package-merge, see deflateHuffman() in zlib.h: the optimal bit lengths no
+ * longer than max_length.  The leaves, in increasing order of frequency, are
+ * the deepest list.  Each shallower list merges the leaves with the pairs
+ * ("packages") of the list below it.  The first 2n-2 items of the shallowest
+ * list are selected, and so are the items making up each selected package;
+ * the length of a leaf is the number of lists in which it was selected.  No
+ * list can have more than 2n-1 items.
+ */
+#define PM_ITEMS (2*L_CODES)
+
+#define PM_LIT  1
+#define PM_DIST 2
+#define PM_BL   4
+
+struct pm_state_s {
+    int overflow;                  /* the trees with a code too long */
+    int merge;                     /* use pm_bitlen() for the bl_tree */
+    uch lit_len[L_CODES];          /* lengths from package-merge */
+    uch dist_len[D_CODES];
+    ulg lit_delta, dist_delta;     /* and the change they make to opt_len */
+    struct ct_data_s ltree[HEAP_SIZE];      /* the trees from the */
+    struct ct_data_s dtree[2*D_CODES+1];    /* heuristic */
+    struct ct_data_s bl_tree[2*BL_CODES+1];
+    int bl_max, max_blindex;
+    ulg opt_len;
+    int sym[L_CODES];              /* the leaves, least frequent first */
+    ulg freq[L_CODES];             /* their frequencies */
+    uch bits[L_CODES];             /* and their new lengths */
+    ulg weight[2][PM_ITEMS];       /* the current list and the one below it */
+    uch leaf[MAX_BITS][PM_ITEMS];  /* which items of each list are leaves */
+};
+
+/* ===========================================================================
+ * Set pm->sym[] and pm->freq[] to the leaves of the tree, least frequent
+ * first, and pm->bits[] to their optimal lengths, and return their number.
+ * IN assertion: the same as gen_bitlen().
+ */
+local int pm_lengths(s, desc)
+    deflate_state *s;
+    tree_desc *desc;    /* the tree descriptor */
+{
+    struct pm_state_s FAR *pm = s->pm;
+    ct_data *tree        = desc->dyn_tree;
+    int max_code         = desc->max_code;
+    int max_length       = desc->stat_desc->max_length;
+    ulg *list, *below, w;
+    int n = 0;          /* number of leaves */
+    int items, packages;
+    int h, i, j, k, d;
+
+    for (h = HEAP_SIZE-1; h > s->heap_max; h--)
+        if (s->heap[h] <= max_code) {
+            pm->bits[n] = 0;
+            pm->freq[n] = tree[s->heap[h]].Freq;
+            pm->sym[n++] = s->heap[h];
+        }
+
+    /* Build the lists from the deepest up.  On equal weights the leaf goes
+     * first, which keeps the selected packages, and so the longest codes,
+     * as few as possible.
+     */
+    list = pm->weight[0];
+    for (i = 0; i < n; i++) {
+        list[i] = pm->freq[i];
+        pm->leaf[max_length-1][i] = 1;
+    }
+    items = n;
+    for (d = max_length-2; d >= 0; d--) {
+        below = list;
+        list = pm->weight[(max_length-1-d) & 1];
+        packages = items >> 1;
+        i = j = k = 0;
+        while (j < packages) {
+            w = below[2*j] + below[2*j+1];
+            if (i < n && pm->freq[i] <= w) {
+                list[k] = pm->freq[i++];
+                pm->leaf[d][k++] = 1;
+            } else {
+                list[k] = w;
+                pm->leaf[d][k++] = 0;
+                j++;
+            }
+        }
+        while (i < n) {
+            list[k] = pm->freq[i++];
+            pm->leaf[d][k++] = 1;
+        }
+        items = k;
+    }
+
+    /* Select from the shallowest down.  The leaves in a list are in the
+     * same order as sym[], so the leaves selected are always its first ones.
+     */
+    items = 2*n-2;
+    for (d = 0; d < max_length; d++) {
+        for (i = j = 0; i < items; i++)
+            j += pm->leaf[d][i];
+        for (i = 0; i < j; i++)
+            pm->bits[i]++;
+        items = (items - j) << 1;
+    }
+    Assert(items == 0, "package-merge selection");
+    return n;
+}
+
+/* ===========================================================================
+ * Replace the lengths set by the first pass of gen_bitlen() with the optimal
+ * limited ones, updating bl_count and opt_len.
+ * IN assertion: the same as gen_bitlen(), and the field len holds the
+ *     lengths of the first pass, limited to max_length.
+ */
+local void pm_bitlen(s, desc)
+    deflate_state *s;
+    tree_desc *desc;    /* the tree descriptor */
+{
+    struct pm_state_s FAR *pm = s->pm;
+    ct_data *tree = desc->dyn_tree;
+    int n = pm_lengths(s, desc);
+    int i, k, d;
+
+    for (d = 0; d <= MAX_BITS; d++) s->bl_count[d] = 0;
+    for (i = 0; i < n; i++) {
+        k = pm->sym[i];
+        d = pm->bits[i];
+        s->bl_count[d]++;
+        if ((unsigned) tree[k].Len != (unsigned) d) {
+            Tracev((stderr,"code %d bits %d->%d\n", k, tree[k].Len, d));
+            s->opt_len += ((ulg)d - tree[k].Len) * tree[k].Freq;
+            tree[k].Len = (ush)d;
+        }
+    }
+}
+
+/* ===========================================================================
+ * Keep the optimal limited lengths of the literal or distance tree, and the
+ * change to opt_len that they would make, for build_trees() to try after the
+ * heuristic.  For the bit length tree only note that it had to be limited.
+ * IN assertion: the same as gen_bitlen(), and the field len holds the
+ *     lengths from the heuristic.
+ */
+local void pm_keep(s, desc)
+    deflate_state *s;
+    tree_desc *desc;    /* the tree descriptor */
+{
+    struct pm_state_s FAR *pm = s->pm;
+    ct_data *tree = desc->dyn_tree;
+    int max_code  = desc->max_code;
+    uch *len;
+    ulg delta = 0;
+    int n, i, k;
+
+    if (desc == &s->bl_desc) {
+        pm->overflow |= PM_BL;
+        return;
+    }
+    len = desc == &s->l_desc ? pm->lit_len : pm->dist_len;
+    for (k = 0; k <= max_code; k++)
+        len[k] = (uch)tree[k].Len;
+    n = pm_lengths(s, desc);
+    for (i = 0; i < n; i++) {
+        k = pm->sym[i];
+        len[k] = (uch)pm->bits[i];
+        delta += ((ulg)pm->bits[i] - tree[k].Len) * tree[k].Freq;
+    }
+    if (desc == &s->l_desc) {
+        pm->overflow |= PM_LIT;
+        pm->lit_delta = delta;
+    } else {
+        pm->overflow |= PM_DIST;
+        pm->dist_delta = delta;
+    }
+}
+
+/* ===========================================================================
+ * Give the codes of a tree built by build_tree() the lengths kept by
+ * pm_keep(), and generate the codes again.
+ */
+local void pm_apply(s, desc, len)
+    deflate_state *s;
+    tree_desc *desc;    /* the tree descriptor */
+    const uch *len;     /* the lengths kept */
+{
+    ct_data *tree = desc->dyn_tree;
+    int max_code  = desc->max_code;
+    int n;
+
+    for (n = 0; n <= MAX_BITS; n++) s->bl_count[n] = 0;
+    for (n = 0; n <= max_code; n++) {
+        tree[n].Len = len[n];
+        if (len[n] != 0) s->bl_count[len[n]]++;
+    }
+    gen_codes(tree, max_code, s->bl_count);
+}
+
 /* ===========================================================================
  * Compute the optimal bit lengths for a tree and update the total bit length
  * for the current block.
@@ -528,6 +744,11 @@ local void gen_bitlen(s, desc)
     Tracev((stderr,"\nbit length overflow\n"));
     /* This happens for example on obj2 and pic of the Calgary corpus */
 
+    if (s->huff_optimal && s->pm != Z_NULL && s->pm->merge) {
+        pm_bitlen(s, desc);     /* the bit length tree, see build_trees() */
+        return;
+    }
+
     /* Find the first bit length which could increase: */
     do {
         bits = max_length-1;
@@ -559,6 +780,7 @@ local void gen_bitlen(s, desc)
             n--;
         }
     }
+    if (s->huff_optimal && s->pm != Z_NULL) pm_keep(s, desc);
 }
 
 /* ===========================================================================
@@ -826,6 +1048,76 @@ local int build_bl_tree(s)
     return max_blindex;
 }
 
+/* ===========================================================================
+ * Construct the literal, distance and bit length trees, and return the index
+ * in bl_order of the last bit length code to send.  opt_len and static_len
+ * are updated.  With deflateHuffman(), if a code was too long the codes that
+ * had to be limited are given the lengths from package-merge instead, and
+ * the bit length tree is built again.  That takes the fewest bits for the
+ * symbols, but the trees can then take more bits to send, so the result of
+ * the heuristic is kept if it is no larger.  Blocks whose codes all fit take
+ * no longer than without deflateHuffman().
+ */
+local int build_trees(s)
+    deflate_state *s;
+{
+    struct pm_state_s FAR *pm;
+    ulg data_len;       /* opt_len of the literal and distance codes */
+    int max_blindex, n;
+
+    if (s->huff_optimal && s->pm == Z_NULL)
+        s->pm = (struct pm_state_s FAR *)
+                ZALLOC(s->strm, 1, sizeof(struct pm_state_s));
+    pm = s->huff_optimal ? s->pm : Z_NULL;  /* if Z_NULL, the heuristic */
+    if (pm != Z_NULL) pm->overflow = pm->merge = 0;
+
+    build_tree(s, (tree_desc *)(&(s->l_desc)));
+    Tracev((stderr, "\nlit data: dyn %ld, stat %ld", s->opt_len,
+            s->static_len));
+
+    build_tree(s, (tree_desc *)(&(s->d_desc)));
+    Tracev((stderr, "\ndist data: dyn %ld, stat %ld", s->opt_len,
+            s->static_len));
+
+    data_len = s->opt_len;
+    max_blindex = build_bl_tree(s);
+    if (pm == Z_NULL || !pm->overflow) return max_blindex;
+
+    /* Keep the trees from the heuristic, and try the lengths that
+     * pm_keep() found.
+     */
+    zmemcpy((Bytef *)pm->ltree, (Bytef *)s->dyn_ltree, sizeof(pm->ltree));
+    zmemcpy((Bytef *)pm->dtree, (Bytef *)s->dyn_dtree, sizeof(pm->dtree));
+    zmemcpy((Bytef *)pm->bl_tree, (Bytef *)s->bl_tree,
+            sizeof(pm->bl_tree));
+    pm->bl_max = s->bl_desc.max_code;
+    pm->max_blindex = max_blindex;
+    pm->opt_len = s->opt_len;
+
+    if (pm->overflow & PM_LIT) {
+        pm_apply(s, &s->l_desc, pm->lit_len);
+        data_len += pm->lit_delta;
+    }
+    if (pm->overflow & PM_DIST) {
+        pm_apply(s, &s->d_desc, pm->dist_len);
+        data_len += pm->dist_delta;
+    }
+    for (n = 0; n < BL_CODES; n++) s->bl_tree[n].Freq = 0;
+    s->opt_len = data_len;
+    pm->merge = 1;
+    max_blindex = build_bl_tree(s);
+    pm->merge = 0;
+    if (s->opt_len < pm->opt_len) return max_blindex;
+
+    zmemcpy((Bytef *)s->dyn_ltree, (Bytef *)pm->ltree, sizeof(pm->ltree));
+    zmemcpy((Bytef *)s->dyn_dtree, (Bytef *)pm->dtree, sizeof(pm->dtree));
+    zmemcpy((Bytef *)s->bl_tree, (Bytef *)pm->bl_tree,
+            sizeof(pm->bl_tree));
+    s->bl_desc.max_code = pm->bl_max;
+    s->opt_len = pm->opt_len;
+    return pm->max_blindex;
+}
+
 /* ===========================================================================
  * Send the header for a block using dynamic Huffman trees: the counts, the
  * lengths of the bit length codes, the literal tree and the distance tree.
@@ -904,6 +1196,290 @@ void ZLIB_INTERNAL _tr_align(s)
     bi_flush(s);
 }
 
+/* ===========================================================================
+ * Block splitting, see deflateSplit() in zlib.h.  When the symbol buffer is
+ * flushed, split_point() looks for the point that divides it into the two
+ * blocks of smallest estimated size, from the entropy of their literal/length
+ * and distance codes plus an allowance for the tree descriptions.  The split
+ * is made if the two blocks are really smaller than the whole, as measured
+ * by building their trees, and each half is then split again in the same way,
+ * to a depth of SPLIT_DEPTH.  The extra bits of the lengths and distances are
+ * the same however the symbols are split, so they are left out.
+ */
+#define SPLIT_MIN   512  /* fewest symbols in a block of its own */
+#define SPLIT_TRIES 32   /* split points tried in each range */
+#define SPLIT_DEPTH 5
+#define SPLIT_MAX   (1 << SPLIT_DEPTH)  /* most blocks made from one buffer */
+#define SPLIT_TREES (64 << 8) /* estimated size of the trees, apart from the
+                               * codes used, in 1/256 bits */
+#define SPLIT_LOGS  4096 /* counts with their log2 in a table */
+
+struct split_state_s {
+    ulg lit[2][L_CODES];  /* counts for the range, and for the left part */
+    ulg dist[2][D_CODES];
+    int stored_ok;        /* the input is still in the window */
+    int blocks;
+    unsigned end[SPLIT_MAX]; /* where each block ends */
+    ush log2[SPLIT_LOGS]; /* _tr_log2() of small counts */
+    /* followed by lit_bufsize distances and lit_bufsize literals/lengths */
+};
+
+#define SPLIT_TALLY(lit, dist, d, lc) \
+    { if ((d) == 0) (lit)[lc]++; \
+      else { (lit)[_length_code[lc] + LITERALS + 1]++; \
+             (dist)[d_code((d) - 1)]++; } }
+
+/* ===========================================================================
+ * Returns log2(x), for x > 0, in units of 1/256 bit.
+ */
+ulg ZLIB_INTERNAL _tr_log2(x)
+    ulg x;
+{
+    ulg y, result;
+    int n, i;
+
+    for (n = 0; (x >> n) > 1; n++)
+        ;
+    y = n > 15 ? x >> (n - 15) : x << (15 - n);
+    result = (ulg)n << 8;
+    for (i = 7; i >= 0; i--) {      /* squaring y doubles its log */
+        y = (y * y) >> 15;
+        if (y >= 65536) {
+            y >>= 1;
+            result |= 1UL << i;
+        }
+    }
+    return result;
+}
+
+/* ===========================================================================
+ * Estimated size in 1/256 bits of the codes counted in part, or in all but
+ * part if right is true: their entropy plus five bits for each code used.
+ */
+local ulg split_cost(log2, all, part, n, right)
+    const ush *log2;
+    const ulg *all;
+    const ulg *part;
+    int n;
+    int right;
+{
+    ulg f, total = 0, bits = 0, log_total;
+    int k;
+
+    for (k = 0; k < n; k++)
+        total += right ? all[k] - part[k] : part[k];
+    if (total == 0) return 0;
+    log_total = total < SPLIT_LOGS ? log2[total] : _tr_log2(total);
+    for (k = 0; k < n; k++) {
+        f = right ? all[k] - part[k] : part[k];
+        if (f)
+            bits += f * (log_total - (f < SPLIT_LOGS ? log2[f] : _tr_log2(f))) +
+                    (5 << 8);
+    }
+    return bits;
+}
+
+/* ===========================================================================
+ * Returns the best of SPLIT_TRIES points to split the symbols from..to-1 at
+ * by the estimate, or 0 if they are better left in one block.
+ */
+local unsigned split_point(s, from, to)
+    deflate_state *s;
+    unsigned from, to;
+{
+    struct split_state_s FAR *sp = s->split;
+    const ush *lg = sp->log2;
+    unsigned i, p, step, best_p = 0;
+    ulg cost, best;
+
+    zmemzero((Bytef *)sp->lit, sizeof(sp->lit));
+    zmemzero((Bytef *)sp->dist, sizeof(sp->dist));
+    for (i = from; i < to; i++)
+        SPLIT_TALLY(sp->lit[0], sp->dist[0], s->d_buf[i], s->l_buf[i]);
+    best = split_cost(lg, sp->lit[0], sp->lit[0], L_CODES, 0) +
+           split_cost(lg, sp->dist[0], sp->dist[0], D_CODES, 0) + SPLIT_TREES;
+
+    step = (to - from) / SPLIT_TRIES;
+    for (i = from, p = from + SPLIT_MIN; p <= to - SPLIT_MIN; p += step) {
+        for (; i < p; i++)
+            SPLIT_TALLY(sp->lit[1], sp->dist[1], s->d_buf[i], s->l_buf[i]);
+        cost = split_cost(lg, sp->lit[0], sp->lit[1], L_CODES, 0) +
+               split_cost(lg, sp->dist[0], sp->dist[1], D_CODES, 0) +
+               split_cost(lg, sp->lit[0], sp->lit[1], L_CODES, 1) +
+               split_cost(lg, sp->dist[0], sp->dist[1], D_CODES, 1) +
+               2 * SPLIT_TREES;
+        if (cost < best) {
+            best = cost;
+            best_p = p;
+        }
+    }
+    return best_p;
+}
+
+/* ===========================================================================
+ * Set the frequencies of the trees for the symbols from..to-1 of dbuf and
+ * lbuf, as _tr_tally() would have, and return the number of input bytes they
+ * stand for.
+ */
+local ulg split_count(s, dbuf, lbuf, from, to)
+    deflate_state *s;
+    const ushf *dbuf;
+    const uchf *lbuf;
+    unsigned from, to;
+{
+    ulg bytes = 0;
+    unsigned i, dist, lc;
+    int n;
+
+    for (n = 0; n < L_CODES;  n++) s->dyn_ltree[n].Freq = 0;
+    for (n = 0; n < D_CODES;  n++) s->dyn_dtree[n].Freq = 0;
+    for (n = 0; n < BL_CODES; n++) s->bl_tree[n].Freq = 0;
+    s->dyn_ltree[END_BLOCK].Freq = 1;
+    s->opt_len = s->static_len = 0L;
+
+    for (i = from; i < to; i++) {
+        dist = dbuf[i];
+        lc = lbuf[i];
+        if (dist == 0) {
+            s->dyn_ltree[lc].Freq++;
+            bytes++;
+        } else {
+            s->dyn_ltree[_length_code[lc]+LITERALS+1].Freq++;
+            s->dyn_dtree[d_code(dist - 1)].Freq++;
+            bytes += lc + MIN_MATCH;
+        }
+    }
+    return bytes;
+}
+
+/* ===========================================================================
+ * Returns the size in bits of the symbols from..to-1 sent as one block.
+ */
+local ulg split_bits(s, from, to)
+    deflate_state *s;
+    unsigned from, to;
+{
+    ulg stored_len = split_count(s, s->d_buf, s->l_buf, from, to);
+    ulg bits;
+
+    (void)build_trees(s);
+    bits = s->opt_len < s->static_len ? s->opt_len : s->static_len;
+    if (s->split->stored_ok && ((stored_len + 4) << 3) < bits)
+        bits = (stored_len + 4) << 3;
+    return bits + 3;
+}
+
+/* ===========================================================================
+ * Divide the symbols from..to-1 into blocks, adding their ends to s->split.
+ */
+local void split_range(s, from, to, depth)
+    deflate_state *s;
+    unsigned from, to;
+    int depth;
+{
+    struct split_state_s FAR *sp = s->split;
+    unsigned p;
+
+    if (depth > 0 && to - from >= 2*SPLIT_MIN &&
+        (p = split_point(s, from, to)) != 0 &&
+        split_bits(s, from, p) + split_bits(s, p, to) <
+        split_bits(s, from, to)) {
+        split_range(s, from, p, depth - 1);
+        split_range(s, p, to, depth - 1);
+    } else
+        sp->end[sp->blocks++] = to;
+}
+
+/* ===========================================================================
+ * Send the current block as several blocks if that is smaller.  Returns 0,
+ * having sent nothing, if one block is best or if there is not the memory to
+ * find out.
+ */
+local int split_block(s, buf, stored_len, last)
+    deflate_state *s;
+    charf *buf;       /* input block, or NULL if too old */
+    ulg stored_len;   /* length of input block */
+    int last;         /* one if this is the last block for a file */
+{
+    struct split_state_s FAR *sp = s->split;
+    unsigned n = s->last_lit, from, to;
+    ushf *dbuf;
+    uchf *lbuf;
+    ulg len, done;
+    int k;
+
+    if (sp == Z_NULL) {
+        sp = (struct split_state_s FAR *)
+             ZALLOC(s->strm, 1, (uInt)(sizeof(struct split_state_s) +
+                                       s->lit_bufsize * (sizeof(ush) + 1)));
+        if (sp == Z_NULL) return 0;
+        s->split = sp;
+        for (k = 1; k < SPLIT_LOGS; k++)
+            sp->log2[k] = (ush)_tr_log2((ulg)k);
+    }
+    sp->stored_ok = buf != (charf *)0;
+    sp->blocks = 0;
+    split_range(s, 0, n, SPLIT_DEPTH);
+    if (sp->blocks == 1) {
+        (void)split_count(s, s->d_buf, s->l_buf, 0, n);   /* as they were */
+        return 0;
+    }
+
+    /* Sending the blocks overwrites the symbols in pending_buf, so they are
+     * sent from a copy.
+     */
+    dbuf = (ushf *)(sp + 1);
+    lbuf = (uchf *)(dbuf + s->lit_bufsize);
+    zmemcpy((Bytef *)dbuf, (Bytef *)s->d_buf, n * sizeof(ush));
+    zmemcpy(lbuf, s->l_buf, n);
+    for (from = 0, done = 0, k = 0; k < sp->blocks; k++, from = to) {
+        to = sp->end[k];
+        len = split_count(s, dbuf, lbuf, from, to);
+        flush_range(s, buf == (charf *)0 ? (charf *)0 : buf + done, len,
+                    last && k == sp->blocks - 1, dbuf + from, lbuf + from,
+                    to - from);
+        done += len;
+    }
+    Assert(done == stored_len, "bad split");
+    (void)stored_len;
+    return 1;
+}
+
+/* ===========================================================================
+ * Replace the symbols of the current block with the nsym symbols in dbuf and
+ * lbuf, which must stand for the same input, if they make a smaller block.
+ * Returns 1 if they were used.
+ */
+int ZLIB_INTERNAL _tr_smaller_block(s, dbuf, lbuf, nsym)
+    deflate_state *s;
+    const ushf *dbuf;
+    const uchf *lbuf;
+    unsigned nsym;
+{
+    ulg bits, alt;
+    unsigned i;
+
+    (void)split_count(s, s->d_buf, s->l_buf, 0, s->last_lit);
+    (void)build_trees(s);
+    bits = s->opt_len < s->static_len ? s->opt_len : s->static_len;
+    (void)split_count(s, dbuf, lbuf, 0, nsym);
+    (void)build_trees(s);
+    alt = s->opt_len < s->static_len ? s->opt_len : s->static_len;
+    if (alt >= bits) {
+        (void)split_count(s, s->d_buf, s->l_buf, 0, s->last_lit);
+        return 0;
+    }
+
+    zmemcpy((Bytef *)s->d_buf, (const Bytef *)dbuf, nsym * sizeof(ush));
+    zmemcpy(s->l_buf, (const Bytef *)lbuf, nsym);
+    s->last_lit = nsym;
+    for (s->matches = 0, i = 0; i < nsym; i++)
+        if (dbuf[i] != 0)
+            s->matches++;
+    (void)split_count(s, s->d_buf, s->l_buf, 0, nsym);
+    return 1;
+}
+
 /* ===========================================================================
  * Determine the best encoding for the current block: dynamic trees, static
  * trees or store, and write out the encoded block.
@@ -913,6 +1489,26 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
     charf *buf;       /* input block, or NULL if too old */
     ulg stored_len;   /* length of input block */
     int last;         /* one if this is the last block for a file */
+{
+    if (s->block_split && s->level > 0 && s->strategy != Z_FIXED &&
+        s->last_lit >= 2*SPLIT_MIN && split_block(s, buf, stored_len, last))
+        return;
+    flush_range(s, buf, stored_len, last, s->d_buf, s->l_buf, s->last_lit);
+}
+
+/* ===========================================================================
+ * Send the block of nsym symbols in dbuf and lbuf, for which the trees have
+ * their frequencies set, as a stored, fixed or dynamic block, whichever is
+ * smallest.
+ */
+local void flush_range(s, buf, stored_len, last, dbuf, lbuf, nsym)
+    deflate_state *s;
+    charf *buf;       /* input block, or NULL if too old */
+    ulg stored_len;   /* length of input block */
+    int last;         /* one if this is the last block for a file */
+    const ushf *dbuf; /* the symbols */
+    const uchf *lbuf;
+    unsigned nsym;
 {
     ulg opt_lenb, static_lenb; /* opt_len and static_len in bytes */
     int max_blindex = 0;  /* index of last bit length code of non zero freq */
@@ -924,22 +1520,11 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
         if (s->strm->data_type == Z_UNKNOWN)
             s->strm->data_type = detect_data_type(s);
 
-        /* Construct the literal and distance trees */
-        build_tree(s, (tree_desc *)(&(s->l_desc)));
-        Tracev((stderr, "\nlit data: dyn %ld, stat %ld", s->opt_len,
-                s->static_len));
-
-        build_tree(s, (tree_desc *)(&(s->d_desc)));
-        Tracev((stderr, "\ndist data: dyn %ld, stat %ld", s->opt_len,
-                s->static_len));
-        /* At this point, opt_len and static_len are the total bit lengths of
-         * the compressed block data, excluding the tree representations.
+        /* Construct the literal and distance trees, and the bit length tree
+         * for them, and get the index in bl_order of the last bit length code
+         * to send.
          */
-
-        /* Build the bit length tree for the above two trees, and get the index
-         * in bl_order of the last bit length code to send.
-         */
-        max_blindex = build_bl_tree(s);
+        max_blindex = build_trees(s);
 
         /* Determine the best encoding. Compute the block lengths in bytes. */
         opt_lenb = (s->opt_len+3+7)>>3;
@@ -947,7 +1532,7 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
 
         Tracev((stderr, "\nopt %lu(%lu) stat %lu(%lu) stored %lu lit %u ",
                 opt_lenb, s->opt_len, static_lenb, s->static_len, stored_len,
-                s->last_lit));
+                nsym));
 
         if (static_lenb <= opt_lenb) opt_lenb = static_lenb;
 
@@ -975,18 +1560,26 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
 #else
     } else if (s->strategy == Z_FIXED || static_lenb == opt_lenb) {
 #endif
-        send_bits(s, (STATIC_TREES<<1)+last, 3);
-        compress_block(s, (const ct_data *)static_ltree,
-                       (const ct_data *)static_dtree);
+        if (s->count_only)
+            skip_bits(s, 3 + s->static_len);
+        else {
+            send_bits(s, (STATIC_TREES<<1)+last, 3);
+            compress_block(s, (const ct_data *)static_ltree,
+                           (const ct_data *)static_dtree, dbuf, lbuf, nsym);
+        }
 #ifdef ZLIB_DEBUG
         s->compressed_len += 3 + s->static_len;
 #endif
     } else {
-        send_bits(s, (DYN_TREES<<1)+last, 3);
-        send_all_trees(s, s->l_desc.max_code+1, s->d_desc.max_code+1,
-                       max_blindex+1);
-        compress_block(s, (const ct_data *)s->dyn_ltree,
-                       (const ct_data *)s->dyn_dtree);
+        if (s->count_only)
+            skip_bits(s, 3 + s->opt_len);
+        else {
+            send_bits(s, (DYN_TREES<<1)+last, 3);
+            send_all_trees(s, s->l_desc.max_code+1, s->d_desc.max_code+1,
+                           max_blindex+1);
+            compress_block(s, (const ct_data *)s->dyn_ltree,
+                           (const ct_data *)s->dyn_dtree, dbuf, lbuf, nsym);
+        }
 #ifdef ZLIB_DEBUG
         s->compressed_len += 3 + s->opt_len;
 #endif
@@ -1061,10 +1654,13 @@ int ZLIB_INTERNAL _tr_tally (s, dist, lc)
 /* ===========================================================================
  * Send the block data compressed using the given Huffman trees
  */
-local void compress_block(s, ltree, dtree)
+local void compress_block(s, ltree, dtree, dbuf, lbuf, nsym)
     deflate_state *s;
     const ct_data *ltree; /* literal tree */
     const ct_data *dtree; /* distance tree */
+    const ushf *dbuf;     /* distances, normally s->d_buf */
+    const uchf *lbuf;     /* literals or lengths, normally s->l_buf */
+    unsigned nsym;        /* number of symbols */
 {
     unsigned dist;      /* distance of matched string */
     int lc;             /* match length or unmatched char (if dist == 0) */
@@ -1072,9 +1668,9 @@ local void compress_block(s, ltree, dtree)
     unsigned code;      /* the code to send */
     int extra;          /* number of extra bits to send */
 
-    if (s->last_lit != 0) do {
-        dist = s->d_buf[lx];
-        lc = s->l_buf[lx++];
+    if (nsym != 0) do {
+        dist = dbuf[lx];
+        lc = lbuf[lx++];
         if (dist == 0) {
             send_code(s, lc, ltree); /* send a literal byte */
             Tracecv(isgraph(lc), (stderr," '%c' ", lc));
@@ -1100,10 +1696,10 @@ local void compress_block(s, ltree, dtree)
         } /* literal or match pair ? */
 
         /* Check that the overlay between pending_buf and d_buf+l_buf is ok: */
-        Assert((uInt)(s->pending) < s->lit_bufsize + 2*lx,
+        Assert(dbuf != s->d_buf || (uInt)(s->pending) < s->lit_bufsize + 2*lx,
                "pendingBuf overflow");
 
-    } while (lx < s->last_lit);
+    } while (lx < nsym);
 
     send_code(s, END_BLOCK, ltree);
 }
@@ -1201,3 +1797,177 @@ local void bi_windup(s)
     s->bits_sent = (s->bits_sent+7) & ~7;
 #endif
 }
+
+/* ===========================================================================
+ * Account for length bits of output without producing them, for
+ * deflateCount().  The pending bytes and bit count end up as send_bits()
+ * would leave them; only their contents are undefined.
+ */
+local void skip_bits(s, length)
+    deflate_state *s;
+    ulg length;
+{
+    ulg bits = (ulg)s->bi_valid + length;
+    ulg shorts = (bits - 1) / Buf_size;  /* length > 0 */
+
+    s->pending += shorts << 1;
+    s->bi_valid = (int)(bits - shorts * Buf_size);
+    s->bi_buf = 0;
+#ifdef ZLIB_DEBUG
+    s->bits_sent += length;
+#endif
+}
+
+#ifdef TEST_TREES
+/* ===========================================================================
+ * Define TEST_TREES to build a program that times build_trees() with the
+ * heuristic and with package-merge (deflateHuffman()), and compress_block(),
+ * on blocks of 32K literals, for example with
+ *     cc -O2 -DTEST_TREES -DNO_GZ -o testtrees trees.c deflate.c zutil.c \
+ *         adler32.c crc32.c
+ * The first two kinds of block have codes longer than 15 bits; only for
+ * those does package-merge take any time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_SYMS 32767     /* lit_bufsize-1 with memLevel 9 */
+#define TEST_REPS 2000
+
+local unsigned long test_seed = 1;
+
+/* zcalloc() is not there with NO_GZ, as in the Makefile */
+local voidpf test_alloc(opaque, items, size)
+    voidpf opaque;
+    uInt items;
+    uInt size;
+{
+    (void)opaque;
+    return malloc((size_t)items * size);
+}
+
+local void test_free(opaque, ptr)
+    voidpf opaque;
+    voidpf ptr;
+{
+    (void)opaque;
+    free(ptr);
+}
+
+local unsigned test_rand()
+{
+    test_seed = test_seed * 1103515245UL + 12345UL;
+    return (unsigned)(test_seed >> 16) & 0x7fff;
+}
+
+/* Fill l_buf with literals, each with half the chance of the one before
+ * (ratio/16 times, in general) among the first syms, and every byte once.
+ */
+local void test_fill(s, syms, ratio)
+    deflate_state *s;
+    int syms;
+    unsigned ratio;
+{
+    unsigned n, c;
+
+    for (n = 0; n < 256; n++)
+        s->l_buf[n] = (uch)n;
+    for (; n < TEST_SYMS; n++) {
+        for (c = 0; c < (unsigned)syms - 1 && test_rand() % 16 >= ratio; c++)
+            ;
+        s->l_buf[n] = (uch)c;
+    }
+    for (n = 0; n < TEST_SYMS; n++)
+        s->d_buf[n] = 0;
+}
+
+local ush test_freq[L_CODES];
+
+/* Count the literals of l_buf once; each block then only copies them. */
+local void test_count(s)
+    deflate_state *s;
+{
+    unsigned n;
+
+    for (n = 0; n < L_CODES; n++)
+        test_freq[n] = 0;
+    test_freq[END_BLOCK] = 1;
+    for (n = 0; n < TEST_SYMS; n++)
+        test_freq[s->l_buf[n]]++;
+}
+
+local void test_tally(s)
+    deflate_state *s;
+{
+    unsigned n;
+
+    init_block(s);
+    for (n = 0; n < L_CODES; n++)
+        s->dyn_ltree[n].Freq = test_freq[n];
+    s->last_lit = TEST_SYMS;
+}
+
+/* Time build_trees() with the heuristic and with package-merge, then
+ * compress_block() with the trees of package-merge, in microseconds per
+ * block, and give the size of each block in bytes.
+ */
+local void test_block(s, name)
+    deflate_state *s;
+    const char *name;
+{
+    double us[3];
+    ulg bytes[2];
+    int pass, rep;
+    clock_t start;
+
+    test_count(s);
+    for (pass = 0; pass < 2; pass++) {
+        s->huff_optimal = pass;
+        start = clock();
+        for (rep = 0; rep < TEST_REPS; rep++) {
+            test_tally(s);
+            build_trees(s);
+        }
+        us[pass] = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC /
+                   TEST_REPS;
+        bytes[pass] = (s->opt_len + 7) >> 3;
+    }
+    start = clock();
+    for (rep = 0; rep < TEST_REPS; rep++) {
+        s->pending = 0;
+        compress_block(s, s->dyn_ltree, s->dyn_dtree, s->d_buf, s->l_buf,
+                       TEST_SYMS);
+    }
+    us[2] = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC / TEST_REPS;
+    s->pending = 0;
+    s->bi_buf = 0;
+    s->bi_valid = 0;
+    printf("%-14s trees %6.1f -> %6.1f us, %6lu -> %6lu bytes, "
+           "compress_block %6.1f us\n",
+           name, us[0], us[1], bytes[0], bytes[1], us[2]);
+}
+
+int main()
+{
+    z_stream strm;
+    deflate_state *s;
+
+    strm.zalloc = test_alloc;
+    strm.zfree = test_free;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, 9, Z_DEFLATED, 15, 9, Z_HUFFMAN_ONLY) != Z_OK)
+        return 1;
+    s = (deflate_state *)strm.state;
+
+    test_fill(s, 256, 8);
+    test_block(s, "256 symbols");
+    test_fill(s, 40, 8);
+    test_block(s, "40 symbols");
+    test_fill(s, 256, 1);
+    test_block(s, "no overflow");
+
+    deflateEnd(&strm);
+    return 0;
+}
+#endif /* TEST_TREES */
@@ -197,6 +197,9 @@ typedef gz_header FAR *gz_headerp;
 #define Z_HUFFMAN_ONLY        2
 #define Z_RLE                 3
 #define Z_FIXED               4
+#define Z_OPTIMAL             5 /* added in this copy of zlib, see deflate.c */
+#define Z_QUICK               6 /* likewise */
+#define Z_MEDIUM              7 /* likewise */
 #define Z_DEFAULT_STRATEGY    0
 /* compression strategy; see deflateInit2() below for details */
 
@@ -598,7 +601,20 @@ ZEXTERN int ZEXPORT deflateInit2 OF((z_streamp strm,
    strategy parameter only affects the compression ratio but not the
    correctness of the compressed output even if it is not set appropriately.
    Z_FIXED prevents the use of dynamic Huffman codes, allowing for a simpler
-   decoder for special applications.
+   decoder for special applications.  Z_OPTIMAL, which is not in the standard
+   zlib, chooses the matches and literals by finding the cheapest path through
+   the input with an estimate of the Huffman code lengths, then re-estimates
+   the code lengths from the result and repeats (see deflateIterations()).
+   Each block is sent with the symbols of the lazy match evaluation of the
+   level instead if those make it smaller, since the estimate can be off.
+   It is 10 to 30 times slower than level 9.
+   Z_QUICK and Z_MEDIUM, also not in the standard zlib, are faster than the
+   default strategy at the same level.  Z_QUICK looks only at the most recent
+   string with the same hash key and does not enter the strings inside a
+   match in the hash table, and Z_MEDIUM is the lazy match evaluation of
+   levels 4 to 9 with the insertion policy of levels 1 to 3: the strings
+   inside a match longer than the lazy match length of the level are not
+   entered in the hash table.  Z_QUICK ignores the level, other than 0.
 
      deflateInit2 returns Z_OK if success, Z_MEM_ERROR if there was not enough
    memory, Z_STREAM_ERROR if any parameter is invalid (such as an invalid
@@ -757,6 +773,148 @@ ZEXTERN int ZEXPORT deflateTune OF((z_streamp strm,
    returns Z_OK on success, or Z_STREAM_ERROR for an invalid deflate stream.
  */
 
+ZEXTERN int ZEXPORT deflateIterations OF((z_streamp strm,
+                                          int iterations));
+/*
+     Sets the number of passes the Z_OPTIMAL strategy makes over each part of
+   the input, each using the symbol counts of the one before to estimate the
+   cost of literals and matches.  The default is 10.  More passes take longer
+   and usually give slightly smaller output; the passes stop early once they
+   no longer help.  This is not in the standard zlib.
+
+     deflateIterations() can be called after deflateInit2(), and returns Z_OK
+   on success, or Z_STREAM_ERROR for an invalid deflate stream or an
+   iterations value less than one.
+ */
+
+ZEXTERN int ZEXPORT deflateHash OF((z_streamp strm,
+                                    int bytes));
+/*
+     Selects the hash used to find earlier occurrences of a string: on its
+   first 3 bytes (the default) or its first 4.  The 4-byte hash puts fewer
+   unrelated strings on each hash chain, which is faster on data with many
+   repeated short strings, such as filtered images.  But 3-byte matches are
+   then found only by chance, so the compressed data is different, and is
+   usually slightly larger on text.  This is not in the standard zlib.
+
+     deflateHash() must be called after deflateInit(), deflateInit2() or
+   deflateReset(), and before the first call of deflate() or
+   deflateSetDictionary().  The setting is kept by deflateReset().  It returns
+   Z_OK on success, or Z_STREAM_ERROR for an invalid deflate stream, if bytes
+   is not 3 or 4, or if it was called too late.
+ */
+
+ZEXTERN int ZEXPORT deflateTree OF((z_streamp strm,
+                                    int tree));
+/*
+     With tree non-zero, the Z_OPTIMAL strategy keeps the strings with the
+   same hash in binary search trees instead of hash chains.  Each search then
+   visits only the strings that are closest in sort order, so it finds the
+   longest match, and every shorter one on the way, with fewer comparisons on
+   data with long chains, such as images with large flat or repeating areas.
+   The trees use another 2*2^windowBits bytes of memory, and the matches found
+   (and therefore the compressed data) may be different.  The other
+   strategies are not affected: they stop searching at the good and nice
+   lengths and insert the strings inside a match without a search, which the
+   trees would make slower.  This is not in the standard zlib.
+
+     deflateTree() must be called after deflateInit(), deflateInit2() or
+   deflateReset(), and before the first call of deflate() or
+   deflateSetDictionary().  The setting is kept by deflateReset().  It returns
+   Z_OK on success, Z_MEM_ERROR if there was not enough memory, or
+   Z_STREAM_ERROR for an invalid deflate stream or if it was called too late.
+ */
+
+ZEXTERN int ZEXPORT deflateSplit OF((z_streamp strm,
+                                     int split));
+/*
+     With split non-zero, each time the buffer of LZ77 symbols is full (see
+   memLevel in deflateInit2) or is flushed, deflate divides it into the
+   blocks that give the smallest output instead of emitting it as a single
+   block, so that each block gets Huffman codes for its own statistics.
+   This takes a little more time and changes the compressed data.  It has no
+   effect with level 0 or the Z_FIXED strategy.  This is not in the standard
+   zlib.
+
+     deflateSplit() may be called at any time after deflateInit(),
+   deflateInit2() or deflateReset(); it applies to the blocks emitted after
+   it.  The setting is kept by deflateReset().  It returns Z_OK on success, or
+   Z_STREAM_ERROR for an invalid deflate stream.
+ */
+
+ZEXTERN int ZEXPORT deflateHuffman OF((z_streamp strm,
+                                       int optimal));
+/*
+     Selects how the lengths of the Huffman codes are kept within the limits
+   of the deflate format (15 bits, or 7 bits for the code length codes) when
+   the frequencies of the symbols are very skewed.  With optimal zero (the
+   default), deflate moves some codes up and down the tree, which is fast but
+   can give longer output than necessary.  With optimal non-zero it uses the
+   package-merge algorithm, which finds the shortest output for those limits.
+   It is only run for the blocks whose codes did not fit, and the lengths of
+   the heuristic are kept when they are no worse.  Blocks whose codes fit take
+   no longer, but for the others building the Huffman trees takes about twice
+   as long: about a tenth more time for a block of 32K literals that is
+   written, and more when deflateCount() is on.  The program built from
+   trees.c with TEST_TREES measures this.  This is not in the standard zlib.
+
+     deflateHuffman() may be called at any time after deflateInit(),
+   deflateInit2() or deflateReset(); it applies to the blocks emitted after
+   it.  The setting is kept by deflateReset().  It returns Z_OK on success, or
+   Z_STREAM_ERROR for an invalid deflate stream.
+ */
+
+ZEXTERN int ZEXPORT deflateCount OF((z_streamp strm,
+                                     int count));
+/*
+     With count non-zero, deflate() only measures its output: it makes all
+   the same choices and advances next_out, avail_out and total_out by exactly
+   as much as it would otherwise, but the Huffman coded blocks are not
+   written, so the bytes it hands back are not defined, and the Adler-32 or
+   CRC-32 of the input is not computed (adler is not defined either).  This
+   is for trial compressions where only the size is wanted.  It is faster the
+   more of the time goes to producing the bits, as with the lower levels and
+   the Z_HUFFMAN_ONLY and Z_RLE strategies.  This is not in the standard zlib.
+
+     deflateCount() must be called after deflateInit(), deflateInit2() or
+   deflateReset(), and before the first call of deflate() or
+   deflateSetDictionary().  The setting is kept by deflateReset().  It returns
+   Z_OK on success, or Z_STREAM_ERROR for an invalid deflate stream or if it
+   was called too late.
+ */
+
+ZEXTERN int ZEXPORT deflateMatchCache OF((z_streamp strm,
+                                          Bytef *cache,
+                                          uLong size));
+/*
+     Gives the Z_OPTIMAL strategy size bytes at cache in which to keep the
+   matches it finds, so that a later stream that compresses the same input
+   with the same settings can take them from there instead of searching for
+   them again.  The first stream to use a cache records its matches, and the
+   cache is marked complete when that stream is finished with Z_FINISH.  A
+   later stream given the same cache then replays them, checking as it goes
+   that its input and the settings that decide the matches (windowBits,
+   memLevel, the level or deflateTune() search limits, deflateHash() and
+   deflateTree()) are the same; the strategy can be Z_OPTIMAL with any
+   deflateIterations(), deflateSplit() or deflateHuffman() settings.  If its
+   input differs from the start, it records its own matches over the old
+   ones, and if it differs later on, the rest is compressed as usual.  The
+   compressed data is always the same as without the cache.  If the matches
+   do not fit in size bytes, recording stops and the cache is not used.  It
+   keeps a copy of the input, to compare it with, and needs up to 35 bytes
+   per input byte plus 1K, typically much less.  Only the
+   stream that is recording writes to the cache, and it must not be freed
+   or used by another stream meanwhile.  It is not used after a call of
+   deflateSetDictionary().  This is not in the standard zlib.
+
+     deflateMatchCache() must be called after deflateInit(), deflateInit2()
+   or deflateReset(), and before the first call of deflate() or
+   deflateSetDictionary().  A cache of Z_NULL stops using it.  The setting
+   is kept by deflateReset(), which starts it again from the beginning.  It
+   returns Z_OK on success, or Z_STREAM_ERROR for an invalid deflate stream,
+   if size is less than 32, or if it was called too late.
+ */
+
 ZEXTERN uLong ZEXPORT deflateBound OF((z_streamp strm,
                                        uLong sourceLen));
 /*